@@ -5,6 +5,7 @@
 #include <modes.h>
 #include <filters.h>
 #include <cassert>
+#include <cstring>
 
 
 
@@ -19,6 +20,12 @@ void AESWrapper::setKey(const std::vector<char>& key)
 }
 
 
+const std::vector<char>& AESWrapper::getKey() const
+{
+	return _key;
+}
+
+
 std::vector<char> AESWrapper::encrypt(const std::vector<char>& plaintext) const
 {
   
@@ -66,3 +73,60 @@ std::vector<char> AESWrapper::decrypt(const std::vector<char>& ciphertext) const
 	// Convert plaintext to std::vector<char> for binary data handling
 	return std::vector<char>(plaintext.begin(), plaintext.end());
 }
+
+
+size_t AESWrapper::encryptedSize(size_t plaintextSize)
+{
+	// PKCS#7 always adds between 1 and a full block of padding
+	return (plaintextSize / AES_BLOCK_SIZE + 1) * AES_BLOCK_SIZE;
+}
+
+
+AESStreamEncryptor::AESStreamEncryptor(const std::vector<char>& key)
+	: _encryptor()
+	, _finished(false)
+{
+	if (key.size() != AES_KEY_SIZE)
+	{
+		throw AESWrapperError("Invalid AES key length");
+	}
+	CryptoPP::byte iv[CryptoPP::AES::BLOCKSIZE] = { 0 };
+	_encryptor.SetKeyWithIV(reinterpret_cast<const CryptoPP::byte*>(key.data()), key.size(), iv);
+}
+
+
+size_t AESStreamEncryptor::update(const char* plaintext, size_t size, char* out)
+{
+	if (_finished)
+	{
+		throw AESWrapperError("The message was already finished");
+	}
+	if (size % AES_BLOCK_SIZE != 0)
+	{
+		throw AESWrapperError("Chunk is not a multiple of the block size");
+	}
+	// CBC chains the blocks across calls
+	_encryptor.ProcessData(reinterpret_cast<CryptoPP::byte*>(out), reinterpret_cast<const CryptoPP::byte*>(plaintext), size);
+	return size;
+}
+
+
+size_t AESStreamEncryptor::finish(const char* plaintext, size_t size, char* out)
+{
+	size_t fullBlocks = size - size % AES_BLOCK_SIZE;
+	update(plaintext, fullBlocks, out);
+
+	// PKCS#7 padding on the last block
+	size_t remaining = size - fullBlocks;
+	auto padding = static_cast<CryptoPP::byte>(AES_BLOCK_SIZE - remaining);
+	CryptoPP::byte lastBlock[CryptoPP::AES::BLOCKSIZE];
+	if (remaining > 0)
+	{
+		std::memcpy(lastBlock, plaintext + fullBlocks, remaining);
+	}
+	std::memset(lastBlock + remaining, padding, AES_BLOCK_SIZE - remaining);
+	_encryptor.ProcessData(reinterpret_cast<CryptoPP::byte*>(out + fullBlocks), lastBlock, AES_BLOCK_SIZE);
+
+	_finished = true;
+	return fullBlocks + AES_BLOCK_SIZE;
+}
@@ -1,10 +1,15 @@
 #ifndef AES_WRAPPER_H
 #define AES_WRAPPER_H
 
+#include <aes.h>
+#include <modes.h>
+
 #include <vector>
+#include <cstddef>
 
 
 constexpr size_t AES_KEY_SIZE = 32; // 256 bits AES key.
+constexpr size_t AES_BLOCK_SIZE = CryptoPP::AES::BLOCKSIZE;
 
 
 /**
@@ -22,6 +27,13 @@ public:
 	 */
 	void setKey(const std::vector<char>& key);
 
+	/**
+	 * @brief Get the key for encryption and decryption.
+	 *
+	 * @return the key
+	 */
+	const std::vector<char>& getKey() const;
+
 	/**
 	 * @brief Encrypt the given plaintext using the key.
 	 *
@@ -38,8 +50,58 @@ public:
 	 */
 	std::vector<char> decrypt(const std::vector<char>& ciphertext) const;
 
+	/**
+	 * @brief Get the size of the ciphertext of a plaintext, including the PKCS#7 padding.
+	 *
+	 * @param plaintextSize the size of the plaintext
+	 * @return the size of the ciphertext
+	 */
+	static size_t encryptedSize(size_t plaintextSize);
+
 private:
 	std::vector<char> _key;
 };
 
-#endif // AES_WRAPPER_H
\ No newline at end of file
+
+/**
+ * @brief AESStreamEncryptor class
+ *
+ * Encrypts a message chunk by chunk using AES-CBC with a zeroed IV. The output is the same as
+ * AESWrapper::encrypt on the whole message, so a file never has to be held in memory at once.
+ */
+class AESStreamEncryptor
+{
+public:
+	/**
+	 * @brief Constructor that starts a new message.
+	 *
+	 * @param key the AES key
+	 */
+	explicit AESStreamEncryptor(const std::vector<char>& key);
+
+	/**
+	 * @brief Encrypt a chunk in the middle of the message.
+	 *
+	 * @param plaintext the chunk, its size must be a multiple of the AES block size
+	 * @param size the size of the chunk
+	 * @param out the output, must hold size bytes
+	 * @return the number of bytes written to out
+	 */
+	size_t update(const char* plaintext, size_t size, char* out);
+
+	/**
+	 * @brief Encrypt the last chunk of the message and add the PKCS#7 padding.
+	 *
+	 * @param plaintext the chunk, may be empty
+	 * @param size the size of the chunk
+	 * @param out the output, must hold AESWrapper::encryptedSize(size) bytes
+	 * @return the number of bytes written to out
+	 */
+	size_t finish(const char* plaintext, size_t size, char* out);
+
+private:
+	CryptoPP::CBC_Mode<CryptoPP::AES>::Encryption _encryptor;
+	bool _finished;
+};
+
+#endif // AES_WRAPPER_H
@@ -1,4 +1,5 @@
 #include "RSAWrapper.h"
+#include "tracing.h"
 
 #include <osrng.h>
 #include <files.h>
@@ -49,6 +50,7 @@ void RSAWrapper::savePrivateKey() const
 
 std::vector<char> RSAWrapper::decrypt(const std::vector<char>& cipher) const
 {
+	ScopedTrace span("crypto", "rsa decrypt");
 	CryptoPP::AutoSeededRandomPool rng;
 	CryptoPP::RSAES_OAEP_SHA_Decryptor decryptor(_privateKey);
 	std::string plaintext;
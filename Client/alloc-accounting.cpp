@@ -0,0 +1,275 @@
+#include "alloc-accounting.h"
+#include "metrics.h"
+
+#include <algorithm>
+#include <atomic>
+#include <iomanip>
+#include <new>
+#include <cstddef>
+#include <cstdlib>
+
+
+#ifdef BACKUP_ALLOC_ACCOUNTING
+
+static constexpr int OUTSIDE_STAGES = static_cast<int>(Stage::COUNT);
+static constexpr int EXCLUDED = -1;
+
+/**
+* @brief The counters of a stage, they are constant initialized so operator new can run before main.
+*/
+struct StageAllocations
+{
+	std::atomic<uint64_t> allocations{ 0 };
+	std::atomic<uint64_t> frees{ 0 };
+	std::atomic<uint64_t> bytes{ 0 };
+	std::atomic<uint64_t> liveBytes{ 0 };
+	std::atomic<uint64_t> peakLiveBytes{ 0 };
+};
+
+static StageAllocations stageAllocations[static_cast<size_t>(Stage::COUNT) + 1];
+static StageAllocations totalAllocations;
+
+// the stage the calling thread runs
+thread_local int currentStage = OUTSIDE_STAGES;
+
+/**
+* @brief The header in front of every allocation, it remembers what to account when it is freed.
+*/
+struct alignas(16) AllocationHeader
+{
+	uint64_t size;
+	int32_t stage;
+	uint32_t offset;  // from the start of the malloc'ed block to the allocation
+};
+
+static_assert(sizeof(AllocationHeader) == 16, "the header keeps the allocations aligned to 16 bytes");
+
+
+static void raisePeak(std::atomic<uint64_t>& peak, uint64_t value)
+{
+	uint64_t current = peak.load(std::memory_order_relaxed);
+	while (value > current && !peak.compare_exchange_weak(current, value, std::memory_order_relaxed))
+	{
+	}
+}
+
+
+static void account(StageAllocations& counters, uint64_t size)
+{
+	counters.allocations.fetch_add(1, std::memory_order_relaxed);
+	counters.bytes.fetch_add(size, std::memory_order_relaxed);
+	raisePeak(counters.peakLiveBytes, counters.liveBytes.fetch_add(size, std::memory_order_relaxed) + size);
+}
+
+
+static void accountFree(StageAllocations& counters, uint64_t size)
+{
+	counters.frees.fetch_add(1, std::memory_order_relaxed);
+	counters.liveBytes.fetch_sub(size, std::memory_order_relaxed);
+}
+
+
+static void* allocate(std::size_t size, std::size_t alignment)
+{
+	alignment = std::max(alignment, alignof(AllocationHeader));
+	size_t padding = sizeof(AllocationHeader) + (alignment > alignof(AllocationHeader) ? alignment : 0);
+	auto block = static_cast<char*>(std::malloc(size + padding));
+	if (block == nullptr)
+	{
+		return nullptr;
+	}
+	auto address = reinterpret_cast<uintptr_t>(block) + sizeof(AllocationHeader);
+	address = (address + alignment - 1) & ~(static_cast<uintptr_t>(alignment) - 1);
+	auto memory = reinterpret_cast<char*>(address);
+
+	auto header = reinterpret_cast<AllocationHeader*>(memory) - 1;
+	header->size = size;
+	header->stage = currentStage;
+	header->offset = static_cast<uint32_t>(memory - block);
+	if (header->stage != EXCLUDED)
+	{
+		account(stageAllocations[header->stage], size);
+		account(totalAllocations, size);
+	}
+	return memory;
+}
+
+
+static void deallocate(void* memory) noexcept
+{
+	if (memory == nullptr)
+	{
+		return;
+	}
+	auto header = static_cast<AllocationHeader*>(memory) - 1;
+	if (header->stage != EXCLUDED)
+	{
+		accountFree(stageAllocations[header->stage], header->size);
+		accountFree(totalAllocations, header->size);
+	}
+	std::free(static_cast<char*>(memory) - header->offset);
+}
+
+
+static void* allocateOrThrow(std::size_t size, std::size_t alignment)
+{
+	while (true)
+	{
+		if (void* memory = allocate(size, alignment))
+		{
+			return memory;
+		}
+		auto handler = std::get_new_handler();
+		if (handler == nullptr)
+		{
+			throw std::bad_alloc();
+		}
+		handler();
+	}
+}
+
+
+void* operator new(std::size_t size) { return allocateOrThrow(size, alignof(std::max_align_t)); }
+void* operator new[](std::size_t size) { return allocateOrThrow(size, alignof(std::max_align_t)); }
+void* operator new(std::size_t size, std::align_val_t alignment) { return allocateOrThrow(size, static_cast<size_t>(alignment)); }
+void* operator new[](std::size_t size, std::align_val_t alignment) { return allocateOrThrow(size, static_cast<size_t>(alignment)); }
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept { return allocate(size, alignof(std::max_align_t)); }
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept { return allocate(size, alignof(std::max_align_t)); }
+
+void operator delete(void* memory) noexcept { deallocate(memory); }
+void operator delete[](void* memory) noexcept { deallocate(memory); }
+void operator delete(void* memory, std::size_t) noexcept { deallocate(memory); }
+void operator delete[](void* memory, std::size_t) noexcept { deallocate(memory); }
+void operator delete(void* memory, std::align_val_t) noexcept { deallocate(memory); }
+void operator delete[](void* memory, std::align_val_t) noexcept { deallocate(memory); }
+void operator delete(void* memory, std::size_t, std::align_val_t) noexcept { deallocate(memory); }
+void operator delete[](void* memory, std::size_t, std::align_val_t) noexcept { deallocate(memory); }
+void operator delete(void* memory, const std::nothrow_t&) noexcept { deallocate(memory); }
+void operator delete[](void* memory, const std::nothrow_t&) noexcept { deallocate(memory); }
+
+
+static AllocationStats snapshot(const StageAllocations& counters)
+{
+	AllocationStats stats;
+	stats.allocations = counters.allocations.load(std::memory_order_relaxed);
+	stats.frees = counters.frees.load(std::memory_order_relaxed);
+	stats.bytes = counters.bytes.load(std::memory_order_relaxed);
+	stats.liveBytes = counters.liveBytes.load(std::memory_order_relaxed);
+	stats.peakLiveBytes = counters.peakLiveBytes.load(std::memory_order_relaxed);
+	return stats;
+}
+
+
+AllocationStats AllocationAccounting::stage(Stage stage)
+{
+	return snapshot(stageAllocations[static_cast<size_t>(stage)]);
+}
+
+
+AllocationStats AllocationAccounting::outsideStages()
+{
+	return snapshot(stageAllocations[OUTSIDE_STAGES]);
+}
+
+
+AllocationStats AllocationAccounting::total()
+{
+	return snapshot(totalAllocations);
+}
+
+
+void AllocationAccounting::resetPeaks()
+{
+	for (auto& counters : stageAllocations)
+	{
+		counters.peakLiveBytes.store(counters.liveBytes.load(std::memory_order_relaxed), std::memory_order_relaxed);
+	}
+	totalAllocations.peakLiveBytes.store(totalAllocations.liveBytes.load(std::memory_order_relaxed), std::memory_order_relaxed);
+}
+
+
+void AllocationAccounting::excludeThread()
+{
+	currentStage = EXCLUDED;
+}
+
+
+AllocationScope::AllocationScope(Stage stage)
+	: _previous(currentStage)
+{
+	if (_previous != EXCLUDED)
+	{
+		currentStage = static_cast<int>(stage);
+	}
+}
+
+
+AllocationScope::~AllocationScope()
+{
+	currentStage = _previous;
+}
+
+#else
+
+AllocationStats AllocationAccounting::stage(Stage)
+{
+	return {};
+}
+
+
+AllocationStats AllocationAccounting::outsideStages()
+{
+	return {};
+}
+
+
+AllocationStats AllocationAccounting::total()
+{
+	return {};
+}
+
+
+void AllocationAccounting::resetPeaks()
+{
+}
+
+
+void AllocationAccounting::excludeThread()
+{
+}
+
+#endif
+
+
+void AllocationAccounting::report(std::ostream& out, uint64_t packets, uint64_t bytes)
+{
+	if (!enabled())
+	{
+		out << "Heap allocations are counted in builds with BACKUP_ALLOC_ACCOUNTING." << std::endl;
+		return;
+	}
+
+	auto flags = out.flags();
+	auto precision = out.precision();
+	double megabytes = bytes / (1024.0 * 1024.0);
+	auto row = [&](const char* name, const AllocationStats& stats) {
+		out << std::left << std::setw(11) << name << std::right
+			<< std::setw(12) << stats.allocations
+			<< std::setw(14) << (packets ? static_cast<double>(stats.allocations) / packets : 0.0)
+			<< std::setw(12) << (megabytes > 0 ? stats.allocations / megabytes : 0.0)
+			<< std::setw(16) << stats.bytes
+			<< std::setw(16) << stats.peakLiveBytes << std::endl;
+	};
+
+	out << "Heap allocations (" << packets << " packets, " << std::fixed << std::setprecision(2) << megabytes << " MB):" << std::endl;
+	out << std::left << std::setw(11) << "Stage" << std::right << std::setw(12) << "Allocs" << std::setw(14) << "Allocs/packet"
+		<< std::setw(12) << "Allocs/MB" << std::setw(16) << "Bytes" << std::setw(16) << "Peak live" << std::endl;
+	for (size_t i = 0; i < static_cast<size_t>(Stage::COUNT); i++)
+	{
+		row(stageName(static_cast<Stage>(i)), stage(static_cast<Stage>(i)));
+	}
+	row("other", outsideStages());
+	row("total", total());
+	out.flags(flags);
+	out.precision(precision);
+}
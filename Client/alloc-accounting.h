@@ -0,0 +1,105 @@
+#ifndef ALLOC_ACCOUNTING_H
+#define ALLOC_ACCOUNTING_H
+
+
+#include <ostream>
+#include <cstdint>
+
+
+enum class Stage;
+
+
+/**
+* @brief The heap allocations of a stage, or of the whole process.
+*/
+struct AllocationStats
+{
+	uint64_t allocations = 0;
+	uint64_t frees = 0;
+	uint64_t bytes = 0;          // allocated in total
+	uint64_t liveBytes = 0;      // allocated and not freed yet
+	uint64_t peakLiveBytes = 0;
+};
+
+
+/**
+* @brief AllocationAccounting class
+*
+* Counts the heap allocations of the process, their bytes and the peak of the live bytes, attributed to
+* the stage of the transfer that made them; a StageTimer marks its thread as running its stage. An
+* allocation is freed from the stage that made it, wherever it is freed.
+*
+* The accounting replaces the global operator new and delete, so it is a build option: it counts only
+* when the client is built with BACKUP_ALLOC_ACCOUNTING, and costs nothing otherwise.
+*/
+class AllocationAccounting
+{
+public:
+	/**
+	* @brief Check if the client was built with the accounting.
+	*/
+	static constexpr bool enabled()
+	{
+#ifdef BACKUP_ALLOC_ACCOUNTING
+		return true;
+#else
+		return false;
+#endif
+	}
+
+	/**
+	* @brief Get the allocations that were made in a stage.
+	*/
+	static AllocationStats stage(Stage stage);
+
+	/**
+	* @brief Get the allocations that were made outside of the stages, like the protocol's requests.
+	*/
+	static AllocationStats outsideStages();
+
+	/**
+	* @brief Get the allocations of the process.
+	*/
+	static AllocationStats total();
+
+	/**
+	* @brief Lower the peaks to the bytes that are live now, to measure the peak of a new run.
+	*/
+	static void resetPeaks();
+
+	/**
+	* @brief Leave the allocations of the calling thread out, like the threads of a server in the same process.
+	*/
+	static void excludeThread();
+
+	/**
+	* @brief Write the allocations of every stage, per packet and per MB transferred.
+	*/
+	static void report(std::ostream& out, uint64_t packets, uint64_t bytes);
+};
+
+
+/**
+* @brief AllocationScope class
+*
+* Attributes the allocations of the calling thread to a stage while it lives.
+*/
+class AllocationScope
+{
+public:
+#ifdef BACKUP_ALLOC_ACCOUNTING
+	explicit AllocationScope(Stage stage);
+	~AllocationScope();
+
+private:
+	int _previous;
+#else
+	explicit AllocationScope(Stage) {}
+#endif
+
+public:
+	AllocationScope(const AllocationScope&) = delete;
+	AllocationScope& operator=(const AllocationScope&) = delete;
+};
+
+#endif // ALLOC_ACCOUNTING_H
@@ -0,0 +1,486 @@
+#include "benchmark.h"
+
+#include "../alloc-accounting.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <sstream>
+#include <thread>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#else
+#include <unistd.h>
+#endif
+
+
+#ifndef BACKUP_ALLOC_ACCOUNTING
+// Every heap allocation of the process goes through these, so the benchmarks can report allocations per iteration.
+// The builds with the allocation accounting replace them with the accounting's.
+static std::atomic<uint64_t> allocationCount{ 0 };
+
+void* operator new(std::size_t size)
+{
+	allocationCount.fetch_add(1, std::memory_order_relaxed);
+	if (void* memory = std::malloc(size ? size : 1))
+	{
+		return memory;
+	}
+	throw std::bad_alloc();
+}
+
+void operator delete(void* memory) noexcept
+{
+	std::free(memory);
+}
+
+void operator delete(void* memory, std::size_t) noexcept
+{
+	std::free(memory);
+}
+#endif
+
+
+namespace bench
+{
+	uint64_t allocations()
+	{
+#ifdef BACKUP_ALLOC_ACCOUNTING
+		return AllocationAccounting::total().allocations;
+#else
+		return allocationCount.load(std::memory_order_relaxed);
+#endif
+	}
+
+
+	State::State(std::vector<int64_t> args, uint64_t iterations)
+		: counters()
+		, _args(std::move(args))
+		, _iterations(iterations)
+		, _remaining(iterations)
+		, _started(false)
+		, _running(false)
+		, _start()
+		, _realTime(0)
+		, _cpuStart(0)
+		, _cpuTime(0)
+		, _allocationsStart(0)
+		, _allocations(0)
+		, _bytes(0)
+		, _items(0)
+		, _label()
+		, _error()
+	{
+	}
+
+
+	int64_t State::range(size_t index) const
+	{
+		return index < _args.size() ? _args[index] : 0;
+	}
+
+
+	uint64_t State::iterations() const
+	{
+		return _iterations;
+	}
+
+
+	void State::PauseTiming()
+	{
+		if (_running)
+		{
+			_realTime += std::chrono::steady_clock::now() - _start;
+			_cpuTime += std::clock() - _cpuStart;
+			_allocations += allocations() - _allocationsStart;
+			_running = false;
+		}
+	}
+
+
+	void State::ResumeTiming()
+	{
+		if (!_running)
+		{
+			_allocationsStart = allocations();
+			_cpuStart = std::clock();
+			_start = std::chrono::steady_clock::now();
+			_running = true;
+		}
+	}
+
+
+	void State::SetBytesProcessed(int64_t bytes)
+	{
+		_bytes = bytes;
+	}
+
+
+	void State::SetItemsProcessed(int64_t items)
+	{
+		_items = items;
+	}
+
+
+	void State::SetLabel(const std::string& label)
+	{
+		_label = label;
+	}
+
+
+	void State::SkipWithError(const std::string& error)
+	{
+		_error = error;
+		_remaining = 0;
+	}
+
+
+	bool State::keepRunning()
+	{
+		if (!_started)
+		{
+			_started = true;
+			ResumeTiming();
+		}
+		if (_remaining > 0 && _error.empty())
+		{
+			_remaining--;
+			return true;
+		}
+		PauseTiming();
+		return false;
+	}
+
+
+	Benchmark::Benchmark(const std::string& name, Function function)
+		: _name(name)
+		, _function(std::move(function))
+		, _args()
+		, _multiplier(8)
+	{
+	}
+
+
+	Benchmark* Benchmark::Arg(int64_t arg)
+	{
+		_args.push_back({ arg });
+		return this;
+	}
+
+
+	Benchmark* Benchmark::Args(const std::vector<int64_t>& args)
+	{
+		_args.push_back(args);
+		return this;
+	}
+
+
+	Benchmark* Benchmark::RangeMultiplier(int64_t multiplier)
+	{
+		_multiplier = std::max<int64_t>(multiplier, 2);
+		return this;
+	}
+
+
+	Benchmark* Benchmark::Range(int64_t start, int64_t limit)
+	{
+		for (int64_t arg = start; arg < limit; arg *= _multiplier)
+		{
+			_args.push_back({ arg });
+		}
+		_args.push_back({ limit });
+		return this;
+	}
+
+
+	static std::vector<std::unique_ptr<Benchmark>>& benchmarks()
+	{
+		static std::vector<std::unique_ptr<Benchmark>> registered;
+		return registered;
+	}
+
+
+	Benchmark* registerBenchmark(const std::string& name, Function function)
+	{
+		benchmarks().push_back(std::make_unique<Benchmark>(name, std::move(function)));
+		return benchmarks().back().get();
+	}
+
+
+	struct Result
+	{
+		std::string name;
+		uint64_t iterations;
+		double realTime;  // ns per iteration
+		double cpuTime;  // ns per iteration
+		double bytesPerSecond;
+		double itemsPerSecond;
+		double allocationsPerIteration;
+		std::map<std::string, double> counters;
+		std::string label;
+		std::string error;
+	};
+
+
+	static std::string runName(const Benchmark& benchmark, const std::vector<int64_t>& args)
+	{
+		std::string name = benchmark.name();
+		for (auto arg : args)
+		{
+			name += "/" + std::to_string(arg);
+		}
+		return name;
+	}
+
+
+	struct Runner
+	{
+		// Runs a benchmark with more and more iterations until it runs for the minimum time.
+		static Result run(const Benchmark& benchmark, const std::vector<int64_t>& args, double minTime)
+		{
+			Result result;
+			result.name = runName(benchmark, args);
+
+			uint64_t iterations = 1;
+			while (true)
+			{
+				State state(args, iterations);
+				benchmark.function()(state);
+
+				double seconds = std::chrono::duration<double>(state._realTime).count();
+				if (!state._error.empty() || seconds >= minTime || iterations >= 1000000000)
+				{
+					double perIteration = static_cast<double>(iterations);
+					result.iterations = iterations;
+					result.realTime = state._realTime.count() / perIteration;
+					result.cpuTime = 1e9 * state._cpuTime / CLOCKS_PER_SEC / perIteration;
+					result.bytesPerSecond = seconds > 0 ? state._bytes / seconds : 0;
+					result.itemsPerSecond = seconds > 0 ? state._items / seconds : 0;
+					result.allocationsPerIteration = state._allocations / perIteration;
+					result.counters = state.counters;
+					result.label = state._label;
+					result.error = state._error;
+					return result;
+				}
+
+				// aim a bit past the minimum time, like Google Benchmark does
+				double scale = seconds > 0 ? minTime * 1.4 / seconds : 10.0;
+				scale = std::clamp(scale, 2.0, 10.0);
+				iterations = static_cast<uint64_t>(iterations * scale);
+			}
+		}
+	};
+
+
+	static std::string escape(const std::string& text)
+	{
+		std::string escaped;
+		for (char c : text)
+		{
+			if (c == '"' || c == '\\')
+			{
+				escaped += '\\';
+			}
+			escaped += c;
+		}
+		return escaped;
+	}
+
+
+	static std::string hostName()
+	{
+		char name[256] = {};
+		if (gethostname(name, sizeof(name) - 1) != 0)
+		{
+			return "";
+		}
+		return name;
+	}
+
+
+	static void writeJSON(std::ostream& out, const std::vector<Result>& results, const std::string& executable)
+	{
+		auto now = std::time(nullptr);
+		char date[64] = {};
+		std::strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", std::localtime(&now));
+
+		out << std::setprecision(10);
+		out << "{\n";
+		out << "  \"context\": {\n";
+		out << "    \"date\": \"" << date << "\",\n";
+		out << "    \"host_name\": \"" << escape(hostName()) << "\",\n";
+		out << "    \"executable\": \"" << escape(executable) << "\",\n";
+		out << "    \"num_cpus\": " << std::thread::hardware_concurrency() << ",\n";
+#ifdef NDEBUG
+		out << "    \"library_build_type\": \"release\"\n";
+#else
+		out << "    \"library_build_type\": \"debug\"\n";
+#endif
+		out << "  },\n";
+		out << "  \"benchmarks\": [";
+		for (size_t i = 0; i < results.size(); i++)
+		{
+			const auto& result = results[i];
+			out << (i ? ",\n" : "\n") << "    {\n";
+			out << "      \"name\": \"" << escape(result.name) << "\",\n";
+			out << "      \"run_name\": \"" << escape(result.name) << "\",\n";
+			out << "      \"run_type\": \"iteration\",\n";
+			if (!result.error.empty())
+			{
+				out << "      \"error_occurred\": true,\n";
+				out << "      \"error_message\": \"" << escape(result.error) << "\",\n";
+			}
+			out << "      \"iterations\": " << result.iterations << ",\n";
+			out << "      \"real_time\": " << result.realTime << ",\n";
+			out << "      \"cpu_time\": " << result.cpuTime << ",\n";
+			out << "      \"time_unit\": \"ns\",\n";
+			if (result.bytesPerSecond > 0)
+			{
+				out << "      \"bytes_per_second\": " << result.bytesPerSecond << ",\n";
+			}
+			if (result.itemsPerSecond > 0)
+			{
+				out << "      \"items_per_second\": " << result.itemsPerSecond << ",\n";
+			}
+			for (const auto& [name, value] : result.counters)
+			{
+				out << "      \"" << escape(name) << "\": " << value << ",\n";
+			}
+			if (!result.label.empty())
+			{
+				out << "      \"label\": \"" << escape(result.label) << "\",\n";
+			}
+			out << "      \"allocs_per_iter\": " << result.allocationsPerIteration << "\n";
+			out << "    }";
+		}
+		out << "\n  ]\n}\n";
+	}
+
+
+	static void writeConsole(std::ostream& out, const Result& result)
+	{
+		out << std::left << std::setw(40) << result.name << std::right;
+		if (!result.error.empty())
+		{
+			out << " ERROR: " << result.error << std::endl;
+			return;
+		}
+		out << std::fixed << std::setprecision(0)
+			<< std::setw(14) << result.realTime << " ns"
+			<< std::setw(14) << result.cpuTime << " ns"
+			<< std::setw(12) << result.iterations;
+		if (result.bytesPerSecond > 0)
+		{
+			out << std::setprecision(1) << std::setw(12) << result.bytesPerSecond / (1024 * 1024) << " MB/s";
+		}
+		if (result.itemsPerSecond > 0)
+		{
+			out << std::setprecision(0) << std::setw(12) << result.itemsPerSecond << " items/s";
+		}
+		out << std::setprecision(2) << std::setw(10) << result.allocationsPerIteration << " allocs";
+		for (const auto& [name, value] : result.counters)
+		{
+			out << " " << name << "=" << value;
+		}
+		if (!result.label.empty())
+		{
+			out << " " << result.label;
+		}
+		out << std::defaultfloat << std::endl;
+	}
+
+
+	int runBenchmarks(int argc, char* argv[])
+	{
+		const std::string filterArgument = "--benchmark_filter=";
+		const std::string minTimeArgument = "--benchmark_min_time=";
+		const std::string formatArgument = "--benchmark_format=";
+		const std::string outArgument = "--benchmark_out=";
+
+		std::string filter;
+		double minTime = 0.5;
+		std::string format = "console";
+		std::string outFile;
+		for (int i = 1; i < argc; i++)
+		{
+			std::string argument = argv[i];
+			if (argument.rfind(filterArgument, 0) == 0)
+			{
+				filter = argument.substr(filterArgument.size());
+			}
+			else if (argument.rfind(minTimeArgument, 0) == 0)
+			{
+				minTime = std::atof(argument.substr(minTimeArgument.size()).c_str());
+			}
+			else if (argument.rfind(formatArgument, 0) == 0)
+			{
+				format = argument.substr(formatArgument.size());
+			}
+			else if (argument.rfind(outArgument, 0) == 0)
+			{
+				outFile = argument.substr(outArgument.size());
+			}
+			else
+			{
+				std::cerr << "Invalid argument: " << argument << std::endl;
+				return -1;
+			}
+		}
+		if (format != "console" && format != "json")
+		{
+			std::cerr << "Invalid format: " << format << std::endl;
+			return -1;
+		}
+
+		std::vector<Result> results;
+		if (format == "console")
+		{
+			std::cout << std::left << std::setw(40) << "Benchmark" << std::right
+				<< std::setw(17) << "Time" << std::setw(17) << "CPU" << std::setw(12) << "Iterations" << std::endl;
+		}
+		for (const auto& benchmark : benchmarks())
+		{
+			auto argsList = benchmark->args();
+			if (argsList.empty())
+			{
+				argsList.push_back({});
+			}
+			for (const auto& args : argsList)
+			{
+				if (!filter.empty() && runName(*benchmark, args).find(filter) == std::string::npos)
+				{
+					continue;
+				}
+				auto result = Runner::run(*benchmark, args, minTime);
+				if (format == "console")
+				{
+					writeConsole(std::cout, result);
+				}
+				results.push_back(std::move(result));
+			}
+		}
+
+		if (format == "json")
+		{
+			writeJSON(std::cout, results, argv[0]);
+		}
+		if (!outFile.empty())
+		{
+			std::ofstream out(outFile);
+			if (!out)
+			{
+				std::cerr << "Cannot open " << outFile << std::endl;
+				return -1;
+			}
+			writeJSON(out, results, argv[0]);
+		}
+		return 0;
+	}
+}
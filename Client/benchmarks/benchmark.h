@@ -0,0 +1,175 @@
+#ifndef BENCHMARK_H
+#define BENCHMARK_H
+
+
+#include <chrono>
+#include <ctime>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+#include <cstddef>
+
+
+/**
+* @brief A small benchmark harness with the interface of Google Benchmark
+*
+* The benchmarks are written as they would be for Google Benchmark, a function that takes a
+* State and loops over it, registered with BENCHMARK(). The results are printed as a table or
+* written in the JSON format of Google Benchmark, so the same tools can compare two runs.
+* Every result also counts the heap allocations per iteration.
+*
+* Command line:
+*   --benchmark_filter=<substring>    run the benchmarks whose name contains the substring
+*   --benchmark_min_time=<seconds>    how long every benchmark runs at least, 0.5 by default
+*   --benchmark_format=<console|json> the format of the standard output
+*   --benchmark_out=<file>            also write the JSON results to a file
+*/
+namespace bench
+{
+	class State;
+	using Function = std::function<void(State&)>;
+
+	/**
+	* @brief Get the number of heap allocations of the process so far.
+	*/
+	uint64_t allocations();
+
+	/**
+	* @brief Keep the compiler from optimizing a value away.
+	*/
+	template <typename T>
+	inline void DoNotOptimize(const T& value)
+	{
+#if defined(__GNUC__) || defined(__clang__)
+		asm volatile("" : : "r,m"(value) : "memory");
+#else
+		static volatile const void* sink;
+		sink = &value;
+#endif
+	}
+
+	/**
+	* @brief State class
+	*
+	* The state of one benchmark run. The benchmark loops over the state, the loop body is timed.
+	*/
+	class State
+	{
+	public:
+		class Iterator
+		{
+		public:
+			// what `for (auto _ : state)` binds, an unused empty type so the loop variable doesn't warn
+			struct [[maybe_unused]] Value {};
+
+			explicit Iterator(State* state) : _state(state) {}
+			bool operator!=(const Iterator&) const { return _state->keepRunning(); }
+			void operator++() {}
+			Value operator*() const { return Value(); }
+
+		private:
+			State* _state;
+		};
+
+		State(std::vector<int64_t> args, uint64_t iterations);
+
+		Iterator begin() { return Iterator(this); }
+		Iterator end() { return Iterator(nullptr); }
+
+		/**
+		* @brief Get an argument of the benchmark.
+		*/
+		int64_t range(size_t index = 0) const;
+
+		/**
+		* @brief Get the number of iterations of the run.
+		*/
+		uint64_t iterations() const;
+
+		/**
+		* @brief Stop the timer, for setup work inside the loop.
+		*/
+		void PauseTiming();
+
+		/**
+		* @brief Start the timer again.
+		*/
+		void ResumeTiming();
+
+		void SetBytesProcessed(int64_t bytes);
+		void SetItemsProcessed(int64_t items);
+		void SetLabel(const std::string& label);
+		void SkipWithError(const std::string& error);
+
+		std::map<std::string, double> counters;
+
+	private:
+		friend struct Runner;
+		bool keepRunning();
+
+		std::vector<int64_t> _args;
+		uint64_t _iterations;
+		uint64_t _remaining;
+		bool _started;
+		bool _running;
+		std::chrono::steady_clock::time_point _start;
+		std::chrono::nanoseconds _realTime;
+		std::clock_t _cpuStart;
+		std::clock_t _cpuTime;
+		uint64_t _allocationsStart;
+		uint64_t _allocations;
+		int64_t _bytes;
+		int64_t _items;
+		std::string _label;
+		std::string _error;
+	};
+
+	/**
+	* @brief Benchmark class
+	*
+	* A registered benchmark and the arguments it runs with.
+	*/
+	class Benchmark
+	{
+	public:
+		Benchmark(const std::string& name, Function function);
+
+		Benchmark* Arg(int64_t arg);
+		Benchmark* Args(const std::vector<int64_t>& args);
+		Benchmark* RangeMultiplier(int64_t multiplier);
+		Benchmark* Range(int64_t start, int64_t limit);
+
+		const std::string& name() const { return _name; }
+		const Function& function() const { return _function; }
+		const std::vector<std::vector<int64_t>>& args() const { return _args; }
+
+	private:
+		std::string _name;
+		Function _function;
+		std::vector<std::vector<int64_t>> _args;
+		int64_t _multiplier;
+	};
+
+	/**
+	* @brief Register a benchmark, BENCHMARK() is the usual way.
+	*/
+	Benchmark* registerBenchmark(const std::string& name, Function function);
+
+	/**
+	* @brief Run the registered benchmarks.
+	*
+	* @return the exit code of the program.
+	*/
+	int runBenchmarks(int argc, char* argv[]);
+}
+
+#define BENCHMARK_CONCAT_(a, b) a##b
+#define BENCHMARK_CONCAT(a, b) BENCHMARK_CONCAT_(a, b)
+#define BENCHMARK(function) \
+	static bench::Benchmark* BENCHMARK_CONCAT(benchmark_, __LINE__) = bench::registerBenchmark(#function, function)
+#define BENCHMARK_MAIN() \
+	int main(int argc, char* argv[]) { return bench::runBenchmarks(argc, argv); }
+
+#endif // BENCHMARK_H
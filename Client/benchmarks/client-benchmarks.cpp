@@ -0,0 +1,306 @@
+#include "benchmark.h"
+
+#include "../AESWrapper.h"
+#include "../buffer-pool.h"
+#include "../cksum.h"
+#include "../connection.h"
+#include "../file-pipeline.h"
+#include "../serializer.h"
+#include "../thread-pool.h"
+
+#include <boost/asio.hpp>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <vector>
+
+
+/*
+* Micro-benchmarks of the hot paths of a transfer: the CRC, the AES stages, the serialization
+* of the packets and the framing of the responses.
+*
+* Build with the client sources, for example:
+*   g++ -O2 -std=c++17 -DNDEBUG benchmarks/client-benchmarks.cpp benchmarks/benchmark.cpp AESWrapper.cpp buffer-pool.cpp cksum.cpp connection.cpp alloc-accounting.cpp metrics.cpp
+*       perf-counters.cpp tracing.cpp file-pipeline.cpp serializer.cpp session-capture.cpp thread-pool.cpp utils.cpp -lcryptopp -lpthread -o client-benchmarks
+* and run with --benchmark_format=json --benchmark_out=results.json to keep the results of a release.
+*/
+
+
+constexpr int64_t KB = 1024;
+constexpr int64_t MB = 1024 * KB;
+constexpr int64_t GB = 1024 * MB;
+constexpr size_t KEY_LENGTH = 32;  // the server's AES-256 session keys
+
+
+static std::vector<char> randomData(size_t size)
+{
+	std::vector<char> data(size);
+	std::mt19937 generator(42);
+	for (auto& byte : data)
+	{
+		byte = static_cast<char>(generator());
+	}
+	return data;
+}
+
+
+static std::vector<char> testKey()
+{
+	return std::vector<char>(KEY_LENGTH, 'k');
+}
+
+
+static void BM_CRC(bench::State& state)
+{
+	auto data = randomData(static_cast<size_t>(state.range(0)));
+	for (auto _ : state)
+	{
+		CRC crc;
+		crc.update(data.data(), data.size());
+		bench::DoNotOptimize(crc.digest());
+	}
+	state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_CRC)->RangeMultiplier(8)->Range(64, 1 * GB);
+
+
+static void BM_CRCChunked(bench::State& state)
+{
+	// the way the pipeline feeds the CRC, one packet at a time
+	auto data = randomData(static_cast<size_t>(state.range(0)));
+	const size_t chunkSize = 32 * KB;
+	for (auto _ : state)
+	{
+		CRC crc;
+		for (size_t offset = 0; offset < data.size(); offset += chunkSize)
+		{
+			crc.update(data.data() + offset, std::min(chunkSize, data.size() - offset));
+		}
+		bench::DoNotOptimize(crc.digest());
+	}
+	state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_CRCChunked)->Arg(1 * MB)->Arg(64 * MB);
+
+
+static void BM_AESEncrypt(bench::State& state)
+{
+	AESWrapper aes;
+	aes.setKey(testKey());
+	auto data = randomData(static_cast<size_t>(state.range(0)));
+	for (auto _ : state)
+	{
+		bench::DoNotOptimize(aes.encrypt(data));
+	}
+	state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_AESEncrypt)->RangeMultiplier(4)->Range(64, 4 * MB);
+
+
+static void BM_AESDecrypt(bench::State& state)
+{
+	AESWrapper aes;
+	aes.setKey(testKey());
+	auto ciphertext = aes.encrypt(randomData(static_cast<size_t>(state.range(0))));
+	for (auto _ : state)
+	{
+		bench::DoNotOptimize(aes.decrypt(ciphertext));
+	}
+	state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_AESDecrypt)->RangeMultiplier(4)->Range(64, 4 * MB);
+
+
+static void BM_AESStreamEncrypt(bench::State& state)
+{
+	// the pipeline's encryption stage, whole blocks into a caller-owned buffer
+	auto key = testKey();
+	auto data = randomData(static_cast<size_t>(state.range(0)));
+	std::vector<char> out(AESWrapper::encryptedSize(data.size()));
+	for (auto _ : state)
+	{
+		AESStreamEncryptor encryptor(key);
+		size_t whole = data.size() / AES_BLOCK_SIZE * AES_BLOCK_SIZE;
+		size_t written = encryptor.update(data.data(), whole, out.data());
+		written += encryptor.finish(data.data() + whole, data.size() - whole, out.data() + written);
+		bench::DoNotOptimize(written);
+	}
+	state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_AESStreamEncrypt)->RangeMultiplier(4)->Range(64, 4 * MB);
+
+
+static Request sendFileRequest(const std::vector<char>& content)
+{
+	SendFileRequest payload
+	{
+		static_cast<uint32_t>(content.size()),
+		static_cast<uint32_t>(content.size()),
+		1,
+		1,
+		"benchmark.bin",
+		ByteSpan{ content.data(), content.size() }
+	};
+	uint32_t payloadSize = static_cast<uint32_t>(CONTENT_SIZE + ORIGINAL_FILE_SIZE + PACKET_NUMBER_SIZE
+		+ TOTAL_PACKETS_SIZE + FILE_NAME_SIZE + content.size());
+	return Request{ ClientID{}, CLIENT_VERSION, static_cast<uint16_t>(RequestCode::REQUEST_SEND_FILE), payloadSize, payload };
+}
+
+
+static void BM_SerializeSendFile(bench::State& state)
+{
+	auto content = randomData(static_cast<size_t>(state.range(0)));
+	auto request = sendFileRequest(content);
+	BufferPool pool(PACKET_LENGTH, 1);
+	for (auto _ : state)
+	{
+		auto buffer = pool.acquire();
+		Serializer::serializeRequest(request, buffer);
+		bench::DoNotOptimize(buffer.data());
+	}
+	state.SetItemsProcessed(state.iterations());
+	state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_SerializeSendFile)->Arg(1 * KB)->Arg(32 * KB - 512);
+
+
+static void BM_SerializeNameRequest(bench::State& state)
+{
+	Request request{ ClientID{}, CLIENT_VERSION, static_cast<uint16_t>(RequestCode::REQUEST_LOGIN), NAME_SIZE, NameRequest{ "benchmark" } };
+	std::vector<char> buffer;
+	for (auto _ : state)
+	{
+		Serializer::serializeRequest(request, buffer);
+		bench::DoNotOptimize(buffer.data());
+	}
+	state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_SerializeNameRequest);
+
+
+// A serialized response, the header and the payload.
+static std::vector<char> response(ResponseCode code, const std::vector<char>& payload)
+{
+	std::vector<char> data(RESPONSE_HEADER_SIZE + payload.size());
+	uint8_t version = CLIENT_VERSION;
+	uint16_t opCode = static_cast<uint16_t>(code);
+	uint32_t payloadSize = static_cast<uint32_t>(payload.size());
+	std::memcpy(data.data(), &version, sizeof(version));
+	std::memcpy(data.data() + 1, &opCode, sizeof(opCode));
+	std::memcpy(data.data() + RESPONSE_PAYLOAD_SIZE_OFFSET, &payloadSize, sizeof(payloadSize));
+	std::memcpy(data.data() + RESPONSE_HEADER_SIZE, payload.data(), payload.size());
+	return data;
+}
+
+
+static std::vector<char> fileResponse()
+{
+	std::vector<char> payload(CLIENT_ID_SIZE + CONTENT_SIZE + FILE_NAME_SIZE + CRC_SIZE, '\0');
+	std::memcpy(payload.data() + CLIENT_ID_SIZE + CONTENT_SIZE, "benchmark.bin", 13);
+	return response(ResponseCode::RESPONSE_FILE_VALID, payload);
+}
+
+
+static void BM_DeserializeFileResponse(bench::State& state)
+{
+	auto data = fileResponse();
+	for (auto _ : state)
+	{
+		bench::DoNotOptimize(Serializer::deserializeResponse(data));
+	}
+	state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_DeserializeFileResponse);
+
+
+static void BM_DeserializePackResponse(bench::State& state)
+{
+	uint32_t fileCount = static_cast<uint32_t>(state.range(0));
+	std::vector<char> payload(CLIENT_ID_SIZE + FILE_NAME_SIZE + FILE_COUNT_SIZE + fileCount * CRC_SIZE, '\0');
+	std::memcpy(payload.data() + CLIENT_ID_SIZE + FILE_NAME_SIZE, &fileCount, sizeof(fileCount));
+	auto data = response(ResponseCode::RESPONSE_PACK_VALID, payload);
+	for (auto _ : state)
+	{
+		bench::DoNotOptimize(Serializer::deserializeResponse(data));
+	}
+	state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_DeserializePackResponse)->Arg(16)->Arg(1024);
+
+
+static void BM_ConnectionReceive(bench::State& state)
+{
+	// responses written back to back on loopback, Connection::receive splits them by their headers
+	boost::asio::io_context context;
+	tcp::acceptor acceptor(context, tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0));
+	Connection connection;
+
+	// keep the connection message out of the JSON results
+	auto output = std::cout.rdbuf(nullptr);
+	bool connected = connection.setServerIP("127.0.0.1", std::to_string(acceptor.local_endpoint().port())) && connection.connect();
+	std::cout.rdbuf(output);
+	if (!connected)
+	{
+		state.SkipWithError("Cannot connect on loopback");
+		return;
+	}
+	tcp::socket server = acceptor.accept();
+
+	const size_t batch = static_cast<size_t>(state.range(0));
+	std::vector<char> responses;
+	auto single = fileResponse();
+	for (size_t i = 0; i < batch; i++)
+	{
+		responses.insert(responses.end(), single.begin(), single.end());
+	}
+
+	for (auto _ : state)
+	{
+		boost::asio::write(server, boost::asio::buffer(responses));
+		for (size_t i = 0; i < batch; i++)
+		{
+			bench::DoNotOptimize(connection.receive().data());
+		}
+	}
+	state.SetItemsProcessed(state.iterations() * batch);
+	state.SetBytesProcessed(state.iterations() * responses.size());
+}
+BENCHMARK(BM_ConnectionReceive)->Arg(1)->Arg(64);
+
+
+static void BM_FilePipeline(bench::State& state)
+{
+	// CRC and encryption of a whole file on the thread pool, the CPU part of handleFileRequest
+	const size_t fileSize = static_cast<size_t>(state.range(0));
+	const size_t chunkSize = 32 * KB;
+	const size_t depth = 8;
+	auto data = randomData(fileSize);
+	ThreadPool pool(static_cast<size_t>(state.range(1)));
+	BufferPool buffers(chunkSize + AES_BLOCK_SIZE, 2 * depth + 1);
+	size_t totalPackets = (fileSize + chunkSize - 1) / chunkSize;
+
+	for (auto _ : state)
+	{
+		FilePipeline pipeline(pool, testKey(), depth);
+		size_t nextRead = 1;
+		for (size_t packet = 1; packet <= totalPackets; packet++)
+		{
+			while (nextRead <= totalPackets && nextRead < packet + depth)
+			{
+				size_t offset = (nextRead - 1) * chunkSize;
+				auto chunk = buffers.acquire();
+				chunk.resize(std::min(chunkSize, fileSize - offset));
+				std::memcpy(chunk.data(), data.data() + offset, chunk.size());
+				pipeline.submit(nextRead, std::move(chunk), buffers.acquire(), nextRead == totalPackets);
+				nextRead++;
+			}
+			bench::DoNotOptimize(pipeline.next().data());
+		}
+		bench::DoNotOptimize(pipeline.finish());
+	}
+	state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_FilePipeline)->Args({ 64 * MB, 1 })->Args({ 64 * MB, 4 });
+
+
+BENCHMARK_MAIN()
@@ -0,0 +1,161 @@
+#include "dataset.h"
+
+#include "../utils.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <random>
+#include <stdexcept>
+
+
+constexpr size_t DEFAULT_LOGNORMAL_MAX = 256 * 1024 * 1024;
+constexpr size_t BLOCK_SIZE = 4096;  // the unit of compressibility, a compressor sees each block as part random and part zeros
+constexpr size_t WRITE_SIZE = 1024 * 1024;
+
+
+static bool parseSize(const std::string& text, size_t& size)
+{
+	return parseByteSize(text, size) && size > 0;
+}
+
+
+bool parseSizeDistribution(const std::string& text, DatasetSpec& spec)
+{
+	auto colon = text.find(':');
+	if (colon == std::string::npos)
+	{
+		return false;
+	}
+	auto kind = text.substr(0, colon);
+	auto arguments = text.substr(colon + 1);
+
+	if (kind == "fixed")
+	{
+		spec.distribution = SizeDistribution::FIXED;
+		if (!parseSize(arguments, spec.size))
+		{
+			return false;
+		}
+		spec.maxSize = spec.size;
+		return true;
+	}
+	if (kind == "uniform")
+	{
+		auto dash = arguments.find('-');
+		spec.distribution = SizeDistribution::UNIFORM;
+		return dash != std::string::npos
+			&& parseSize(arguments.substr(0, dash), spec.size)
+			&& parseSize(arguments.substr(dash + 1), spec.maxSize)
+			&& spec.size <= spec.maxSize;
+	}
+	if (kind == "lognormal")
+	{
+		auto comma = arguments.find(',');
+		if (comma == std::string::npos)
+		{
+			return false;
+		}
+		spec.distribution = SizeDistribution::LOGNORMAL;
+		if (!parseSize(arguments.substr(0, comma), spec.size))
+		{
+			return false;
+		}
+		auto rest = arguments.substr(comma + 1);
+		auto maxComma = rest.find(',');
+		spec.maxSize = DEFAULT_LOGNORMAL_MAX;
+		if (maxComma != std::string::npos && !parseSize(rest.substr(maxComma + 1), spec.maxSize))
+		{
+			return false;
+		}
+		try
+		{
+			spec.sigma = std::stod(rest.substr(0, maxComma));
+		}
+		catch (const std::exception&)
+		{
+			return false;
+		}
+		return spec.sigma >= 0 && spec.size <= spec.maxSize;
+	}
+	return false;
+}
+
+
+static size_t drawSize(const DatasetSpec& spec, std::mt19937_64& generator)
+{
+	switch (spec.distribution)
+	{
+	case SizeDistribution::UNIFORM:
+		return std::uniform_int_distribution<size_t>(spec.size, spec.maxSize)(generator);
+	case SizeDistribution::LOGNORMAL:
+	{
+		std::lognormal_distribution<double> distribution(std::log(static_cast<double>(spec.size)), spec.sigma);
+		auto size = static_cast<size_t>(std::llround(distribution(generator)));
+		return std::clamp<size_t>(size, 1, spec.maxSize);
+	}
+	default:
+		return spec.size;
+	}
+}
+
+
+// Fill a buffer block by block: random bytes first, then as many zeros as the compressibility asks for.
+static void fillBlocks(char* data, size_t size, double compressibility, std::mt19937_64& generator)
+{
+	auto randomBytes = static_cast<size_t>(std::llround((1.0 - compressibility) * BLOCK_SIZE));
+	for (size_t offset = 0; offset < size; offset += BLOCK_SIZE)
+	{
+		size_t blockSize = std::min(BLOCK_SIZE, size - offset);
+		size_t randomSize = std::min(randomBytes, blockSize);
+		for (size_t i = 0; i < randomSize; i += sizeof(uint64_t))
+		{
+			uint64_t value = generator();
+			std::memcpy(data + offset + i, &value, std::min(sizeof(value), randomSize - i));
+		}
+		std::fill(data + offset + randomSize, data + offset + blockSize, '\0');
+	}
+}
+
+
+std::vector<std::string> generateDataset(const std::filesystem::path& directory, const DatasetSpec& spec)
+{
+	if (spec.compressibility < 0.0 || spec.compressibility > 1.0)
+	{
+		throw std::invalid_argument("The compressibility must be between 0 and 1");
+	}
+	std::filesystem::create_directories(directory);
+
+	std::mt19937_64 generator(spec.seed);
+	std::vector<char> buffer(WRITE_SIZE);
+	std::vector<std::string> names;
+	names.reserve(spec.fileCount);
+
+	for (size_t i = 0; i < spec.fileCount; i++)
+	{
+		char name[32];
+		std::snprintf(name, sizeof(name), "file%06zu.bin", i);
+		names.push_back(name);
+
+		std::ofstream file(directory / name, std::ios::binary | std::ios::trunc);
+		if (!file)
+		{
+			throw std::runtime_error("Cannot write " + (directory / name).string());
+		}
+		size_t remaining = drawSize(spec, generator);
+		while (remaining > 0)
+		{
+			size_t chunkSize = std::min(remaining, buffer.size());
+			fillBlocks(buffer.data(), chunkSize, spec.compressibility, generator);
+			file.write(buffer.data(), static_cast<std::streamsize>(chunkSize));
+			remaining -= chunkSize;
+		}
+		if (!file)
+		{
+			throw std::runtime_error("Cannot write " + (directory / name).string());
+		}
+	}
+	return names;
+}
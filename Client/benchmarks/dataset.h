@@ -0,0 +1,59 @@
+#ifndef DATASET_H
+#define DATASET_H
+
+
+#include <filesystem>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+
+/**
+* @brief How the sizes of the files of a dataset are drawn.
+*/
+enum class SizeDistribution
+{
+	FIXED,      // every file has the same size
+	UNIFORM,    // uniform between a minimum and a maximum
+	LOGNORMAL   // a few large files among many small ones, like a real tree of files
+};
+
+/**
+* @brief The description of a synthetic dataset.
+*/
+struct DatasetSpec
+{
+	size_t fileCount = 100;
+	SizeDistribution distribution = SizeDistribution::FIXED;
+	size_t size = 1024 * 1024;           // the fixed size, the minimum of a uniform or the median of a lognormal
+	size_t maxSize = 1024 * 1024;        // the maximum of a uniform or of a lognormal
+	double sigma = 1.0;                  // the spread of a lognormal
+	double compressibility = 0.0;        // the fraction of every block that is zeros, 0 for random data
+	uint32_t seed = 42;
+};
+
+/**
+* @brief Parse a size distribution.
+*
+* The formats are fixed:<size>, uniform:<min>-<max> and lognormal:<median>,<sigma>[,<max>],
+* with sizes like 64KB or 1MB. The lognormal's maximum is 256MB if it is not given.
+*
+* @param text the distribution.
+* @param spec the dataset to set the distribution of.
+* @return true if the distribution is valid.
+*/
+bool parseSizeDistribution(const std::string& text, DatasetSpec& spec);
+
+/**
+* @brief Write a synthetic dataset.
+*
+* The same spec always generates the same files.
+*
+* @param directory the directory to write the files to, it is created if needed.
+* @param spec the dataset.
+* @return the names of the files, relative to the directory.
+*/
+std::vector<std::string> generateDataset(const std::filesystem::path& directory, const DatasetSpec& spec);
+
+#endif // DATASET_H
@@ -0,0 +1,455 @@
+#include "dataset.h"
+#include "impairment-proxy.h"
+#include "stand-in-server.h"
+
+#include "../alloc-accounting.h"
+#include "../client.h"
+#include "../metrics.h"
+#include "../perf-counters.h"
+#include "../utils.h"
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+
+/*
+* End-to-end throughput of the client: a synthetic dataset is sent to a stand-in server on loopback,
+* through the whole client (file reads, CRC, encryption, packing, the protocol and the socket).
+* Every run reports files/s, MB/s, the p50 and p99 latency of a file and the peak RSS of the process.
+* Built with BACKUP_ALLOC_ACCOUNTING, it also reports the client's heap allocations per packet and can fail
+* when they rise above a budget, so a regression in the allocations fails the benchmark like a test.
+*
+* The first run registers, the next runs log in like a returning user. The server runs in the same
+* process but keeps no files, its footprint is a packet buffer per connection, so the peak RSS is the
+* client's. The dataset, the client's transfer.info, me.info and priv.key live in the dataset directory.
+*
+* Build with the client sources, for example:
+*   g++ -O2 -std=c++17 -DNDEBUG benchmarks/e2e-benchmark.cpp benchmarks/dataset.cpp benchmarks/stand-in-server.cpp benchmarks/impairment-proxy.cpp
+*       AESWrapper.cpp RSAWrapper.cpp buffer-pool.cpp cksum.cpp alloc-accounting.cpp metrics.cpp perf-counters.cpp client.cpp connection.cpp
+*       file-handler.cpp file-pipeline.cpp serializer.cpp session-capture.cpp thread-pool.cpp tracing.cpp utils.cpp -lcryptopp -lboost_filesystem -lpthread -o e2e-benchmark
+* and add -DBACKUP_ALLOC_ACCOUNTING to count the allocations.
+*
+* Command line:
+*   --files=<count>               the number of files, 100 by default
+*   --size=<distribution>         fixed:<size>, uniform:<min>-<max> or lognormal:<median>,<sigma>[,<max>], fixed:1MB by default
+*   --compressibility=<fraction>  the fraction of the data that is zeros, 0 by default
+*   --seed=<number>               the seed of the dataset
+*   --runs=<count>                how many times the dataset is sent, 3 by default
+*   --workers=, --window=, --max-inflight=   the client's options
+*   --dir=<path>                  the dataset directory, a temporary directory by default
+*   --keep                        keep the dataset after the benchmark
+*   --format=<console|json>       the format of the results
+*   --perf-counters               count the hardware events of every stage, on Linux
+*   --max-allocs-per-packet=<n>   fail if a returning run allocates more per packet, with BACKUP_ALLOC_ACCOUNTING
+*   --latency=, --jitter=, --bandwidth=, --loss=, --rto=, --reorder=, --reset=, --reset-after=, --proxy-buffer=
+*                                 send through an impairment proxy that makes the loopback a WAN link, see wan-proxy.cpp
+*/
+
+
+const std::string FILES_ARGUMENT = "--files=";
+const std::string SIZE_ARGUMENT = "--size=";
+const std::string COMPRESSIBILITY_ARGUMENT = "--compressibility=";
+const std::string SEED_ARGUMENT = "--seed=";
+const std::string RUNS_ARGUMENT = "--runs=";
+const std::string WORKERS_ARGUMENT = "--workers=";
+const std::string WINDOW_ARGUMENT = "--window=";
+const std::string MAX_INFLIGHT_ARGUMENT = "--max-inflight=";
+const std::string DIR_ARGUMENT = "--dir=";
+const std::string KEEP_ARGUMENT = "--keep";
+const std::string FORMAT_ARGUMENT = "--format=";
+const std::string PERF_COUNTERS_ARGUMENT = "--perf-counters";
+const std::string MAX_ALLOCS_ARGUMENT = "--max-allocs-per-packet=";
+
+constexpr double MB = 1024.0 * 1024.0;
+const std::string BENCHMARK_USER = "benchmark";
+
+
+/**
+* @brief The results of sending the dataset once.
+*/
+struct RunResult
+{
+	bool succeeded;
+	size_t files;
+	uint64_t bytes;
+	double seconds;
+	double p50;  // ms
+	double p99;  // ms
+	uint64_t peakRSS;
+	uint64_t packets;
+	uint64_t allocations;  // the client's, with BACKUP_ALLOC_ACCOUNTING
+
+	double allocationsPerPacket() const
+	{
+		return packets ? static_cast<double>(allocations) / packets : 0.0;
+	}
+};
+
+
+// The peak RSS is reset before every run where the OS allows it (Linux), otherwise it is the peak of the process so far.
+static void resetPeakRSS()
+{
+#ifdef __linux__
+	std::ofstream clearRefs("/proc/self/clear_refs");
+	clearRefs << "5";
+#endif
+}
+
+
+static uint64_t peakRSS()
+{
+#if defined(_WIN32)
+	PROCESS_MEMORY_COUNTERS counters;
+	if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+	{
+		return counters.PeakWorkingSetSize;
+	}
+	return 0;
+#elif defined(__linux__)
+	std::ifstream status("/proc/self/status");
+	std::string line;
+	while (std::getline(status, line))
+	{
+		if (line.rfind("VmHWM:", 0) == 0)
+		{
+			return std::stoull(line.substr(6)) * 1024;  // in kB
+		}
+	}
+	return 0;
+#else
+	rusage usage{};
+	getrusage(RUSAGE_SELF, &usage);
+	return static_cast<uint64_t>(usage.ru_maxrss);  // in bytes on macOS
+#endif
+}
+
+
+static double percentile(std::vector<double>& values, double fraction)
+{
+	if (values.empty())
+	{
+		return 0;
+	}
+	std::sort(values.begin(), values.end());
+	size_t rank = static_cast<size_t>(fraction * (values.size() - 1) + 0.5);
+	return values[rank];
+}
+
+
+static void writeTransferInfo(unsigned short port, const std::vector<std::string>& files)
+{
+	std::ofstream transferInfo(REQUEST_FILE_NAME, std::ios::trunc);
+	transferInfo << "127.0.0.1:" << port << "\n" << BENCHMARK_USER << "\n";
+	for (const auto& file : files)
+	{
+		transferInfo << file << "\n";
+	}
+}
+
+
+static RunResult runOnce(StandInServer& server, size_t workerThreads, size_t fileWindow, size_t maxInflight)
+{
+	resetPeakRSS();
+	AllocationAccounting::resetPeaks();
+	uint64_t packets = Metrics::instance().packets();
+	uint64_t allocations = AllocationAccounting::total().allocations;
+	auto start = std::chrono::steady_clock::now();
+	bool succeeded = false;
+	{
+		// the client reports every response, keep that out of the results
+		auto output = std::cout.rdbuf(nullptr);
+		try
+		{
+			Client client{ workerThreads, fileWindow, maxInflight };
+			succeeded = client.startClient() && client.sendAndReceive();
+		}
+		catch (const std::exception& e)
+		{
+			std::cerr << e.what() << std::endl;
+		}
+		std::cout.rdbuf(output);
+	}
+	auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	auto records = server.takeRecords();
+	std::vector<double> latencies;
+	uint64_t bytes = 0;
+	for (const auto& record : records)
+	{
+		latencies.push_back(std::chrono::duration<double, std::milli>(record.latency).count());
+		bytes += record.size;
+	}
+	return RunResult{ succeeded, records.size(), bytes, seconds, percentile(latencies, 0.5), percentile(latencies, 0.99), peakRSS(),
+		Metrics::instance().packets() - packets, AllocationAccounting::total().allocations - allocations };
+}
+
+
+static void writeConsole(const std::vector<RunResult>& results)
+{
+	std::cout << std::left << std::setw(6) << "Run" << std::right
+		<< std::setw(8) << "Files" << std::setw(12) << "Seconds" << std::setw(12) << "Files/s" << std::setw(12) << "MB/s"
+		<< std::setw(12) << "p50 ms" << std::setw(12) << "p99 ms" << std::setw(14) << "Peak RSS MB";
+	if (AllocationAccounting::enabled())
+	{
+		std::cout << std::setw(14) << "Allocs/pkt";
+	}
+	std::cout << std::endl;
+	for (size_t i = 0; i < results.size(); i++)
+	{
+		const auto& result = results[i];
+		std::cout << std::left << std::setw(6) << (std::to_string(i + 1) + (i == 0 ? "*" : "")) << std::right
+			<< std::fixed << std::setprecision(2)
+			<< std::setw(8) << result.files
+			<< std::setw(12) << result.seconds
+			<< std::setw(12) << result.files / result.seconds
+			<< std::setw(12) << result.bytes / MB / result.seconds
+			<< std::setw(12) << result.p50
+			<< std::setw(12) << result.p99
+			<< std::setw(14) << result.peakRSS / MB;
+		if (AllocationAccounting::enabled())
+		{
+			std::cout << std::setw(14) << result.allocationsPerPacket();
+		}
+		std::cout << (result.succeeded ? "" : "  FAILED") << std::defaultfloat << std::endl;
+	}
+	std::cout << "* registration and key generation included" << std::endl;
+}
+
+
+static void writeJSON(const std::vector<RunResult>& results, const DatasetSpec& spec)
+{
+	std::cout << std::setprecision(10);
+	std::cout << "{\n";
+	std::cout << "  \"dataset\": { \"files\": " << spec.fileCount << ", \"compressibility\": " << spec.compressibility
+		<< ", \"seed\": " << spec.seed << " },\n";
+	std::cout << "  \"runs\": [";
+	for (size_t i = 0; i < results.size(); i++)
+	{
+		const auto& result = results[i];
+		std::cout << (i ? ",\n" : "\n") << "    { "
+			<< "\"succeeded\": " << (result.succeeded ? "true" : "false")
+			<< ", \"registration\": " << (i == 0 ? "true" : "false")
+			<< ", \"files\": " << result.files
+			<< ", \"bytes\": " << result.bytes
+			<< ", \"seconds\": " << result.seconds
+			<< ", \"files_per_second\": " << result.files / result.seconds
+			<< ", \"mb_per_second\": " << result.bytes / MB / result.seconds
+			<< ", \"p50_ms\": " << result.p50
+			<< ", \"p99_ms\": " << result.p99
+			<< ", \"peak_rss_bytes\": " << result.peakRSS;
+		if (AllocationAccounting::enabled())
+		{
+			std::cout << ", \"packets\": " << result.packets
+				<< ", \"allocations\": " << result.allocations
+				<< ", \"allocs_per_packet\": " << result.allocationsPerPacket();
+		}
+		std::cout << " }";
+	}
+	std::cout << "\n  ]\n}" << std::endl;
+}
+
+
+static bool parseCount(const std::string& text, size_t& count)
+{
+	if (!isNumber(text))
+	{
+		return false;
+	}
+	count = std::stoul(text);
+	return true;
+}
+
+
+int main(int argc, char* argv[])
+{
+	DatasetSpec spec;
+	size_t runs = 3;
+	size_t workerThreads = 0;
+	size_t fileWindow = DEFAULT_FILE_WINDOW;
+	size_t maxInflight = DEFAULT_MAX_INFLIGHT;
+	auto directory = std::filesystem::temp_directory_path() / "client-e2e-benchmark";
+	bool keep = false;
+	std::string format = "console";
+	bool perfCounters = false;
+	double maxAllocationsPerPacket = -1.0;  // no budget
+	ImpairmentSettings link;
+
+	for (int i = 1; i < argc; i++)
+	{
+		std::string argument = argv[i];
+		bool valid = true;
+		size_t seed = 0;
+		if (argument.rfind(FILES_ARGUMENT, 0) == 0)
+		{
+			valid = parseCount(argument.substr(FILES_ARGUMENT.size()), spec.fileCount) && spec.fileCount > 0;
+		}
+		else if (argument.rfind(SIZE_ARGUMENT, 0) == 0)
+		{
+			valid = parseSizeDistribution(argument.substr(SIZE_ARGUMENT.size()), spec);
+		}
+		else if (argument.rfind(COMPRESSIBILITY_ARGUMENT, 0) == 0)
+		{
+			spec.compressibility = std::atof(argument.substr(COMPRESSIBILITY_ARGUMENT.size()).c_str());
+			valid = spec.compressibility >= 0.0 && spec.compressibility <= 1.0;
+		}
+		else if (argument.rfind(SEED_ARGUMENT, 0) == 0)
+		{
+			valid = parseCount(argument.substr(SEED_ARGUMENT.size()), seed);
+			spec.seed = static_cast<uint32_t>(seed);
+		}
+		else if (argument.rfind(RUNS_ARGUMENT, 0) == 0)
+		{
+			valid = parseCount(argument.substr(RUNS_ARGUMENT.size()), runs) && runs > 0;
+		}
+		else if (argument.rfind(WORKERS_ARGUMENT, 0) == 0)
+		{
+			valid = parseCount(argument.substr(WORKERS_ARGUMENT.size()), workerThreads);
+		}
+		else if (argument.rfind(WINDOW_ARGUMENT, 0) == 0)
+		{
+			valid = parseCount(argument.substr(WINDOW_ARGUMENT.size()), fileWindow);
+		}
+		else if (argument.rfind(MAX_INFLIGHT_ARGUMENT, 0) == 0)
+		{
+			valid = parseByteSize(argument.substr(MAX_INFLIGHT_ARGUMENT.size()), maxInflight);
+		}
+		else if (argument.rfind(DIR_ARGUMENT, 0) == 0)
+		{
+			directory = argument.substr(DIR_ARGUMENT.size());
+		}
+		else if (argument == KEEP_ARGUMENT)
+		{
+			keep = true;
+		}
+		else if (argument.rfind(FORMAT_ARGUMENT, 0) == 0)
+		{
+			format = argument.substr(FORMAT_ARGUMENT.size());
+			valid = format == "console" || format == "json";
+		}
+		else if (argument == PERF_COUNTERS_ARGUMENT)
+		{
+			perfCounters = true;
+		}
+		else if (argument.rfind(MAX_ALLOCS_ARGUMENT, 0) == 0)
+		{
+			maxAllocationsPerPacket = std::atof(argument.substr(MAX_ALLOCS_ARGUMENT.size()).c_str());
+			valid = maxAllocationsPerPacket > 0.0 && AllocationAccounting::enabled();
+		}
+		else if (!parseImpairment(argument, link, valid))
+		{
+			valid = false;
+		}
+		if (!valid)
+		{
+			std::cerr << "Invalid argument: " << argument << std::endl;
+			return -1;
+		}
+	}
+
+	std::string perfError;
+	if (perfCounters && !PerfCounters::enable(perfError))
+	{
+		std::cerr << "Hardware counters are not available: " << perfError << std::endl;
+		perfCounters = false;
+	}
+
+	if (AllocationAccounting::enabled())
+	{
+		// the packets of every run, to count the allocations per packet
+		Metrics::enable();
+	}
+
+	std::vector<std::string> files;
+	std::vector<RunResult> results;
+	try
+	{
+		directory = std::filesystem::absolute(directory);
+		std::cerr << "Generating " << spec.fileCount << " files in " << directory.string() << std::endl;
+		files = generateDataset(directory, spec);
+
+		// the client keeps its files in the working directory, start from a new user
+		std::filesystem::current_path(directory);
+		std::filesystem::remove(USER_FILE_NAME);
+		std::filesystem::remove(PRIVATE_KEY_FILE);
+
+		StandInServer server;
+		std::unique_ptr<ImpairmentProxy> proxy;
+		if (link.any())
+		{
+			proxy = std::make_unique<ImpairmentProxy>(link, "127.0.0.1", std::to_string(server.port()));
+		}
+		writeTransferInfo(proxy ? proxy->port() : server.port(), files);
+		for (size_t run = 0; run < runs; run++)
+		{
+			results.push_back(runOnce(server, workerThreads, fileWindow, maxInflight));
+		}
+	}
+	catch (const std::exception& e)
+	{
+		std::cerr << e.what() << std::endl;
+		return -1;
+	}
+
+	if (format == "json")
+	{
+		writeJSON(results, spec);
+	}
+	else
+	{
+		writeConsole(results);
+	}
+	if (perfCounters)
+	{
+		// the counts of all the runs, on stderr when stdout is JSON
+		PerfCounters::instance().report(format == "json" ? std::cerr : std::cout);
+	}
+	if (AllocationAccounting::enabled())
+	{
+		AllocationAccounting::report(format == "json" ? std::cerr : std::cout,
+			Metrics::instance().packets(), Metrics::instance().stageBytes(Stage::SEND));
+	}
+
+	if (!keep)
+	{
+		// only what the benchmark wrote, the directory may have been given on the command line
+		std::error_code error;
+		for (const auto& file : files)
+		{
+			std::filesystem::remove(file, error);
+		}
+		std::filesystem::remove(REQUEST_FILE_NAME, error);
+		std::filesystem::remove(USER_FILE_NAME, error);
+		std::filesystem::remove(PRIVATE_KEY_FILE, error);
+		std::filesystem::current_path(directory.parent_path(), error);
+		std::filesystem::remove(directory, error);  // if it is empty
+	}
+
+	bool succeeded = std::all_of(results.begin(), results.end(), [](const RunResult& result) { return result.succeeded; });
+	if (maxAllocationsPerPacket > 0.0)
+	{
+		// the first run also generates the RSA keys, the returning runs are the steady state
+		for (size_t i = (results.size() > 1 ? 1 : 0); i < results.size(); i++)
+		{
+			if (results[i].allocationsPerPacket() > maxAllocationsPerPacket)
+			{
+				std::cerr << "Run " << i + 1 << " made " << results[i].allocationsPerPacket()
+					<< " allocations per packet, the budget is " << maxAllocationsPerPacket << std::endl;
+				succeeded = false;
+			}
+		}
+	}
+	return succeeded ? 0 : -1;
+}
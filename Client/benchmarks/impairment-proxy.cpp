@@ -0,0 +1,448 @@
+#include "impairment-proxy.h"
+
+#include "../alloc-accounting.h"
+#include "../utils.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+
+
+constexpr size_t SEGMENT_SIZE = 64 * 1024;  // the most a read of a socket returns
+
+const std::string LATENCY_ARGUMENT = "--latency=";
+const std::string JITTER_ARGUMENT = "--jitter=";
+const std::string BANDWIDTH_ARGUMENT = "--bandwidth=";
+const std::string LOSS_ARGUMENT = "--loss=";
+const std::string RTO_ARGUMENT = "--rto=";
+const std::string REORDER_ARGUMENT = "--reorder=";
+const std::string RESET_ARGUMENT = "--reset=";
+const std::string RESET_AFTER_ARGUMENT = "--reset-after=";
+const std::string PROXY_BUFFER_ARGUMENT = "--proxy-buffer=";
+
+
+static std::chrono::steady_clock::duration milliseconds(double ms)
+{
+	return std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double, std::milli>(ms));
+}
+
+
+static bool parseNonNegative(const std::string& text, double& value)
+{
+	char* end = nullptr;
+	value = std::strtod(text.c_str(), &end);
+	return !text.empty() && *end == '\0' && value >= 0;
+}
+
+
+static bool parseFraction(const std::string& text, double& value)
+{
+	return parseNonNegative(text, value) && value <= 1;
+}
+
+
+// A rate in bits like 10Mbit, or in bytes per second like 1MB.
+static bool parseRate(const std::string& text, uint64_t& bytesPerSecond)
+{
+	const std::pair<std::string, double> units[] = {
+		{ "Gbit", 1e9 }, { "Mbit", 1e6 }, { "Kbit", 1e3 }, { "bit", 1 }
+	};
+	for (const auto& [suffix, bits] : units)
+	{
+		if (text.size() > suffix.size() && text.compare(text.size() - suffix.size(), suffix.size(), suffix) == 0)
+		{
+			double value = 0;
+			if (!parseNonNegative(text.substr(0, text.size() - suffix.size()), value))
+			{
+				return false;
+			}
+			bytesPerSecond = static_cast<uint64_t>(value * bits / 8);
+			return bytesPerSecond > 0;
+		}
+	}
+	size_t bytes = 0;
+	if (!parseByteSize(text, bytes))
+	{
+		return false;
+	}
+	bytesPerSecond = bytes;
+	return bytesPerSecond > 0;
+}
+
+
+bool ImpairmentSettings::any() const
+{
+	return latency > 0 || jitter > 0 || bandwidth > 0 || lossRate > 0 || (reorderRate > 0 && reorderDelay > 0)
+		|| resetRate > 0 || resetAfter > 0;
+}
+
+
+bool parseImpairment(const std::string& argument, ImpairmentSettings& settings, bool& valid)
+{
+	auto value = [&](const std::string& prefix) { return argument.substr(prefix.size()); };
+
+	if (argument.rfind(LATENCY_ARGUMENT, 0) == 0)
+	{
+		valid = parseNonNegative(value(LATENCY_ARGUMENT), settings.latency);
+	}
+	else if (argument.rfind(JITTER_ARGUMENT, 0) == 0)
+	{
+		valid = parseNonNegative(value(JITTER_ARGUMENT), settings.jitter);
+	}
+	else if (argument.rfind(BANDWIDTH_ARGUMENT, 0) == 0)
+	{
+		valid = parseRate(value(BANDWIDTH_ARGUMENT), settings.bandwidth);
+	}
+	else if (argument.rfind(LOSS_ARGUMENT, 0) == 0)
+	{
+		valid = parseFraction(value(LOSS_ARGUMENT), settings.lossRate);
+	}
+	else if (argument.rfind(RTO_ARGUMENT, 0) == 0)
+	{
+		valid = parseNonNegative(value(RTO_ARGUMENT), settings.retransmitTimeout);
+	}
+	else if (argument.rfind(REORDER_ARGUMENT, 0) == 0)
+	{
+		auto reorder = value(REORDER_ARGUMENT);
+		auto comma = reorder.find(',');
+		valid = comma != std::string::npos
+			&& parseFraction(reorder.substr(0, comma), settings.reorderRate)
+			&& parseNonNegative(reorder.substr(comma + 1), settings.reorderDelay);
+	}
+	else if (argument.rfind(RESET_ARGUMENT, 0) == 0)
+	{
+		valid = parseFraction(value(RESET_ARGUMENT), settings.resetRate);
+	}
+	else if (argument.rfind(RESET_AFTER_ARGUMENT, 0) == 0)
+	{
+		size_t bytes = 0;
+		valid = parseByteSize(value(RESET_AFTER_ARGUMENT), bytes) && bytes > 0;
+		settings.resetAfter = bytes;
+	}
+	else if (argument.rfind(PROXY_BUFFER_ARGUMENT, 0) == 0)
+	{
+		valid = parseByteSize(value(PROXY_BUFFER_ARGUMENT), settings.bufferSize) && settings.bufferSize > 0;
+	}
+	else
+	{
+		return false;
+	}
+	return true;
+}
+
+
+ImpairmentProxy::Direction::Direction(tcp::socket* from, tcp::socket* to, bool toServer)
+	: from(from)
+	, to(to)
+	, toServer(toServer)
+	, segments()
+	, linkFree()
+	, lastDelivery()
+	, changed()
+{
+}
+
+
+ImpairmentProxy::Connection::Connection(boost::asio::io_context& context)
+	: client(context)
+	, server(context)
+	, mutex()
+	, toServer(&client, &server, true)
+	, toClient(&server, &client, false)
+	, random()
+	, thread()
+{
+}
+
+
+ImpairmentProxy::ImpairmentProxy(const ImpairmentSettings& settings, const std::string& serverAddress, const std::string& serverPort, unsigned short port)
+	: _settings(settings)
+	, _serverAddress(serverAddress)
+	, _serverPort(serverPort)
+	, _context()
+	, _acceptor(_context, tcp::endpoint(boost::asio::ip::address_v4::loopback(), port))
+	, _acceptThread()
+	, _stopping(false)
+	, _mutex()
+	, _connections()
+	, _stats()
+{
+	_acceptThread = std::thread(&ImpairmentProxy::acceptConnections, this);
+}
+
+
+ImpairmentProxy::~ImpairmentProxy()
+{
+	// a connection of our own wakes the blocking accept up
+	_stopping = true;
+	try
+	{
+		tcp::socket wakeUp(_context);
+		wakeUp.connect(tcp::endpoint(boost::asio::ip::address_v4::loopback(), port()));
+	}
+	catch (const std::exception&)
+	{
+	}
+	_acceptThread.join();
+	reapConnections(true);
+}
+
+
+unsigned short ImpairmentProxy::port() const
+{
+	return _acceptor.local_endpoint().port();
+}
+
+
+ImpairmentProxy::Stats ImpairmentProxy::stats() const
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	return _stats;
+}
+
+
+void ImpairmentProxy::acceptConnections()
+{
+	// the allocations of the benchmarks are the client's
+	AllocationAccounting::excludeThread();
+	while (true)
+	{
+		auto connection = std::make_unique<Connection>(_context);
+		boost::system::error_code error;
+		_acceptor.accept(connection->client, error);
+		if (_stopping)
+		{
+			return;
+		}
+		if (error)
+		{
+			std::cerr << "Impairment proxy: " << error.message() << std::endl;
+			continue;
+		}
+		reapConnections(false);
+
+		std::lock_guard<std::mutex> lock(_mutex);
+		connection->random.seed(_settings.seed + static_cast<uint32_t>(_stats.connections));
+		_stats.connections++;
+		auto& accepted = *connection;
+		_connections.push_back(std::move(connection));
+		accepted.thread = std::thread(&ImpairmentProxy::serve, this, std::ref(accepted));
+	}
+}
+
+
+void ImpairmentProxy::serve(Connection& connection)
+{
+	AllocationAccounting::excludeThread();
+	boost::system::error_code error;
+	tcp::resolver resolver(_context);
+	boost::asio::connect(connection.server, resolver.resolve(_serverAddress, _serverPort, error), error);
+	if (error)
+	{
+		std::cerr << "Impairment proxy: cannot connect to " << _serverAddress << ":" << _serverPort << ": " << error.message() << std::endl;
+		connection.client.set_option(boost::asio::socket_base::linger(true, 0), error);
+	}
+	else
+	{
+		connection.client.set_option(tcp::no_delay(true), error);
+		connection.server.set_option(tcp::no_delay(true), error);
+
+		std::thread readToServer(&ImpairmentProxy::readDirection, this, std::ref(connection), std::ref(connection.toServer));
+		std::thread readToClient(&ImpairmentProxy::readDirection, this, std::ref(connection), std::ref(connection.toClient));
+		std::thread writeToClient(&ImpairmentProxy::writeDirection, this, std::ref(connection), std::ref(connection.toClient));
+		writeDirection(connection, connection.toServer);
+		readToServer.join();
+		readToClient.join();
+		writeToClient.join();
+	}
+
+	// with a linger of 0 the close resets the connection
+	connection.client.close(error);
+	connection.server.close(error);
+	connection.done = true;
+}
+
+
+void ImpairmentProxy::readDirection(Connection& connection, Direction& direction)
+{
+	AllocationAccounting::excludeThread();
+	std::uniform_real_distribution<double> uniform(0.0, 1.0);
+	while (true)
+	{
+		{
+			std::unique_lock<std::mutex> lock(connection.mutex);
+			direction.changed.wait(lock, [&] { return connection.aborted || direction.queuedBytes < _settings.bufferSize; });
+			if (connection.aborted)
+			{
+				return;
+			}
+		}
+
+		std::vector<char> data(SEGMENT_SIZE);
+		boost::system::error_code error;
+		size_t size = direction.from->read_some(boost::asio::buffer(data), error);
+		if (error && error != boost::asio::error::eof)
+		{
+			// a reset of one side resets the other
+			abort(connection, true);
+			return;
+		}
+		data.resize(size);
+
+		auto now = std::chrono::steady_clock::now();
+		bool lost = false;
+		bool reordered = false;
+		{
+			std::lock_guard<std::mutex> lock(connection.mutex);
+			if (connection.aborted)
+			{
+				return;
+			}
+
+			// the segment is on the wire when the link has sent the ones before it
+			direction.linkFree = std::max(direction.linkFree, now);
+			if (_settings.bandwidth > 0)
+			{
+				direction.linkFree += std::chrono::nanoseconds(size * 1000000000ull / _settings.bandwidth);
+			}
+			auto deliverAt = direction.linkFree + milliseconds(_settings.latency + _settings.jitter * uniform(connection.random));
+			if (size > 0 && uniform(connection.random) < _settings.lossRate)
+			{
+				lost = true;
+				deliverAt += milliseconds(_settings.retransmitTimeout);
+			}
+			else if (size > 0 && uniform(connection.random) < _settings.reorderRate)
+			{
+				reordered = true;
+				deliverAt += milliseconds(_settings.reorderDelay);
+			}
+			// the stream stays in order, a late segment holds back the ones behind it
+			deliverAt = std::max(deliverAt, direction.lastDelivery);
+			direction.lastDelivery = deliverAt;
+
+			bool reset = size > 0 && uniform(connection.random) < _settings.resetRate;
+			if (direction.toServer && size > 0)
+			{
+				connection.bytesToServer += size;
+				reset = reset || (_settings.resetAfter > 0 && connection.bytesToServer >= _settings.resetAfter);
+			}
+			direction.queuedBytes += size;
+			direction.segments.push_back(Segment{ std::move(data), deliverAt, reset });
+			direction.changed.notify_all();
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			(direction.toServer ? _stats.bytesToServer : _stats.bytesToClient) += size;
+			_stats.segments += (size > 0) ? 1 : 0;
+			_stats.lostSegments += lost ? 1 : 0;
+			_stats.reorderedSegments += reordered ? 1 : 0;
+		}
+		if (size == 0)
+		{
+			return;
+		}
+	}
+}
+
+
+void ImpairmentProxy::writeDirection(Connection& connection, Direction& direction)
+{
+	while (true)
+	{
+		Segment segment;
+		{
+			std::unique_lock<std::mutex> lock(connection.mutex);
+			direction.changed.wait(lock, [&] { return connection.aborted || !direction.segments.empty(); });
+			if (connection.aborted)
+			{
+				return;
+			}
+			// the segments are delivered in order, the first is the earliest
+			auto deliverAt = direction.segments.front().deliverAt;
+			if (direction.changed.wait_until(lock, deliverAt, [&] { return connection.aborted; }))
+			{
+				return;
+			}
+			segment = std::move(direction.segments.front());
+			direction.segments.pop_front();
+			direction.queuedBytes -= segment.data.size();
+			direction.changed.notify_all();
+		}
+
+		boost::system::error_code error;
+		if (segment.reset)
+		{
+			{
+				std::lock_guard<std::mutex> lock(_mutex);
+				_stats.resets++;
+			}
+			abort(connection, true);
+			return;
+		}
+		if (segment.data.empty())
+		{
+			// the end of the direction, the other one may go on
+			direction.to->shutdown(tcp::socket::shutdown_send, error);
+			return;
+		}
+		boost::asio::write(*direction.to, boost::asio::buffer(segment.data), error);
+		if (error)
+		{
+			abort(connection, true);
+			return;
+		}
+	}
+}
+
+
+void ImpairmentProxy::abort(Connection& connection, bool reset)
+{
+	{
+		std::lock_guard<std::mutex> lock(connection.mutex);
+		if (connection.aborted)
+		{
+			return;
+		}
+		connection.aborted = true;
+		connection.toServer.changed.notify_all();
+		connection.toClient.changed.notify_all();
+	}
+
+	// wake the blocking reads up, the sockets are closed when the threads of the connection are done
+	boost::system::error_code error;
+	for (auto* socket : { &connection.client, &connection.server })
+	{
+		if (reset)
+		{
+			socket->set_option(boost::asio::socket_base::linger(true, 0), error);
+		}
+		socket->shutdown(reset ? tcp::socket::shutdown_receive : tcp::socket::shutdown_both, error);
+	}
+}
+
+
+void ImpairmentProxy::reapConnections(bool all)
+{
+	std::list<std::unique_ptr<Connection>> finished;
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		for (auto it = _connections.begin(); it != _connections.end();)
+		{
+			auto next = std::next(it);
+			if (all || (*it)->done)
+			{
+				finished.splice(finished.end(), _connections, it);
+			}
+			it = next;
+		}
+	}
+	for (auto& connection : finished)
+	{
+		if (all)
+		{
+			abort(*connection, false);
+		}
+		connection->thread.join();
+	}
+}
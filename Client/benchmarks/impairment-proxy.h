@@ -0,0 +1,188 @@
+#ifndef IMPAIRMENT_PROXY_H
+#define IMPAIRMENT_PROXY_H
+
+
+#include <boost/asio.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+
+using boost::asio::ip::tcp;
+
+
+/**
+* @brief The impairments of the proxied connections, every one applies to both directions.
+*/
+struct ImpairmentSettings
+{
+	double latency = 0;                 // ms added one way, the round trip grows by twice as much
+	double jitter = 0;                  // ms, every segment gets a uniform delay of up to this much more
+	uint64_t bandwidth = 0;             // bytes per second of every direction, 0 for no cap
+	double lossRate = 0;                // the fraction of the segments that are lost and resent
+	double retransmitTimeout = 200;     // ms a lost segment is held back
+	double reorderRate = 0;             // the fraction of the segments that arrive late
+	double reorderDelay = 0;            // ms a late segment is held back
+	double resetRate = 0;               // the fraction of the segments that reset the connection
+	uint64_t resetAfter = 0;            // bytes to the server after which a connection is reset, 0 for never
+	size_t bufferSize = 4 * 1024 * 1024;  // the bytes a direction holds before it stops reading, like socket buffers
+	uint32_t seed = 42;
+
+	/**
+	* @brief Check if anything is impaired.
+	*/
+	bool any() const;
+};
+
+/**
+* @brief Parse an impairment option of the command line.
+*
+* The options are --latency=<ms>, --jitter=<ms>, --bandwidth=<rate>, --loss=<fraction>, --rto=<ms>,
+* --reorder=<fraction>,<ms>, --reset=<fraction>, --reset-after=<size> and --proxy-buffer=<size>, a rate is
+* like 10Mbit, 512Kbit or 1MB (per second) and a size like 64KB.
+*
+* @param argument the argument.
+* @param settings the settings to set the option of.
+* @param valid set to false if the argument is an impairment option with an invalid value.
+* @return true if the argument is an impairment option.
+*/
+bool parseImpairment(const std::string& argument, ImpairmentSettings& settings, bool& valid);
+
+
+/**
+* @brief ImpairmentProxy class
+*
+* A TCP proxy on loopback that makes a connection to a server look like a WAN link: it delays the data by
+* a latency and a jitter, caps the bandwidth, holds segments back as if they were lost or reordered, and
+* resets connections. A segment is what one read of the socket returns. TCP delivers a stream in order, so
+* a lost or reordered segment reaches the application as a stall of the segment and of everything behind
+* it, and that is how the proxy applies them.
+*
+* Every direction of a connection runs a reader thread that stamps the segments with the time they arrive,
+* after the bandwidth cap, the latency and the stalls, and a writer thread that forwards them at that time.
+*/
+class ImpairmentProxy
+{
+public:
+	/**
+	* @brief What the proxy forwarded.
+	*/
+	struct Stats
+	{
+		uint64_t connections = 0;
+		uint64_t bytesToServer = 0;
+		uint64_t bytesToClient = 0;
+		uint64_t segments = 0;
+		uint64_t lostSegments = 0;
+		uint64_t reorderedSegments = 0;
+		uint64_t resets = 0;
+	};
+
+	/**
+	* @brief Constructor, starts accepting connections on the loopback interface.
+	*
+	* @param settings the impairments.
+	* @param serverAddress the address of the server.
+	* @param serverPort the port of the server.
+	* @param port the port to listen on, 0 for any free port.
+	*/
+	ImpairmentProxy(const ImpairmentSettings& settings, const std::string& serverAddress, const std::string& serverPort, unsigned short port = 0);
+
+	/**
+	* @brief Destructor
+	*
+	* Stops accepting connections and closes the connections that are open.
+	*/
+	~ImpairmentProxy();
+
+	ImpairmentProxy(const ImpairmentProxy&) = delete;
+	ImpairmentProxy& operator=(const ImpairmentProxy&) = delete;
+
+	/**
+	* @brief Get the port the proxy listens on.
+	*/
+	unsigned short port() const;
+
+	/**
+	* @brief Get what the proxy forwarded so far.
+	*/
+	Stats stats() const;
+
+private:
+	/**
+	* @brief Data on its way, or the end of a direction when it is empty.
+	*/
+	struct Segment
+	{
+		std::vector<char> data;
+		std::chrono::steady_clock::time_point deliverAt;
+		bool reset;
+	};
+
+	/**
+	* @brief One direction of a connection.
+	*/
+	struct Direction
+	{
+		Direction(tcp::socket* from, tcp::socket* to, bool toServer);
+
+		tcp::socket* from;
+		tcp::socket* to;
+		bool toServer;
+		std::deque<Segment> segments;
+		size_t queuedBytes = 0;
+		std::chrono::steady_clock::time_point linkFree;   // when the link has sent what it was given
+		std::chrono::steady_clock::time_point lastDelivery;
+		std::condition_variable changed;
+	};
+
+	/**
+	* @brief A proxied connection.
+	*/
+	struct Connection
+	{
+		explicit Connection(boost::asio::io_context& context);
+
+		tcp::socket client;
+		tcp::socket server;
+		std::mutex mutex;   // guards the directions and the flags
+		Direction toServer;
+		Direction toClient;
+		bool aborted = false;
+		uint64_t bytesToServer = 0;
+		std::mt19937 random;
+		std::thread thread;
+		std::atomic<bool> done{ false };
+	};
+
+	void acceptConnections();
+	void serve(Connection& connection);
+	void readDirection(Connection& connection, Direction& direction);
+	void writeDirection(Connection& connection, Direction& direction);
+	void abort(Connection& connection, bool reset);
+	void reapConnections(bool all);
+
+	ImpairmentSettings _settings;
+	std::string _serverAddress;
+	std::string _serverPort;
+	boost::asio::io_context _context;
+	tcp::acceptor _acceptor;
+	std::thread _acceptThread;
+	std::atomic<bool> _stopping;
+	mutable std::mutex _mutex;  // guards the connections and the stats
+	std::list<std::unique_ptr<Connection>> _connections;
+	Stats _stats;
+};
+
+#endif // IMPAIRMENT_PROXY_H
@@ -0,0 +1,723 @@
+#include "dataset.h"
+
+#include "../AESWrapper.h"
+#include "../RSAWrapper.h"
+#include "../cksum.h"
+#include "../connection.h"
+#include "../serializer.h"
+#include "../utils.h"
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+
+/*
+* A load generator for the server: many simulated backup clients, each on its own thread and its own
+* connection, run sessions against the server for a while. A session connects, registers a new user or
+* logs in as one the client registered before, sends its files, checks their CRCs and disconnects, with
+* think times between the requests. The results are the throughput, the error rate and a latency
+* histogram of every request type, from the request to its response.
+*
+* The simulated clients share one RSA key pair, kept in priv.key of the working directory like the
+* client's, so run the generator from a directory of its own.
+*
+* Build with the client sources, for example:
+*   g++ -O2 -std=c++17 -DNDEBUG benchmarks/load-generator.cpp benchmarks/dataset.cpp AESWrapper.cpp RSAWrapper.cpp
+*       buffer-pool.cpp cksum.cpp alloc-accounting.cpp metrics.cpp perf-counters.cpp connection.cpp serializer.cpp session-capture.cpp tracing.cpp utils.cpp -lcryptopp -lpthread -o load-generator
+*
+* Command line:
+*   --server=<address:port>   the server, 127.0.0.1:1256 by default
+*   --clients=<count>         the number of concurrent clients, 100 by default
+*   --duration=<seconds>      how long the clients run sessions, 30 by default
+*   --ramp-up=<seconds>       the clients start evenly over this time, 5 by default
+*   --register=<fraction>     the fraction of the sessions that register a new user, 0.2 by default;
+*                             the first session of every client registers
+*   --files=<count>           the files of every session, 1 by default
+*   --size=<distribution>     the sizes of the files like e2e-benchmark's, fixed:64KB by default
+*   --think=<ms>              the mean think time before every request, exponentially distributed, 100 by default
+*   --format=<console|json>   the format of the results
+*/
+
+
+const std::string SERVER_ARGUMENT = "--server=";
+const std::string CLIENTS_ARGUMENT = "--clients=";
+const std::string DURATION_ARGUMENT = "--duration=";
+const std::string RAMP_UP_ARGUMENT = "--ramp-up=";
+const std::string REGISTER_ARGUMENT = "--register=";
+const std::string FILES_ARGUMENT = "--files=";
+const std::string SIZE_ARGUMENT = "--size=";
+const std::string THINK_ARGUMENT = "--think=";
+const std::string FORMAT_ARGUMENT = "--format=";
+
+constexpr double MB = 1024.0 * 1024.0;
+constexpr size_t HEADER_SIZE = CLIENT_ID_SIZE + sizeof(Request::version) + sizeof(Request::opCode) + sizeof(Request::payloadSize);
+constexpr size_t FILE_HEADER_SIZE = CONTENT_SIZE + ORIGINAL_FILE_SIZE + PACKET_NUMBER_SIZE + TOTAL_PACKETS_SIZE + FILE_NAME_SIZE;
+
+// The request types of the results, the connection is measured like a request.
+const std::string CONNECT = "CONNECT";
+const std::string REGISTER = "REGISTER";
+const std::string PUBLIC_KEY = "PUBLIC_KEY";
+const std::string LOGIN = "LOGIN";
+const std::string SEND_FILE = "SEND_FILE";
+const std::string CRC_VALID = "CRC_VALID";
+
+
+/**
+* @brief LatencyHistogram class
+*
+* A log-linear histogram of latencies in microseconds: 8 buckets for every power of two, so a bucket
+* is at most 12.5% wide. Recording is an increment, the histograms of the clients are merged at the end.
+*/
+class LatencyHistogram
+{
+public:
+	static constexpr size_t SUB_BUCKETS = 8;
+	static constexpr size_t BUCKETS = SUB_BUCKETS + 40 * SUB_BUCKETS;  // up to 2^43 us
+
+	void record(std::chrono::nanoseconds latency)
+	{
+		auto micros = static_cast<uint64_t>(std::max<int64_t>(0, latency.count() / 1000));
+		_counts[bucket(micros)]++;
+		_count++;
+		_max = std::max(_max, micros);
+	}
+
+	void merge(const LatencyHistogram& other)
+	{
+		for (size_t i = 0; i < BUCKETS; i++)
+		{
+			_counts[i] += other._counts[i];
+		}
+		_count += other._count;
+		_max = std::max(_max, other._max);
+	}
+
+	uint64_t count() const
+	{
+		return _count;
+	}
+
+	// The upper bound of the bucket that holds the percentile, in ms.
+	double percentile(double fraction) const
+	{
+		if (_count == 0)
+		{
+			return 0;
+		}
+		auto rank = static_cast<uint64_t>(fraction * _count + 0.5);
+		uint64_t seen = 0;
+		for (size_t i = 0; i < BUCKETS; i++)
+		{
+			seen += _counts[i];
+			if (seen >= std::max<uint64_t>(rank, 1))
+			{
+				return std::min(upperBound(i), _max) / 1000.0;
+			}
+		}
+		return _max / 1000.0;
+	}
+
+	double max() const
+	{
+		return _max / 1000.0;
+	}
+
+	// The buckets that are not empty, as their upper bound in ms and their count.
+	std::vector<std::pair<double, uint64_t>> buckets() const
+	{
+		std::vector<std::pair<double, uint64_t>> buckets;
+		for (size_t i = 0; i < BUCKETS; i++)
+		{
+			if (_counts[i] > 0)
+			{
+				buckets.emplace_back(upperBound(i) / 1000.0, _counts[i]);
+			}
+		}
+		return buckets;
+	}
+
+private:
+	static size_t bucket(uint64_t micros)
+	{
+		if (micros < SUB_BUCKETS)
+		{
+			return static_cast<size_t>(micros);
+		}
+		size_t exponent = 3;
+		while ((micros >> exponent) > 1)
+		{
+			exponent++;
+		}
+		size_t sub = static_cast<size_t>(micros >> (exponent - 3)) - SUB_BUCKETS;
+		return std::min(SUB_BUCKETS + (exponent - 3) * SUB_BUCKETS + sub, BUCKETS - 1);
+	}
+
+	static uint64_t upperBound(size_t index)
+	{
+		if (index < SUB_BUCKETS)
+		{
+			return index;
+		}
+		size_t exponent = (index - SUB_BUCKETS) / SUB_BUCKETS + 3;
+		size_t sub = (index - SUB_BUCKETS) % SUB_BUCKETS;
+		return ((SUB_BUCKETS + sub + 1) << (exponent - 3)) - 1;
+	}
+
+	std::array<uint64_t, BUCKETS> _counts{};
+	uint64_t _count = 0;
+	uint64_t _max = 0;
+};
+
+
+/**
+* @brief The results of a request type.
+*/
+struct RequestStats
+{
+	uint64_t errors = 0;
+	LatencyHistogram latency;
+};
+
+
+/**
+* @brief The results of a client, merged into the totals when it stops.
+*/
+struct ClientStats
+{
+	std::map<std::string, RequestStats> requests;
+	uint64_t sessions = 0;
+	uint64_t failedSessions = 0;
+	uint64_t files = 0;
+	uint64_t bytes = 0;
+};
+
+
+/**
+* @brief The settings of the run.
+*/
+struct LoadSettings
+{
+	std::string address = "127.0.0.1";
+	std::string port = "1256";
+	size_t clients = 100;
+	double duration = 30;
+	double rampUp = 5;
+	double registerFraction = 0.2;
+	size_t files = 1;
+	DatasetSpec sizes;
+	double thinkTime = 100;  // ms
+	std::string format = "console";
+};
+
+
+/**
+* @brief The failure of a session, the request it happened on is counted as an error.
+*/
+class SessionError : public std::runtime_error
+{
+public:
+	explicit SessionError(const std::string& message) : std::runtime_error(message) {}
+};
+
+
+/**
+* @brief SimulatedClient class
+*
+* A backup client that runs sessions on its own connection until the end of the run.
+*/
+class SimulatedClient
+{
+public:
+	SimulatedClient(size_t index, const LoadSettings& settings, const RSAWrapper& rsa, const std::string& runTag)
+		: _index(index)
+		, _settings(settings)
+		, _rsa(rsa)
+		, _runTag(runTag)
+		, _generator(static_cast<uint32_t>(index + 1))
+		, _users()
+		, _stats()
+		, _clientID()
+		, _aesKey()
+		, _buffer()
+		, _content()
+		, _encrypted(PACKET_LENGTH)
+	{
+	}
+
+	void run(std::chrono::steady_clock::time_point start, std::chrono::steady_clock::time_point end)
+	{
+		std::this_thread::sleep_until(start);
+		while (std::chrono::steady_clock::now() < end)
+		{
+			_stats.sessions++;
+			try
+			{
+				session();
+			}
+			catch (const SessionError&)
+			{
+				_stats.failedSessions++;
+			}
+		}
+	}
+
+	const ClientStats& stats() const
+	{
+		return _stats;
+	}
+
+private:
+	void session()
+	{
+		Connection connection;
+		if (!connection.setServerIP(_settings.address, _settings.port))
+		{
+			throw SessionError("Invalid server address");
+		}
+		think();
+		timed(CONNECT, [&] {
+			if (!connection.connect())
+			{
+				throw SessionError("Cannot connect");
+			}
+		});
+
+		std::uniform_real_distribution<double> coin(0.0, 1.0);
+		if (_users.empty() || coin(_generator) < _settings.registerFraction)
+		{
+			registerUser(connection);
+		}
+		else
+		{
+			login(connection);
+		}
+
+		for (size_t i = 0; i < _settings.files; i++)
+		{
+			sendFile(connection, i);
+		}
+	}
+
+	void registerUser(Connection& connection)
+	{
+		auto name = "load-" + _runTag + "-" + std::to_string(_index) + "-" + std::to_string(_users.size());
+		_clientID = {};
+		auto response = request(connection, REGISTER, RequestCode::REQUEST_REGISTER, NameRequest{ name }, NAME_SIZE, ResponseCode::RESPONSE_REGISTRATION);
+		_clientID = std::get<ClientIDResponse>(response.payload).clientID;
+
+		response = request(connection, PUBLIC_KEY, RequestCode::REQUEST_PUBLIC_KEY, SendPublickKeyRequest{ name, _rsa.getPublicKey() },
+			NAME_SIZE + PUBLIC_KEY_SIZE, ResponseCode::RESPONSE_AES_KEY);
+		setKey(response);
+		_users.push_back(name);
+	}
+
+	void login(Connection& connection)
+	{
+		auto name = _users[std::uniform_int_distribution<size_t>(0, _users.size() - 1)(_generator)];
+		auto response = request(connection, LOGIN, RequestCode::REQUEST_LOGIN, NameRequest{ name }, NAME_SIZE, ResponseCode::RESPONSE_LOGIN);
+		_clientID = std::get<SymmetricKeyResponse>(response.payload).clientID;
+		setKey(response);
+	}
+
+	void setKey(const Response& response)
+	{
+		try
+		{
+			_aesKey = _rsa.decrypt(std::get<SymmetricKeyResponse>(response.payload).symmetricKey);
+		}
+		catch (const std::exception& e)
+		{
+			throw SessionError(e.what());
+		}
+	}
+
+	void sendFile(Connection& connection, size_t fileIndex)
+	{
+		// the content is random, a part of one buffer that is filled once
+		size_t fileSize = std::max<size_t>(1, drawFileSize(_settings.sizes));
+		if (_content.size() < fileSize)
+		{
+			size_t oldSize = _content.size();
+			_content.resize(fileSize);
+			for (size_t i = oldSize; i < fileSize; i++)
+			{
+				_content[i] = static_cast<char>(_generator());
+			}
+		}
+		auto fileName = "file" + std::to_string(fileIndex) + ".bin";
+
+		CRC crc;
+		crc.update(_content.data(), fileSize);
+
+		think();
+		auto response = timedResponse(SEND_FILE, ResponseCode::RESPONSE_FILE_VALID, [&] {
+			sendContent(connection, fileName, fileSize);
+			return receive(connection);
+		});
+		if (std::get<FileResponse>(response.payload).crc != crc.digest())
+		{
+			_stats.requests[SEND_FILE].errors++;
+			throw SessionError("CRC mismatch");
+		}
+		_stats.files++;
+		_stats.bytes += fileSize;
+
+		request(connection, CRC_VALID, RequestCode::REQUEST_CRC_VALID, CRCRequest{ fileName }, FILE_NAME_SIZE, ResponseCode::RESPONSE_ACK);
+	}
+
+	size_t drawFileSize(const DatasetSpec& spec)
+	{
+		switch (spec.distribution)
+		{
+		case SizeDistribution::UNIFORM:
+			return std::uniform_int_distribution<size_t>(spec.size, spec.maxSize)(_generator);
+		case SizeDistribution::LOGNORMAL:
+		{
+			std::lognormal_distribution<double> distribution(std::log(static_cast<double>(spec.size)), spec.sigma);
+			return std::min(static_cast<size_t>(distribution(_generator)), spec.maxSize);
+		}
+		default:
+			return spec.size;
+		}
+	}
+
+	// The packets of a file, encrypted as one stream like the client does it.
+	void sendContent(Connection& connection, const std::string& fileName, size_t fileSize)
+	{
+		size_t firstPayloadSize = (PACKET_LENGTH - FILE_HEADER_SIZE - HEADER_SIZE) / AES_BLOCK_SIZE * AES_BLOCK_SIZE;
+		size_t payloadSize = (PACKET_LENGTH - FILE_HEADER_SIZE) / AES_BLOCK_SIZE * AES_BLOCK_SIZE;
+		size_t encryptedSize = AESWrapper::encryptedSize(fileSize);
+		size_t totalPackets = 1;
+		if (encryptedSize > firstPayloadSize)
+		{
+			totalPackets += (encryptedSize - firstPayloadSize + payloadSize - 1) / payloadSize;
+		}
+		if (totalPackets > UINT16_MAX)
+		{
+			throw SessionError("File too large");
+		}
+
+		AESStreamEncryptor encryptor(_aesKey);
+		size_t plainOffset = 0;
+		for (size_t packetNumber = 1; packetNumber <= totalPackets; packetNumber++)
+		{
+			size_t chunkSize = packetNumber == 1 ? firstPayloadSize : payloadSize;
+			size_t contentSize = 0;
+			if (packetNumber == totalPackets)
+			{
+				contentSize = encryptor.finish(_content.data() + plainOffset, fileSize - plainOffset, _encrypted.data());
+				plainOffset = fileSize;
+			}
+			else
+			{
+				contentSize = encryptor.update(_content.data() + plainOffset, chunkSize, _encrypted.data());
+				plainOffset += chunkSize;
+			}
+
+			SendFileRequest packet
+			{
+				static_cast<uint32_t>(contentSize),
+				static_cast<uint32_t>(fileSize),
+				static_cast<uint16_t>(packetNumber),
+				static_cast<uint16_t>(totalPackets),
+				fileName,
+				ByteSpan{ _encrypted.data(), contentSize }
+			};
+			auto packetSize = static_cast<uint32_t>(FILE_HEADER_SIZE + contentSize);
+			if (packetNumber == 1)
+			{
+				Serializer::serializeRequest(Request{ _clientID, CLIENT_VERSION,
+					static_cast<uint16_t>(RequestCode::REQUEST_SEND_FILE), packetSize, packet }, _buffer);
+			}
+			else
+			{
+				Serializer::serializePayload(packet, packetSize, _buffer);
+			}
+			send(connection, _buffer);
+		}
+	}
+
+	Response request(Connection& connection, const std::string& name, RequestCode code, Payload payload, size_t payloadSize, ResponseCode expected)
+	{
+		think();
+		Serializer::serializeRequest(Request{ _clientID, CLIENT_VERSION, static_cast<uint16_t>(code), static_cast<uint32_t>(payloadSize), std::move(payload) }, _buffer);
+		return timedResponse(name, expected, [&] {
+			send(connection, _buffer);
+			return receive(connection);
+		});
+	}
+
+	template <typename Function>
+	Response timedResponse(const std::string& name, ResponseCode expected, Function function)
+	{
+		Response response;
+		timed(name, [&] { response = function(); });
+		if (response.opCode != static_cast<uint16_t>(expected))
+		{
+			_stats.requests[name].errors++;
+			throw SessionError("Unexpected response " + std::to_string(response.opCode));
+		}
+		return response;
+	}
+
+	template <typename Function>
+	void timed(const std::string& name, Function function)
+	{
+		auto& stats = _stats.requests[name];
+		auto start = std::chrono::steady_clock::now();
+		try
+		{
+			function();
+		}
+		catch (const std::exception&)
+		{
+			stats.errors++;
+			throw SessionError("Request failed: " + name);
+		}
+		stats.latency.record(std::chrono::steady_clock::now() - start);
+	}
+
+	void send(Connection& connection, const std::vector<char>& data)
+	{
+		connection.send(data);
+	}
+
+	Response receive(Connection& connection)
+	{
+		return Serializer::deserializeResponse(connection.receive());
+	}
+
+	void think()
+	{
+		if (_settings.thinkTime > 0)
+		{
+			std::exponential_distribution<double> distribution(1.0 / _settings.thinkTime);
+			std::this_thread::sleep_for(std::chrono::duration<double, std::milli>(distribution(_generator)));
+		}
+	}
+
+	size_t _index;
+	const LoadSettings& _settings;
+	const RSAWrapper& _rsa;
+	std::string _runTag;
+	std::mt19937_64 _generator;
+	std::vector<std::string> _users;
+	ClientStats _stats;
+	ClientID _clientID;
+	std::vector<char> _aesKey;
+	std::vector<char> _buffer;
+	std::vector<char> _content;
+	std::vector<char> _encrypted;
+};
+
+
+static void writeConsole(std::ostream& out, const ClientStats& totals, double seconds, size_t clients)
+{
+	out << std::fixed << std::setprecision(2);
+	out << clients << " clients, " << seconds << " s, "
+		<< totals.sessions << " sessions (" << totals.failedSessions << " failed), "
+		<< totals.sessions / seconds << " sessions/s, "
+		<< totals.files / seconds << " files/s, "
+		<< totals.bytes / MB / seconds << " MB/s" << std::endl;
+
+	out << std::left << std::setw(12) << "Request" << std::right
+		<< std::setw(10) << "Count" << std::setw(10) << "Errors" << std::setw(10) << "Error %" << std::setw(10) << "Req/s"
+		<< std::setw(12) << "p50 ms" << std::setw(12) << "p90 ms" << std::setw(12) << "p99 ms" << std::setw(12) << "Max ms" << std::endl;
+	for (const auto& [name, stats] : totals.requests)
+	{
+		uint64_t attempts = stats.latency.count() + stats.errors;
+		out << std::left << std::setw(12) << name << std::right
+			<< std::setw(10) << stats.latency.count()
+			<< std::setw(10) << stats.errors
+			<< std::setw(10) << (attempts ? 100.0 * stats.errors / attempts : 0.0)
+			<< std::setw(10) << stats.latency.count() / seconds
+			<< std::setw(12) << stats.latency.percentile(0.5)
+			<< std::setw(12) << stats.latency.percentile(0.9)
+			<< std::setw(12) << stats.latency.percentile(0.99)
+			<< std::setw(12) << stats.latency.max() << std::endl;
+	}
+	out << std::defaultfloat;
+}
+
+
+static void writeJSON(std::ostream& out, const ClientStats& totals, double seconds, size_t clients)
+{
+	out << std::setprecision(10);
+	out << "{\n";
+	out << "  \"clients\": " << clients << ",\n";
+	out << "  \"seconds\": " << seconds << ",\n";
+	out << "  \"sessions\": " << totals.sessions << ",\n";
+	out << "  \"failed_sessions\": " << totals.failedSessions << ",\n";
+	out << "  \"files\": " << totals.files << ",\n";
+	out << "  \"bytes\": " << totals.bytes << ",\n";
+	out << "  \"requests\": {";
+	bool first = true;
+	for (const auto& [name, stats] : totals.requests)
+	{
+		out << (first ? "\n" : ",\n") << "    \"" << name << "\": {\n";
+		out << "      \"count\": " << stats.latency.count() << ",\n";
+		out << "      \"errors\": " << stats.errors << ",\n";
+		out << "      \"p50_ms\": " << stats.latency.percentile(0.5) << ",\n";
+		out << "      \"p90_ms\": " << stats.latency.percentile(0.9) << ",\n";
+		out << "      \"p99_ms\": " << stats.latency.percentile(0.99) << ",\n";
+		out << "      \"max_ms\": " << stats.latency.max() << ",\n";
+		out << "      \"histogram\": [";
+		auto buckets = stats.latency.buckets();
+		for (size_t i = 0; i < buckets.size(); i++)
+		{
+			out << (i ? ", " : "") << "[" << buckets[i].first << ", " << buckets[i].second << "]";
+		}
+		out << "]\n    }";
+		first = false;
+	}
+	out << "\n  }\n}" << std::endl;
+}
+
+
+static bool parseCount(const std::string& text, size_t& count)
+{
+	if (!isNumber(text))
+	{
+		return false;
+	}
+	count = std::stoul(text);
+	return true;
+}
+
+
+int main(int argc, char* argv[])
+{
+	LoadSettings settings;
+	settings.sizes.size = 64 * 1024;
+	settings.sizes.maxSize = settings.sizes.size;
+
+	for (int i = 1; i < argc; i++)
+	{
+		std::string argument = argv[i];
+		bool valid = true;
+		if (argument.rfind(SERVER_ARGUMENT, 0) == 0)
+		{
+			auto server = argument.substr(SERVER_ARGUMENT.size());
+			auto colon = server.rfind(':');
+			valid = colon != std::string::npos;
+			if (valid)
+			{
+				settings.address = server.substr(0, colon);
+				settings.port = server.substr(colon + 1);
+			}
+		}
+		else if (argument.rfind(CLIENTS_ARGUMENT, 0) == 0)
+		{
+			valid = parseCount(argument.substr(CLIENTS_ARGUMENT.size()), settings.clients) && settings.clients > 0;
+		}
+		else if (argument.rfind(DURATION_ARGUMENT, 0) == 0)
+		{
+			settings.duration = std::atof(argument.substr(DURATION_ARGUMENT.size()).c_str());
+			valid = settings.duration > 0;
+		}
+		else if (argument.rfind(RAMP_UP_ARGUMENT, 0) == 0)
+		{
+			settings.rampUp = std::atof(argument.substr(RAMP_UP_ARGUMENT.size()).c_str());
+			valid = settings.rampUp >= 0;
+		}
+		else if (argument.rfind(REGISTER_ARGUMENT, 0) == 0)
+		{
+			settings.registerFraction = std::atof(argument.substr(REGISTER_ARGUMENT.size()).c_str());
+			valid = settings.registerFraction >= 0 && settings.registerFraction <= 1;
+		}
+		else if (argument.rfind(FILES_ARGUMENT, 0) == 0)
+		{
+			valid = parseCount(argument.substr(FILES_ARGUMENT.size()), settings.files);
+		}
+		else if (argument.rfind(SIZE_ARGUMENT, 0) == 0)
+		{
+			valid = parseSizeDistribution(argument.substr(SIZE_ARGUMENT.size()), settings.sizes);
+		}
+		else if (argument.rfind(THINK_ARGUMENT, 0) == 0)
+		{
+			settings.thinkTime = std::atof(argument.substr(THINK_ARGUMENT.size()).c_str());
+			valid = settings.thinkTime >= 0;
+		}
+		else if (argument.rfind(FORMAT_ARGUMENT, 0) == 0)
+		{
+			settings.format = argument.substr(FORMAT_ARGUMENT.size());
+			valid = settings.format == "console" || settings.format == "json";
+		}
+		else
+		{
+			valid = false;
+		}
+		if (!valid)
+		{
+			std::cerr << "Invalid argument: " << argument << std::endl;
+			return -1;
+		}
+	}
+
+	// the names of a run must be new to the server's database
+	auto runTag = std::to_string(std::chrono::duration_cast<std::chrono::seconds>(
+		std::chrono::system_clock::now().time_since_epoch()).count());
+
+	RSAWrapper rsa;
+	std::vector<std::unique_ptr<SimulatedClient>> clients;
+	for (size_t i = 0; i < settings.clients; i++)
+	{
+		clients.push_back(std::make_unique<SimulatedClient>(i, settings, rsa, runTag));
+	}
+
+	// Connection reports every connection on the standard output, keep it for the results
+	auto output = std::cout.rdbuf(nullptr);
+	std::ostream results(output);
+
+	auto start = std::chrono::steady_clock::now();
+	auto end = start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+		std::chrono::duration<double>(settings.rampUp + settings.duration));
+	std::vector<std::thread> threads;
+	for (size_t i = 0; i < clients.size(); i++)
+	{
+		auto delay = std::chrono::duration<double>(settings.rampUp * i / clients.size());
+		auto clientStart = start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(delay);
+		threads.emplace_back(&SimulatedClient::run, clients[i].get(), clientStart, end);
+	}
+	for (auto& thread : threads)
+	{
+		thread.join();
+	}
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	std::cout.rdbuf(output);
+
+	ClientStats totals;
+	for (const auto& client : clients)
+	{
+		const auto& stats = client->stats();
+		for (const auto& [name, requestStats] : stats.requests)
+		{
+			totals.requests[name].errors += requestStats.errors;
+			totals.requests[name].latency.merge(requestStats.latency);
+		}
+		totals.sessions += stats.sessions;
+		totals.failedSessions += stats.failedSessions;
+		totals.files += stats.files;
+		totals.bytes += stats.bytes;
+	}
+
+	if (settings.format == "json")
+	{
+		writeJSON(results, totals, seconds, settings.clients);
+	}
+	else
+	{
+		writeConsole(results, totals, seconds, settings.clients);
+	}
+	return 0;
+}
@@ -0,0 +1,706 @@
+#include "stand-in-server.h"
+
+#include "../AESWrapper.h"
+#include "../RSAWrapper.h"
+#include "../cksum.h"
+#include "../connection.h"
+#include "../endian.h"
+#include "../serializer.h"
+#include "../session-capture.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+
+/*
+* Replays a session capture, recorded with the client's --capture=<file>, against a server or a stand-in
+* server in the same process, at the original pace or as fast as the server answers, and reports how the
+* latency of every exchange and the length of the session differ from the capture.
+*
+* The replay sends the captured frames in their order with their sizes, packet by packet, but as a user of
+* its own: it registers a new user where the capture registered one, registers one before the session where
+* the capture logged in, and encrypts synthetic content of the captured sizes with the session's key, since
+* a capture keeps neither the keys nor the content. A pack gets the file count of the captured pack.
+* The replay shares one RSA key pair, kept in priv.key of the working directory like the client's.
+*
+* Build with the client sources, for example:
+*   g++ -O2 -std=c++17 -DNDEBUG benchmarks/session-replay.cpp benchmarks/stand-in-server.cpp AESWrapper.cpp RSAWrapper.cpp
+*       buffer-pool.cpp cksum.cpp alloc-accounting.cpp metrics.cpp perf-counters.cpp connection.cpp serializer.cpp
+*       session-capture.cpp tracing.cpp utils.cpp -lcryptopp -lpthread -o session-replay
+*
+* Command line:
+*   --capture=<file>            the capture to replay
+*   --server=<address:port>     the server, 127.0.0.1:1256 by default
+*   --stand-in                  replay against a stand-in server in the process instead
+*   --speed=<original|max>      keep the captured pace, or send every frame as soon as possible; original by default
+*   --format=<console|json>     the format of the results
+*/
+
+
+const std::string CAPTURE_ARGUMENT = "--capture=";
+const std::string SERVER_ARGUMENT = "--server=";
+const std::string STAND_IN_ARGUMENT = "--stand-in";
+const std::string SPEED_ARGUMENT = "--speed=";
+const std::string FORMAT_ARGUMENT = "--format=";
+
+constexpr size_t HEADER_SIZE = CLIENT_ID_SIZE + sizeof(Request::version) + sizeof(Request::opCode) + sizeof(Request::payloadSize);
+constexpr size_t OPCODE_OFFSET = CLIENT_ID_SIZE + sizeof(Request::version);
+constexpr size_t PAYLOAD_SIZE_OFFSET = OPCODE_OFFSET + sizeof(Request::opCode);
+constexpr size_t FILE_HEADER_SIZE = CONTENT_SIZE + ORIGINAL_FILE_SIZE + PACKET_NUMBER_SIZE + TOTAL_PACKETS_SIZE + FILE_NAME_SIZE;
+constexpr size_t RESPONSE_OPCODE_OFFSET = 1;
+constexpr size_t PATTERN_SIZE = 64 * 1024;  // the synthetic content repeats a random block of this size
+
+
+template <typename T>
+static T readValue(const char* data)
+{
+	T value;
+	std::memcpy(&value, data, sizeof(value));
+	EndianConverter::fromLittleEndian(value);
+	return value;
+}
+
+
+template <typename T>
+static void writeValue(char* out, T value)
+{
+	EndianConverter::toLittleEndian(value);
+	std::memcpy(out, &value, sizeof(value));
+}
+
+
+static std::string requestName(uint16_t opCode)
+{
+	switch (static_cast<RequestCode>(opCode))
+	{
+	case RequestCode::REQUEST_REGISTER: return "REGISTER";
+	case RequestCode::REQUEST_PUBLIC_KEY: return "PUBLIC_KEY";
+	case RequestCode::REQUEST_LOGIN: return "LOGIN";
+	case RequestCode::REQUEST_SEND_FILE: return "SEND_FILE";
+	case RequestCode::REQUEST_SEND_FILE_DEFERRED: return "SEND_FILE_DEFERRED";
+	case RequestCode::REQUEST_FILE_CRC: return "FILE_CRC";
+	case RequestCode::REQUEST_SEND_PACK: return "SEND_PACK";
+	case RequestCode::REQUEST_CRC_VALID: return "CRC_VALID";
+	case RequestCode::REQUEST_CRC_INVALID: return "CRC_INVALID";
+	case RequestCode::REQUEST_CRC_FATAL: return "CRC_FATAL";
+	default: return std::to_string(opCode);
+	}
+}
+
+
+/**
+* @brief The settings of the replay.
+*/
+struct ReplaySettings
+{
+	std::string capture;
+	std::string address = "127.0.0.1";
+	std::string port = "1256";
+	bool standIn = false;
+	bool originalSpeed = true;
+	std::string format = "console";
+};
+
+
+/**
+* @brief A request and its response, as captured and as replayed.
+*/
+struct Exchange
+{
+	std::string request;
+	bool matched;          // the replay got the captured response code
+	double captured;       // ms from the end of the request to the response
+	double replayed;
+};
+
+
+/**
+* @brief ConnectionReplay class
+*
+* Replays the records of one captured connection on a connection of its own.
+*/
+class ConnectionReplay
+{
+public:
+	ConnectionReplay(std::vector<const CaptureRecord*> records, const ReplaySettings& settings, const RSAWrapper& rsa, const std::string& userName)
+		: _records(std::move(records))
+		, _settings(settings)
+		, _rsa(rsa)
+		, _userName(userName)
+		, _connection()
+		, _clientID()
+		, _aesKey()
+		, _packFileCounts()
+		, _pending()
+		, _exchanges()
+		, _plain()
+		, _encryptor()
+		, _plainOffset(0)
+		, _plainSize(0)
+		, _frame()
+		, _replayedSeconds(0)
+		, _error()
+	{
+		// the file count of every pack, from the captured responses, in the order of the packs
+		for (const auto* record : _records)
+		{
+			if (record->kind == CaptureKind::RESPONSE && record->data.size() >= RESPONSE_HEADER_SIZE + CLIENT_ID_SIZE + FILE_NAME_SIZE + FILE_COUNT_SIZE
+				&& readValue<uint16_t>(record->data.data() + RESPONSE_OPCODE_OFFSET) == static_cast<uint16_t>(ResponseCode::RESPONSE_PACK_VALID))
+			{
+				_packFileCounts.push_back(readValue<uint32_t>(record->data.data() + RESPONSE_HEADER_SIZE + CLIENT_ID_SIZE + FILE_NAME_SIZE));
+			}
+		}
+	}
+
+	/**
+	* @brief Register the user before the replay when the captured session logged in.
+	*/
+	void prepare()
+	{
+		auto first = std::find_if(_records.begin(), _records.end(), [](const CaptureRecord* record) {
+			return record->kind == CaptureKind::REQUEST;
+		});
+		if (first == _records.end() || readValue<uint16_t>((*first)->data.data() + OPCODE_OFFSET) != static_cast<uint16_t>(RequestCode::REQUEST_LOGIN))
+		{
+			return;
+		}
+
+		Connection connection;
+		connect(connection);
+		std::vector<char> buffer;
+		Serializer::serializeRequest(Request{ ClientID{}, CLIENT_VERSION, static_cast<uint16_t>(RequestCode::REQUEST_REGISTER),
+			static_cast<uint32_t>(NAME_SIZE), NameRequest{ _userName } }, buffer);
+		connection.send(buffer);
+		auto response = Serializer::deserializeResponse(connection.receive());
+		if (response.opCode != static_cast<uint16_t>(ResponseCode::RESPONSE_REGISTRATION))
+		{
+			throw std::runtime_error("Cannot register " + _userName);
+		}
+		auto clientID = std::get<ClientIDResponse>(response.payload).clientID;
+		Serializer::serializeRequest(Request{ clientID, CLIENT_VERSION, static_cast<uint16_t>(RequestCode::REQUEST_PUBLIC_KEY),
+			static_cast<uint32_t>(NAME_SIZE + PUBLIC_KEY_SIZE), SendPublickKeyRequest{ _userName, _rsa.getPublicKey() } }, buffer);
+		connection.send(buffer);
+		Serializer::deserializeResponse(connection.receive());
+	}
+
+	/**
+	* @brief Replay the connection.
+	*
+	* @param start when the replay starts.
+	* @param captureStart when the capture started, in the capture's time.
+	*/
+	void run(std::chrono::steady_clock::time_point start, uint64_t captureStart)
+	{
+		try
+		{
+			std::this_thread::sleep_until(start + std::chrono::nanoseconds(_records.front()->time - captureStart));
+			auto replayStart = std::chrono::steady_clock::now();
+			connect(_connection);
+			for (const auto* record : _records)
+			{
+				if (record->kind == CaptureKind::RESPONSE)
+				{
+					receive(*record);
+					continue;
+				}
+				if (_settings.originalSpeed)
+				{
+					std::this_thread::sleep_until(start + std::chrono::nanoseconds(record->time - captureStart));
+				}
+				if (record->kind == CaptureKind::REQUEST)
+				{
+					sendRequest(*record);
+				}
+				else
+				{
+					sendPacket(*record);
+				}
+			}
+			_replayedSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - replayStart).count();
+		}
+		catch (const std::exception& e)
+		{
+			_error = e.what();
+		}
+		_connection.close();
+	}
+
+	double capturedSeconds() const
+	{
+		return (_records.back()->time - _records.front()->time) / 1e9;
+	}
+
+	double replayedSeconds() const
+	{
+		return _replayedSeconds;
+	}
+
+	const std::vector<Exchange>& exchanges() const
+	{
+		return _exchanges;
+	}
+
+	const std::string& error() const
+	{
+		return _error;
+	}
+
+private:
+	struct PendingRequest
+	{
+		std::string name;
+		uint64_t captured;   // the end of the request, in the capture's time
+		std::chrono::steady_clock::time_point replayed;
+	};
+
+	void connect(Connection& connection)
+	{
+		if (!connection.setServerIP(_settings.address, _settings.port) || !connection.connect())
+		{
+			throw std::runtime_error("Cannot connect to " + _settings.address + ":" + _settings.port);
+		}
+	}
+
+	void sendRequest(const CaptureRecord& record)
+	{
+		if (record.data.size() < HEADER_SIZE)
+		{
+			throw std::runtime_error("Invalid request in the capture");
+		}
+		_frame.assign(record.data.begin(), record.data.end());
+		std::memcpy(_frame.data(), _clientID.data(), CLIENT_ID_SIZE);
+
+		auto opCode = readValue<uint16_t>(_frame.data() + OPCODE_OFFSET);
+		auto code = static_cast<RequestCode>(opCode);
+		if ((code == RequestCode::REQUEST_REGISTER || code == RequestCode::REQUEST_LOGIN || code == RequestCode::REQUEST_PUBLIC_KEY)
+			&& _frame.size() >= HEADER_SIZE + NAME_SIZE)
+		{
+			// the user of the replay instead of the captured one
+			std::memset(_frame.data() + HEADER_SIZE, 0, NAME_SIZE);
+			std::memcpy(_frame.data() + HEADER_SIZE, _userName.data(), std::min(_userName.size(), NAME_SIZE - 1));
+			if (code == RequestCode::REQUEST_PUBLIC_KEY && _frame.size() >= HEADER_SIZE + NAME_SIZE + PUBLIC_KEY_SIZE)
+			{
+				auto publicKey = _rsa.getPublicKey();
+				std::memcpy(_frame.data() + HEADER_SIZE + NAME_SIZE, publicKey.data(), std::min(publicKey.size(), PUBLIC_KEY_SIZE));
+			}
+		}
+		bool content = (code == RequestCode::REQUEST_SEND_FILE || code == RequestCode::REQUEST_SEND_FILE_DEFERRED
+			|| code == RequestCode::REQUEST_SEND_PACK);
+		if (content && _frame.size() >= HEADER_SIZE + FILE_HEADER_SIZE)
+		{
+			startContent(code, readValue<uint32_t>(_frame.data() + HEADER_SIZE + CONTENT_SIZE));
+			size_t contentSize = appendContent(HEADER_SIZE, record);
+			writeValue<uint32_t>(_frame.data() + PAYLOAD_SIZE_OFFSET, static_cast<uint32_t>(FILE_HEADER_SIZE + contentSize));
+		}
+
+		auto now = std::chrono::steady_clock::now();
+		_connection.send(_frame);
+		// the server doesn't answer them, a deferred file is answered on its FILE_CRC. The captured
+		// CRC doesn't match the synthetic content, the server's verification fails but costs the same.
+		if (code != RequestCode::REQUEST_CRC_INVALID && code != RequestCode::REQUEST_SEND_FILE_DEFERRED)
+		{
+			_pending.push_back(PendingRequest{ requestName(opCode), record.time, now });
+		}
+	}
+
+	void sendPacket(const CaptureRecord& record)
+	{
+		if (record.data.size() < FILE_HEADER_SIZE)
+		{
+			throw std::runtime_error("Invalid packet in the capture");
+		}
+		_frame.assign(record.data.begin(), record.data.end());
+		appendContent(0, record);
+
+		auto now = std::chrono::steady_clock::now();
+		_connection.send(_frame);
+		if (!_pending.empty())
+		{
+			// the request ends with its last packet
+			_pending.back().captured = record.time;
+			_pending.back().replayed = now;
+		}
+	}
+
+	void receive(const CaptureRecord& record)
+	{
+		auto response = Serializer::deserializeResponse(_connection.receive());
+		auto now = std::chrono::steady_clock::now();
+		auto code = static_cast<ResponseCode>(response.opCode);
+		if (code == ResponseCode::RESPONSE_REGISTRATION)
+		{
+			_clientID = std::get<ClientIDResponse>(response.payload).clientID;
+		}
+		else if (code == ResponseCode::RESPONSE_AES_KEY || code == ResponseCode::RESPONSE_LOGIN)
+		{
+			const auto& keyResponse = std::get<SymmetricKeyResponse>(response.payload);
+			_clientID = keyResponse.clientID;
+			_aesKey = _rsa.decrypt(keyResponse.symmetricKey);
+		}
+
+		if (_pending.empty() || record.data.size() < RESPONSE_HEADER_SIZE)
+		{
+			return;
+		}
+		auto pending = _pending.front();
+		_pending.pop_front();
+		_exchanges.push_back(Exchange{
+			pending.name,
+			readValue<uint16_t>(record.data.data() + RESPONSE_OPCODE_OFFSET) == response.opCode,
+			(static_cast<double>(record.time) - pending.captured) / 1e6,
+			std::chrono::duration<double, std::milli>(now - pending.replayed).count() });
+	}
+
+	// Synthetic content of the captured size, a pack gets a valid index with the captured file count.
+	void startContent(RequestCode code, uint32_t size)
+	{
+		if (_aesKey.empty())
+		{
+			throw std::runtime_error("File before the key exchange");
+		}
+		if (_plain.size() < size)
+		{
+			std::mt19937 generator(static_cast<uint32_t>(size));
+			size_t oldSize = _plain.size();
+			_plain.resize(size);
+			for (size_t i = oldSize; i < size; i++)
+			{
+				_plain[i] = (i < PATTERN_SIZE) ? static_cast<char>(generator()) : _plain[i % PATTERN_SIZE];
+			}
+		}
+
+		if (code == RequestCode::REQUEST_SEND_PACK)
+		{
+			uint32_t fileCount = _packFileCounts.empty() ? 1 : _packFileCounts.front();
+			if (!_packFileCounts.empty())
+			{
+				_packFileCounts.pop_front();
+			}
+			fileCount = std::max<uint32_t>(1, std::min<uint32_t>(fileCount,
+				static_cast<uint32_t>(size > FILE_COUNT_SIZE ? (size - FILE_COUNT_SIZE) / (PACK_ENTRY_SIZE + 1) : 0)));
+			size_t indexSize = FILE_COUNT_SIZE + fileCount * PACK_ENTRY_SIZE;
+			size_t dataSize = (size > indexSize) ? size - indexSize : 0;
+			writeValue<uint32_t>(_plain.data(), fileCount);
+			size_t offset = indexSize;
+			for (uint32_t i = 0; i < fileCount; i++)
+			{
+				size_t fileSize = dataSize / fileCount + (i < dataSize % fileCount ? 1 : 0);
+				char* entry = _plain.data() + FILE_COUNT_SIZE + i * PACK_ENTRY_SIZE;
+				auto name = "replay" + std::to_string(i) + ".bin";
+				std::memset(entry, 0, FILE_NAME_SIZE);
+				std::memcpy(entry, name.data(), name.size());
+				CRC crc;
+				crc.update(_plain.data() + offset, fileSize);
+				writeValue<uint32_t>(entry + FILE_NAME_SIZE, static_cast<uint32_t>(offset));
+				writeValue<uint32_t>(entry + FILE_NAME_SIZE + PACK_OFFSET_SIZE, static_cast<uint32_t>(fileSize));
+				writeValue<uint32_t>(entry + FILE_NAME_SIZE + PACK_OFFSET_SIZE + CONTENT_SIZE, crc.digest());
+				offset += fileSize;
+			}
+		}
+		_encryptor = std::make_unique<AESStreamEncryptor>(_aesKey);
+		_plainOffset = 0;
+		_plainSize = size;
+	}
+
+	// Append the next encrypted chunk of the content after the file header of the frame, the size of the
+	// captured one, and fix the header's content size.
+	size_t appendContent(size_t fileHeaderOffset, const CaptureRecord& record)
+	{
+		if (!_encryptor)
+		{
+			throw std::runtime_error("A packet without its file in the capture");
+		}
+		auto packet = readValue<uint16_t>(_frame.data() + fileHeaderOffset + CONTENT_SIZE + ORIGINAL_FILE_SIZE);
+		auto totalPackets = readValue<uint16_t>(_frame.data() + fileHeaderOffset + CONTENT_SIZE + ORIGINAL_FILE_SIZE + PACKET_NUMBER_SIZE);
+		bool last = packet >= totalPackets;
+
+		size_t plainSize = last ? _plainSize - _plainOffset : std::min<size_t>(record.contentSize, _plainSize - _plainOffset);
+		size_t frameSize = _frame.size();
+		_frame.resize(frameSize + AESWrapper::encryptedSize(plainSize));
+		size_t contentSize = last
+			? _encryptor->finish(_plain.data() + _plainOffset, plainSize, _frame.data() + frameSize)
+			: _encryptor->update(_plain.data() + _plainOffset, plainSize, _frame.data() + frameSize);
+		_frame.resize(frameSize + contentSize);
+		_plainOffset += plainSize;
+		writeValue<uint32_t>(_frame.data() + fileHeaderOffset, static_cast<uint32_t>(contentSize));
+		if (last)
+		{
+			_encryptor.reset();
+		}
+		return contentSize;
+	}
+
+	std::vector<const CaptureRecord*> _records;
+	const ReplaySettings& _settings;
+	const RSAWrapper& _rsa;
+	std::string _userName;
+	Connection _connection;
+	ClientID _clientID;
+	std::vector<char> _aesKey;
+	std::deque<uint32_t> _packFileCounts;
+	std::deque<PendingRequest> _pending;
+	std::vector<Exchange> _exchanges;
+	std::vector<char> _plain;
+	std::unique_ptr<AESStreamEncryptor> _encryptor;
+	size_t _plainOffset;
+	size_t _plainSize;
+	std::vector<char> _frame;
+	double _replayedSeconds;
+	std::string _error;
+};
+
+
+/**
+* @brief The exchanges of a request type, as captured and as replayed.
+*/
+struct RequestTiming
+{
+	std::vector<double> captured;
+	std::vector<double> replayed;
+	size_t mismatches = 0;
+};
+
+
+static double mean(const std::vector<double>& values)
+{
+	double sum = 0;
+	for (double value : values)
+	{
+		sum += value;
+	}
+	return values.empty() ? 0 : sum / values.size();
+}
+
+
+static double percentile(std::vector<double> values, double fraction)
+{
+	if (values.empty())
+	{
+		return 0;
+	}
+	std::sort(values.begin(), values.end());
+	size_t index = static_cast<size_t>(fraction * (values.size() - 1) + 0.5);
+	return values[std::min(index, values.size() - 1)];
+}
+
+
+static double difference(double captured, double replayed)
+{
+	return captured > 0 ? 100.0 * (replayed - captured) / captured : 0;
+}
+
+
+static void writeConsole(std::ostream& out, const std::map<std::string, RequestTiming>& timings, double captured, double replayed,
+	size_t connections, const ReplaySettings& settings)
+{
+	out << std::fixed << std::setprecision(2);
+	out << "Replayed " << connections << " connection(s) " << (settings.originalSpeed ? "at the original speed" : "at the maximum speed")
+		<< ": captured " << captured << " s, replayed " << replayed << " s (" << std::showpos << difference(captured, replayed)
+		<< std::noshowpos << "%)" << std::endl;
+	out << std::left << std::setw(12) << "Request" << std::right << std::setw(8) << "Count" << std::setw(10) << "Mismatch"
+		<< std::setw(14) << "Captured ms" << std::setw(14) << "Replayed ms" << std::setw(10) << "Diff %"
+		<< std::setw(14) << "Captured p99" << std::setw(14) << "Replayed p99" << std::endl;
+	for (const auto& [name, timing] : timings)
+	{
+		double capturedMean = mean(timing.captured);
+		double replayedMean = mean(timing.replayed);
+		out << std::left << std::setw(12) << name << std::right
+			<< std::setw(8) << timing.captured.size()
+			<< std::setw(10) << timing.mismatches
+			<< std::setw(14) << capturedMean
+			<< std::setw(14) << replayedMean
+			<< std::setw(10) << std::showpos << difference(capturedMean, replayedMean) << std::noshowpos
+			<< std::setw(14) << percentile(timing.captured, 0.99)
+			<< std::setw(14) << percentile(timing.replayed, 0.99) << std::endl;
+	}
+	out << std::defaultfloat;
+}
+
+
+static void writeJSON(std::ostream& out, const std::map<std::string, RequestTiming>& timings, double captured, double replayed,
+	size_t connections, const ReplaySettings& settings)
+{
+	out << std::setprecision(10);
+	out << "{\n";
+	out << "  \"connections\": " << connections << ",\n";
+	out << "  \"speed\": \"" << (settings.originalSpeed ? "original" : "max") << "\",\n";
+	out << "  \"captured_seconds\": " << captured << ",\n";
+	out << "  \"replayed_seconds\": " << replayed << ",\n";
+	out << "  \"requests\": {";
+	bool first = true;
+	for (const auto& [name, timing] : timings)
+	{
+		out << (first ? "\n" : ",\n") << "    \"" << name << "\": { "
+			<< "\"count\": " << timing.captured.size()
+			<< ", \"mismatches\": " << timing.mismatches
+			<< ", \"captured_mean_ms\": " << mean(timing.captured)
+			<< ", \"replayed_mean_ms\": " << mean(timing.replayed)
+			<< ", \"captured_p99_ms\": " << percentile(timing.captured, 0.99)
+			<< ", \"replayed_p99_ms\": " << percentile(timing.replayed, 0.99) << " }";
+		first = false;
+	}
+	out << "\n  }\n}" << std::endl;
+}
+
+
+int main(int argc, char* argv[])
+{
+	ReplaySettings settings;
+	for (int i = 1; i < argc; i++)
+	{
+		std::string argument = argv[i];
+		bool valid = true;
+		if (argument.rfind(CAPTURE_ARGUMENT, 0) == 0)
+		{
+			settings.capture = argument.substr(CAPTURE_ARGUMENT.size());
+		}
+		else if (argument.rfind(SERVER_ARGUMENT, 0) == 0)
+		{
+			auto server = argument.substr(SERVER_ARGUMENT.size());
+			auto colon = server.rfind(':');
+			valid = colon != std::string::npos;
+			if (valid)
+			{
+				settings.address = server.substr(0, colon);
+				settings.port = server.substr(colon + 1);
+			}
+		}
+		else if (argument == STAND_IN_ARGUMENT)
+		{
+			settings.standIn = true;
+		}
+		else if (argument.rfind(SPEED_ARGUMENT, 0) == 0)
+		{
+			auto speed = argument.substr(SPEED_ARGUMENT.size());
+			valid = speed == "original" || speed == "max";
+			settings.originalSpeed = speed == "original";
+		}
+		else if (argument.rfind(FORMAT_ARGUMENT, 0) == 0)
+		{
+			settings.format = argument.substr(FORMAT_ARGUMENT.size());
+			valid = settings.format == "console" || settings.format == "json";
+		}
+		else
+		{
+			valid = false;
+		}
+		if (!valid)
+		{
+			std::cerr << "Invalid argument: " << argument << std::endl;
+			return -1;
+		}
+	}
+	if (settings.capture.empty())
+	{
+		std::cerr << "No capture, use " << CAPTURE_ARGUMENT << "<file>" << std::endl;
+		return -1;
+	}
+
+	std::vector<CaptureRecord> records;
+	try
+	{
+		records = SessionCapture::load(settings.capture);
+	}
+	catch (const std::exception& e)
+	{
+		std::cerr << e.what() << std::endl;
+		return -1;
+	}
+	if (records.empty())
+	{
+		std::cerr << "The capture is empty" << std::endl;
+		return -1;
+	}
+
+	std::unique_ptr<StandInServer> standIn;
+	if (settings.standIn)
+	{
+		standIn = std::make_unique<StandInServer>();
+		settings.address = "127.0.0.1";
+		settings.port = std::to_string(standIn->port());
+	}
+
+	// the names of a replay must be new to the server's database
+	auto runTag = std::to_string(std::chrono::duration_cast<std::chrono::seconds>(
+		std::chrono::system_clock::now().time_since_epoch()).count());
+
+	std::map<uint32_t, std::vector<const CaptureRecord*>> connections;
+	for (const auto& record : records)
+	{
+		connections[record.connection].push_back(&record);
+	}
+
+	// Connection reports every connection on the standard output, keep it for the results
+	auto output = std::cout.rdbuf(nullptr);
+	std::ostream results(output);
+
+	RSAWrapper rsa;
+	std::vector<std::unique_ptr<ConnectionReplay>> replays;
+	try
+	{
+		for (auto& [id, connectionRecords] : connections)
+		{
+			auto userName = "replay-" + runTag + "-" + std::to_string(id);
+			replays.push_back(std::make_unique<ConnectionReplay>(std::move(connectionRecords), settings, rsa, userName));
+			replays.back()->prepare();
+		}
+	}
+	catch (const std::exception& e)
+	{
+		std::cout.rdbuf(output);
+		std::cerr << e.what() << std::endl;
+		return -1;
+	}
+
+	auto start = std::chrono::steady_clock::now();
+	std::vector<std::thread> threads;
+	for (auto& replay : replays)
+	{
+		threads.emplace_back(&ConnectionReplay::run, replay.get(), start, records.front().time);
+	}
+	for (auto& thread : threads)
+	{
+		thread.join();
+	}
+	double replayed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	std::cout.rdbuf(output);
+
+	std::map<std::string, RequestTiming> timings;
+	bool failed = false;
+	for (const auto& replay : replays)
+	{
+		if (!replay->error().empty())
+		{
+			std::cerr << "A connection failed: " << replay->error() << std::endl;
+			failed = true;
+		}
+		for (const auto& exchange : replay->exchanges())
+		{
+			auto& timing = timings[exchange.request];
+			timing.captured.push_back(exchange.captured);
+			timing.replayed.push_back(exchange.replayed);
+			timing.mismatches += exchange.matched ? 0 : 1;
+		}
+	}
+	double captured = (records.back().time - records.front().time) / 1e9;
+
+	if (settings.format == "json")
+	{
+		writeJSON(results, timings, captured, replayed, replays.size(), settings);
+	}
+	else
+	{
+		writeConsole(results, timings, captured, replayed, replays.size(), settings);
+	}
+	return failed ? -1 : 0;
+}
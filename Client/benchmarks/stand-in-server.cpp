@@ -0,0 +1,530 @@
+#include "stand-in-server.h"
+
+#include "../AESWrapper.h"
+#include "../alloc-accounting.h"
+#include "../cksum.h"
+#include "../connection.h"
+#include "../endian.h"
+#include "../protocol.h"
+
+#include <aes.h>
+#include <modes.h>
+#include <filters.h>
+#include <osrng.h>
+#include <rsa.h>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+
+
+constexpr uint8_t SERVER_VERSION = 3;
+constexpr size_t REQUEST_HEADER_SIZE = CLIENT_ID_SIZE + sizeof(Request::version) + sizeof(Request::opCode) + sizeof(Request::payloadSize);
+constexpr size_t FILE_PAYLOAD_HEADER_SIZE = CONTENT_SIZE + ORIGINAL_FILE_SIZE + PACKET_NUMBER_SIZE + TOTAL_PACKETS_SIZE + FILE_NAME_SIZE;
+
+
+template <typename T>
+static T readValue(const char* data)
+{
+	T value;
+	std::memcpy(&value, data, sizeof(value));
+	EndianConverter::fromLittleEndian(value);
+	return value;
+}
+
+
+template <typename T>
+static void appendValue(std::vector<char>& out, T value)
+{
+	EndianConverter::toLittleEndian(value);
+	const char* bytes = reinterpret_cast<const char*>(&value);
+	out.insert(out.end(), bytes, bytes + sizeof(value));
+}
+
+
+// A fixed-size, zero-padded name field.
+static void appendName(std::vector<char>& out, const std::string& name)
+{
+	size_t offset = out.size();
+	out.resize(offset + FILE_NAME_SIZE, '\0');
+	std::memcpy(out.data() + offset, name.data(), std::min(name.size(), FILE_NAME_SIZE - 1));
+}
+
+
+static std::string readName(const char* data)
+{
+	return std::string(data, strnlen(data, NAME_SIZE));
+}
+
+
+StandInServer::StandInServer(unsigned short port)
+	: _context()
+	, _acceptor(_context, tcp::endpoint(boost::asio::ip::address_v4::loopback(), port))
+	, _acceptThread()
+	, _sessions()
+	, _stopping(false)
+	, _bytesReceived(0)
+	, _mutex()
+	, _users()
+	, _records()
+{
+	_acceptThread = std::thread(&StandInServer::acceptConnections, this);
+}
+
+
+StandInServer::~StandInServer()
+{
+	// a connection of our own wakes the blocking accept up
+	_stopping = true;
+	try
+	{
+		tcp::socket wakeUp(_context);
+		wakeUp.connect(tcp::endpoint(boost::asio::ip::address_v4::loopback(), port()));
+	}
+	catch (const std::exception&)
+	{
+	}
+	_acceptThread.join();
+
+	std::lock_guard<std::mutex> lock(_mutex);
+	for (auto& session : _sessions)
+	{
+		session.join();
+	}
+}
+
+
+unsigned short StandInServer::port() const
+{
+	return _acceptor.local_endpoint().port();
+}
+
+
+std::vector<StandInServer::FileRecord> StandInServer::takeRecords()
+{
+	std::vector<FileRecord> records;
+	std::lock_guard<std::mutex> lock(_mutex);
+	records.swap(_records);
+	return records;
+}
+
+
+uint64_t StandInServer::bytesReceived() const
+{
+	return _bytesReceived.load(std::memory_order_relaxed);
+}
+
+
+void StandInServer::acceptConnections()
+{
+	// the allocations of the benchmarks are the client's
+	AllocationAccounting::excludeThread();
+	while (true)
+	{
+		tcp::socket socket(_context);
+		boost::system::error_code error;
+		_acceptor.accept(socket, error);
+		if (_stopping)
+		{
+			return;
+		}
+		if (error)
+		{
+			std::cerr << "Stand-in server: " << error.message() << std::endl;
+			continue;
+		}
+		socket.set_option(tcp::no_delay(true));
+		std::lock_guard<std::mutex> lock(_mutex);
+		_sessions.emplace_back(&StandInServer::serve, this, std::move(socket));
+	}
+}
+
+
+void StandInServer::serve(tcp::socket socket)
+{
+	AllocationAccounting::excludeThread();
+	Session session{};
+	try
+	{
+		while (true)
+		{
+			char header[REQUEST_HEADER_SIZE];
+			read(socket, header, sizeof(header));
+
+			size_t offset = CLIENT_ID_SIZE + sizeof(Request::version);
+			auto code = readValue<uint16_t>(header + offset);
+			offset += sizeof(Request::opCode);
+			auto payloadSize = readValue<uint32_t>(header + offset);
+
+			auto request = static_cast<RequestCode>(code);
+			if (request == RequestCode::REQUEST_SEND_FILE || request == RequestCode::REQUEST_SEND_FILE_DEFERRED
+				|| request == RequestCode::REQUEST_SEND_PACK)
+			{
+				// the content is read packet by packet, it never sits in memory as a whole
+				handleContent(socket, session, code, payloadSize);
+				continue;
+			}
+
+			if (payloadSize > PACKET_LENGTH)
+			{
+				throw std::runtime_error("Request payload is too large");
+			}
+			std::vector<char> payload(payloadSize);
+			read(socket, payload.data(), payload.size());
+
+			switch (request)
+			{
+			case RequestCode::REQUEST_REGISTER:
+				handleRegister(socket, session, payload);
+				break;
+			case RequestCode::REQUEST_PUBLIC_KEY:
+				handlePublicKey(socket, session, payload);
+				break;
+			case RequestCode::REQUEST_LOGIN:
+				handleLogin(socket, session, payload);
+				break;
+			case RequestCode::REQUEST_CRC_VALID:
+			case RequestCode::REQUEST_CRC_INVALID:
+			case RequestCode::REQUEST_CRC_FATAL:
+				handleCRC(socket, session, code, payload);
+				break;
+			case RequestCode::REQUEST_FILE_CRC:
+				handleFileCRC(socket, session, payload);
+				break;
+			default:
+				respond(socket, static_cast<uint16_t>(ResponseCode::RESPONSE_ERROR), {});
+				break;
+			}
+		}
+	}
+	catch (const boost::system::system_error& e)
+	{
+		// the client closed the connection at the end of its session
+		if (e.code() != boost::asio::error::eof && e.code() != boost::asio::error::connection_reset)
+		{
+			std::cerr << "Stand-in server: " << e.what() << std::endl;
+		}
+	}
+	catch (const std::exception& e)
+	{
+		std::cerr << "Stand-in server: " << e.what() << std::endl;
+	}
+}
+
+
+void StandInServer::read(tcp::socket& socket, char* data, size_t size)
+{
+	boost::asio::read(socket, boost::asio::buffer(data, size));
+	_bytesReceived.fetch_add(size, std::memory_order_relaxed);
+}
+
+
+void StandInServer::respond(tcp::socket& socket, uint16_t code, const std::vector<char>& payload)
+{
+	std::vector<char> header;
+	header.reserve(RESPONSE_HEADER_SIZE);
+	appendValue(header, SERVER_VERSION);
+	appendValue(header, code);
+	appendValue(header, static_cast<uint32_t>(payload.size()));
+
+	std::array<boost::asio::const_buffer, 2> buffers{ boost::asio::buffer(header), boost::asio::buffer(payload) };
+	boost::asio::write(socket, buffers);
+}
+
+
+void StandInServer::handleRegister(tcp::socket& socket, Session& session, const std::vector<char>& payload)
+{
+	if (payload.size() < NAME_SIZE)
+	{
+		throw std::runtime_error("Invalid registration request");
+	}
+	auto name = readName(payload.data());
+
+	CryptoPP::AutoSeededRandomPool rng;
+	rng.GenerateBlock(reinterpret_cast<CryptoPP::byte*>(session.clientID.data()), session.clientID.size());
+	bool registered = false;
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		registered = _users.emplace(name, User{ session.clientID, {} }).second;
+	}
+	if (!registered)
+	{
+		// like the real server, a name is registered once
+		respond(socket, static_cast<uint16_t>(ResponseCode::RESPONSE_REGISTRATION_FAILED), {});
+		return;
+	}
+	respond(socket, static_cast<uint16_t>(ResponseCode::RESPONSE_REGISTRATION),
+		std::vector<char>(session.clientID.begin(), session.clientID.end()));
+}
+
+
+void StandInServer::handlePublicKey(tcp::socket& socket, Session& session, const std::vector<char>& payload)
+{
+	if (payload.size() < NAME_SIZE + PUBLIC_KEY_SIZE)
+	{
+		throw std::runtime_error("Invalid public key request");
+	}
+	auto name = readName(payload.data());
+	std::vector<char> publicKey(payload.begin() + NAME_SIZE, payload.begin() + NAME_SIZE + PUBLIC_KEY_SIZE);
+	bool known = false;
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		auto user = _users.find(name);
+		known = (user != _users.end() && user->second.clientID == session.clientID);
+		if (known)
+		{
+			user->second.publicKey = publicKey;
+		}
+	}
+	if (!known)
+	{
+		respond(socket, static_cast<uint16_t>(ResponseCode::RESPONSE_ERROR), {});
+		return;
+	}
+	respond(socket, static_cast<uint16_t>(ResponseCode::RESPONSE_AES_KEY), keyResponse(session, publicKey));
+}
+
+
+void StandInServer::handleLogin(tcp::socket& socket, Session& session, const std::vector<char>& payload)
+{
+	if (payload.size() < NAME_SIZE)
+	{
+		throw std::runtime_error("Invalid login request");
+	}
+	auto name = readName(payload.data());
+
+	std::vector<char> publicKey;
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		auto user = _users.find(name);
+		if (user != _users.end())
+		{
+			session.clientID = user->second.clientID;
+			publicKey = user->second.publicKey;
+		}
+	}
+	if (publicKey.empty())
+	{
+		respond(socket, static_cast<uint16_t>(ResponseCode::RESPONSE_LOGIN_FAILED),
+			std::vector<char>(session.clientID.begin(), session.clientID.end()));
+		return;
+	}
+	respond(socket, static_cast<uint16_t>(ResponseCode::RESPONSE_LOGIN), keyResponse(session, publicKey));
+}
+
+
+std::vector<char> StandInServer::keyResponse(Session& session, const std::vector<char>& publicKey)
+{
+	// a new session key, encrypted with the client's public key
+	CryptoPP::AutoSeededRandomPool rng;
+	session.aesKey.assign(AES_KEY_SIZE, '\0');
+	rng.GenerateBlock(reinterpret_cast<CryptoPP::byte*>(session.aesKey.data()), session.aesKey.size());
+
+	CryptoPP::RSA::PublicKey key;
+	CryptoPP::ArraySource keySource(reinterpret_cast<const CryptoPP::byte*>(publicKey.data()), publicKey.size(), true);
+	key.Load(keySource);
+	CryptoPP::RSAES_OAEP_SHA_Encryptor encryptor(key);
+
+	std::string encryptedKey;
+	CryptoPP::StringSource ss(reinterpret_cast<const CryptoPP::byte*>(session.aesKey.data()), session.aesKey.size(), true,
+		new CryptoPP::PK_EncryptorFilter(rng, encryptor,
+			new CryptoPP::StringSink(encryptedKey)
+		)
+	);
+
+	std::vector<char> payload(session.clientID.begin(), session.clientID.end());
+	payload.insert(payload.end(), encryptedKey.begin(), encryptedKey.end());
+	return payload;
+}
+
+
+void StandInServer::handleContent(tcp::socket& socket, Session& session, uint16_t code, uint32_t payloadSize)
+{
+	if (session.aesKey.empty())
+	{
+		throw std::runtime_error("File before the key exchange");
+	}
+	auto started = std::chrono::steady_clock::now();
+	bool isPack = static_cast<RequestCode>(code) == RequestCode::REQUEST_SEND_PACK;
+
+	CryptoPP::byte iv[CryptoPP::AES::BLOCKSIZE] = { 0 };
+	CryptoPP::CBC_Mode<CryptoPP::AES>::Decryption decryptor;
+	decryptor.SetKeyWithIV(reinterpret_cast<const CryptoPP::byte*>(session.aesKey.data()), session.aesKey.size(), iv);
+
+	std::vector<char> encrypted(PACKET_LENGTH);
+	std::vector<char> pack;  // a pack is verified file by file, so its plaintext is kept until it is whole
+	CRC crc;
+	std::string fileName;
+	uint64_t fileSize = 0;
+	uint32_t encryptedSize = 0;
+	uint16_t packetNumber = 0;
+	uint16_t totalPackets = 1;
+
+	while (packetNumber < totalPackets)
+	{
+		// the first packet follows the request header, the next ones come on their own
+		char header[FILE_PAYLOAD_HEADER_SIZE];
+		read(socket, header, sizeof(header));
+		auto contentSize = readValue<uint32_t>(header);
+		auto packet = readValue<uint16_t>(header + CONTENT_SIZE + ORIGINAL_FILE_SIZE);
+		totalPackets = readValue<uint16_t>(header + CONTENT_SIZE + ORIGINAL_FILE_SIZE + PACKET_NUMBER_SIZE);
+		if (packet == 1)
+		{
+			fileName = readName(header + CONTENT_SIZE + ORIGINAL_FILE_SIZE + PACKET_NUMBER_SIZE + TOTAL_PACKETS_SIZE);
+			if (payloadSize != FILE_PAYLOAD_HEADER_SIZE + contentSize)
+			{
+				throw std::runtime_error("Invalid payload size of " + fileName);
+			}
+		}
+		if (packet != packetNumber + 1 || contentSize > encrypted.size() || contentSize % AES_BLOCK_SIZE != 0)
+		{
+			throw std::runtime_error("Invalid packet of " + fileName);
+		}
+		packetNumber = packet;
+
+		read(socket, encrypted.data(), contentSize);
+		encryptedSize += contentSize;
+		auto plain = reinterpret_cast<CryptoPP::byte*>(encrypted.data());
+		decryptor.ProcessData(plain, plain, contentSize);
+
+		size_t plainSize = contentSize;
+		if (packetNumber == totalPackets)
+		{
+			// PKCS#7 padding on the last block
+			size_t padding = contentSize > 0 ? plain[contentSize - 1] : 0;
+			if (padding == 0 || padding > AES_BLOCK_SIZE)
+			{
+				throw std::runtime_error("Invalid padding of " + fileName);
+			}
+			plainSize -= padding;
+		}
+
+		if (isPack)
+		{
+			pack.insert(pack.end(), encrypted.data(), encrypted.data() + plainSize);
+		}
+		else
+		{
+			crc.update(encrypted.data(), plainSize);
+		}
+		fileSize += plainSize;
+	}
+
+	std::vector<char> payload(session.clientID.begin(), session.clientID.end());
+	if (static_cast<RequestCode>(code) == RequestCode::REQUEST_SEND_FILE_DEFERRED)
+	{
+		// answered on its CRC request, which follows right away
+		session.pendingFiles[fileName] = PendingFile{ started, fileSize, encryptedSize, crc.digest() };
+		return;
+	}
+	if (!isPack)
+	{
+		// a file that is sent again keeps the time of its first attempt
+		session.pendingFiles.emplace(fileName, PendingFile{ started, fileSize, encryptedSize, crc.digest() });
+		appendValue(payload, encryptedSize);
+		appendName(payload, fileName);
+		appendValue(payload, crc.digest());
+		respond(socket, static_cast<uint16_t>(ResponseCode::RESPONSE_FILE_VALID), payload);
+		return;
+	}
+
+	// the pack's index: the file count, then the name, offset, size and CRC of every file
+	if (pack.size() < FILE_COUNT_SIZE)
+	{
+		throw std::runtime_error("Invalid pack " + fileName);
+	}
+	auto fileCount = readValue<uint32_t>(pack.data());
+	if (fileCount > PACK_MAX_FILES || pack.size() < FILE_COUNT_SIZE + fileCount * PACK_ENTRY_SIZE)
+	{
+		throw std::runtime_error("Invalid pack " + fileName);
+	}
+	appendName(payload, fileName);
+	appendValue(payload, fileCount);
+	for (uint32_t i = 0; i < fileCount; i++)
+	{
+		const char* entry = pack.data() + FILE_COUNT_SIZE + i * PACK_ENTRY_SIZE;
+		auto name = readName(entry);
+		auto offset = readValue<uint32_t>(entry + FILE_NAME_SIZE);
+		auto size = readValue<uint32_t>(entry + FILE_NAME_SIZE + PACK_OFFSET_SIZE);
+		auto expected = readValue<uint32_t>(entry + FILE_NAME_SIZE + PACK_OFFSET_SIZE + CONTENT_SIZE);
+		if (static_cast<uint64_t>(offset) + size > pack.size())
+		{
+			throw std::runtime_error("Invalid pack " + fileName);
+		}
+
+		CRC fileCRC;
+		fileCRC.update(pack.data() + offset, size);
+		auto digest = fileCRC.digest();
+		appendValue(payload, digest);
+		if (digest == expected)
+		{
+			// the client sends the mismatched files again in a later pack
+			record(name, size, started);
+		}
+	}
+	respond(socket, static_cast<uint16_t>(ResponseCode::RESPONSE_PACK_VALID), payload);
+}
+
+
+void StandInServer::handleCRC(tcp::socket& socket, Session& session, uint16_t code, const std::vector<char>& payload)
+{
+	if (payload.size() < FILE_NAME_SIZE)
+	{
+		throw std::runtime_error("Invalid CRC request");
+	}
+	auto fileName = readName(payload.data());
+	auto request = static_cast<RequestCode>(code);
+	if (request == RequestCode::REQUEST_CRC_INVALID)
+	{
+		// the file comes again, the server doesn't answer
+		return;
+	}
+
+	auto pending = session.pendingFiles.find(fileName);
+	if (pending != session.pendingFiles.end())
+	{
+		if (request == RequestCode::REQUEST_CRC_VALID)
+		{
+			record(fileName, pending->second.size, pending->second.started);
+		}
+		session.pendingFiles.erase(pending);
+	}
+	respond(socket, static_cast<uint16_t>(ResponseCode::RESPONSE_ACK),
+		std::vector<char>(session.clientID.begin(), session.clientID.end()));
+}
+
+
+void StandInServer::handleFileCRC(tcp::socket& socket, Session& session, const std::vector<char>& payload)
+{
+	if (payload.size() < FILE_NAME_SIZE + CRC_SIZE)
+	{
+		throw std::runtime_error("Invalid CRC request");
+	}
+	auto fileName = readName(payload.data());
+	auto crc = readValue<uint32_t>(payload.data() + FILE_NAME_SIZE);
+	auto pending = session.pendingFiles.find(fileName);
+	if (pending == session.pendingFiles.end())
+	{
+		respond(socket, static_cast<uint16_t>(ResponseCode::RESPONSE_ERROR), {});
+		return;
+	}
+
+	// the real server verifies the file in the background, the stand-in already has its CRC
+	if (crc == pending->second.crc)
+	{
+		record(fileName, pending->second.size, pending->second.started);
+	}
+	std::vector<char> response(session.clientID.begin(), session.clientID.end());
+	appendValue(response, pending->second.encryptedSize);
+	appendName(response, fileName);
+	appendValue(response, crc);
+	session.pendingFiles.erase(pending);
+	respond(socket, static_cast<uint16_t>(ResponseCode::RESPONSE_FILE_STORED), response);
+}
+
+
+void StandInServer::record(const std::string& name, uint64_t size, std::chrono::steady_clock::time_point started)
+{
+	auto latency = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - started);
+	std::lock_guard<std::mutex> lock(_mutex);
+	_records.push_back(FileRecord{ name, size, latency });
+}
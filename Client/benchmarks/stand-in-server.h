@@ -0,0 +1,137 @@
+#ifndef STAND_IN_SERVER_H
+#define STAND_IN_SERVER_H
+
+
+#include <boost/asio.hpp>
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <cstdint>
+
+
+using boost::asio::ip::tcp;
+
+
+/**
+* @brief StandInServer class
+*
+* A stand-in for the backup server that speaks the client's protocol on loopback: registration,
+* login, the exchange of the AES key, single files, deferred files, packs and the CRC requests. The content is
+* decrypted and checked packet by packet as it arrives and then dropped, nothing is written to disk,
+* so an end-to-end benchmark measures the client and not the storage of the server.
+*
+* Every connection is served on its own thread. The server records how long every file took, from
+* the first packet of the file to the client's CRC request for it, retries included. The files of a
+* pack are done when the pack is verified.
+*/
+class StandInServer
+{
+public:
+	/**
+	* @brief A file the server received and verified.
+	*/
+	struct FileRecord
+	{
+		std::string name;
+		uint64_t size;
+		std::chrono::nanoseconds latency;
+	};
+
+	/**
+	* @brief Constructor, starts accepting connections on the loopback interface.
+	*
+	* @param port the port to listen on, 0 for any free port.
+	*/
+	explicit StandInServer(unsigned short port = 0);
+
+	/**
+	* @brief Destructor
+	*
+	* Stops accepting connections and waits for the connections that are open to be closed.
+	*/
+	~StandInServer();
+
+	StandInServer(const StandInServer&) = delete;
+	StandInServer& operator=(const StandInServer&) = delete;
+
+	/**
+	* @brief Get the port the server listens on.
+	*/
+	unsigned short port() const;
+
+	/**
+	* @brief Take the records of the files that were verified since the last call.
+	*/
+	std::vector<FileRecord> takeRecords();
+
+	/**
+	* @brief Get the number of bytes the server received so far, headers included.
+	*/
+	uint64_t bytesReceived() const;
+
+private:
+	using ClientID = std::array<char, 16>;
+
+	/**
+	* @brief A registered user, kept for the logins of the next sessions.
+	*/
+	struct User
+	{
+		ClientID clientID;
+		std::vector<char> publicKey;
+	};
+
+	/**
+	* @brief A file that was answered and waits for the client's CRC request, or a deferred file that waits for its CRC.
+	*/
+	struct PendingFile
+	{
+		std::chrono::steady_clock::time_point started;
+		uint64_t size;
+		uint32_t encryptedSize;
+		uint32_t crc;
+	};
+
+	/**
+	* @brief The state of one connection.
+	*/
+	struct Session
+	{
+		ClientID clientID;
+		std::vector<char> aesKey;
+		std::unordered_map<std::string, PendingFile> pendingFiles;
+	};
+
+	void acceptConnections();
+	void serve(tcp::socket socket);
+	void read(tcp::socket& socket, char* data, size_t size);
+	void respond(tcp::socket& socket, uint16_t code, const std::vector<char>& payload);
+
+	void handleRegister(tcp::socket& socket, Session& session, const std::vector<char>& payload);
+	void handlePublicKey(tcp::socket& socket, Session& session, const std::vector<char>& payload);
+	void handleLogin(tcp::socket& socket, Session& session, const std::vector<char>& payload);
+	void handleContent(tcp::socket& socket, Session& session, uint16_t code, uint32_t payloadSize);
+	void handleCRC(tcp::socket& socket, Session& session, uint16_t code, const std::vector<char>& payload);
+	void handleFileCRC(tcp::socket& socket, Session& session, const std::vector<char>& payload);
+
+	std::vector<char> keyResponse(Session& session, const std::vector<char>& publicKey);
+	void record(const std::string& name, uint64_t size, std::chrono::steady_clock::time_point started);
+
+	boost::asio::io_context _context;
+	tcp::acceptor _acceptor;
+	std::thread _acceptThread;
+	std::vector<std::thread> _sessions;
+	std::atomic<bool> _stopping;
+	std::atomic<uint64_t> _bytesReceived;
+	std::mutex _mutex;  // guards the users, the records and the sessions
+	std::unordered_map<std::string, User> _users;
+	std::vector<FileRecord> _records;
+};
+
+#endif // STAND_IN_SERVER_H
@@ -0,0 +1,124 @@
+#include "impairment-proxy.h"
+
+#include "../utils.h"
+
+#include <chrono>
+#include <csignal>
+#include <iostream>
+#include <string>
+#include <thread>
+
+
+/*
+* A proxy that puts a WAN link between the client and a server on one machine: it listens on loopback,
+* forwards every connection to the server, and adds a latency, a jitter, a bandwidth cap, stalls of lost or
+* reordered segments and connection resets to both directions. Point the client's transfer.info at the proxy.
+* It runs until Ctrl+C or for --duration seconds, then prints what it forwarded.
+*
+* Build with the client sources, for example:
+*   g++ -O2 -std=c++17 -DNDEBUG benchmarks/wan-proxy.cpp benchmarks/impairment-proxy.cpp alloc-accounting.cpp utils.cpp
+*       -lpthread -o wan-proxy
+*
+* Command line:
+*   --listen=<port>               the port to listen on, 1257 by default
+*   --server=<address:port>       the server, 127.0.0.1:1256 by default
+*   --duration=<seconds>          stop after this long
+*   --latency=<ms>                one way, added to both directions
+*   --jitter=<ms>                 up to this much more for every segment
+*   --bandwidth=<rate>            a cap of every direction, like 10Mbit or 1MB
+*   --loss=<fraction>             segments held back by a retransmission timeout, --rto=<ms>, 200 by default
+*   --reorder=<fraction>,<ms>     segments held back by a delay
+*   --reset=<fraction>            segments that reset their connection
+*   --reset-after=<size>          reset every connection after it sent this much to the server
+*   --proxy-buffer=<size>         the bytes a direction holds before it stops reading, 4MB by default
+*
+* For example, a transatlantic link:
+*   ./wan-proxy --server=127.0.0.1:1256 --latency=40 --jitter=5 --bandwidth=50Mbit --loss=0.001
+*/
+
+
+const std::string LISTEN_ARGUMENT = "--listen=";
+const std::string SERVER_ARGUMENT = "--server=";
+const std::string DURATION_ARGUMENT = "--duration=";
+
+static volatile std::sig_atomic_t interrupted = 0;
+
+
+static void onInterrupt(int)
+{
+	interrupted = 1;
+}
+
+
+int main(int argc, char* argv[])
+{
+	ImpairmentSettings settings;
+	std::string listenPort = "1257";
+	std::string address = "127.0.0.1";
+	std::string port = "1256";
+	double duration = 0;  // until interrupted
+
+	for (int i = 1; i < argc; i++)
+	{
+		std::string argument = argv[i];
+		bool valid = true;
+		if (argument.rfind(LISTEN_ARGUMENT, 0) == 0)
+		{
+			listenPort = argument.substr(LISTEN_ARGUMENT.size());
+			valid = isNumber(listenPort) && std::stoul(listenPort) <= 65535;
+		}
+		else if (argument.rfind(SERVER_ARGUMENT, 0) == 0)
+		{
+			auto server = argument.substr(SERVER_ARGUMENT.size());
+			auto colon = server.rfind(':');
+			valid = colon != std::string::npos;
+			if (valid)
+			{
+				address = server.substr(0, colon);
+				port = server.substr(colon + 1);
+			}
+		}
+		else if (argument.rfind(DURATION_ARGUMENT, 0) == 0)
+		{
+			duration = std::atof(argument.substr(DURATION_ARGUMENT.size()).c_str());
+			valid = duration > 0;
+		}
+		else if (!parseImpairment(argument, settings, valid))
+		{
+			valid = false;
+		}
+		if (!valid)
+		{
+			std::cerr << "Invalid argument: " << argument << std::endl;
+			return -1;
+		}
+	}
+
+	std::signal(SIGINT, onInterrupt);
+	std::signal(SIGTERM, onInterrupt);
+
+	ImpairmentProxy::Stats stats;
+	try
+	{
+		ImpairmentProxy proxy(settings, address, port, static_cast<unsigned short>(std::stoul(listenPort)));
+		std::cout << "Forwarding 127.0.0.1:" << proxy.port() << " to " << address << ":" << port << std::endl;
+
+		auto end = std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+			std::chrono::duration<double>(duration));
+		while (!interrupted && (duration <= 0 || std::chrono::steady_clock::now() < end))
+		{
+			std::this_thread::sleep_for(std::chrono::milliseconds(100));
+		}
+		stats = proxy.stats();
+	}
+	catch (const std::exception& e)
+	{
+		std::cerr << e.what() << std::endl;
+		return -1;
+	}
+
+	std::cout << stats.connections << " connection(s), " << stats.bytesToServer << " bytes to the server, "
+		<< stats.bytesToClient << " bytes to the client in " << stats.segments << " segments, "
+		<< stats.lostSegments << " lost, " << stats.reorderedSegments << " reordered, " << stats.resets << " reset(s)" << std::endl;
+	return 0;
+}
@@ -0,0 +1,178 @@
+#include "buffer-pool.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+
+PooledBuffer::PooledBuffer()
+	: _pool(nullptr)
+	, _data()
+	, _size(0)
+	, _capacity(0)
+{
+}
+
+
+PooledBuffer::PooledBuffer(BufferPool* pool, std::unique_ptr<char[]> data, size_t capacity)
+	: _pool(pool)
+	, _data(std::move(data))
+	, _size(0)
+	, _capacity(capacity)
+{
+}
+
+
+PooledBuffer::~PooledBuffer()
+{
+	release();
+}
+
+
+PooledBuffer::PooledBuffer(PooledBuffer&& other) noexcept
+	: _pool(other._pool)
+	, _data(std::move(other._data))
+	, _size(other._size)
+	, _capacity(other._capacity)
+{
+	other._pool = nullptr;
+	other._size = 0;
+	other._capacity = 0;
+}
+
+
+PooledBuffer& PooledBuffer::operator=(PooledBuffer&& other) noexcept
+{
+	if (this != &other)
+	{
+		release();
+		_pool = other._pool;
+		_data = std::move(other._data);
+		_size = other._size;
+		_capacity = other._capacity;
+		other._pool = nullptr;
+		other._size = 0;
+		other._capacity = 0;
+	}
+	return *this;
+}
+
+
+char* PooledBuffer::data()
+{
+	return _data.get();
+}
+
+
+const char* PooledBuffer::data() const
+{
+	return _data.get();
+}
+
+
+size_t PooledBuffer::size() const
+{
+	return _size;
+}
+
+
+size_t PooledBuffer::capacity() const
+{
+	return _capacity;
+}
+
+
+void PooledBuffer::resize(size_t size)
+{
+	if (size > _capacity)
+	{
+		throw std::length_error("Pooled buffer is too small");
+	}
+	_size = size;
+}
+
+
+void PooledBuffer::release()
+{
+	if (_pool && _data)
+	{
+		_pool->release(std::move(_data));
+	}
+	_pool = nullptr;
+	_size = 0;
+	_capacity = 0;
+}
+
+
+BufferPool::BufferPool(size_t bufferSize, size_t maxFreeBuffers, size_t maxBuffers)
+	: _mutex()
+	, _returned()
+	, _free()
+	, _bufferSize(bufferSize)
+	, _maxFreeBuffers(std::min(maxFreeBuffers, maxBuffers))
+	, _maxBuffers(maxBuffers)
+	, _allocated(0)
+{
+	_free.reserve(_maxFreeBuffers);
+}
+
+
+PooledBuffer BufferPool::acquire()
+{
+	{
+		std::unique_lock<std::mutex> lock(_mutex);
+		_returned.wait(lock, [this] { return !_free.empty() || _allocated < _maxBuffers; });
+		if (!_free.empty())
+		{
+			auto data = std::move(_free.back());
+			_free.pop_back();
+			return PooledBuffer(this, std::move(data), _bufferSize);
+		}
+		_allocated++;
+	}
+	// allocate outside of the lock, the pool is still growing.
+	return PooledBuffer(this, std::unique_ptr<char[]>(new char[_bufferSize]), _bufferSize);
+}
+
+
+size_t BufferPool::bufferSize() const
+{
+	return _bufferSize;
+}
+
+
+size_t BufferPool::freeBuffers() const
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	return _free.size();
+}
+
+
+size_t BufferPool::allocatedBuffers() const
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	return _allocated;
+}
+
+
+size_t BufferPool::maxBuffers() const
+{
+	return _maxBuffers;
+}
+
+
+void BufferPool::release(std::unique_ptr<char[]> data)
+{
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		if (_free.size() < _maxFreeBuffers)
+		{
+			_free.push_back(std::move(data));
+		}
+		else
+		{
+			_allocated--;
+			data.reset();
+		}
+	}
+	_returned.notify_one();
+}
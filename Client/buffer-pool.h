@@ -0,0 +1,153 @@
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+
+#include <condition_variable>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <cstddef>
+
+
+class BufferPool;
+
+
+/**
+* @brief PooledBuffer class
+*
+* A fixed-capacity byte buffer leased from a BufferPool. The buffer is returned to its pool
+* when the handle is destroyed, so a buffer can be handed from stage to stage by moving the handle.
+*/
+class PooledBuffer
+{
+public:
+	/**
+	* @brief Constructor of an empty handle that doesn't own a buffer.
+	*/
+	PooledBuffer();
+
+	/**
+	* @brief Destructor
+	*
+	* Returns the buffer to its pool.
+	*/
+	~PooledBuffer();
+
+	PooledBuffer(PooledBuffer&& other) noexcept;
+	PooledBuffer& operator=(PooledBuffer&& other) noexcept;
+	PooledBuffer(const PooledBuffer&) = delete;
+	PooledBuffer& operator=(const PooledBuffer&) = delete;
+
+	/**
+	* @brief Get a pointer to the start of the buffer.
+	*/
+	char* data();
+
+	/**
+	* @brief Get a pointer to the start of the buffer.
+	*/
+	const char* data() const;
+
+	/**
+	* @brief Get the number of bytes in use.
+	*/
+	size_t size() const;
+
+	/**
+	* @brief Get the fixed capacity of the buffer.
+	*/
+	size_t capacity() const;
+
+	/**
+	* @brief Set the number of bytes in use.
+	*
+	* @param size the new size, must not exceed the capacity.
+	* @throws std::length_error if the size exceeds the capacity.
+	*/
+	void resize(size_t size);
+
+	/**
+	* @brief Return the buffer to its pool before the handle is destroyed.
+	*/
+	void release();
+
+private:
+	friend class BufferPool;
+	PooledBuffer(BufferPool* pool, std::unique_ptr<char[]> data, size_t capacity);
+
+	BufferPool* _pool;
+	std::unique_ptr<char[]> _data;
+	size_t _size;
+	size_t _capacity;
+};
+
+
+/**
+* @brief BufferPool class
+*
+* A pool of fixed-size buffers. Buffers are allocated on demand and kept after they are returned,
+* so once the pool has grown to the number of buffers that are in flight at the same time, leasing
+* a buffer does not allocate. The pool is thread safe, the lock is only held to push or pop a pointer.
+*
+* The pool can be capped to a number of buffers. When all of them are leased, acquire() blocks until
+* a buffer is returned, which is the backpressure between the stages that share the pool.
+*/
+class BufferPool
+{
+public:
+	/**
+	* @brief Constructor
+	*
+	* @param bufferSize the capacity of every buffer in the pool.
+	* @param maxFreeBuffers how many returned buffers are kept for reuse, extra buffers are freed.
+	* @param maxBuffers how many buffers can exist at the same time, leased or free.
+	*/
+	BufferPool(size_t bufferSize, size_t maxFreeBuffers, size_t maxBuffers = std::numeric_limits<size_t>::max());
+
+	BufferPool(const BufferPool&) = delete;
+	BufferPool& operator=(const BufferPool&) = delete;
+
+	/**
+	* @brief Lease a buffer from the pool.
+	*
+	* Blocks while the pool is at its cap and all the buffers are leased.
+	*
+	* @return a handle to a buffer of bufferSize() bytes, with a size of 0.
+	*/
+	PooledBuffer acquire();
+
+	/**
+	* @brief Get the capacity of the pool's buffers.
+	*/
+	size_t bufferSize() const;
+
+	/**
+	* @brief Get the number of buffers that are waiting for reuse.
+	*/
+	size_t freeBuffers() const;
+
+	/**
+	* @brief Get the number of buffers the pool has allocated so far.
+	*/
+	size_t allocatedBuffers() const;
+
+	/**
+	* @brief Get the maximum number of buffers of the pool.
+	*/
+	size_t maxBuffers() const;
+
+private:
+	friend class PooledBuffer;
+	void release(std::unique_ptr<char[]> data);
+
+	mutable std::mutex _mutex;
+	std::condition_variable _returned;
+	std::vector<std::unique_ptr<char[]>> _free;
+	size_t _bufferSize;
+	size_t _maxFreeBuffers;
+	size_t _maxBuffers;
+	size_t _allocated;
+};
+
+#endif // BUFFER_POOL_H
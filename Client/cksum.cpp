@@ -466,6 +466,41 @@ unsigned long memcrc(char* b, size_t n) {
 
 }
 
+void CRC::update(const char* data, size_t size) {
+    _state = cksum_update(_state, reinterpret_cast<const unsigned char*>(data), size);
+    _length += size;
+}
+
+// The product of two polynomials modulo the cksum polynomial, the highest bit is x^31.
+static uint32_t multiplyModPoly(uint32_t a, uint32_t b) {
+    uint32_t product = 0;
+    for (int bit = 31; bit >= 0; bit--) {
+        product = (product << 1) ^ ((product & 0x80000000) ? 0x04c11db7 : 0);
+        if ((b >> bit) & 1) {
+            product ^= a;
+        }
+    }
+    return product;
+}
+
+void CRC::append(const CRC& next) {
+    // the state moves on by x^(8 * length) over the next chunk, as if it was fed zeros
+    uint32_t shift = 1;
+    uint32_t power = 0x100;  // x^8
+    for (uint64_t length = next._length; length; length >>= 1) {
+        if (length & 1) {
+            shift = multiplyModPoly(shift, power);
+        }
+        power = multiplyModPoly(power, power);
+    }
+    _state = multiplyModPoly(_state, shift) ^ next._state;
+    _length += next._length;
+}
+
+uint32_t CRC::digest() const {
+    return cksum_finish(_state, _length);
+}
+
 uint32_t readfileCRC(const std::string& fname) {
     if (std::filesystem::exists(fname)) {
         std::filesystem::path fpath = fname;
@@ -487,3 +522,44 @@ uint32_t readfileCRC(const std::string& fname) {
         return 0;
     }
 }
+
+
+uint32_t cksum_update(uint32_t state, const unsigned char* data, size_t size) {
+    uint_fast32_t s = state;
+    for (size_t i = 0; i < size; i++) {
+        s = UNSIGNED((s << 8)) ^ crctab[0][(s >> 24) ^ data[i]];
+    }
+    return static_cast<uint32_t>(s);
+}
+
+uint32_t cksum_finish(uint32_t state, uint64_t length) {
+    uint_fast32_t s = state;
+    while (length) {
+        unsigned int c = length & 0377;
+        length = length >> 8;
+        s = UNSIGNED(s << 8) ^ crctab[0][(s >> 24) ^ c];
+    }
+    return static_cast<uint32_t>(UNSIGNED(~s));
+}
+
+uint32_t cksum_memcrc(const unsigned char* data, size_t size) {
+    return cksum_finish(cksum_update(0, data, size), size);
+}
+
+int cksum_readfile(const char* path, uint32_t* crc) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+        return -1;
+    }
+    std::vector<char> buffer(1024 * 1024);
+    CRC running;
+    while (file) {
+        file.read(buffer.data(), buffer.size());
+        running.update(buffer.data(), static_cast<size_t>(file.gcount()));
+    }
+    if (file.bad()) {
+        return -1;
+    }
+    *crc = running.digest();
+    return 0;
+}
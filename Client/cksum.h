@@ -3,6 +3,44 @@
 
 #include <string>
 #include <cstdint>
+#include <cstddef>
+
+/**
+ * @brief Incremental POSIX cksum
+ *
+ * Feeds the data chunk by chunk, the digest is the same as the CRC of all the chunks at once.
+ */
+class CRC
+{
+public:
+	/**
+	 * @brief Add a chunk of data to the checksum.
+	 *
+	 * @param data the chunk
+	 * @param size the size of the chunk
+	 */
+	void update(const char* data, size_t size);
+
+	/**
+	 * @brief Add the checksum of the data that follows, computed on its own.
+	 *
+	 * The chunks of a file can be checksummed in parallel and appended in order.
+	 *
+	 * @param next the checksum of the next chunk, from an empty CRC
+	 */
+	void append(const CRC& next);
+
+	/**
+	 * @brief Get the checksum of all the data so far.
+	 *
+	 * @return the CRC, with the total length folded in as cksum does.
+	 */
+	uint32_t digest() const;
+
+private:
+	uint32_t _state = 0;
+	uint64_t _length = 0;
+};
 
 /**
  * @brief Calculate the CRC of a file
@@ -12,4 +50,48 @@
  */
 uint32_t readfileCRC(const std::string& fname);
 
+
+/*
+ * The C ABI of the cksum, for the server to load cksum.cpp as a shared library, for example:
+ *   g++ -O2 -std=c++17 -shared -fPIC cksum.cpp -o ../Server/libcksum.so
+ */
+#if defined(_WIN32)
+#define CKSUM_API extern "C" __declspec(dllexport)
+#else
+#define CKSUM_API extern "C" __attribute__((visibility("default")))
+#endif
+
+/**
+ * @brief Add a chunk of data to a running cksum.
+ *
+ * @param state the state of the data so far, 0 to start
+ * @param data the chunk
+ * @param size the size of the chunk
+ * @return the state with the chunk added
+ */
+CKSUM_API uint32_t cksum_update(uint32_t state, const unsigned char* data, size_t size);
+
+/**
+ * @brief Get the cksum of a running state.
+ *
+ * @param state the state of all the data
+ * @param length the total length of the data
+ * @return the CRC, with the length folded in
+ */
+CKSUM_API uint32_t cksum_finish(uint32_t state, uint64_t length);
+
+/**
+ * @brief Calculate the cksum of a buffer.
+ */
+CKSUM_API uint32_t cksum_memcrc(const unsigned char* data, size_t size);
+
+/**
+ * @brief Calculate the cksum of a file, chunk by chunk.
+ *
+ * @param path the path of the file
+ * @param crc set to the CRC of the file
+ * @return 0 on success, -1 if the file can't be read
+ */
+CKSUM_API int cksum_readfile(const char* path, uint32_t* crc);
+
 #endif
\ No newline at end of file
@@ -3,20 +3,64 @@
 #include "exceptions.h"
 #include "serializer.h"
 #include "utils.h"
-#include "cksum.h"
+#include "file-pipeline.h"
+#include "metrics.h"
+#include "tracing.h"
 
 #include <iostream>
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <stdexcept>
 
 
-Client::Client()
+// A quarter of the budget goes to the pack buffer, the rest to the packet buffers.
+static size_t packLimit(size_t maxInflight)
+{
+	if (maxInflight < MIN_MAX_INFLIGHT)
+	{
+		throw std::invalid_argument("The in-flight budget must be at least " + std::to_string(MIN_MAX_INFLIGHT) + " bytes");
+	}
+	return std::clamp(maxInflight / 4, MIN_PACK_BUFFER, PACK_MAX_SIZE);
+}
+
+
+// Every chunk in the pipeline holds a plain and an encrypted buffer, and one more buffer
+// is needed to serialize the packet that is sent.
+static size_t pipelineDepth(size_t maxInflight, size_t packLimit)
+{
+	size_t packets = (maxInflight - packLimit) / PACKET_LENGTH;
+	return std::min((packets - 1) / 2, MAX_FILE_PIPELINE_DEPTH);
+}
+
+
+Client::Client(size_t workerThreads, size_t fileWindow, size_t maxInflight, bool deferredVerify)
 	: _fileHandler(FileHandler())
 	, _connection(Connection())
 	, _rsaWrapper(RSAWrapper())
 	, _aesWrapper(AESWrapper())
 	, _errorCount(0)
-	, _fileToSend("")
-	, _fileCRC(0)
-	, _sendingFile(false)
+	, _request()
+	, _response()
+	, _packLimit(packLimit(maxInflight))
+	, _pipelineDepth(pipelineDepth(maxInflight, _packLimit))
+	, _bufferPool(PACKET_LENGTH, 2 * _pipelineDepth + 1, 2 * _pipelineDepth + 1)
+	, _executor(workerThreads)
+	, _filesToSend()
+	, _fileQueue()
+	, _packQueue()
+	, _transfers()
+	, _retries()
+	, _packBuffer()
+	, _packCount(0)
+	, _fileWindow(std::max<size_t>(fileWindow, 1))
+	, _pendingAcks(0)
+	, _failedFiles(0)
+	, _requestSent(false)
+	, _transferComplete(false)
+	, _deferredVerify(deferredVerify)
+	, _requestTime()
+	, _crcRequestTimes()
 {
 }
 
@@ -29,10 +73,11 @@ bool Client::startClient()
 	Request request;
 	bool writeToFile = false;
 
-	if (!getRegisterInfo(user, _fileToSend))
+	if (!getRegisterInfo(user, _filesToSend))
 	{
 		return false;
 	}
+	queueFiles();
 	try
 	{
 		if (!getLoginInfo(user, clientID, filePrivateKey))
@@ -43,7 +88,7 @@ bool Client::startClient()
 	catch (const FileError&)
 	{
 		// if the saved file doesn't exist, create a registration request.
-		std::vector<char> uuid(CLIENT_ID_SIZE, 0);  // don't care about the value
+		ClientID uuid{};  // don't care about the value
 		request = createNameRequest(user, uuid , static_cast<uint16_t>(RequestCode::REQUEST_REGISTER));
 		writeToFile = true;
 	}
@@ -63,8 +108,7 @@ bool Client::startClient()
 	{
 		return false;
 	}
-	_request.reset();
-	_request = std::make_unique<Request>(request);
+	_request = std::move(request);
 	return true;
 }
 
@@ -74,11 +118,15 @@ bool Client::sendAndReceive()
 	bool connected = true;
 	while (connected)
 	{
-		if (!_sendingFile)  // if not sending a file, send the request
+		// a request, its response, and the requests the response's handler sends
+		ScopedTrace exchange("protocol", "exchange");
+		if (!_requestSent)  // if the handler didn't send the requests itself, send the request
 		{
 			try
 			{
-				sendRequest(*_request);
+				exchange.arg("request", _request.opCode);
+				sendRequest(_request);
+				_requestTime = std::chrono::steady_clock::now();
 			}
 			catch (std::exception& e)
 			{
@@ -86,13 +134,11 @@ bool Client::sendAndReceive()
 				return false;
 			}
 		}
-		_sendingFile = false; // reset the flag, file was sent.
+		_requestSent = false;
 		try
 		{
-			auto response = receiveResponse();
-			
-			_response.reset();
-			_response = std::make_unique<Response>(response);
+			_response = receiveResponse();
+			exchange.arg("response", _response.opCode);
 			if (!handleResponse())
 			{
 				_connection.close();
@@ -106,15 +152,11 @@ bool Client::sendAndReceive()
 		}
 		
 	}
-	if (RequestCode(_request->opCode) == RequestCode::REQUEST_CRC_VALID)
-	{
-		return true;
-	}
-	return false;
+	return _transferComplete && _failedFiles == 0;
 }
 
 
-bool Client::getRegisterInfo(std::string& user, std::string& sendFile)
+bool Client::getRegisterInfo(std::string& user, std::vector<std::string>& sendFiles)
 {
 	try
 	{
@@ -133,7 +175,7 @@ bool Client::getRegisterInfo(std::string& user, std::string& sendFile)
 	std::string addr;
 	std::string port;
 	
-	if (!_fileHandler.parseRegisterFile(addr, port, user, sendFile))
+	if (!_fileHandler.parseRegisterFile(addr, port, user, sendFiles))
 	{
 		return false;
 	}
@@ -150,15 +192,18 @@ bool Client::getRegisterInfo(std::string& user, std::string& sendFile)
 		std::cerr << "Username too long" << std::endl;
 		return false;
 	}
-	if (sendFile.empty())
+	if (sendFiles.empty())
 	{
 		std::cerr << "Invalid file name" << std::endl;
 		return false;
 	}
-	if (sendFile.size() >= FILE_NAME_SIZE)
+	for (const auto& sendFile : sendFiles)
 	{
-		std::cerr << "File name too long" << std::endl;
-		return false;
+		if (sendFile.size() >= FILE_NAME_SIZE)
+		{
+			std::cerr << "File name too long: " << sendFile << std::endl;
+			return false;
+		}
 	}
 	
 	// Set the server IP and port
@@ -188,22 +233,25 @@ bool Client::getLoginInfo(std::string& user, std::string& uuid, std::string& pri
 
 void Client::sendRequest(const Request& request)
 {
-	std::vector<char> buffer;
-	
-	buffer = Serializer::serializeRequest(request);
-	_connection.send(buffer);
-	
+	auto buffer = _bufferPool.acquire();
+	{
+		ScopedTrace span("protocol", "serialize");
+		StageTimer timer(Stage::SERIALIZE);
+		Serializer::serializeRequest(request, buffer);
+		timer.setBytes(buffer.size());
+	}
+	Metrics::instance().recordRequest(request.opCode, buffer.size());
+	_connection.send(std::move(buffer));
 }
 
 
 Response Client::receiveResponse() 
 {
-	auto response = Serializer::deserializeResponse(_connection.receive());
-	return response;
+	return Serializer::deserializeResponse(_connection.receive());
 }
 
 
-bool Client::saveUserInfo(const std::string& name, const std::vector<char>& uuid, const std::string& privateKey)
+bool Client::saveUserInfo(const std::string& name, const ClientID& uuid, const std::string& privateKey)
 {
 	try
 	{
@@ -226,21 +274,21 @@ bool Client::saveUserInfo(const std::string& name, const std::vector<char>& uuid
 }
 
 
-Request Client::createNameRequest(const std::string& user, const std::vector<char>& clientID, uint16_t opCode) const
+Request Client::createNameRequest(const std::string& user, const ClientID& clientID, uint16_t opCode) const
 {
 	NameRequest nameRequest{ user };
 	auto version = CLIENT_VERSION;
 	auto payloadSize = getPayloadSize(nameRequest);
-	return Request{ clientID, version, opCode, payloadSize, nameRequest };
+	return Request{ clientID, version, opCode, payloadSize, std::move(nameRequest) };
 }
 
 
-Request Client::createPublicKeyRequest(const std::string& user, const std::vector<char>& publicKey, const std::vector<char>& clientID, uint16_t opCode) const
+Request Client::createPublicKeyRequest(const std::string& user, const std::vector<char>& publicKey, const ClientID& clientID, uint16_t opCode) const
 {
 	SendPublickKeyRequest sendPublicKeyRequest{ user, publicKey };
 	auto version = CLIENT_VERSION;
 	auto payloadSize = getPayloadSize(sendPublicKeyRequest);
-	return Request{ clientID, version, opCode, payloadSize, sendPublicKeyRequest };
+	return Request{ clientID, version, opCode, payloadSize, std::move(sendPublicKeyRequest) };
 }
 
 
@@ -276,9 +324,18 @@ uint32_t Client::getPayloadSize(const Payload& payload) const
 			+ FILE_NAME_SIZE
 			+ CRC_SIZE;
 
+		else if constexpr (std::is_same_v<T, PackResponse>)
+			return CLIENT_ID_SIZE
+			+ FILE_NAME_SIZE
+			+ FILE_COUNT_SIZE
+			+ static_cast<uint32_t>(p.crcs.size() * CRC_SIZE);
+
 		else if constexpr (std::is_same_v<T, CRCRequest>)
 			return FILE_NAME_SIZE;
 
+		else if constexpr (std::is_same_v<T, FileCRCRequest>)
+			return FILE_NAME_SIZE + CRC_SIZE;
+
 		// error case
 		else
 			return 0;
@@ -288,20 +345,25 @@ uint32_t Client::getPayloadSize(const Payload& payload) const
 
 bool Client::handleResponse()
 {
-	auto code = static_cast<ResponseCode>(_response->opCode);
+	auto code = static_cast<ResponseCode>(_response.opCode);
 	std::cout << "Response code: " << static_cast<int>(code) << std::endl;
+	Metrics::instance().recordResponse(_response.opCode);
+	if (code == ResponseCode::RESPONSE_REGISTRATION || code == ResponseCode::RESPONSE_REGISTRATION_FAILED
+		|| code == ResponseCode::RESPONSE_AES_KEY || code == ResponseCode::RESPONSE_LOGIN || code == ResponseCode::RESPONSE_LOGIN_FAILED)
+	{
+		// the answers to the requests that sendAndReceive sent itself
+		Metrics::instance().recordRoundTrip(_response.opCode, std::chrono::steady_clock::now() - _requestTime);
+	}
 
 	if (code == ResponseCode::RESPONSE_REGISTRATION)
 	{
 		// save the username , clientID, and the private key in a file.
 		_errorCount = 0;
-		auto clientID = std::get<ClientIDResponse>(_response->payload).clientID;
-		auto name = std::get<NameRequest>(_request->payload).name;
+		auto clientID = std::get<ClientIDResponse>(_response.payload).clientID;
+		auto name = std::move(std::get<NameRequest>(_request.payload).name);
 		saveUserInfo(name, clientID, _rsaWrapper.getBase64PrivateKey());
 
-		auto request{ createPublicKeyRequest(name, _rsaWrapper.getPublicKey(), clientID, static_cast<uint16_t>(RequestCode::REQUEST_PUBLIC_KEY)) };
-		_request.reset();
-		_request = std::make_unique<Request>(request);
+		_request = createPublicKeyRequest(name, _rsaWrapper.getPublicKey(), clientID, static_cast<uint16_t>(RequestCode::REQUEST_PUBLIC_KEY));
 		return true;
 	}
 
@@ -320,79 +382,79 @@ bool Client::handleResponse()
 	else if (code == ResponseCode::RESPONSE_LOGIN || code == ResponseCode::RESPONSE_AES_KEY)
 	{
 		_errorCount = 0;
-		auto clientID = std::get<SymmetricKeyResponse>(_response->payload).clientID;
-		auto encryptedKey = std::get<SymmetricKeyResponse>(_response->payload).symmetricKey;
+		const auto& encryptedKey = std::get<SymmetricKeyResponse>(_response.payload).symmetricKey;
 		auto aesKey = _rsaWrapper.decrypt(encryptedKey);
 		_aesWrapper.setKey(aesKey);
-		handleFileRequest();
-		return true;
+		return fillWindow();
 	}
 
 	else if (code == ResponseCode::RESPONSE_LOGIN_FAILED)
 	{
 		_fileHandler.deleteFile(USER_FILE_NAME);
 		std::string user;
-		std::string sendFile;
-		if (!getRegisterInfo(user, sendFile))
+		std::vector<std::string> sendFiles;
+		if (!getRegisterInfo(user, sendFiles))
 		{
 			return false;
 		}
-		auto request{ createNameRequest(user, std::vector<char>(CLIENT_ID_SIZE, '\0'), static_cast<uint16_t>(RequestCode::REQUEST_REGISTER))};
-		_request.reset();
-		_request = std::make_unique<Request>(request);
+		_request = createNameRequest(user, ClientID{}, static_cast<uint16_t>(RequestCode::REQUEST_REGISTER));
 		return true;
 	}
 
 	else if (code == ResponseCode::RESPONSE_FILE_VALID)
 	{
-		auto crc = std::get<FileResponse>(_response->payload).crc;
-		if (crc == _fileCRC)
+		if (!handleFileResponse())
 		{
-			_errorCount = 0;
-			CRCRequest crcRequest{ _fileToSend };
-			Request request{ _request->clientID, CLIENT_VERSION, static_cast<uint16_t>(RequestCode::REQUEST_CRC_VALID), getPayloadSize(crcRequest), crcRequest };
-			
-			_request.reset();
-			_request = std::make_unique<Request>(request);
-			return true;
+			return false;
 		}
-		else
+		return fillWindow();
+	}
+	else if (code == ResponseCode::RESPONSE_FILE_STORED)
+	{
+		if (!handleStoredResponse())
 		{
-			std::cerr << "CRC mismatch" << std::endl;
-			_errorCount++;
-			if (_errorCount > MAX_ERRORS)
-			{
-				std::cerr << "Fatal Error: CRC mismatch" << std::endl;
-				CRCRequest crcRequest{ _fileToSend };
-				Request request{ _request->clientID, CLIENT_VERSION, static_cast<uint16_t>(RequestCode::REQUEST_CRC_FATAL), getPayloadSize(crcRequest), crcRequest };
-				_request.reset();
-				_request = std::make_unique<Request>(request);
-				sendRequest(*_request);
-				return false;
-			}
-			CRCRequest crcRequest{ _fileToSend };
-			Request request{ _request->clientID, CLIENT_VERSION, static_cast<uint16_t>(RequestCode::REQUEST_CRC_INVALID), getPayloadSize(crcRequest), crcRequest };
-			_request.reset();
-			_request = std::make_unique<Request>(request);
-			sendRequest(*_request);
-			handleFileRequest();
-			return true;
+			return false;
 		}
-		
+		return fillWindow();
+	}
+	else if (code == ResponseCode::RESPONSE_PACK_VALID)
+	{
+		if (!handlePackResponse())
+		{
+			return false;
+		}
+		return fillWindow();
 	}
 	else if (code == ResponseCode::RESPONSE_ACK)
 	{
-		return false;
+		if (!_crcRequestTimes.empty())
+		{
+			// the server answers the CRC requests in order
+			Metrics::instance().recordRoundTrip(_response.opCode, std::chrono::steady_clock::now() - _crcRequestTimes.front());
+			_crcRequestTimes.pop_front();
+		}
+		if (_pendingAcks > 0)
+		{
+			_pendingAcks--;
+		}
+		return fillWindow();
 	}
 	else if (code == ResponseCode::RESPONSE_ERROR)
 	{
 		std::cerr << "Server responded with an error" << std::endl;
+		if (!_transfers.empty() || _pendingAcks > 0)
+		{
+			// the server dropped a transfer, the responses that are still expected won't come.
+			std::cerr << "Fatal Error: Server failed the transfer" << std::endl;
+			return false;
+		}
 		_errorCount++;
 		if (_errorCount == MAX_ERRORS)
 		{
 			std::cerr << "Fatal Error: Server responded with an error" << std::endl;
 			return false;
 		}
+		return true;
 	}
 	else
 	{
@@ -402,11 +464,99 @@ bool Client::handleResponse()
 }
 
 
-void Client::handleFileRequest()
+void Client::queueFiles()
+{
+	std::vector<std::string> smallFiles;
+	for (const auto& path : _filesToSend)
+	{
+		std::error_code error;
+		auto size = std::filesystem::file_size(path, error);
+		if (!error && size <= PACK_MAX_FILE_SIZE)
+		{
+			smallFiles.push_back(path);
+		}
+		else
+		{
+			_fileQueue.push_back(path);
+		}
+	}
+
+	// packing only saves round trips when there are a few small files.
+	if (smallFiles.size() >= PACK_MIN_FILES)
+	{
+		_packQueue.assign(smallFiles.begin(), smallFiles.end());
+	}
+	else
+	{
+		_fileQueue.insert(_fileQueue.end(), smallFiles.begin(), smallFiles.end());
+	}
+}
+
+
+bool Client::fillWindow()
+{
+	while (_transfers.size() < _fileWindow && startNextTransfer())
+	{
+	}
+
+	if (_transfers.empty() && _pendingAcks == 0)
+	{
+		// nothing in flight, so nothing is waiting for a file in flight either.
+		_transferComplete = _packQueue.empty() && _fileQueue.empty();
+		return false;
+	}
+	_requestSent = true;
+	return true;
+}
+
+
+bool Client::startNextTransfer()
 {
-	if (!_fileHandler.open(_fileToSend, FileMode::READ_BINARY))
+	while (!_packQueue.empty() || !_fileQueue.empty())
 	{
-		return;
+		bool packing = !_packQueue.empty();
+		std::string path;
+		try
+		{
+			if (packing)
+			{
+				if (!sendPack())
+				{
+					continue;
+				}
+			}
+			else
+			{
+				// the server keeps one file per name, wait for the one in flight to be verified.
+				if (_transfers.count(_fileHandler.getFileNameFromPath(_fileQueue.front())) > 0)
+				{
+					return false;
+				}
+				path = _fileQueue.front();
+				_fileQueue.pop_front();
+				handleFileRequest(path);
+			}
+			return true;
+		}
+		catch (const FileError& e)
+		{
+			std::cerr << e.what() << std::endl;
+			_failedFiles++;
+			_retries.erase(path);
+		}
+	}
+	return false;
+}
+
+
+void Client::handleFileRequest(const std::string& path)
+{
+	{
+		ScopedTrace span("file", "open");
+		if (!_fileHandler.open(path, FileMode::READ_BINARY))
+		{
+			throw FileError("Cannot open " + path);
+		}
 	}
 
 	size_t fileSize = _fileHandler.getFileSize();
@@ -420,23 +570,306 @@ void Client::handleFileRequest()
 		_fileHandler.close();
 		throw FileError("File is too large");
 	}
-	std::vector<char> fileContent = _fileHandler.readFile(fileSize);
+	auto fileName = _fileHandler.getFileNameFromPath(path);
+
+	uint32_t crc = 0;
+	auto code = _deferredVerify ? RequestCode::REQUEST_SEND_FILE_DEFERRED : RequestCode::REQUEST_SEND_FILE;
+	try
+	{
+		crc = sendContent(code, fileName, fileSize, [this](char* buffer, size_t size) {
+			ScopedTrace span("file", "read chunk");
+			StageTimer timer(Stage::READ);
+			size_t bytesRead = _fileHandler.readChunk(buffer, size);
+			timer.setBytes(bytesRead);
+			span.arg("bytes", bytesRead);
+			return bytesRead;
+		});
+	}
+	catch (...)
+	{
+		_fileHandler.close();
+		throw;
+	}
 	_fileHandler.close();
+	if (_deferredVerify)
+	{
+		FileCRCRequest crcRequest{ fileName, crc };
+		auto payloadSize = getPayloadSize(crcRequest);
+		sendRequest(Request{ _request.clientID, CLIENT_VERSION, static_cast<uint16_t>(RequestCode::REQUEST_FILE_CRC), payloadSize, std::move(crcRequest) });
+	}
+	_transfers[fileName] = Transfer{ path, crc, {}, std::chrono::steady_clock::now() };
+}
+
+
+bool Client::sendPack()
+{
+	// take the next files, up to the limits of a pack
+	std::vector<PackEntry> entries;
+	size_t dataSize = 0;
+	while (!_packQueue.empty() && entries.size() < PACK_MAX_FILES)
+	{
+		std::error_code error;
+		auto size = std::filesystem::file_size(_packQueue.front(), error);
+		if (error)
+		{
+			std::cerr << "Cannot read " << _packQueue.front() << std::endl;
+			_failedFiles++;
+			_retries.erase(_packQueue.front());
+			_packQueue.pop_front();
+			continue;
+		}
+		size_t packSize = FILE_COUNT_SIZE + (entries.size() + 1) * PACK_ENTRY_SIZE + dataSize + size;
+		if (!entries.empty() && packSize > _packLimit)
+		{
+			break;
+		}
+		entries.push_back(PackEntry{ _packQueue.front(), static_cast<uint32_t>(size), 0 });
+		_packQueue.pop_front();
+		dataSize += size;
+	}
+	if (entries.empty())
+	{
+		return false;
+	}
+
+	// the index comes first, then the data of the files back to back.
+	size_t indexSize = FILE_COUNT_SIZE + entries.size() * PACK_ENTRY_SIZE;
+	_packBuffer.assign(indexSize + dataSize, '\0');
+
+	// a file that can't be read is left out, the rest of the pack goes on without it.
+	size_t dataOffset = indexSize;
+	size_t kept = 0;
+	for (size_t i = 0; i < entries.size(); i++)
+	{
+		auto& entry = entries[i];
+		bool opened = false;
+		{
+			ScopedTrace span("file", "open");
+			opened = _fileHandler.open(entry.path, FileMode::READ_BINARY);
+		}
+		size_t bytesRead = 0;
+		if (opened)
+		{
+			ScopedTrace span("file", "read chunk");
+			span.arg("bytes", entry.size);
+			StageTimer timer(Stage::READ, entry.size);
+			bytesRead = _fileHandler.readChunk(_packBuffer.data() + dataOffset, entry.size);
+			_fileHandler.close();
+		}
+		if (!opened || bytesRead != entry.size)
+		{
+			std::cerr << (opened ? "File changed while it was read: " : "Cannot open ") << entry.path << std::endl;
+			_failedFiles++;
+			_retries.erase(entry.path);
+			continue;
+		}
+
+		{
+			ScopedTrace span("pipeline", "crc update");
+			span.arg("bytes", entry.size);
+			StageTimer timer(Stage::CRC, entry.size);
+			CRC crc;
+			crc.update(_packBuffer.data() + dataOffset, entry.size);
+			entry.crc = crc.digest();
+		}
+		dataOffset += entry.size;
+		if (kept != i)
+		{
+			entries[kept] = std::move(entry);
+		}
+		kept++;
+	}
+	entries.resize(kept);
+	if (entries.empty())
+	{
+		return false;
+	}
+
+	// the files that were left out leave their room in the index and at the end of the data.
+	size_t keptIndexSize = FILE_COUNT_SIZE + entries.size() * PACK_ENTRY_SIZE;
+	size_t keptDataSize = dataOffset - indexSize;
+	if (keptIndexSize != indexSize)
+	{
+		std::memmove(_packBuffer.data() + keptIndexSize, _packBuffer.data() + indexSize, keptDataSize);
+	}
+	_packBuffer.resize(keptIndexSize + keptDataSize);
+
+	auto writeUint32 = [](char* out, uint32_t value) {
+		EndianConverter::toLittleEndian(value);
+		std::memcpy(out, &value, sizeof(value));
+	};
+
+	writeUint32(_packBuffer.data(), static_cast<uint32_t>(entries.size()));
+	size_t indexOffset = FILE_COUNT_SIZE;
+	dataOffset = keptIndexSize;
+	for (const auto& entry : entries)
+	{
+		auto name = _fileHandler.getFileNameFromPath(entry.path);
+		std::memcpy(_packBuffer.data() + indexOffset, name.data(), name.size());
+		indexOffset += FILE_NAME_SIZE;
+		writeUint32(_packBuffer.data() + indexOffset, static_cast<uint32_t>(dataOffset));
+		indexOffset += PACK_OFFSET_SIZE;
+		writeUint32(_packBuffer.data() + indexOffset, entry.size);
+		indexOffset += CONTENT_SIZE;
+		writeUint32(_packBuffer.data() + indexOffset, entry.crc);
+		indexOffset += CRC_SIZE;
+
+		dataOffset += entry.size;
+	}
+
+	_packCount++;
+	auto packName = "pack" + std::to_string(_packCount) + ".pack";
+	std::cout << "Sending " << entries.size() << " files in " << packName << std::endl;
+
+	size_t readOffset = 0;
+	sendContent(RequestCode::REQUEST_SEND_PACK, packName, _packBuffer.size(), [this, &readOffset](char* buffer, size_t size) {
+		size_t bytes = std::min(size, _packBuffer.size() - readOffset);
+		std::memcpy(buffer, _packBuffer.data() + readOffset, bytes);
+		readOffset += bytes;
+		return bytes;
+	});
+	_transfers[packName] = Transfer{ "", 0, std::move(entries), std::chrono::steady_clock::now() };
+	return true;
+}
+
+
+bool Client::handleFileResponse()
+{
+	const auto& fileResponse = std::get<FileResponse>(_response.payload);
+	auto transfer = _transfers.find(fileResponse.fileName);
+	if (transfer == _transfers.end() || !transfer->second.packEntries.empty())
+	{
+		std::cerr << "Response for an unknown file: " << fileResponse.fileName << std::endl;
+		return false;
+	}
+	auto path = std::move(transfer->second.path);
+	auto crc = transfer->second.crc;
+	Metrics::instance().recordRoundTrip(_response.opCode, std::chrono::steady_clock::now() - transfer->second.sent);
+	_transfers.erase(transfer);
+
+	if (fileResponse.crc == crc)
+	{
+		_retries.erase(path);
+		sendCRCRequest(RequestCode::REQUEST_CRC_VALID, fileResponse.fileName);
+		_pendingAcks++;
+		return true;
+	}
+
+	std::cerr << "CRC mismatch: " << path << std::endl;
+	Metrics::instance().addCRCMismatches(1);
+	if (retryFile(path))
+	{
+		// the server doesn't answer, the file is sent again with the next transfers.
+		sendCRCRequest(RequestCode::REQUEST_CRC_INVALID, fileResponse.fileName);
+		_fileQueue.push_front(path);
+	}
+	else
+	{
+		std::cerr << "Fatal Error: CRC mismatch" << std::endl;
+		sendCRCRequest(RequestCode::REQUEST_CRC_FATAL, fileResponse.fileName);
+		_pendingAcks++;
+	}
+	return true;
+}
+
+
+bool Client::handleStoredResponse()
+{
+	const auto& fileResponse = std::get<FileResponse>(_response.payload);
+	auto transfer = _transfers.find(fileResponse.fileName);
+	if (transfer == _transfers.end() || !transfer->second.packEntries.empty())
+	{
+		std::cerr << "Response for an unknown file: " << fileResponse.fileName << std::endl;
+		return false;
+	}
+	if (fileResponse.crc != transfer->second.crc)
+	{
+		// the server echoes the CRC it got, it's checked against the content later
+		std::cerr << "Stored with a wrong CRC: " << transfer->second.path << std::endl;
+		return false;
+	}
+	Metrics::instance().recordRoundTrip(_response.opCode, std::chrono::steady_clock::now() - transfer->second.sent);
+	_transfers.erase(transfer);
+	return true;
+}
+
+
+bool Client::handlePackResponse()
+{
+	const auto& packResponse = std::get<PackResponse>(_response.payload);
+	auto transfer = _transfers.find(packResponse.fileName);
+	if (transfer == _transfers.end() || transfer->second.packEntries.empty())
+	{
+		std::cerr << "Response for an unknown pack: " << packResponse.fileName << std::endl;
+		return false;
+	}
+	auto entries = std::move(transfer->second.packEntries);
+	Metrics::instance().recordRoundTrip(_response.opCode, std::chrono::steady_clock::now() - transfer->second.sent);
+	_transfers.erase(transfer);
+
+	std::vector<std::string> mismatched;
+	size_t mismatches = 0;
+	for (size_t i = 0; i < entries.size(); i++)
+	{
+		if (i < packResponse.crcs.size() && packResponse.crcs[i] == entries[i].crc)
+		{
+			_retries.erase(entries[i].path);
+			continue;
+		}
+		mismatches++;
+		if (retryFile(entries[i].path))
+		{
+			mismatched.push_back(entries[i].path);
+		}
+	}
+	Metrics::instance().addCRCMismatches(mismatches);
+
+	if (!mismatched.empty())
+	{
+		// send them again in the next pack
+		std::cerr << "CRC mismatch in " << mismatched.size() << " packed files" << std::endl;
+		_packQueue.insert(_packQueue.begin(), mismatched.begin(), mismatched.end());
+	}
+	return true;
+}
 
-	_fileCRC = readfileCRC(_fileToSend);
-	std::string fileName = _fileHandler.getFileNameFromPath(_fileToSend);
 
-	std::vector<char> encryptedFile = _aesWrapper.encrypt(fileContent);
-	std::vector<char>().swap(fileContent); // Release the memory
+bool Client::retryFile(const std::string& path)
+{
+	if (++_retries[path] > MAX_ERRORS)
+	{
+		_retries.erase(path);
+		_failedFiles++;
+		return false;
+	}
+	Metrics::instance().addRetry();
+	return true;
+}
+
 
-	size_t headerSize = CLIENT_ID_SIZE + sizeof(Request::version) + sizeof(Request::opCode) + sizeof(Request::payloadSize);
+void Client::sendCRCRequest(RequestCode code, const std::string& fileName)
+{
+	CRCRequest crcRequest{ fileName };
+	auto payloadSize = getPayloadSize(crcRequest);
+	if (code != RequestCode::REQUEST_CRC_INVALID)
+	{
+		_crcRequestTimes.push_back(std::chrono::steady_clock::now());
+	}
+	sendRequest(Request{ _request.clientID, CLIENT_VERSION, static_cast<uint16_t>(code), payloadSize, std::move(crcRequest) });
+}
+
+
+uint32_t Client::sendContent(RequestCode code, const std::string& fileName, size_t contentSize, const std::function<size_t(char*, size_t)>& readChunk)
+{	size_t headerSize = CLIENT_ID_SIZE + sizeof(Request::version) + sizeof(Request::opCode) + sizeof(Request::payloadSize);
 	size_t payloadHeaderSize = CONTENT_SIZE + ORIGINAL_FILE_SIZE + PACKET_NUMBER_SIZE + TOTAL_PACKETS_SIZE + FILE_NAME_SIZE;
 
-	size_t firstPayloadSize = PACKET_LENGTH - payloadHeaderSize - headerSize;
-	size_t payloadSize = PACKET_LENGTH - payloadHeaderSize;
+	// The content is encrypted packet by packet, so the content of every packet but the last is whole AES blocks.
+	size_t firstPayloadSize = (PACKET_LENGTH - payloadHeaderSize - headerSize) / AES_BLOCK_SIZE * AES_BLOCK_SIZE;
+	size_t payloadSize = (PACKET_LENGTH - payloadHeaderSize) / AES_BLOCK_SIZE * AES_BLOCK_SIZE;
 
-	size_t remainingSize = (encryptedFile.size() > firstPayloadSize)  // Deduce the first packet from the file size
-		? encryptedFile.size() - firstPayloadSize
+	size_t encryptedSize = AESWrapper::encryptedSize(contentSize);
+	size_t remainingSize = (encryptedSize > firstPayloadSize)  // Deduce the first packet from the content size
+		? encryptedSize - firstPayloadSize
 		: 0;
 
 	size_t totalPackets = 1; // Start with the first packet
@@ -448,66 +881,85 @@ void Client::handleFileRequest()
 	{
 		throw FileError("File too large");
 	}
-	else
+	Metrics::instance().addPackets(totalPackets);
+
+	// The CRC and the encryption run on the thread pool while the next chunks are read
+	// and the previous packets are sent.
+	FilePipeline pipeline(_executor, _aesWrapper.getKey(), _pipelineDepth);
+	size_t plainRemaining = contentSize;
+	size_t encryptedRemaining = encryptedSize;
+	size_t nextRead = 1;
+
+	for (size_t packetNumber = 1; packetNumber <= totalPackets; packetNumber++)
 	{
-		std::vector<char> contentChunk(encryptedFile.begin(), encryptedFile.begin() + firstPayloadSize);
+		while (nextRead <= totalPackets && nextRead < packetNumber + pipeline.depth())
+		{
+			bool lastPacket = (nextRead == totalPackets);
+			size_t chunkSize = std::min(nextRead == 1 ? firstPayloadSize : payloadSize, encryptedRemaining);
+			size_t plainSize = lastPacket ? plainRemaining : chunkSize;
+
+			// read the next chunk
+			auto plainChunk = _bufferPool.acquire();
+			plainChunk.resize(readChunk(plainChunk.data(), plainSize));
+			if (plainChunk.size() != plainSize)
+			{
+				// once the first packet is out the server expects the rest, the session can't go on.
+				if (packetNumber > 1)
+				{
+					throw ConnectionError("File changed while it was sent: " + fileName);
+				}
+				throw FileError("File changed while it was read: " + fileName);
+			}
+			plainRemaining -= plainSize;
+			encryptedRemaining -= lastPacket ? encryptedRemaining : chunkSize;
 
-		// send the first packet.
-		SendFileRequest sendFileRequest
+			pipeline.submit(nextRead, std::move(plainChunk), _bufferPool.acquire(), lastPacket);
+			nextRead++;
+		}
+
+		auto encryptedChunk = pipeline.next();
+		SendFileRequest packet
 		{
-			static_cast<uint32_t>(contentChunk.size()),
-			static_cast<uint32_t>(fileSize),
-			1,
+			static_cast<uint32_t>(encryptedChunk.size()),
+			static_cast<uint32_t>(contentSize),
+			static_cast<uint16_t>(packetNumber),
 			static_cast<uint16_t>(totalPackets),
 			fileName,
-			contentChunk
+			ByteSpan{ encryptedChunk.data(), encryptedChunk.size() }
 		};
-		Request request
-		{
-			_request->clientID,
-			CLIENT_VERSION,
-			static_cast<uint16_t>(RequestCode::REQUEST_SEND_FILE),
-			getPayloadSize(sendFileRequest),
-			sendFileRequest
-		};
-		_request.reset();
-		_request = std::make_unique<Request>(request);
-		sendRequest(*_request);
-		_sendingFile = true;
-	}
-	
-	if (totalPackets > 1)
-	{
-		size_t offset = firstPayloadSize;
-		bool keepSending = true;
-		for (uint16_t i = 2; keepSending; i++)
-		{
-			if (offset + payloadSize >= encryptedFile.size())
-			{
-				payloadSize = encryptedFile.size() - offset;
-				keepSending = false;
-			}
 
-			std::vector<char> packetContent(encryptedFile.begin() + offset, encryptedFile.begin() + offset + payloadSize);
-			
-			offset += payloadSize;
-			SendFileRequest packet
+		if (packetNumber == 1)
+		{
+			// the first packet carries the request header.
+			auto requestPayloadSize = getPayloadSize(packet);
+			Request request
 			{
-				static_cast<uint32_t>(packetContent.size()),
-				static_cast<uint32_t>(fileSize),
-				i,
-				static_cast<uint16_t>(totalPackets),
-				fileName,
-				packetContent
+				_request.clientID,
+				CLIENT_VERSION,
+				static_cast<uint16_t>(code),
+				requestPayloadSize,
+				packet
 			};
+			sendRequest(request);
+		}
+		else
+		{
 			sendFilePayload(packet);
 		}
 	}
+	return pipeline.finish();
 }
 
 
 void Client::sendFilePayload(const SendFileRequest& sendFileRequest)
 {
-	auto buffer = Serializer::serializePayload(sendFileRequest, getPayloadSize(sendFileRequest));
-	_connection.send(buffer);
-}
+	auto buffer = _bufferPool.acquire();
+	{
+		ScopedTrace span("protocol", "serialize");
+		span.arg("packet", sendFileRequest.packetNumber);
+		StageTimer timer(Stage::SERIALIZE);
+		Serializer::serializePayload(sendFileRequest, getPayloadSize(sendFileRequest), buffer);
+		timer.setBytes(buffer.size());
+	}
+	_connection.send(std::move(buffer));
+}
\ No newline at end of file
@@ -7,10 +7,16 @@
 #include "file-handler.h"
 #include "RSAWrapper.h"
 #include "AESWrapper.h"
+#include "buffer-pool.h"
+#include "thread-pool.h"
 
 #include <string>
+#include <chrono>
 #include <cstdint>
+#include <deque>
+#include <functional>
 #include <memory>
+#include <unordered_map>
 #include <vector>
 
 
@@ -18,6 +24,11 @@ const std::string REQUEST_FILE_NAME = "transfer.info";
 const std::string USER_FILE_NAME = "me.info";
 constexpr int MAX_ERRORS = 3;
 constexpr size_t MAX_FILE_SIZE = UINT32_MAX;
+constexpr size_t MAX_FILE_PIPELINE_DEPTH = 16;  // chunks of a file in flight between reading and sending
+constexpr size_t DEFAULT_FILE_WINDOW = 4;  // files sent before their verification comes back
+constexpr size_t DEFAULT_MAX_INFLIGHT = 64 * 1024 * 1024;  // bytes of file data held by the client
+constexpr size_t MIN_PACK_BUFFER = FILE_COUNT_SIZE + PACK_MIN_FILES * (PACK_ENTRY_SIZE + PACK_MAX_FILE_SIZE);
+constexpr size_t MIN_MAX_INFLIGHT = MIN_PACK_BUFFER + 3 * PACKET_LENGTH;  // a pack and a chunk on its way
 
 
 /**********************************************************************************************//**
@@ -33,13 +44,24 @@ class Client
 public:
 
 	/**********************************************************************************************//**
-	 * @fn	Client::Client()
+	 * @fn	Client::Client(size_t workerThreads, size_t fileWindow, size_t maxInflight, bool deferredVerify)
 	 *
-	 * @brief	Default constructor.
+	 * @brief	Constructor.
 	 *
 	 * Initializes a new instance of the Client class.
+	 *
+	 * The in-flight budget covers the pack being built, the chunks read ahead, the encrypted
+	 * chunks and the packets waiting to be sent. A stage that runs out of budget blocks until the
+	 * next stage gives a buffer back.
+	 *
+	 * @param	workerThreads	The number of threads for the CRC and AES stages, 0 for one per core.
+	 * @param	fileWindow	 	The number of files and packs that can wait for their verification.
+	 * @param	maxInflight  	The number of bytes of file data the client holds at once, at least MIN_MAX_INFLIGHT.
+	 * @param	deferredVerify	Send the files to be stored as they are received and verified by the server later.
+	 *
+	 * @throws	std::invalid_argument if the budget is smaller than MIN_MAX_INFLIGHT.
 	 **************************************************************************************************/
-	Client();
+	explicit Client(size_t workerThreads = 0, size_t fileWindow = DEFAULT_FILE_WINDOW, size_t maxInflight = DEFAULT_MAX_INFLIGHT, bool deferredVerify = false);
 
 	/** 
 	* @brief Starts the client.
@@ -65,10 +87,10 @@ public:
 	* This method sets the server information, gets the username and the file to transfer from a file.
 	* 
 	* @param user The user's name.
-	* @param sendFile The file to transfer.
+	* @param sendFiles The files to transfer, one per line after the username.
 	* @return true if the server information was set successfully; false otherwise.
 	*/
-	bool getRegisterInfo(std::string& user, std::string& sendFile);
+	bool getRegisterInfo(std::string& user, std::vector<std::string>& sendFiles);
 
 	/**
 	* @brief Gets the user information from a file.
@@ -110,7 +132,7 @@ public:
 	* @param privateKey The user's private key in base64 format.
 	* @return true if the user information was saved successfully; false otherwise.
 	*/
-	bool saveUserInfo(const std::string& name, const std::vector<char>& uuid, const std::string& privateKey);
+	bool saveUserInfo(const std::string& name, const ClientID& uuid, const std::string& privateKey);
 
 	/**
 	* @brief Creates a name request.
@@ -122,7 +144,7 @@ public:
 	* @param opCode The request code.
 	* @return The name request.
 	*/
-	Request createNameRequest(const std::string& user, const std::vector<char>& clientID, uint16_t opCode) const;
+	Request createNameRequest(const std::string& user, const ClientID& clientID, uint16_t opCode) const;
 
 	/**
 	* @brief Creates a public key request.
@@ -135,7 +157,7 @@ public:
 	* @param opCode The request code.
 	* @return The public key request.
 	*/
-	Request createPublicKeyRequest(const std::string& user, const std::vector<char>& publicKey, const std::vector<char>& clientID, uint16_t opCode) const;
+	Request createPublicKeyRequest(const std::string& user, const std::vector<char>& publicKey, const ClientID& clientID, uint16_t opCode) const;
 
 	/**
 	 * @brief Gets the size of the payload.
@@ -157,23 +179,119 @@ public:
 	*/
 	bool handleResponse();
 
+	/**
+	 * @brief Splits the files to transfer between the pack queue and the file queue.
+	 *
+	 * Files up to PACK_MAX_FILE_SIZE are packed together when there are at least PACK_MIN_FILES
+	 * of them, the other files are sent one by one.
+	 */
+	void queueFiles();
+
+	/**
+	 * @brief Starts transfers until the window of unverified files is full.
+	 *
+	 * The server verifies the files in the order they were sent, so the next files are sent
+	 * while the verification of the previous ones is on its way back.
+	 *
+	 * @return true if there are responses to wait for, false if the session is over.
+	 */
+	bool fillWindow();
+
+	/**
+	 * @brief Starts the transfer of the next pack or file.
+	 *
+	 * Packs are sent before the large files. A file that can't be read is skipped and counted as failed.
+	 *
+	 * @return true if a transfer was started, false if there is nothing left to send or the next
+	 * file has to wait for a file with the same name to be verified.
+	 */
+	bool startNextTransfer();
+
 	/**
 	 * @brief Handles the file transfer request to the server.
 	 *
-	 * This method reads a file from disk, encrypts it using AES, and sends it to the server
-	 * in multiple packets. It ensures that the file is properly split into chunks that fit
-	 * within the packet size limits.
+	 * This method streams a file from disk to the server in multiple packets. Every packet is
+	 * read, added to the CRC, encrypted using AES and serialized in buffers leased from the
+	 * packet pool, so the file is never held in memory at once. The CRC and the encryption
+	 * run on the shared thread pool while the next chunks are read.
+	 *
+	 * In the deferred mode the file is sent as REQUEST_SEND_FILE_DEFERRED and its CRC follows
+	 * right after the content, the server stores the file and answers without decrypting it.
 	 *
-	 * @return true if the file was successfully sent; false otherwise.
+	 * @param path The path of the file to send.
 	 * @throws FileError if there is an issue reading the file or if the file size is too large.
 	 */
-	void handleFileRequest();
+	void handleFileRequest(const std::string& path);
+
+	/**
+	 * @brief Packs the next small files into one pack file and sends it to the server.
+	 *
+	 * The pack starts with an index of the file names, offsets, sizes and CRCs, followed by the
+	 * content of the files. The server unpacks it and answers with the CRC of every file.
+	 *
+	 * @return false if none of the queued files could be read.
+	 * @throws FileError if one of the files can't be read.
+	 */
+	bool sendPack();
+
+	/**
+	 * @brief Checks the CRC of a file response and answers the server.
+	 *
+	 * The response is matched to its transfer by the file name. A file with a wrong CRC is
+	 * queued to be sent again, without waiting for the other files in flight.
+	 *
+	 * @return false if the response doesn't match a file in flight.
+	 */
+	bool handleFileResponse();
+
+	/**
+	 * @brief Finishes a deferred file that the server stored, the server verifies its CRC later.
+	 *
+	 * @return false if the response doesn't match a file in flight.
+	 */
+	bool handleStoredResponse();
+
+	/**
+	 * @brief Checks the CRCs of a pack response and queues the mismatched files again.
+	 *
+	 * @return false if the response doesn't match a pack in flight.
+	 */
+	bool handlePackResponse();
+
+	/**
+	 * @brief Sends a CRC request for a file that was verified.
+	 *
+	 * @param code REQUEST_CRC_VALID, REQUEST_CRC_INVALID or REQUEST_CRC_FATAL.
+	 * @param fileName The name of the file on the server.
+	 */
+	void sendCRCRequest(RequestCode code, const std::string& fileName);
+
+	/**
+	 * @brief Checks if a file should be sent again after a CRC mismatch.
+	 *
+	 * @param path The path of the file.
+	 * @return true if the file has retries left; false if it failed for good.
+	 */
+	bool retryFile(const std::string& path);
+
+	/**
+	 * @brief Encrypts and sends content to the server in multiple packets.
+	 *
+	 * @param code The request code of the first packet.
+	 * @param fileName The name of the content on the server.
+	 * @param contentSize The size of the content before encryption.
+	 * @param readChunk Reads the next bytes of the content into a buffer and returns the number of bytes read.
+	 * @return The CRC of the content.
+	 * @throws FileError if the content is too large or can't be read before the first packet is sent.
+	 * @throws ConnectionError if the content can't be read after the first packet was sent.
+	 */
+	uint32_t sendContent(RequestCode code, const std::string& fileName, size_t contentSize, const std::function<size_t(char*, size_t)>& readChunk);
 
 	/**
 	 * @brief Sends a file packet to the server.
 	 *
 	 * This method serializes the file packet which is the header of the content of the file
-	 * and sends it to the server.
+	 * and sends it to the server. The packet is serialized into a buffer leased from the packet pool.
 	 *
 	 * @param sendFileRequest The file packet to send.
 	 */
@@ -181,16 +299,48 @@ public:
 
 
 private:
+	struct PackEntry
+	{
+		std::string path;
+		uint32_t size;
+		uint32_t crc;
+	};
+
+	// a file or a pack waiting for its verification
+	struct Transfer
+	{
+		std::string path;  // empty for a pack
+		uint32_t crc;
+		std::vector<PackEntry> packEntries;
+		std::chrono::steady_clock::time_point sent;  // when its last packet was sent
+	};
+
 	FileHandler _fileHandler;
 	Connection _connection;
 	RSAWrapper _rsaWrapper;
 	AESWrapper _aesWrapper;
 	int _errorCount;
-	std::unique_ptr<Request> _request;
-	std::unique_ptr<Response> _response;
-	std::string _fileToSend;
-	uint32_t _fileCRC;
-	bool _sendingFile;
+	Request _request;
+	Response _response;
+	size_t _packLimit;  // the part of the in-flight budget for the pack buffer
+	size_t _pipelineDepth;  // the rest of the budget, in packets
+	BufferPool _bufferPool;  // read, encrypt, serialize and send buffers
+	ThreadPool _executor;  // CPU stages of the file transfers
+	std::vector<std::string> _filesToSend;
+	std::deque<std::string> _fileQueue;  // files sent one by one
+	std::deque<std::string> _packQueue;  // small files sent in packs
+	std::unordered_map<std::string, Transfer> _transfers;  // by the file name on the server
+	std::unordered_map<std::string, int> _retries;  // CRC mismatches by file path
+	std::vector<char> _packBuffer;
+	size_t _packCount;
+	size_t _fileWindow;
+	size_t _pendingAcks;
+	size_t _failedFiles;
+	bool _requestSent;  // the handler of the last response already sent the next requests
+	bool _transferComplete;
+	bool _deferredVerify;  // the files are verified by the server after it answered
+	std::chrono::steady_clock::time_point _requestTime;  // when sendAndReceive sent the last request
+	std::deque<std::chrono::steady_clock::time_point> _crcRequestTimes;  // the CRC requests that wait for an ACK
 };
 
 
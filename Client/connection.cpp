@@ -1,8 +1,13 @@
 #include "connection.h"
 #include "utils.h"
 #include "exceptions.h"
+#include "endian.h"
+#include "metrics.h"
+#include "session-capture.h"
+#include "tracing.h"
 
 #include <iostream>
+#include <cstring>
 
 
 Connection::Connection() 
@@ -11,7 +16,10 @@ Connection::Connection()
 	, _socket(tcp::socket(_io_context))
 	, _address("")
 	, _port("")
+	, _receiveBuffer()
+	, _captureID(SessionCapture::instance().newConnection())
 {
+	_receiveBuffer.reserve(PACKET_LENGTH);
 }
 
 Connection::~Connection()
@@ -94,6 +102,10 @@ bool Connection::connect()
 
 void Connection::send(const std::vector<char>& data)
 {
+	ScopedTrace span("socket", "write");
+	span.arg("bytes", data.size());
+	StageTimer timer(Stage::SEND, data.size());
+	SessionCapture::instance().recordSend(_captureID, data.data(), data.size());
 	try
 	{
 		boost::asio::write(_socket, boost::asio::buffer(data));
@@ -105,18 +117,47 @@ void Connection::send(const std::vector<char>& data)
 }
 
 
-std::vector<char> Connection::receive()
+void Connection::send(PooledBuffer buffer)
 {
-	std::vector<char> data(PACKET_LENGTH);
 	try
 	{
-		size_t bytesRead = _socket.read_some(boost::asio::buffer(data));
-		if (bytesRead > PACKET_LENGTH)
+		ScopedTrace span("socket", "write");
+		span.arg("bytes", buffer.size());
+		StageTimer timer(Stage::SEND, buffer.size());
+		SessionCapture::instance().recordSend(_captureID, buffer.data(), buffer.size());
+		boost::asio::write(_socket, boost::asio::buffer(buffer.data(), buffer.size()));
+	}
+	catch (const boost::system::system_error& e)
+	{
+		throw ConnectionError(e.what());
+	}
+	buffer.release();
+}
+
+
+const std::vector<char>& Connection::receive()
+{
+	_receiveBuffer.resize(RESPONSE_HEADER_SIZE);
+	ScopedTrace span("socket", "read");
+	StageTimer timer(Stage::RECEIVE);
+	try
+	{
+		boost::asio::read(_socket, boost::asio::buffer(_receiveBuffer));
+
+		uint32_t payloadSize = 0;
+		std::memcpy(&payloadSize, _receiveBuffer.data() + RESPONSE_PAYLOAD_SIZE_OFFSET, sizeof(payloadSize));
+		EndianConverter::fromLittleEndian(payloadSize);
+		if (payloadSize > PACKET_LENGTH - RESPONSE_HEADER_SIZE)
 		{
 			throw ConnectionError("Received too many bytes");
 		}
-		data.resize(bytesRead);
-		return data;
+
+		_receiveBuffer.resize(RESPONSE_HEADER_SIZE + payloadSize);
+		boost::asio::read(_socket, boost::asio::buffer(_receiveBuffer.data() + RESPONSE_HEADER_SIZE, payloadSize));
+		timer.setBytes(_receiveBuffer.size());
+		span.arg("bytes", _receiveBuffer.size());
+		SessionCapture::instance().recordResponse(_captureID, _receiveBuffer.data(), _receiveBuffer.size());
+		return _receiveBuffer;
 	}
 	catch (const boost::system::system_error&)
 	{
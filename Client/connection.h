@@ -2,6 +2,8 @@
 #define CONNECTION_H
 
 
+#include "buffer-pool.h"
+
 #include <boost/asio.hpp>
 #include <string>
 #include <vector>
@@ -9,6 +11,8 @@
 using boost::asio::ip::tcp;
 
 constexpr size_t PACKET_LENGTH = 32768;
+constexpr size_t RESPONSE_HEADER_SIZE = 7;  // version, code and payload size
+constexpr size_t RESPONSE_PAYLOAD_SIZE_OFFSET = 3;
 
 /**
 * @brief Connection class
@@ -76,14 +80,25 @@ public:
 	* @param data a vector of chars containing the data to be sent to the server
 	*/
 	void send(const std::vector<char>& data);
+
+	/**
+	* @brief Send a pooled buffer to the server
+	*
+	* The connection takes the lease of the buffer, it goes back to its pool as soon as the write completes.
+	*
+	* @param buffer the buffer to be sent to the server
+	*/
+	void send(PooledBuffer buffer);
 	/** 
-	* @brief Receive data from the server
+	* @brief Receive a response from the server
 	* 
-	* Receives data from the server and returns it as a vector of chars
+	* Receives exactly one response, its header and then the payload size the header announces,
+	* into the connection's receive buffer. Responses that arrived together are read one by one.
+	* The buffer is reused by the next call, so the caller must finish with the data before receiving again.
 	* 
-	* @return a vector of chars containing the data received from the server
+	* @return a vector of chars containing the response received from the server
 	*/
-	std::vector<char> receive();
+	const std::vector<char>& receive();
 
 
 private:
@@ -92,6 +107,8 @@ private:
 	tcp::socket _socket;
 	std::string _address;
 	std::string _port;
+	std::vector<char> _receiveBuffer;
+	uint32_t _captureID;  // the connection in a session capture
 
 };
 
@@ -24,6 +24,19 @@ namespace EndianConverter
 		value = boost::endian::native_to_little(value);
 	}
 
+	/**
+	* @brief Convert a value from litte endian to the native order
+	* 
+	* @tparam T the type of the value
+	* @param value the value to be converted
+	*/
+	template <typename T>
+	void fromLittleEndian(T& value)
+	{
+		static_assert(std::is_integral_v<T>, "Only integral types are supported");
+		value = boost::endian::little_to_native(value);
+	}
+
 	/**
 	* @brief Check if the system is big endian
 	* 
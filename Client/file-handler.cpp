@@ -92,7 +92,7 @@ void FileHandler::close()
 }
 
 
-bool FileHandler::parseRegisterFile(std::string& addr, std::string& port, std::string& user, std::string& fileTransfer)
+bool FileHandler::parseRegisterFile(std::string& addr, std::string& port, std::string& user, std::vector<std::string>& filesTransfer)
 {
 	if (!_file.is_open())
 	{
@@ -135,15 +135,9 @@ bool FileHandler::parseRegisterFile(std::string& addr, std::string& port, std::s
 		{
 			user = line;
 		}
-		else if (lineCount == 3)  // get the file name to transfer to the server
+		else  // get the files to transfer to the server, one per line
 		{
-			fileTransfer = line;
-		}
-		else if (lineCount > 3) // Too many lines
-		{
-			std::cerr << "Too many lines in file: " << _name << std::endl;
-			close();
-			return false;
+			filesTransfer.push_back(line);
 		}
 	}
 	if (lineCount < 3) // Too few lines
@@ -250,6 +244,21 @@ std::vector<char> FileHandler::readFile(size_t size)
 }
 
 
+size_t FileHandler::readChunk(char* buffer, size_t size)
+{
+	if (!_file.is_open())
+	{
+		throw FileError("The file is not open");
+	}
+	_file.read(buffer, size);
+	if (_file.bad())
+	{
+		throw FileError("Error reading the file");
+	}
+	return static_cast<size_t>(_file.gcount());
+}
+
+
 size_t FileHandler::getFileSize()
 {
 	if (!_file.is_open())
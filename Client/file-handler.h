@@ -65,10 +65,10 @@ public:
 	* @param addr the server address
 	* @param port the server port
 	* @param user the user name
-	* @param fileTransfer the file to be transferred to the server.
+	* @param filesTransfer the files to be transferred to the server, one per line from the third line on.
 	* @return true if the server information was read successfully; false otherwise
 	*/
-	bool parseRegisterFile(std::string& addr, std::string& port, std::string& user, std::string& fileTransfer);
+	bool parseRegisterFile(std::string& addr, std::string& port, std::string& user, std::vector<std::string>& filesTransfer);
 
 	/**
 	* @brief Parse the login file and return the user information
@@ -104,6 +104,15 @@ public:
 	* @return the contents of the file
 	*/
     std::vector<char> readFile(size_t size);
+
+	/**
+	* @brief Read the next chunk of the file into a buffer
+	* 
+	* @param buffer the buffer to read into
+	* @param size how many bytes to read
+	* @return the number of bytes that were read, less than size only at the end of the file
+	*/
+	size_t readChunk(char* buffer, size_t size);
 	
 	/**
 	* @brief Get the size of the file
@@ -0,0 +1,125 @@
+#include "file-pipeline.h"
+#include "metrics.h"
+#include "tracing.h"
+
+
+FilePipeline::FilePipeline(ThreadPool& pool, const std::vector<char>& key, size_t depth)
+	: _pool(pool)
+	, _encryptor(key)
+	, _crc()
+	, _nextPacket(1)
+	, _chunks(std::make_unique<Chunk[]>(depth))
+	, _depth(depth)
+	, _ready(depth, 1)
+	, _crcMutex()
+	, _crcIdle()
+	, _crcPending(0)
+	, _encryptStage(pool)
+{
+}
+
+
+FilePipeline::~FilePipeline()
+{
+	// a failed file leaves CRC tasks behind, they use the chunks
+	std::unique_lock<std::mutex> lock(_crcMutex);
+	_crcIdle.wait(lock, [this] { return _crcPending == 0; });
+}
+
+
+size_t FilePipeline::depth() const
+{
+	return _depth;
+}
+
+
+FilePipeline::Chunk& FilePipeline::chunk(size_t packetNumber)
+{
+	return _chunks[packetNumber % _depth];
+}
+
+
+void FilePipeline::submit(size_t packetNumber, PooledBuffer plainChunk, PooledBuffer encryptedChunk, bool last)
+{
+	auto& slot = chunk(packetNumber);
+	slot.plain = std::move(plainChunk);
+	slot.encrypted = std::move(encryptedChunk);
+	slot.crc = CRC();
+	slot.last = last;
+	slot.pendingStages = 2;
+	{
+		std::lock_guard<std::mutex> lock(_crcMutex);
+		_crcPending++;
+	}
+
+	// the captures fit in std::function's small buffer, posting doesn't allocate.
+	_pool.post([this, packetNumber] { runCRC(packetNumber); });
+	_encryptStage.post([this, packetNumber] { runEncryption(packetNumber); });
+}
+
+
+PooledBuffer FilePipeline::next()
+{
+	auto encryptedChunk = _ready.pop();
+	// both stages of the chunk are done, its slot isn't reused until the next submit
+	_crc.append(chunk(_nextPacket).crc);
+	_nextPacket++;
+	return encryptedChunk;
+}
+
+
+uint32_t FilePipeline::finish()
+{
+	_encryptStage.wait();
+	return _crc.digest();
+}
+
+
+void FilePipeline::runCRC(size_t packetNumber)
+{
+	auto& slot = chunk(packetNumber);
+	{
+		ScopedTrace span("pipeline", "crc update");
+		span.arg("packet", packetNumber);
+		StageTimer timer(Stage::CRC, slot.plain.size());
+		slot.crc.update(slot.plain.data(), slot.plain.size());
+	}
+	completeStage(packetNumber);
+	std::lock_guard<std::mutex> lock(_crcMutex);  // notified under the lock, the pipeline may go right after
+	if (--_crcPending == 0)
+	{
+		_crcIdle.notify_all();
+	}
+}
+
+
+void FilePipeline::runEncryption(size_t packetNumber)
+{
+	auto& slot = chunk(packetNumber);
+	try
+	{
+		ScopedTrace span("pipeline", "encrypt chunk");
+		span.arg("packet", packetNumber);
+		StageTimer timer(Stage::ENCRYPT, slot.plain.size());
+		slot.encrypted.resize(slot.last
+			? _encryptor.finish(slot.plain.data(), slot.plain.size(), slot.encrypted.data())
+			: _encryptor.update(slot.plain.data(), slot.plain.size(), slot.encrypted.data()));
+	}
+	catch (...)
+	{
+		_ready.fail(std::current_exception());
+		throw;
+	}
+	completeStage(packetNumber);
+}
+
+
+void FilePipeline::completeStage(size_t packetNumber)
+{
+	auto& slot = chunk(packetNumber);
+	if (--slot.pendingStages == 0)
+	{
+		slot.plain.release();
+		_ready.push(packetNumber, std::move(slot.encrypted));
+	}
+}
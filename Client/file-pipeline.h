@@ -0,0 +1,110 @@
+#ifndef FILE_PIPELINE_H
+#define FILE_PIPELINE_H
+
+
+#include "AESWrapper.h"
+#include "buffer-pool.h"
+#include "cksum.h"
+#include "reorder-buffer.h"
+#include "thread-pool.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <cstdint>
+
+
+/**
+* @brief FilePipeline class
+*
+* Runs the CPU stages of one file on the shared thread pool. The client reads the file chunk by
+* chunk and submits the chunks. The CRC of every chunk is a task of its own, the chunks in flight
+* are checksummed on as many workers as they find and the CRCs are appended in packet order.
+* The AES encryption is one CBC stream per file, as the server decrypts it, so it runs in chunk
+* order on one worker at a time, alongside the CRCs. The encrypted chunks come back in packet order.
+*/
+class FilePipeline
+{
+public:
+	/**
+	* @brief Constructor
+	*
+	* @param pool the pool that runs the stages.
+	* @param key the AES key of the session.
+	* @param depth how many chunks can be in flight.
+	*/
+	FilePipeline(ThreadPool& pool, const std::vector<char>& key, size_t depth);
+
+	FilePipeline(const FilePipeline&) = delete;
+	FilePipeline& operator=(const FilePipeline&) = delete;
+
+	/**
+	* @brief Get how many chunks can be in flight.
+	*/
+	size_t depth() const;
+
+	/**
+	* @brief Submit the next chunk of the file.
+	*
+	* The caller must not submit more than depth() chunks ahead of next().
+	*
+	* @param packetNumber the packet number of the chunk, starting at 1.
+	* @param plainChunk the chunk of the file, it goes back to the pool once both stages are done.
+	* @param encryptedChunk an empty buffer for the encrypted chunk.
+	* @param last whether this is the last chunk of the file, it gets the padding.
+	*/
+	void submit(size_t packetNumber, PooledBuffer plainChunk, PooledBuffer encryptedChunk, bool last);
+
+	/**
+	* @brief Wait for the next encrypted chunk in packet order.
+	*
+	* @return the encrypted chunk
+	* @throws the first error of a stage.
+	*/
+	PooledBuffer next();
+
+	/**
+	* @brief Wait for all the stages to finish, after the last chunk was taken with next().
+	*
+	* @return the CRC of the file.
+	*/
+	uint32_t finish();
+
+	/**
+	* @brief Destructor
+	*
+	* Waits for the CRC tasks that are still running.
+	*/
+	~FilePipeline();
+
+private:
+	struct Chunk
+	{
+		PooledBuffer plain;
+		PooledBuffer encrypted;
+		CRC crc;
+		std::atomic<int> pendingStages{ 0 };
+		bool last = false;
+	};
+
+	void runCRC(size_t packetNumber);
+	void runEncryption(size_t packetNumber);
+	void completeStage(size_t packetNumber);
+	Chunk& chunk(size_t packetNumber);
+
+	ThreadPool& _pool;
+	AESStreamEncryptor _encryptor;
+	CRC _crc;
+	size_t _nextPacket;
+	std::unique_ptr<Chunk[]> _chunks;
+	size_t _depth;
+	ReorderBuffer<PooledBuffer> _ready;
+	std::mutex _crcMutex;
+	std::condition_variable _crcIdle;
+	size_t _crcPending;
+	TaskChain _encryptStage;  // declared last, waits for the tasks before the chunks are destroyed
+};
+
+#endif // FILE_PIPELINE_H
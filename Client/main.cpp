@@ -1,15 +1,133 @@
+#include "alloc-accounting.h"
 #include "client.h"
+#include "metrics.h"
+#include "perf-counters.h"
+#include "session-capture.h"
+#include "tracing.h"
+#include "utils.h"
 
+#include <algorithm>
 #include <iostream>
+#include <memory>
+#include <string>
 
 
+const std::string WORKERS_ARGUMENT = "--workers=";
+const std::string WINDOW_ARGUMENT = "--window=";
+const std::string MAX_INFLIGHT_ARGUMENT = "--max-inflight=";
+const std::string METRICS_JSON_ARGUMENT = "--metrics-json=";
+const std::string METRICS_TEXTFILE_ARGUMENT = "--metrics-textfile=";
+const std::string METRICS_INTERVAL_ARGUMENT = "--metrics-interval=";
+const std::string TRACE_ARGUMENT = "--trace=";
+const std::string TRACE_EVENTS_ARGUMENT = "--trace-events=";
+const std::string PERF_COUNTERS_ARGUMENT = "--perf-counters";
+const std::string CAPTURE_ARGUMENT = "--capture=";
+const std::string DEFERRED_VERIFY_ARGUMENT = "--deferred-verify";
 
-int main()
+
+int main(int argc, char* argv[])
 {
-	Client client{};
+	size_t workerThreads = 0;  // one per core, see --workers in the README
+	size_t fileWindow = DEFAULT_FILE_WINDOW;
+	size_t maxInflight = DEFAULT_MAX_INFLIGHT;
+	std::string metricsJSON;  // written at exit
+	std::string metricsTextfile;  // written every interval, for the node exporter
+	size_t metricsInterval = 15;
+	std::string tracePath;  // a Chrome trace-event file, written at exit
+	size_t traceEvents = Tracer::DEFAULT_EVENTS_PER_THREAD;
+	bool perfCounters = false;
+	std::string capturePath;  // the session's requests and responses, for the replay tool
+	bool deferredVerify = false;  // the server stores the files and verifies them later
+	for (int i = 1; i < argc; i++)
+	{
+		std::string argument = argv[i];
+		if (argument.rfind(WORKERS_ARGUMENT, 0) == 0 && isNumber(argument.substr(WORKERS_ARGUMENT.size())))
+		{
+			workerThreads = std::stoul(argument.substr(WORKERS_ARGUMENT.size()));
+		}
+		else if (argument.rfind(WINDOW_ARGUMENT, 0) == 0 && isNumber(argument.substr(WINDOW_ARGUMENT.size())))
+		{
+			fileWindow = std::stoul(argument.substr(WINDOW_ARGUMENT.size()));
+		}
+		else if (argument.rfind(MAX_INFLIGHT_ARGUMENT, 0) == 0)
+		{
+			if (!parseByteSize(argument.substr(MAX_INFLIGHT_ARGUMENT.size()), maxInflight))
+			{
+				std::cerr << "Invalid in-flight budget: " << argument << std::endl;
+				return -1;
+			}
+		}
+		else if (argument.rfind(METRICS_JSON_ARGUMENT, 0) == 0)
+		{
+			metricsJSON = argument.substr(METRICS_JSON_ARGUMENT.size());
+		}
+		else if (argument.rfind(METRICS_TEXTFILE_ARGUMENT, 0) == 0)
+		{
+			metricsTextfile = argument.substr(METRICS_TEXTFILE_ARGUMENT.size());
+		}
+		else if (argument.rfind(METRICS_INTERVAL_ARGUMENT, 0) == 0 && isNumber(argument.substr(METRICS_INTERVAL_ARGUMENT.size())))
+		{
+			metricsInterval = std::max<size_t>(1, std::stoul(argument.substr(METRICS_INTERVAL_ARGUMENT.size())));
+		}
+		else if (argument.rfind(TRACE_ARGUMENT, 0) == 0)
+		{
+			tracePath = argument.substr(TRACE_ARGUMENT.size());
+		}
+		else if (argument.rfind(TRACE_EVENTS_ARGUMENT, 0) == 0 && isNumber(argument.substr(TRACE_EVENTS_ARGUMENT.size())))
+		{
+			traceEvents = std::stoul(argument.substr(TRACE_EVENTS_ARGUMENT.size()));
+		}
+		else if (argument == PERF_COUNTERS_ARGUMENT)
+		{
+			perfCounters = true;
+		}
+		else if (argument.rfind(CAPTURE_ARGUMENT, 0) == 0)
+		{
+			capturePath = argument.substr(CAPTURE_ARGUMENT.size());
+		}
+		else if (argument == DEFERRED_VERIFY_ARGUMENT)
+		{
+			deferredVerify = true;
+		}
+		else
+		{
+			std::cerr << "Invalid argument: " << argument << std::endl;
+			return -1;
+		}
+	}
 
+	// the builds that count the allocations report them per packet
+	if (!metricsJSON.empty() || !metricsTextfile.empty() || AllocationAccounting::enabled())
+	{
+		Metrics::enable();
+	}
+	if (!tracePath.empty())
+	{
+		Tracer::enable(traceEvents);
+		Tracer::instance().nameThread("main");
+	}
+	std::string perfError;
+	if (perfCounters && !PerfCounters::enable(perfError))
+	{
+		// the backup runs all the same, without the counters
+		std::cerr << "Hardware counters are not available: " << perfError << std::endl;
+		perfCounters = false;
+	}
+	if (!capturePath.empty() && !SessionCapture::instance().open(capturePath))
+	{
+		std::cerr << "Cannot create the capture " << capturePath << std::endl;
+		return -1;
+	}
+	std::unique_ptr<MetricsExporter> exporter;
+	if (!metricsTextfile.empty())
+	{
+		exporter = std::make_unique<MetricsExporter>(metricsTextfile, std::chrono::seconds(metricsInterval));
+	}
+
+	int result = 0;
 	try 
 	{
+		Client client{ workerThreads, fileWindow, maxInflight, deferredVerify };
 		client.startClient();
 
 		if (client.sendAndReceive())
@@ -19,14 +137,34 @@ int main()
 		else
 		{
 			std::cout << "File was not sent successfully" << std::endl;
-			return -1;
+			result = -1;
 		}
 	}
 	catch (const std::exception& e)
 	{
 		std::cerr << e.what() << std::endl;
-		return -1;
+		result = -1;
 	}
 
-	return 0;
-}
\ No newline at end of file
+	SessionCapture::instance().close();
+	// the metrics of a failed backup are the most interesting ones
+	exporter.reset();
+	if (!metricsJSON.empty() && !Metrics::writeFile(metricsJSON, Metrics::instance().toJSON()))
+	{
+		std::cerr << "Cannot write the metrics to " << metricsJSON << std::endl;
+	}
+	if (perfCounters)
+	{
+		PerfCounters::instance().report(std::cout);
+	}
+	if (AllocationAccounting::enabled())
+	{
+		AllocationAccounting::report(std::cout, Metrics::instance().packets(), Metrics::instance().stageBytes(Stage::SEND));
+	}
+	// the client and its workers are gone, nothing records spans anymore
+	if (!tracePath.empty() && !Tracer::instance().write(tracePath))
+	{
+		std::cerr << "Cannot write the trace to " << tracePath << std::endl;
+	}
+	return result;
+}
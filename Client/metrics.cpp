@@ -0,0 +1,425 @@
+#include "metrics.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+
+
+struct OpCodeName
+{
+	uint16_t opCode;
+	const char* name;
+};
+
+// the protocol's opcodes, in the order of the metrics' arrays
+static const OpCodeName REQUEST_NAMES[] = {
+	{ 825, "register" }, { 826, "public_key" }, { 827, "login" }, { 828, "send_file" }, { 829, "send_pack" },
+	{ 830, "send_file_deferred" }, { 831, "file_crc" }, { 900, "crc_valid" }, { 901, "crc_invalid" }, { 902, "crc_fatal" }
+};
+static const OpCodeName RESPONSE_NAMES[] = {
+	{ 1600, "registration" }, { 1601, "registration_failed" }, { 1602, "aes_key" }, { 1603, "file_valid" }, { 1604, "ack" },
+	{ 1605, "login" }, { 1606, "login_failed" }, { 1607, "error" }, { 1608, "pack_valid" }, { 1609, "file_stored" }
+};
+static const char* STAGE_NAMES[] = { "read", "crc", "encrypt", "serialize", "send", "receive" };
+
+
+const char* stageName(Stage stage)
+{
+	return STAGE_NAMES[static_cast<size_t>(stage)];
+}
+
+
+template <size_t N>
+static int opCodeIndex(const OpCodeName (&names)[N], uint16_t opCode)
+{
+	for (size_t i = 0; i < N; i++)
+	{
+		if (names[i].opCode == opCode)
+		{
+			return static_cast<int>(i);
+		}
+	}
+	return -1;
+}
+
+
+void LatencyHistogram::record(std::chrono::nanoseconds duration)
+{
+	auto nanos = static_cast<uint64_t>(std::max<int64_t>(0, duration.count()));
+	uint64_t micros = (nanos + 999) / 1000;  // rounded up, a bucket's bound is the longest duration in it
+	size_t bucket = 0;
+	while (bucket < BUCKETS - 1 && (uint64_t{ 1 } << bucket) < micros)
+	{
+		bucket++;
+	}
+	_buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+	_count.fetch_add(1, std::memory_order_relaxed);
+	_sum.fetch_add(nanos, std::memory_order_relaxed);
+}
+
+
+uint64_t LatencyHistogram::count() const
+{
+	return _count.load(std::memory_order_relaxed);
+}
+
+
+double LatencyHistogram::sum() const
+{
+	return _sum.load(std::memory_order_relaxed) / 1e9;
+}
+
+
+uint64_t LatencyHistogram::bucketCount(size_t bucket) const
+{
+	return _buckets[bucket].load(std::memory_order_relaxed);
+}
+
+
+double LatencyHistogram::upperBound(size_t bucket)
+{
+	return static_cast<double>(uint64_t{ 1 } << bucket) / 1e6;
+}
+
+
+double LatencyHistogram::percentile(double fraction) const
+{
+	uint64_t total = 0;
+	for (size_t i = 0; i < BUCKETS; i++)
+	{
+		total += bucketCount(i);
+	}
+	auto rank = std::max<uint64_t>(1, static_cast<uint64_t>(fraction * total + 0.5));
+	uint64_t seen = 0;
+	for (size_t i = 0; i < BUCKETS; i++)
+	{
+		seen += bucketCount(i);
+		if (seen >= rank)
+		{
+			return upperBound(i);
+		}
+	}
+	return 0;
+}
+
+
+Metrics& Metrics::instance()
+{
+	static Metrics metrics;
+	return metrics;
+}
+
+
+void Metrics::enable()
+{
+	_enabled.store(true, std::memory_order_relaxed);
+}
+
+
+void Metrics::recordStage(Stage stage, std::chrono::nanoseconds duration, size_t bytes)
+{
+	if (!enabled())
+	{
+		return;
+	}
+	auto& metrics = _stages[static_cast<size_t>(stage)];
+	metrics.latency.record(duration);
+	metrics.bytes.fetch_add(bytes, std::memory_order_relaxed);
+}
+
+
+void Metrics::recordRequest(uint16_t opCode, size_t bytes)
+{
+	if (!enabled())
+	{
+		return;
+	}
+	int index = opCodeIndex(REQUEST_NAMES, opCode);
+	if (index < 0)
+	{
+		return;
+	}
+	_requests[index].count.fetch_add(1, std::memory_order_relaxed);
+	_requests[index].bytes.fetch_add(bytes, std::memory_order_relaxed);
+}
+
+
+void Metrics::recordResponse(uint16_t opCode)
+{
+	if (!enabled())
+	{
+		return;
+	}
+	int index = opCodeIndex(RESPONSE_NAMES, opCode);
+	if (index < 0)
+	{
+		return;
+	}
+	_responses[index].count.fetch_add(1, std::memory_order_relaxed);
+}
+
+
+void Metrics::recordRoundTrip(uint16_t opCode, std::chrono::nanoseconds duration)
+{
+	if (!enabled())
+	{
+		return;
+	}
+	int index = opCodeIndex(RESPONSE_NAMES, opCode);
+	if (index < 0)
+	{
+		return;
+	}
+	_responses[index].roundTrip.record(duration);
+}
+
+
+void Metrics::addPackets(size_t packets)
+{
+	if (enabled())
+	{
+		_packets.fetch_add(packets, std::memory_order_relaxed);
+	}
+}
+
+
+void Metrics::addRetry()
+{
+	if (enabled())
+	{
+		_retries.fetch_add(1, std::memory_order_relaxed);
+	}
+}
+
+
+void Metrics::addCRCMismatches(size_t mismatches)
+{
+	if (enabled())
+	{
+		_crcMismatches.fetch_add(mismatches, std::memory_order_relaxed);
+	}
+}
+
+
+uint64_t Metrics::packets() const
+{
+	return _packets.load(std::memory_order_relaxed);
+}
+
+
+uint64_t Metrics::stageBytes(Stage stage) const
+{
+	return _stages[static_cast<size_t>(stage)].bytes.load(std::memory_order_relaxed);
+}
+
+
+static void writeHistogramJSON(std::ostream& out, const LatencyHistogram& histogram)
+{
+	out << "\"count\": " << histogram.count()
+		<< ", \"seconds\": " << histogram.sum()
+		<< ", \"p50_seconds\": " << histogram.percentile(0.5)
+		<< ", \"p99_seconds\": " << histogram.percentile(0.99);
+}
+
+
+std::string Metrics::toJSON() const
+{
+	std::ostringstream out;
+	out << std::setprecision(9);
+	out << "{\n  \"stages\": {";
+	for (size_t i = 0; i < _stages.size(); i++)
+	{
+		out << (i ? ",\n" : "\n") << "    \"" << STAGE_NAMES[i] << "\": { ";
+		writeHistogramJSON(out, _stages[i].latency);
+		out << ", \"bytes\": " << _stages[i].bytes.load(std::memory_order_relaxed) << " }";
+	}
+	out << "\n  },\n  \"requests\": {";
+	for (size_t i = 0; i < _requests.size(); i++)
+	{
+		out << (i ? ",\n" : "\n") << "    \"" << REQUEST_NAMES[i].name << "\": { \"opcode\": " << REQUEST_NAMES[i].opCode
+			<< ", \"count\": " << _requests[i].count.load(std::memory_order_relaxed)
+			<< ", \"bytes\": " << _requests[i].bytes.load(std::memory_order_relaxed) << " }";
+	}
+	out << "\n  },\n  \"responses\": {";
+	for (size_t i = 0; i < _responses.size(); i++)
+	{
+		out << (i ? ",\n" : "\n") << "    \"" << RESPONSE_NAMES[i].name << "\": { \"opcode\": " << RESPONSE_NAMES[i].opCode
+			<< ", \"count\": " << _responses[i].count.load(std::memory_order_relaxed) << ", \"rtt\": { ";
+		writeHistogramJSON(out, _responses[i].roundTrip);
+		out << " } }";
+	}
+	out << "\n  },\n";
+	out << "  \"packets\": " << _packets.load(std::memory_order_relaxed) << ",\n";
+	out << "  \"retries\": " << _retries.load(std::memory_order_relaxed) << ",\n";
+	out << "  \"crc_mismatches\": " << _crcMismatches.load(std::memory_order_relaxed) << "\n";
+	out << "}\n";
+	return out.str();
+}
+
+
+static void writeHistogramPrometheus(std::ostream& out, const std::string& metric, const std::string& labels, const LatencyHistogram& histogram)
+{
+	uint64_t cumulative = 0;
+	for (size_t i = 0; i < LatencyHistogram::BUCKETS - 1; i++)
+	{
+		cumulative += histogram.bucketCount(i);
+		out << metric << "_bucket{" << labels << ",le=\"" << LatencyHistogram::upperBound(i) << "\"} " << cumulative << "\n";
+	}
+	cumulative += histogram.bucketCount(LatencyHistogram::BUCKETS - 1);
+	out << metric << "_bucket{" << labels << ",le=\"+Inf\"} " << cumulative << "\n";
+	out << metric << "_sum{" << labels << "} " << histogram.sum() << "\n";
+	out << metric << "_count{" << labels << "} " << cumulative << "\n";
+}
+
+
+std::string Metrics::toPrometheus() const
+{
+	std::ostringstream out;
+	out << std::setprecision(9);
+
+	out << "# HELP backup_client_stage_seconds Time spent in a stage of the transfers.\n";
+	out << "# TYPE backup_client_stage_seconds histogram\n";
+	for (size_t i = 0; i < _stages.size(); i++)
+	{
+		writeHistogramPrometheus(out, "backup_client_stage_seconds", std::string("stage=\"") + STAGE_NAMES[i] + "\"", _stages[i].latency);
+	}
+	out << "# HELP backup_client_stage_bytes_total Bytes processed by a stage of the transfers.\n";
+	out << "# TYPE backup_client_stage_bytes_total counter\n";
+	for (size_t i = 0; i < _stages.size(); i++)
+	{
+		out << "backup_client_stage_bytes_total{stage=\"" << STAGE_NAMES[i] << "\"} " << _stages[i].bytes.load(std::memory_order_relaxed) << "\n";
+	}
+
+	out << "# HELP backup_client_requests_total Requests sent, by opcode.\n";
+	out << "# TYPE backup_client_requests_total counter\n";
+	for (size_t i = 0; i < _requests.size(); i++)
+	{
+		out << "backup_client_requests_total{opcode=\"" << REQUEST_NAMES[i].opCode << "\",request=\"" << REQUEST_NAMES[i].name << "\"} "
+			<< _requests[i].count.load(std::memory_order_relaxed) << "\n";
+	}
+	out << "# HELP backup_client_request_bytes_total Bytes of the first packet of the requests, by opcode.\n";
+	out << "# TYPE backup_client_request_bytes_total counter\n";
+	for (size_t i = 0; i < _requests.size(); i++)
+	{
+		out << "backup_client_request_bytes_total{opcode=\"" << REQUEST_NAMES[i].opCode << "\",request=\"" << REQUEST_NAMES[i].name << "\"} "
+			<< _requests[i].bytes.load(std::memory_order_relaxed) << "\n";
+	}
+	out << "# HELP backup_client_responses_total Responses received, by opcode.\n";
+	out << "# TYPE backup_client_responses_total counter\n";
+	for (size_t i = 0; i < _responses.size(); i++)
+	{
+		out << "backup_client_responses_total{opcode=\"" << RESPONSE_NAMES[i].opCode << "\",response=\"" << RESPONSE_NAMES[i].name << "\"} "
+			<< _responses[i].count.load(std::memory_order_relaxed) << "\n";
+	}
+	out << "# HELP backup_client_rtt_seconds Time from a request to its response, by the opcode of the response.\n";
+	out << "# TYPE backup_client_rtt_seconds histogram\n";
+	for (size_t i = 0; i < _responses.size(); i++)
+	{
+		auto labels = "opcode=\"" + std::to_string(RESPONSE_NAMES[i].opCode) + "\",response=\"" + RESPONSE_NAMES[i].name + "\"";
+		writeHistogramPrometheus(out, "backup_client_rtt_seconds", labels, _responses[i].roundTrip);
+	}
+
+	out << "# HELP backup_client_packets_total File packets sent.\n";
+	out << "# TYPE backup_client_packets_total counter\n";
+	out << "backup_client_packets_total " << _packets.load(std::memory_order_relaxed) << "\n";
+	out << "# HELP backup_client_retries_total Files sent again after a CRC mismatch.\n";
+	out << "# TYPE backup_client_retries_total counter\n";
+	out << "backup_client_retries_total " << _retries.load(std::memory_order_relaxed) << "\n";
+	out << "# HELP backup_client_crc_mismatches_total Files whose CRC didn't match the server's.\n";
+	out << "# TYPE backup_client_crc_mismatches_total counter\n";
+	out << "backup_client_crc_mismatches_total " << _crcMismatches.load(std::memory_order_relaxed) << "\n";
+	return out.str();
+}
+
+
+bool Metrics::writeFile(const std::string& path, const std::string& content)
+{
+	auto temporary = path + ".tmp";
+	{
+		std::ofstream file(temporary, std::ios::trunc);
+		if (!(file << content))
+		{
+			return false;
+		}
+	}
+	std::error_code error;
+	std::filesystem::rename(temporary, path, error);
+	return !error;
+}
+
+
+StageTimer::StageTimer(Stage stage, size_t bytes)
+	: _stage(stage)
+	, _bytes(bytes)
+	, _enabled(Metrics::enabled())
+	, _counted(PerfCounters::enabled())
+	, _start()
+	, _startCounts()
+	, _allocations(stage)
+{
+	if (_counted)
+	{
+		_counted = PerfCounters::instance().read(_startCounts);
+	}
+	if (_enabled)
+	{
+		_start = std::chrono::steady_clock::now();
+	}
+}
+
+
+StageTimer::~StageTimer()
+{
+	if (_enabled)
+	{
+		Metrics::instance().recordStage(_stage, std::chrono::steady_clock::now() - _start, _bytes);
+	}
+	PerfSample endCounts;
+	if (_counted && PerfCounters::instance().read(endCounts))
+	{
+		PerfCounters::instance().add(_stage, _startCounts, endCounts, _bytes);
+	}
+}
+
+
+void StageTimer::setBytes(size_t bytes)
+{
+	_bytes = bytes;
+}
+
+
+MetricsExporter::MetricsExporter(const std::string& path, std::chrono::seconds interval)
+	: _path(path)
+	, _interval(interval)
+	, _mutex()
+	, _wakeUp()
+	, _stopping(false)
+	, _thread()
+{
+	_thread = std::thread(&MetricsExporter::run, this);
+}
+
+
+MetricsExporter::~MetricsExporter()
+{
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_stopping = true;
+	}
+	_wakeUp.notify_all();
+	_thread.join();
+	Metrics::writeFile(_path, Metrics::instance().toPrometheus());
+}
+
+
+void MetricsExporter::run()
+{
+	std::unique_lock<std::mutex> lock(_mutex);
+	while (!_wakeUp.wait_for(lock, _interval, [this] { return _stopping; }))
+	{
+		Metrics::writeFile(_path, Metrics::instance().toPrometheus());
+	}
+}
@@ -0,0 +1,241 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+
+#include "alloc-accounting.h"
+#include "perf-counters.h"
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <cstdint>
+#include <cstddef>
+
+
+/**
+* @brief The stages of a transfer that are timed.
+*/
+enum class Stage
+{
+	READ,       // reading the files from the disk
+	CRC,
+	ENCRYPT,
+	SERIALIZE,
+	SEND,       // writing to the socket
+	RECEIVE,    // waiting for a response and reading it
+	COUNT
+};
+
+/**
+* @brief Get the name of a stage, as it appears in the reports.
+*/
+const char* stageName(Stage stage);
+
+
+/**
+* @brief LatencyHistogram class
+*
+* A lock-free histogram of durations with power-of-two buckets from 1us to 8s. Recording is three
+* relaxed atomic increments, so the stages on the thread pool can share a histogram.
+*/
+class LatencyHistogram
+{
+public:
+	static constexpr size_t BUCKETS = 24;  // the upper bounds are 2^i us, the last bucket takes the rest
+
+	/**
+	* @brief Record a duration.
+	*/
+	void record(std::chrono::nanoseconds duration);
+
+	/**
+	* @brief Get the number of recorded durations.
+	*/
+	uint64_t count() const;
+
+	/**
+	* @brief Get the sum of the recorded durations, in seconds.
+	*/
+	double sum() const;
+
+	/**
+	* @brief Get the number of durations in a bucket.
+	*/
+	uint64_t bucketCount(size_t bucket) const;
+
+	/**
+	* @brief Get the upper bound of a bucket, in seconds.
+	*/
+	static double upperBound(size_t bucket);
+
+	/**
+	* @brief Get the upper bound of the bucket that holds a percentile, in seconds.
+	*/
+	double percentile(double fraction) const;
+
+private:
+	std::array<std::atomic<uint64_t>, BUCKETS> _buckets{};
+	std::atomic<uint64_t> _count{ 0 };
+	std::atomic<uint64_t> _sum{ 0 };  // ns
+};
+
+
+/**
+* @brief Metrics class
+*
+* The counters and latency histograms of the client: the time and bytes of every stage of a transfer,
+* the requests and responses by opcode, the round trip of every response, and the packets, retries and
+* CRC mismatches. They are off by default; when they are off, recording is a single relaxed load.
+* The metrics can be dumped as JSON or in the Prometheus text format.
+*/
+class Metrics
+{
+public:
+	/**
+	* @brief Get the metrics of the process.
+	*/
+	static Metrics& instance();
+
+	/**
+	* @brief Check if the metrics are recorded.
+	*/
+	static bool enabled()
+	{
+		return _enabled.load(std::memory_order_relaxed);
+	}
+
+	/**
+	* @brief Start recording the metrics.
+	*/
+	static void enable();
+
+	void recordStage(Stage stage, std::chrono::nanoseconds duration, size_t bytes);
+	void recordRequest(uint16_t opCode, size_t bytes);
+	void recordResponse(uint16_t opCode);
+	void recordRoundTrip(uint16_t opCode, std::chrono::nanoseconds duration);
+	void addPackets(size_t packets);
+	void addRetry();
+	void addCRCMismatches(size_t mismatches);
+
+	/**
+	* @brief Get the number of file packets sent.
+	*/
+	uint64_t packets() const;
+
+	/**
+	* @brief Get the bytes a stage processed.
+	*/
+	uint64_t stageBytes(Stage stage) const;
+
+	/**
+	* @brief Get the metrics as a JSON document.
+	*/
+	std::string toJSON() const;
+
+	/**
+	* @brief Get the metrics in the Prometheus text format, for the node exporter's textfile collector.
+	*/
+	std::string toPrometheus() const;
+
+	/**
+	* @brief Write a file atomically, through a temporary file that is renamed.
+	*
+	* A collector that reads the file never sees it half written.
+	*
+	* @return true if the file was written.
+	*/
+	static bool writeFile(const std::string& path, const std::string& content);
+
+private:
+	static constexpr size_t REQUEST_CODES = 10;
+	static constexpr size_t RESPONSE_CODES = 10;
+
+	struct StageMetrics
+	{
+		LatencyHistogram latency;
+		std::atomic<uint64_t> bytes{ 0 };
+	};
+
+	struct OpCodeMetrics
+	{
+		std::atomic<uint64_t> count{ 0 };
+		std::atomic<uint64_t> bytes{ 0 };
+		LatencyHistogram roundTrip;
+	};
+
+	Metrics() = default;
+
+	static inline std::atomic<bool> _enabled{ false };
+
+	std::array<StageMetrics, static_cast<size_t>(Stage::COUNT)> _stages;
+	std::array<OpCodeMetrics, REQUEST_CODES> _requests;
+	std::array<OpCodeMetrics, RESPONSE_CODES> _responses;
+	std::atomic<uint64_t> _packets{ 0 };
+	std::atomic<uint64_t> _retries{ 0 };
+	std::atomic<uint64_t> _crcMismatches{ 0 };
+};
+
+
+/**
+* @brief StageTimer class
+*
+* Times a stage from its construction to its destruction, counts its hardware events when the counters
+* are on, and attributes the heap allocations of its thread to the stage in the builds that count them.
+* When the metrics are off, it doesn't read the clock.
+*/
+class StageTimer
+{
+public:
+	explicit StageTimer(Stage stage, size_t bytes = 0);
+	~StageTimer();
+
+	StageTimer(const StageTimer&) = delete;
+	StageTimer& operator=(const StageTimer&) = delete;
+
+	/**
+	* @brief Set the bytes the stage processed, when they are known at its end.
+	*/
+	void setBytes(size_t bytes);
+
+private:
+	Stage _stage;
+	size_t _bytes;
+	bool _enabled;
+	bool _counted;
+	std::chrono::steady_clock::time_point _start;
+	PerfSample _startCounts;
+	AllocationScope _allocations;
+};
+
+
+/**
+* @brief MetricsExporter class
+*
+* Writes the metrics to a Prometheus textfile every interval, on a thread of its own, and one last time
+* when it is destroyed.
+*/
+class MetricsExporter
+{
+public:
+	MetricsExporter(const std::string& path, std::chrono::seconds interval);
+	~MetricsExporter();
+
+	MetricsExporter(const MetricsExporter&) = delete;
+	MetricsExporter& operator=(const MetricsExporter&) = delete;
+
+private:
+	void run();
+
+	std::string _path;
+	std::chrono::seconds _interval;
+	std::mutex _mutex;
+	std::condition_variable _wakeUp;
+	bool _stopping;
+	std::thread _thread;
+};
+
+#endif // METRICS_H
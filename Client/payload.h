@@ -3,10 +3,14 @@
 
 
 #include <string>
+#include <string_view>
 #include <vector>
+#include <array>
 #include <cstdint>
+#include <cstddef>
 
 
+constexpr size_t CLIENT_ID_SIZE = 16;
 constexpr size_t PUBLIC_KEY_SIZE = 160;
 constexpr size_t NAME_SIZE = 255;
 constexpr size_t FILE_NAME_SIZE = 255;
@@ -15,6 +19,27 @@ constexpr size_t ORIGINAL_FILE_SIZE = 4;
 constexpr size_t PACKET_NUMBER_SIZE = 2;
 constexpr size_t TOTAL_PACKETS_SIZE = 2;
 constexpr size_t CRC_SIZE = 4;
+constexpr size_t FILE_COUNT_SIZE = 4;
+
+
+/**
+* @brief A fixed-size client identifier (UUID bytes).
+*/
+using ClientID = std::array<char, CLIENT_ID_SIZE>;
+
+
+/**
+ * @struct	ByteSpan
+ *
+ * @brief	A non-owning view over a contiguous block of bytes.
+ *
+ * The viewed buffer must outlive the payload that refers to it.
+*/
+struct ByteSpan
+{
+	const char* data = nullptr;
+	size_t size = 0;
+};
 
 
 /**
@@ -50,6 +75,8 @@ struct SendPublickKeyRequest
  * @brief	A send file request.
  *
  * This struct represents a payload that contains the metadata of a file.
+ * The file name and the content are views into buffers owned by the client,
+ * so building a packet never copies the file data.
 */
 struct SendFileRequest
 {
@@ -57,8 +84,8 @@ struct SendFileRequest
 	uint32_t originalFileSize;
 	uint16_t packetNumber;
 	uint16_t totalPackets;
-	std::string fileName;
-	std::vector<char> content;  // for binary data
+	std::string_view fileName;
+	ByteSpan content;  // for binary data
 };
 
 
@@ -75,6 +102,21 @@ struct CRCRequest
 };
 
 
+/**
+ * @struct	FileCRCRequest
+ *
+ * @brief	The CRC of a deferred file.
+ *
+ * This struct represents a payload that contains the name of a file and the CRC of its content,
+ * which the server checks after it stored the file.
+*/
+struct FileCRCRequest
+{
+	std::string fileName;
+	uint32_t crc;
+};
+
+
 /**
  * @struct	ClientIDResponse
  *
@@ -84,7 +126,7 @@ struct CRCRequest
 */
 struct ClientIDResponse
 {
-	std::vector<char> clientID;
+	ClientID clientID;
 };
 
 
@@ -97,7 +139,7 @@ struct ClientIDResponse
 */
 struct SymmetricKeyResponse
 {
-	std::vector<char> clientID;
+	ClientID clientID;
 	std::vector<char> symmetricKey;
 };
 
@@ -111,13 +153,30 @@ struct SymmetricKeyResponse
 */
 struct FileResponse
 {
-	std::vector<char> clientID;
+	ClientID clientID;
 	uint32_t contentSize;
 	std::string fileName;
 	uint32_t crc;
 };
 
 
+/**
+ * @struct	PackResponse
+ *
+ * @brief	A pack response.
+ *
+ * This struct represents a payload that contains the CRC the server calculated for every file
+ * of a pack, in the order of the pack's index.
+*/
+struct PackResponse
+{
+	ClientID clientID;
+	std::string fileName;
+	uint32_t fileCount;
+	std::vector<uint32_t> crcs;
+};
+
+
 /**
  * @struct	ErrorResponse
  *
@@ -0,0 +1,282 @@
+#include "perf-counters.h"
+#include "metrics.h"
+
+#include <fstream>
+#include <iomanip>
+#include <cerrno>
+#include <cstring>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+
+static const char* EVENT_NAMES[] = { "cycles", "instructions", "L1D misses", "cache misses", "branch misses" };
+
+
+#ifdef __linux__
+
+/**
+* @brief The group of counters of a thread, the first counter that could be opened leads it.
+*/
+struct ThreadCounters
+{
+	std::array<int, PerfCounters::EVENTS> fds;
+	std::array<size_t, PerfCounters::EVENTS> slots;  // the position of every counter in a read of the group
+	int leader = -1;
+	size_t opened = 0;
+	bool tried = false;
+	int error = 0;  // the errno of the first counter that couldn't be opened
+
+	ThreadCounters()
+	{
+		fds.fill(-1);
+		slots.fill(0);
+	}
+
+	~ThreadCounters()
+	{
+		for (int fd : fds)
+		{
+			if (fd >= 0)
+			{
+				close(fd);
+			}
+		}
+	}
+};
+
+thread_local ThreadCounters threadCounters;
+
+
+static int openCounter(PerfEvent event, int group)
+{
+	perf_event_attr attr;
+	std::memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HARDWARE;
+	switch (event)
+	{
+	case PerfEvent::CYCLES:
+		attr.config = PERF_COUNT_HW_CPU_CYCLES;
+		break;
+	case PerfEvent::INSTRUCTIONS:
+		attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+		break;
+	case PerfEvent::L1D_MISSES:
+		attr.type = PERF_TYPE_HW_CACHE;
+		attr.config = PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+		break;
+	case PerfEvent::CACHE_MISSES:
+		attr.config = PERF_COUNT_HW_CACHE_MISSES;
+		break;
+	default:
+		attr.config = PERF_COUNT_HW_BRANCH_MISSES;
+		break;
+	}
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+	return static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, group, PERF_FLAG_FD_CLOEXEC));
+}
+
+
+static void openThreadCounters()
+{
+	auto& counters = threadCounters;
+	counters.tried = true;
+	for (size_t i = 0; i < PerfCounters::EVENTS; i++)
+	{
+		int fd = openCounter(static_cast<PerfEvent>(i), counters.leader);
+		if (fd < 0)
+		{
+			if (counters.error == 0)
+			{
+				counters.error = errno;
+			}
+			continue;
+		}
+		if (counters.leader < 0)
+		{
+			counters.leader = fd;
+		}
+		counters.fds[i] = fd;
+		counters.slots[i] = counters.opened++;
+	}
+}
+
+
+static std::string describeError(int error)
+{
+	if (error == EACCES || error == EPERM)
+	{
+		std::string paranoid;
+		std::ifstream file("/proc/sys/kernel/perf_event_paranoid");
+		file >> paranoid;
+		return "not permitted (kernel.perf_event_paranoid is " + (paranoid.empty() ? "unknown" : paranoid) + ")";
+	}
+	if (error == ENOENT || error == EOPNOTSUPP || error == ENODEV)
+	{
+		return "the CPU or the VM has no hardware counters";
+	}
+	if (error == ENOSYS)
+	{
+		return "the kernel doesn't support perf_event_open";
+	}
+	return std::strerror(error);
+}
+
+#endif
+
+
+PerfCounters::PerfCounters()
+	: _stages(std::make_unique<StageCounts[]>(static_cast<size_t>(Stage::COUNT)))
+{
+}
+
+
+PerfCounters& PerfCounters::instance()
+{
+	static PerfCounters counters;
+	return counters;
+}
+
+
+bool PerfCounters::enable(std::string& error)
+{
+#ifdef __linux__
+	// open the counters of the calling thread, the other threads fail the same way if they fail
+	PerfSample sample;
+	if (!instance().read(sample))
+	{
+		error = describeError(threadCounters.error);
+		return false;
+	}
+	_enabled.store(true, std::memory_order_relaxed);
+	return true;
+#else
+	error = "hardware counters are only supported on Linux";
+	return false;
+#endif
+}
+
+
+bool PerfCounters::read(PerfSample& sample)
+{
+#ifdef __linux__
+	auto& counters = threadCounters;
+	if (!counters.tried)
+	{
+		openThreadCounters();
+		for (size_t i = 0; i < EVENTS; i++)
+		{
+			if (counters.fds[i] >= 0)
+			{
+				_available[i].store(true, std::memory_order_relaxed);
+			}
+		}
+	}
+	if (counters.leader < 0)
+	{
+		return false;
+	}
+
+	struct
+	{
+		uint64_t count;
+		uint64_t timeEnabled;
+		uint64_t timeRunning;
+		uint64_t values[EVENTS];
+	} data;
+	if (::read(counters.leader, &data, sizeof(data)) < 0 || data.timeRunning == 0)
+	{
+		return false;
+	}
+
+	// the group was multiplexed with other groups, extrapolate to the time it was enabled
+	double scale = static_cast<double>(data.timeEnabled) / data.timeRunning;
+	for (size_t i = 0; i < EVENTS; i++)
+	{
+		sample.values[i] = (counters.fds[i] >= 0) ? static_cast<uint64_t>(data.values[counters.slots[i]] * scale) : 0;
+	}
+	return true;
+#else
+	(void)sample;
+	return false;
+#endif
+}
+
+
+void PerfCounters::add(Stage stage, const PerfSample& start, const PerfSample& end, size_t bytes)
+{
+	auto& counts = _stages[static_cast<size_t>(stage)];
+	for (size_t i = 0; i < EVENTS; i++)
+	{
+		if (end.values[i] > start.values[i])
+		{
+			counts.values[i].fetch_add(end.values[i] - start.values[i], std::memory_order_relaxed);
+		}
+	}
+	counts.bytes.fetch_add(bytes, std::memory_order_relaxed);
+	counts.samples.fetch_add(1, std::memory_order_relaxed);
+}
+
+
+void PerfCounters::report(std::ostream& out) const
+{
+	auto available = [this](PerfEvent event) {
+		return _available[static_cast<size_t>(event)].load(std::memory_order_relaxed);
+	};
+	auto value = [](const StageCounts& counts, PerfEvent event) {
+		return static_cast<double>(counts.values[static_cast<size_t>(event)].load(std::memory_order_relaxed));
+	};
+	auto cell = [&out](bool valid, double number) {
+		if (valid)
+		{
+			out << std::setw(14) << number;
+		}
+		else
+		{
+			out << std::setw(14) << "n/a";
+		}
+	};
+
+	out << "Hardware counters (user space):" << std::endl;
+	out << std::left << std::setw(11) << "Stage" << std::right << std::setw(14) << "Bytes" << std::setw(14) << "IPC"
+		<< std::setw(14) << "Cycles/B" << std::setw(14) << "L1D miss/B" << std::setw(14) << "LLC miss/B"
+		<< std::setw(14) << "Br miss/B" << std::endl;
+	auto flags = out.flags();
+	auto precision = out.precision();
+	out << std::fixed << std::setprecision(4);
+	for (size_t i = 0; i < static_cast<size_t>(Stage::COUNT); i++)
+	{
+		const auto& counts = _stages[i];
+		if (counts.samples.load(std::memory_order_relaxed) == 0)
+		{
+			continue;
+		}
+		auto bytes = static_cast<double>(counts.bytes.load(std::memory_order_relaxed));
+		double cycles = value(counts, PerfEvent::CYCLES);
+		out << std::left << std::setw(11) << stageName(static_cast<Stage>(i)) << std::right
+			<< std::setw(14) << static_cast<uint64_t>(bytes);
+		cell(available(PerfEvent::CYCLES) && available(PerfEvent::INSTRUCTIONS) && cycles > 0,
+			value(counts, PerfEvent::INSTRUCTIONS) / cycles);
+		cell(available(PerfEvent::CYCLES) && bytes > 0, cycles / bytes);
+		cell(available(PerfEvent::L1D_MISSES) && bytes > 0, value(counts, PerfEvent::L1D_MISSES) / bytes);
+		cell(available(PerfEvent::CACHE_MISSES) && bytes > 0, value(counts, PerfEvent::CACHE_MISSES) / bytes);
+		cell(available(PerfEvent::BRANCH_MISSES) && bytes > 0, value(counts, PerfEvent::BRANCH_MISSES) / bytes);
+		out << std::endl;
+	}
+	out.flags(flags);
+	out.precision(precision);
+
+	for (size_t i = 0; i < EVENTS; i++)
+	{
+		if (!_available[i].load(std::memory_order_relaxed))
+		{
+			out << "The CPU doesn't count " << EVENT_NAMES[i] << "." << std::endl;
+		}
+	}
+}
@@ -0,0 +1,111 @@
+#ifndef PERF_COUNTERS_H
+#define PERF_COUNTERS_H
+
+
+#include <array>
+#include <atomic>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <cstdint>
+#include <cstddef>
+
+
+enum class Stage;
+
+
+/**
+* @brief The hardware events that are counted.
+*/
+enum class PerfEvent
+{
+	CYCLES,
+	INSTRUCTIONS,
+	L1D_MISSES,      // L1 data cache read misses
+	CACHE_MISSES,    // last level cache misses
+	BRANCH_MISSES,
+	COUNT
+};
+
+
+/**
+* @brief The counts of the events of a thread at one point in time.
+*/
+struct PerfSample
+{
+	std::array<uint64_t, static_cast<size_t>(PerfEvent::COUNT)> values{};
+};
+
+
+/**
+* @brief PerfCounters class
+*
+* Counts the cycles, instructions, cache misses and branch misses of every stage of a transfer with the
+* hardware counters of Linux' perf_event_open. Every thread opens a group of counters of its own the first
+* time it runs a stage, so the stages on the thread pool are counted on the thread that runs them. Only
+* the user space is counted, which is what the CRC and the encryption run in.
+*
+* The counters are off by default. When the kernel doesn't permit them (perf_event_paranoid, containers)
+* or the CPU doesn't have them (most VMs), enable fails with the reason and nothing is counted; an event
+* the CPU doesn't have is left out of the report.
+*/
+class PerfCounters
+{
+public:
+	static constexpr size_t EVENTS = static_cast<size_t>(PerfEvent::COUNT);
+
+	/**
+	* @brief Get the counters of the process.
+	*/
+	static PerfCounters& instance();
+
+	/**
+	* @brief Check if the stages are counted.
+	*/
+	static bool enabled()
+	{
+		return _enabled.load(std::memory_order_relaxed);
+	}
+
+	/**
+	* @brief Start counting the stages.
+	*
+	* @param error set to the reason the counters are not available.
+	* @return true if the counters could be opened.
+	*/
+	static bool enable(std::string& error);
+
+	/**
+	* @brief Read the counters of the calling thread, opening them on its first call.
+	*
+	* @return false if the counters of the thread couldn't be opened.
+	*/
+	bool read(PerfSample& sample);
+
+	/**
+	* @brief Add the events between two samples of the calling thread to a stage.
+	*/
+	void add(Stage stage, const PerfSample& start, const PerfSample& end, size_t bytes);
+
+	/**
+	* @brief Write the IPC, the misses per byte and the cycles per byte of every stage.
+	*/
+	void report(std::ostream& out) const;
+
+private:
+	struct StageCounts
+	{
+		std::array<std::atomic<uint64_t>, EVENTS> values{};
+		std::atomic<uint64_t> bytes{ 0 };
+		std::atomic<uint64_t> samples{ 0 };
+	};
+
+	PerfCounters();
+
+	static inline std::atomic<bool> _enabled{ false };
+
+	std::unique_ptr<StageCounts[]> _stages;
+	std::array<std::atomic<bool>, EVENTS> _available{};  // the events that could be opened
+};
+
+#endif // PERF_COUNTERS_H
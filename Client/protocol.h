@@ -10,7 +10,6 @@
 
 
 constexpr uint8_t CLIENT_VERSION = 3;
-constexpr size_t CLIENT_ID_SIZE = 16;
 
 /**
 * @brief A union for the dynamic payload.
@@ -19,9 +18,11 @@ using Payload = std::variant<NameRequest
 	, SendPublickKeyRequest
 	, SendFileRequest
 	, CRCRequest
+	, FileCRCRequest
 	, ClientIDResponse
 	, SymmetricKeyResponse
 	, FileResponse
+	, PackResponse
 	, ErrorResponse>;
 
 /**
@@ -29,7 +30,7 @@ using Payload = std::variant<NameRequest
 */
 struct Request
 {
-	std::vector<char> clientID;
+	ClientID clientID;
 	uint8_t version;
 	uint16_t opCode;
 	uint32_t payloadSize;
@@ -56,6 +57,9 @@ enum class RequestCode : uint16_t
 	REQUEST_PUBLIC_KEY = 826,
 	REQUEST_LOGIN = 827,
 	REQUEST_SEND_FILE = 828,
+	REQUEST_SEND_PACK = 829,
+	REQUEST_SEND_FILE_DEFERRED = 830,  // stored as it was received, verified by the server later
+	REQUEST_FILE_CRC = 831,  // the CRC of a deferred file, right after its content
 
 	REQUEST_CRC_VALID = 900,
 	REQUEST_CRC_INVALID = 901,
@@ -74,7 +78,23 @@ enum class ResponseCode : uint16_t
 	RESPONSE_ACK = 1604,
 	RESPONSE_LOGIN = 1605,
 	RESPONSE_LOGIN_FAILED = 1606,
-	RESPONSE_ERROR = 1607
+	RESPONSE_ERROR = 1607,
+	RESPONSE_PACK_VALID = 1608,
+	RESPONSE_FILE_STORED = 1609
 };
 
+/**
+* @brief The layout of a pack, the content of a REQUEST_SEND_PACK.
+*
+* A pack bundles many small files into one stream: a little endian file count, an index entry
+* for every file (name, offset of the data from the start of the pack, size, CRC) and then the
+* data of the files, back to back. The whole pack is encrypted and sent like a single file.
+*/
+constexpr size_t PACK_OFFSET_SIZE = 4;
+constexpr size_t PACK_ENTRY_SIZE = FILE_NAME_SIZE + PACK_OFFSET_SIZE + CONTENT_SIZE + CRC_SIZE;
+constexpr size_t PACK_MAX_FILE_SIZE = 64 * 1024;  // bigger files are sent on their own
+constexpr size_t PACK_MAX_SIZE = 4 * 1024 * 1024;
+constexpr size_t PACK_MAX_FILES = 1024;
+constexpr size_t PACK_MIN_FILES = 2;  // a single small file is sent on its own
+
 #endif
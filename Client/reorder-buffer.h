@@ -0,0 +1,114 @@
+#ifndef REORDER_BUFFER_H
+#define REORDER_BUFFER_H
+
+
+#include <condition_variable>
+#include <exception>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <vector>
+#include <cstddef>
+
+
+/**
+* @brief ReorderBuffer class
+*
+* Collects items that are produced out of order, for example packets that were processed on a
+* thread pool, and hands them out in sequence order. The buffer holds a fixed window of items,
+* the producer must not run more than window() items ahead of the consumer.
+*
+* @tparam T the type of the items
+*/
+template <typename T>
+class ReorderBuffer
+{
+public:
+	/**
+	* @brief Constructor
+	*
+	* @param window the maximum number of items in flight.
+	* @param first the sequence number of the first item.
+	*/
+	explicit ReorderBuffer(size_t window, size_t first = 0)
+		: _slots(window)
+		, _next(first)
+		, _error()
+	{
+	}
+
+	/**
+	* @brief Add an item, can be called from any thread.
+	*
+	* @param sequence the sequence number of the item
+	* @param item the item
+	* @throws std::out_of_range if the item is outside the window.
+	*/
+	void push(size_t sequence, T item)
+	{
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			if (sequence < _next || sequence >= _next + _slots.size())
+			{
+				throw std::out_of_range("Sequence number is outside of the reorder window");
+			}
+			_slots[sequence % _slots.size()] = std::move(item);
+		}
+		_ready.notify_all();
+	}
+
+	/**
+	* @brief Wait for the next item in sequence and take it.
+	*
+	* @return the next item
+	* @throws the error that was reported with fail().
+	*/
+	T pop()
+	{
+		std::unique_lock<std::mutex> lock(_mutex);
+		auto& slot = _slots[_next % _slots.size()];
+		_ready.wait(lock, [&] { return slot.has_value() || _error; });
+		if (_error)
+		{
+			std::rethrow_exception(_error);
+		}
+		T item = std::move(*slot);
+		slot.reset();
+		_next++;
+		return item;
+	}
+
+	/**
+	* @brief Report a producer error, the consumer gets it from pop().
+	*
+	* @param error the error
+	*/
+	void fail(std::exception_ptr error)
+	{
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			if (!_error)
+			{
+				_error = error;
+			}
+		}
+		_ready.notify_all();
+	}
+
+	/**
+	* @brief Get the number of items that can be in flight.
+	*/
+	size_t window() const
+	{
+		return _slots.size();
+	}
+
+private:
+	std::mutex _mutex;
+	std::condition_variable _ready;
+	std::vector<std::optional<T>> _slots;
+	size_t _next;
+	std::exception_ptr _error;
+};
+
+#endif // REORDER_BUFFER_H
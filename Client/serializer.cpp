@@ -5,64 +5,23 @@
 #include <cstring>
 
 
+constexpr size_t REQUEST_HEADER_SIZE = CLIENT_ID_SIZE + sizeof(Request::version) + sizeof(Request::opCode) + sizeof(Request::payloadSize);
 
-std::vector<char> Serializer::serializeRequest(const Request& request)
-{
-	// Calculate the total size needed for serialization
-	size_t totalSize = CLIENT_ID_SIZE + sizeof(request.version) + sizeof(request.opCode) + sizeof(request.payloadSize) + request.payloadSize;
-	std::vector<char> buffer(totalSize,'\0');
-
-	uint8_t version = request.version;
-	uint16_t opCode = request.opCode;
-	uint32_t payloadSize = request.payloadSize;
-
-	// Convert the request members to little endian if necessary
-	if (EndianConverter::isBigEndian())
-	{
-		// Convert the request members to little endian
-		EndianConverter::toLittleEndian(version);
-		EndianConverter::toLittleEndian(opCode);
-		EndianConverter::toLittleEndian(payloadSize);
-	}
-
-	size_t offset = 0;
-
-	// Serialize the request header members
-	std::memcpy(buffer.data() + offset, request.clientID.data(), CLIENT_ID_SIZE);
-	offset += CLIENT_ID_SIZE;
-	std::memcpy(buffer.data() + offset, &version, sizeof(version));
-	offset += sizeof(version);
-	std::memcpy(buffer.data() + offset, &opCode, sizeof(opCode));
-	offset += sizeof(opCode);
-	std::memcpy(buffer.data() + offset, &payloadSize, sizeof(payloadSize));
-	offset += sizeof(payloadSize);
 
-	// Serialize the payload
-	auto payloadData = serializePayload(request.payload, request.payloadSize);
-	std::memcpy(buffer.data() + offset, payloadData.data(), payloadData.size());
-	
-	return buffer;
-}
-
-// Helper functions for serialization
-std::vector<char> serializeNameRequest(const NameRequest& p, uint32_t payloadSize)
+// Helper functions for serialization, each one writes the payload to out.
+void serializeNameRequest(const NameRequest& p, char* out)
 {
-	std::vector<char> buffer(payloadSize,'\0');
-	std::memcpy(buffer.data(), p.name.c_str(), p.name.size());
-	return buffer;
+	std::memcpy(out, p.name.c_str(), p.name.size());
 }
 
-std::vector<char> serializeSendPublicKeyRequest(const SendPublickKeyRequest& p, uint32_t payloadSize)
+void serializeSendPublicKeyRequest(const SendPublickKeyRequest& p, char* out)
 {
-	std::vector<char> buffer(payloadSize,'\0');
-	std::memcpy(buffer.data(), p.name.c_str(), p.name.size());
-	std::memcpy(buffer.data() + NAME_SIZE, p.publicKey.data(), PUBLIC_KEY_SIZE);
-	return buffer;
+	std::memcpy(out, p.name.c_str(), p.name.size());
+	std::memcpy(out + NAME_SIZE, p.publicKey.data(), PUBLIC_KEY_SIZE);
 }
 
-std::vector<char> serializeSendFileRequest(const SendFileRequest& p, uint32_t payloadSize)
+void serializeSendFileRequest(const SendFileRequest& p, char* out)
 {
-	std::vector<char> buffer(payloadSize,'\0');
 	size_t offset = 0;
 
 	uint32_t contentSize = p.contentSize;
@@ -78,48 +37,57 @@ std::vector<char> serializeSendFileRequest(const SendFileRequest& p, uint32_t pa
 		EndianConverter::toLittleEndian(totalPackets);
 	}
 
-	std::memcpy(buffer.data() + offset, &contentSize, CONTENT_SIZE);
+	std::memcpy(out + offset, &contentSize, CONTENT_SIZE);
 	offset += CONTENT_SIZE;
-	std::memcpy(buffer.data() + offset, &originalFileSize, ORIGINAL_FILE_SIZE);
+	std::memcpy(out + offset, &originalFileSize, ORIGINAL_FILE_SIZE);
 	offset += ORIGINAL_FILE_SIZE;
-	std::memcpy(buffer.data() + offset, &packetNumber, PACKET_NUMBER_SIZE);
+	std::memcpy(out + offset, &packetNumber, PACKET_NUMBER_SIZE);
 	offset += PACKET_NUMBER_SIZE;
-	std::memcpy(buffer.data() + offset, &totalPackets, TOTAL_PACKETS_SIZE);
+	std::memcpy(out + offset, &totalPackets, TOTAL_PACKETS_SIZE);
 	offset += TOTAL_PACKETS_SIZE;
-	std::memcpy(buffer.data() + offset, p.fileName.c_str(), p.fileName.size());
+	std::memcpy(out + offset, p.fileName.data(), p.fileName.size());
 	offset += FILE_NAME_SIZE;
-	std::memcpy(buffer.data() + offset, p.content.data(), p.contentSize);
+	std::memcpy(out + offset, p.content.data, p.contentSize);
+}
 
-	return buffer;
+void serializeCRCRequest(const CRCRequest& p, char* out)
+{
+	std::memcpy(out, p.fileName.c_str(), p.fileName.size());
 }
 
-std::vector<char> serializeCRCRequest(const CRCRequest& p, uint32_t payloadSize)
+void serializeFileCRCRequest(const FileCRCRequest& p, char* out)
 {
-	std::vector<char> buffer(payloadSize);
-	std::memcpy(buffer.data(), p.fileName.c_str(), p.fileName.size());
-	return buffer;
+	uint32_t crc = p.crc;
+	EndianConverter::toLittleEndian(crc);
+	std::memcpy(out, p.fileName.c_str(), p.fileName.size());
+	std::memcpy(out + FILE_NAME_SIZE, &crc, CRC_SIZE);
 }
 
-std::vector<char> Serializer::serializePayload(const Payload& payload, uint32_t payloadSize)
+// Writes the payload at the given position of the buffer, the buffer must already hold payloadSize zeroed bytes.
+void writePayload(const Payload& payload, char* out)
 {
-	return std::visit([payloadSize](const auto& p) -> std::vector<char>
+	std::visit([out](const auto& p)
 		{
 		using T = std::decay_t<decltype(p)>;
 		if constexpr (std::is_same_v<T, NameRequest>)
 		{
-			return serializeNameRequest(p, payloadSize);
+			serializeNameRequest(p, out);
 		}
 		else if constexpr (std::is_same_v<T, SendPublickKeyRequest>)
 		{
-			return serializeSendPublicKeyRequest(p, payloadSize);
+			serializeSendPublicKeyRequest(p, out);
 		}
 		else if constexpr (std::is_same_v<T, SendFileRequest>)
 		{
-			return serializeSendFileRequest(p, payloadSize);
+			serializeSendFileRequest(p, out);
 		}
 		else if constexpr (std::is_same_v<T, CRCRequest>)
 		{
-			return serializeCRCRequest(p, payloadSize);
+			serializeCRCRequest(p, out);
+		}
+		else if constexpr (std::is_same_v<T, FileCRCRequest>)
+		{
+			serializeFileCRCRequest(p, out);
 		}
 		else
 		{
@@ -128,6 +96,81 @@ std::vector<char> Serializer::serializePayload(const Payload& payload, uint32_t
 		}, payload);
 }
 
+
+// Writes the request at the given position of the buffer, the buffer must already hold the zeroed request.
+void writeRequest(const Request& request, char* out)
+{
+	uint8_t version = request.version;
+	uint16_t opCode = request.opCode;
+	uint32_t payloadSize = request.payloadSize;
+
+	// Convert the request members to little endian if necessary
+	if (EndianConverter::isBigEndian())
+	{
+		// Convert the request members to little endian
+		EndianConverter::toLittleEndian(version);
+		EndianConverter::toLittleEndian(opCode);
+		EndianConverter::toLittleEndian(payloadSize);
+	}
+
+	size_t offset = 0;
+
+	// Serialize the request header members
+	std::memcpy(out + offset, request.clientID.data(), CLIENT_ID_SIZE);
+	offset += CLIENT_ID_SIZE;
+	std::memcpy(out + offset, &version, sizeof(version));
+	offset += sizeof(version);
+	std::memcpy(out + offset, &opCode, sizeof(opCode));
+	offset += sizeof(opCode);
+	std::memcpy(out + offset, &payloadSize, sizeof(payloadSize));
+	offset += sizeof(payloadSize);
+
+	// Serialize the payload in place
+	writePayload(request.payload, out + offset);
+}
+
+
+void Serializer::serializeRequest(const Request& request, std::vector<char>& buffer)
+{
+	// Calculate the total size needed for serialization
+	size_t totalSize = REQUEST_HEADER_SIZE + request.payloadSize;
+	buffer.assign(totalSize, '\0');  // keeps the capacity of a reused buffer
+	writeRequest(request, buffer.data());
+}
+
+
+void Serializer::serializeRequest(const Request& request, PooledBuffer& buffer)
+{
+	size_t totalSize = REQUEST_HEADER_SIZE + request.payloadSize;
+	if (totalSize > buffer.capacity())
+	{
+		throw SerializationError("Request is larger than the packet buffer");
+	}
+	buffer.resize(totalSize);
+	std::memset(buffer.data(), 0, totalSize);
+	writeRequest(request, buffer.data());
+}
+
+
+void Serializer::serializePayload(const Payload& payload, uint32_t payloadSize, std::vector<char>& buffer)
+{
+	buffer.assign(payloadSize, '\0');
+	writePayload(payload, buffer.data());
+}
+
+
+void Serializer::serializePayload(const Payload& payload, uint32_t payloadSize, PooledBuffer& buffer)
+{
+	if (payloadSize > buffer.capacity())
+	{
+		throw SerializationError("Payload is larger than the packet buffer");
+	}
+	buffer.resize(payloadSize);
+	std::memset(buffer.data(), 0, payloadSize);
+	writePayload(payload, buffer.data());
+}
+
+
 Response Serializer::deserializeResponse(const std::vector<char>& buffer)
 {
 	if (buffer.size() < sizeof(Response::version) + sizeof(Response::opCode) + sizeof(Response::payloadSize))
@@ -152,50 +195,77 @@ Response Serializer::deserializeResponse(const std::vector<char>& buffer)
 	std::memcpy(&response.payloadSize, buffer.data() + offset, sizeof(response.payloadSize));
 	offset += sizeof(response.payloadSize);
 
-	// Copy payload
-	auto payloadData = std::vector<char>(buffer.begin() + offset, buffer.end());
-	
-	response.payload = deserializePayload(payloadData, response.opCode);
+	// Parse the payload straight out of the receive buffer
+	response.payload = deserializePayload(buffer.data() + offset, buffer.size() - offset, response.opCode);
 	
 	return response;
 }
 
 
-Payload Serializer::deserializePayload(const std::vector<char>& buffer, uint16_t opCode)
+Payload Serializer::deserializePayload(const char* data, size_t size, uint16_t opCode)
 {
 	auto code = static_cast<ResponseCode>(opCode);
 
 	if (code == ResponseCode::RESPONSE_REGISTRATION || code == ResponseCode::RESPONSE_ACK || code == ResponseCode::RESPONSE_LOGIN_FAILED)
 	{
+		if (size < CLIENT_ID_SIZE)
+		{
+			throw SerializationError("Response payload is too short");
+		}
 		ClientIDResponse clientIDResponse;
-		clientIDResponse.clientID.resize(CLIENT_ID_SIZE);
-		std::copy(buffer.begin(), buffer.begin() + CLIENT_ID_SIZE, clientIDResponse.clientID.begin());
+		std::memcpy(clientIDResponse.clientID.data(), data, CLIENT_ID_SIZE);
 		return clientIDResponse;
 	}
 	else if (code == ResponseCode::RESPONSE_AES_KEY || code == ResponseCode::RESPONSE_LOGIN)
 	{
+		if (size < CLIENT_ID_SIZE)
+		{
+			throw SerializationError("Response payload is too short");
+		}
 		SymmetricKeyResponse symmetricKeyResponse;
-		symmetricKeyResponse.clientID.resize(CLIENT_ID_SIZE);
-		symmetricKeyResponse.symmetricKey.resize(buffer.size() - CLIENT_ID_SIZE);
-		std::copy(buffer.begin(), buffer.begin() + CLIENT_ID_SIZE, symmetricKeyResponse.clientID.begin());
-		std::copy(buffer.begin() + CLIENT_ID_SIZE, buffer.end(), symmetricKeyResponse.symmetricKey.begin());
+		std::memcpy(symmetricKeyResponse.clientID.data(), data, CLIENT_ID_SIZE);
+		symmetricKeyResponse.symmetricKey.assign(data + CLIENT_ID_SIZE, data + size);
 		return symmetricKeyResponse;
 	}
-	else if (code == ResponseCode::RESPONSE_FILE_VALID)
+	else if (code == ResponseCode::RESPONSE_FILE_VALID || code == ResponseCode::RESPONSE_FILE_STORED)
 	{
+		if (size < CLIENT_ID_SIZE + CONTENT_SIZE + FILE_NAME_SIZE + CRC_SIZE)
+		{
+			throw SerializationError("Response payload is too short");
+		}
 		FileResponse fileResponse;
 		size_t offset = 0;
-		fileResponse.clientID.resize(CLIENT_ID_SIZE);
-		std::copy(buffer.begin() + offset, buffer.begin() + offset + CLIENT_ID_SIZE, fileResponse.clientID.begin());
+		std::memcpy(fileResponse.clientID.data(), data + offset, CLIENT_ID_SIZE);
 		offset += CLIENT_ID_SIZE;
-		std::memcpy(&fileResponse.contentSize, buffer.data() + offset, CONTENT_SIZE);
+		std::memcpy(&fileResponse.contentSize, data + offset, CONTENT_SIZE);
 		offset += CONTENT_SIZE;
-		fileResponse.fileName.resize(FILE_NAME_SIZE);
-		std::copy(buffer.begin() + offset, buffer.begin() + offset + FILE_NAME_SIZE, fileResponse.fileName.begin());
+		fileResponse.fileName.assign(data + offset, strnlen(data + offset, FILE_NAME_SIZE));
 		offset += FILE_NAME_SIZE;
-		std::memcpy(&fileResponse.crc, buffer.data() + offset, CRC_SIZE);
+		std::memcpy(&fileResponse.crc, data + offset, CRC_SIZE);
 		return fileResponse;
 	}
+	else if (code == ResponseCode::RESPONSE_PACK_VALID)
+	{
+		if (size < CLIENT_ID_SIZE + FILE_NAME_SIZE + FILE_COUNT_SIZE)
+		{
+			throw SerializationError("Response payload is too short");
+		}
+		PackResponse packResponse;
+		size_t offset = 0;
+		std::memcpy(packResponse.clientID.data(), data + offset, CLIENT_ID_SIZE);
+		offset += CLIENT_ID_SIZE;
+		packResponse.fileName.assign(data + offset, strnlen(data + offset, FILE_NAME_SIZE));
+		offset += FILE_NAME_SIZE;
+		std::memcpy(&packResponse.fileCount, data + offset, FILE_COUNT_SIZE);
+		offset += FILE_COUNT_SIZE;
+		if (size < offset + static_cast<size_t>(packResponse.fileCount) * CRC_SIZE)
+		{
+			throw SerializationError("Response payload is too short");
+		}
+		packResponse.crcs.resize(packResponse.fileCount);
+		std::memcpy(packResponse.crcs.data(), data + offset, packResponse.fileCount * CRC_SIZE);
+		return packResponse;
+	}
 	else if (code == ResponseCode::RESPONSE_REGISTRATION_FAILED || code == ResponseCode::RESPONSE_ERROR)
 	{
 		return ErrorResponse{};
@@ -3,25 +3,45 @@
 
 
 #include "protocol.h"
+#include "buffer-pool.h"
 
 #include <vector>
 #include <cstdint>
+#include <cstddef>
 
 
 /** 
 * @brief functions for serializing and deserializing the request and response
+*
+* The serialize functions write into a caller-owned buffer. The buffer is resized to the
+* serialized length, so a buffer that is reused across packets keeps its capacity and
+* does not allocate once it has grown to the packet size.
 */
 namespace Serializer
 {
 	/**
-	* @brief serializes the request
+	* @brief serializes the request into the given buffer
 	*/
-	std::vector<char> serializeRequest(const Request& request);
+	void serializeRequest(const Request& request, std::vector<char>& buffer);
+
+	/**
+	* @brief serializes the request into a buffer leased from a BufferPool
+	*
+	* @throws SerializationError if the request doesn't fit in the buffer.
+	*/
+	void serializeRequest(const Request& request, PooledBuffer& buffer);
 	
 	/**
-	* @brief Serializes the request's payload.
+	* @brief Serializes the request's payload into the given buffer.
+	*/
+	void serializePayload(const Payload& payload, uint32_t payloadSize, std::vector<char>& buffer);
+
+	/**
+	* @brief Serializes the request's payload into a buffer leased from a BufferPool.
+	*
+	* @throws SerializationError if the payload doesn't fit in the buffer.
 	*/
-	std::vector<char> serializePayload(const Payload& payload, uint32_t payloadSize);
+	void serializePayload(const Payload& payload, uint32_t payloadSize, PooledBuffer& buffer);
 
 	/**
 	* @brief Deserializes the response.
@@ -31,7 +51,7 @@ namespace Serializer
 	/** 
 	* @breif Deserializes the response's payload.
 	*/
-	Payload deserializePayload(const std::vector<char>& buffer, uint16_t opCode);
+	Payload deserializePayload(const char* data, size_t size, uint16_t opCode);
 }
 
 #endif // SERIALIZER_H
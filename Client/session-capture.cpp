@@ -0,0 +1,193 @@
+#include "session-capture.h"
+#include "connection.h"
+#include "endian.h"
+#include "exceptions.h"
+#include "payload.h"
+#include "protocol.h"
+
+#include <algorithm>
+#include <cstring>
+
+
+// the layout of the frames, to tell the requests from the file packets and to leave out the content
+constexpr size_t REQUEST_HEADER_SIZE = CLIENT_ID_SIZE + sizeof(Request::version) + sizeof(Request::opCode) + sizeof(Request::payloadSize);
+constexpr size_t OPCODE_OFFSET = CLIENT_ID_SIZE + sizeof(Request::version);
+constexpr size_t FILE_HEADER_SIZE = CONTENT_SIZE + ORIGINAL_FILE_SIZE + PACKET_NUMBER_SIZE + TOTAL_PACKETS_SIZE + FILE_NAME_SIZE;
+constexpr size_t TOTAL_PACKETS_OFFSET = CONTENT_SIZE + ORIGINAL_FILE_SIZE + PACKET_NUMBER_SIZE;
+constexpr size_t RECORD_HEADER_SIZE = 1 + 4 + 8 + 4 + 4;
+
+
+template <typename T>
+static T readLittleEndian(const char* data)
+{
+	T value;
+	std::memcpy(&value, data, sizeof(value));
+	EndianConverter::fromLittleEndian(value);
+	return value;
+}
+
+
+template <typename T>
+static void writeLittleEndian(char* out, T value)
+{
+	EndianConverter::toLittleEndian(value);
+	std::memcpy(out, &value, sizeof(value));
+}
+
+
+SessionCapture::SessionCapture()
+	: _mutex()
+	, _file()
+	, _start(std::chrono::steady_clock::now())
+	, _pendingPackets()
+	, _nextConnection(1)
+{
+}
+
+
+SessionCapture& SessionCapture::instance()
+{
+	static SessionCapture capture;
+	return capture;
+}
+
+
+bool SessionCapture::open(const std::string& path)
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	_file.open(path, std::ios::out | std::ios::binary | std::ios::trunc);
+	if (!_file.write(CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC)))
+	{
+		_file.close();
+		return false;
+	}
+	_start = std::chrono::steady_clock::now();
+	_enabled.store(true, std::memory_order_relaxed);
+	return true;
+}
+
+
+void SessionCapture::close()
+{
+	_enabled.store(false, std::memory_order_relaxed);
+	std::lock_guard<std::mutex> lock(_mutex);
+	if (_file.is_open())
+	{
+		_file.close();
+	}
+}
+
+
+uint32_t SessionCapture::newConnection()
+{
+	return _nextConnection.fetch_add(1, std::memory_order_relaxed);
+}
+
+
+void SessionCapture::recordSend(uint32_t connection, const char* data, size_t size)
+{
+	if (!enabled())
+	{
+		return;
+	}
+	std::lock_guard<std::mutex> lock(_mutex);
+	auto& pendingPackets = _pendingPackets[connection];
+	if (pendingPackets > 0)
+	{
+		// the next packet of a file, without a request header
+		pendingPackets--;
+		size_t frameSize = std::min(size, FILE_HEADER_SIZE);
+		write(CaptureKind::PACKET, connection, data, frameSize, size - frameSize);
+		return;
+	}
+
+	uint16_t opCode = (size >= REQUEST_HEADER_SIZE) ? readLittleEndian<uint16_t>(data + OPCODE_OFFSET) : 0;
+	bool content = (opCode == static_cast<uint16_t>(RequestCode::REQUEST_SEND_FILE)
+		|| opCode == static_cast<uint16_t>(RequestCode::REQUEST_SEND_FILE_DEFERRED)
+		|| opCode == static_cast<uint16_t>(RequestCode::REQUEST_SEND_PACK));
+	if (!content || size < REQUEST_HEADER_SIZE + FILE_HEADER_SIZE)
+	{
+		write(CaptureKind::REQUEST, connection, data, size, 0);
+		return;
+	}
+	uint16_t totalPackets = readLittleEndian<uint16_t>(data + REQUEST_HEADER_SIZE + TOTAL_PACKETS_OFFSET);
+	pendingPackets = (totalPackets > 0) ? totalPackets - 1 : 0;
+	write(CaptureKind::REQUEST, connection, data, REQUEST_HEADER_SIZE + FILE_HEADER_SIZE, size - REQUEST_HEADER_SIZE - FILE_HEADER_SIZE);
+}
+
+
+void SessionCapture::recordResponse(uint32_t connection, const char* data, size_t size)
+{
+	if (!enabled())
+	{
+		return;
+	}
+	std::lock_guard<std::mutex> lock(_mutex);
+	write(CaptureKind::RESPONSE, connection, data, size, 0);
+}
+
+
+void SessionCapture::write(CaptureKind kind, uint32_t connection, const char* data, size_t size, size_t contentSize)
+{
+	if (!_file.is_open())
+	{
+		return;
+	}
+	auto time = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - _start).count();
+
+	char header[RECORD_HEADER_SIZE];
+	header[0] = static_cast<char>(kind);
+	writeLittleEndian<uint32_t>(header + 1, connection);
+	writeLittleEndian<uint64_t>(header + 5, static_cast<uint64_t>(time));
+	writeLittleEndian<uint32_t>(header + 13, static_cast<uint32_t>(size));
+	writeLittleEndian<uint32_t>(header + 17, static_cast<uint32_t>(contentSize));
+	_file.write(header, sizeof(header));
+	_file.write(data, static_cast<std::streamsize>(size));
+}
+
+
+std::vector<CaptureRecord> SessionCapture::load(const std::string& path)
+{
+	std::ifstream file(path, std::ios::in | std::ios::binary);
+	if (!file.is_open())
+	{
+		throw FileError("Cannot open the capture " + path);
+	}
+	char magic[sizeof(CAPTURE_MAGIC)];
+	if (!file.read(magic, sizeof(magic)) || std::memcmp(magic, CAPTURE_MAGIC, sizeof(magic)) != 0)
+	{
+		throw FileError("Not a session capture: " + path);
+	}
+
+	std::vector<CaptureRecord> records;
+	char header[RECORD_HEADER_SIZE];
+	while (file.read(header, sizeof(header)))
+	{
+		CaptureRecord record;
+		auto kind = static_cast<uint8_t>(header[0]);
+		if (kind > static_cast<uint8_t>(CaptureKind::RESPONSE))
+		{
+			throw FileError("Invalid record in the capture " + path);
+		}
+		record.kind = static_cast<CaptureKind>(kind);
+		record.connection = readLittleEndian<uint32_t>(header + 1);
+		record.time = readLittleEndian<uint64_t>(header + 5);
+		auto size = readLittleEndian<uint32_t>(header + 13);
+		record.contentSize = readLittleEndian<uint32_t>(header + 17);
+		if (size > PACKET_LENGTH)
+		{
+			throw FileError("Invalid record in the capture " + path);
+		}
+		record.data.resize(size);
+		if (!file.read(record.data.data(), size))
+		{
+			throw FileError("The capture is truncated: " + path);
+		}
+		records.push_back(std::move(record));
+	}
+	if (!file.eof() || file.gcount() != 0)
+	{
+		throw FileError("The capture is truncated: " + path);
+	}
+	return records;
+}
@@ -0,0 +1,116 @@
+#ifndef SESSION_CAPTURE_H
+#define SESSION_CAPTURE_H
+
+
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+
+/**
+* @brief What a record of a capture holds.
+*/
+enum class CaptureKind : uint8_t
+{
+	REQUEST = 0,    // a request with its header, the first packet of a file or a pack
+	PACKET = 1,     // one of the next packets of a file or a pack
+	RESPONSE = 2
+};
+
+/**
+* @brief A framed request or response of a capture.
+*/
+struct CaptureRecord
+{
+	CaptureKind kind;
+	uint32_t connection;
+	uint64_t time;             // ns since the capture started, when the send started or the response was read
+	std::vector<char> data;    // the frame, without the content of a file packet
+	uint32_t contentSize;      // the bytes of file content that were left out
+};
+
+
+/**
+* @brief SessionCapture class
+*
+* Records every framed request and response of the connections with its time to a compact binary file,
+* for the replay tool to send the same traffic again. The content of the files is left out, only its size
+* is kept, so a capture holds the shape of a session but not the user's data; the names of the user and of
+* the files are kept.
+*
+* The file starts with CAPTURE_MAGIC, then every record is its kind (u8), connection (u32), time (u64),
+* frame size (u32) and content size (u32), little-endian, followed by the frame.
+*/
+class SessionCapture
+{
+public:
+	static constexpr char CAPTURE_MAGIC[8] = { 'B', 'K', 'C', 'A', 'P', '0', '0', '1' };
+
+	/**
+	* @brief Get the capture of the process.
+	*/
+	static SessionCapture& instance();
+
+	/**
+	* @brief Check if the connections are captured.
+	*/
+	static bool enabled()
+	{
+		return _enabled.load(std::memory_order_relaxed);
+	}
+
+	/**
+	* @brief Start capturing to a file.
+	*
+	* @return true if the file could be created.
+	*/
+	bool open(const std::string& path);
+
+	/**
+	* @brief Stop capturing and flush the file.
+	*/
+	void close();
+
+	/**
+	* @brief Get an id for a new connection.
+	*/
+	uint32_t newConnection();
+
+	/**
+	* @brief Record a frame that a connection sends.
+	*/
+	void recordSend(uint32_t connection, const char* data, size_t size);
+
+	/**
+	* @brief Record a response that a connection received.
+	*/
+	void recordResponse(uint32_t connection, const char* data, size_t size);
+
+	/**
+	* @brief Read the records of a capture file.
+	*
+	* @throws FileError if the file can't be read or isn't a capture.
+	*/
+	static std::vector<CaptureRecord> load(const std::string& path);
+
+private:
+	SessionCapture();
+
+	void write(CaptureKind kind, uint32_t connection, const char* data, size_t size, size_t contentSize);
+
+	static inline std::atomic<bool> _enabled{ false };
+
+	std::mutex _mutex;
+	std::ofstream _file;
+	std::chrono::steady_clock::time_point _start;
+	std::map<uint32_t, size_t> _pendingPackets;  // the packets every connection still sends of a file or a pack
+	std::atomic<uint32_t> _nextConnection;
+};
+
+#endif // SESSION_CAPTURE_H
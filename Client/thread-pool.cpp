@@ -0,0 +1,208 @@
+#include "thread-pool.h"
+#include "tracing.h"
+
+#include <algorithm>
+
+
+// The pool and the queue of the worker that runs on this thread, if any.
+thread_local ThreadPool* currentPool = nullptr;
+thread_local size_t currentQueue = 0;
+
+
+ThreadPool::ThreadPool(size_t threads)
+	: _queues()
+	, _workers()
+	, _mutex()
+	, _wakeUp()
+	, _pending(0)
+	, _nextQueue(0)
+	, _stopping(false)
+{
+	if (threads == 0)
+	{
+		threads = std::max<size_t>(1, std::thread::hardware_concurrency());
+	}
+	for (size_t i = 0; i < threads; i++)
+	{
+		_queues.push_back(std::make_unique<TaskQueue>());
+	}
+	for (size_t i = 0; i < threads; i++)
+	{
+		_workers.emplace_back(&ThreadPool::run, this, i);
+	}
+}
+
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_stopping = true;
+	}
+	_wakeUp.notify_all();
+	for (auto& worker : _workers)
+	{
+		worker.join();
+	}
+}
+
+
+void ThreadPool::post(std::function<void()> task)
+{
+	// a worker keeps its own tasks, other threads spread them over the queues.
+	size_t index = (currentPool == this)
+		? currentQueue
+		: _nextQueue.fetch_add(1, std::memory_order_relaxed) % _queues.size();
+	{
+		std::lock_guard<std::mutex> lock(_queues[index]->mutex);
+		_queues[index]->tasks.push_back(std::move(task));
+	}
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_pending++;
+	}
+	_wakeUp.notify_one();
+}
+
+
+size_t ThreadPool::size() const
+{
+	return _workers.size();
+}
+
+
+bool ThreadPool::popTask(size_t index, std::function<void()>& task)
+{
+	// the newest task of the own queue, its data is most likely still in the cache.
+	{
+		auto& own = *_queues[index];
+		std::lock_guard<std::mutex> lock(own.mutex);
+		if (!own.tasks.empty())
+		{
+			task = std::move(own.tasks.back());
+			own.tasks.pop_back();
+			return true;
+		}
+	}
+	// otherwise steal the oldest task of another worker.
+	for (size_t i = 1; i < _queues.size(); i++)
+	{
+		auto& victim = *_queues[(index + i) % _queues.size()];
+		std::lock_guard<std::mutex> lock(victim.mutex);
+		if (!victim.tasks.empty())
+		{
+			task = std::move(victim.tasks.front());
+			victim.tasks.pop_front();
+			return true;
+		}
+	}
+	return false;
+}
+
+
+void ThreadPool::run(size_t index)
+{
+	currentPool = this;
+	currentQueue = index;
+	Tracer::instance().nameThread("worker " + std::to_string(index));
+
+	while (true)
+	{
+		std::function<void()> task;
+		if (popTask(index, task))
+		{
+			_pending--;
+			task();
+			continue;
+		}
+
+		std::unique_lock<std::mutex> lock(_mutex);
+		_wakeUp.wait(lock, [this] { return _pending > 0 || _stopping; });
+		if (_stopping && _pending == 0)
+		{
+			return;
+		}
+	}
+}
+
+
+TaskChain::TaskChain(ThreadPool& pool)
+	: _pool(pool)
+	, _mutex()
+	, _idle()
+	, _tasks()
+	, _running(false)
+	, _error()
+{
+}
+
+
+TaskChain::~TaskChain()
+{
+	std::unique_lock<std::mutex> lock(_mutex);
+	_idle.wait(lock, [this] { return !_running; });
+}
+
+
+void TaskChain::post(std::function<void()> task)
+{
+	bool schedule = false;
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_tasks.push_back(std::move(task));
+		if (!_running)
+		{
+			_running = true;
+			schedule = true;
+		}
+	}
+	if (schedule)
+	{
+		_pool.post([this] { drain(); });
+	}
+}
+
+
+void TaskChain::wait()
+{
+	std::unique_lock<std::mutex> lock(_mutex);
+	_idle.wait(lock, [this] { return !_running; });
+	if (_error)
+	{
+		auto error = _error;
+		_error = nullptr;
+		std::rethrow_exception(error);
+	}
+}
+
+
+void TaskChain::drain()
+{
+	while (true)
+	{
+		std::function<void()> task;
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			if (_tasks.empty())
+			{
+				_running = false;
+				_idle.notify_all();
+				return;
+			}
+			task = std::move(_tasks.front());
+			_tasks.pop_front();
+		}
+		try
+		{
+			task();
+		}
+		catch (...)
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			if (!_error)
+			{
+				_error = std::current_exception();
+			}
+		}
+	}
+}
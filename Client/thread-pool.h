@@ -0,0 +1,130 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <cstddef>
+
+
+/**
+* @brief ThreadPool class
+*
+* A work-stealing thread pool for the CPU-heavy stages of a transfer (CRC, AES).
+* Every worker owns a task queue. Tasks posted from a worker go to its own queue, other tasks
+* are spread over the queues, and a worker that runs out of tasks steals from the others.
+* One pool is shared by all the files of a session, so the work scales to the number of cores
+* instead of the number of files.
+*/
+class ThreadPool
+{
+public:
+	/**
+	* @brief Constructor
+	*
+	* @param threads the number of workers, 0 for one worker per core.
+	*/
+	explicit ThreadPool(size_t threads = 0);
+
+	/**
+	* @brief Destructor
+	*
+	* Runs the tasks that are still queued and joins the workers.
+	*/
+	~ThreadPool();
+
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	/**
+	* @brief Queue a task to run on one of the workers.
+	*
+	* @param task the task, it must not throw.
+	*/
+	void post(std::function<void()> task);
+
+	/**
+	* @brief Get the number of workers.
+	*/
+	size_t size() const;
+
+private:
+	struct TaskQueue
+	{
+		std::mutex mutex;
+		std::deque<std::function<void()>> tasks;
+	};
+
+	void run(size_t index);
+	bool popTask(size_t index, std::function<void()>& task);
+
+	std::vector<std::unique_ptr<TaskQueue>> _queues;
+	std::vector<std::thread> _workers;
+	std::mutex _mutex;
+	std::condition_variable _wakeUp;
+	std::atomic<size_t> _pending;
+	std::atomic<size_t> _nextQueue;
+	bool _stopping;
+};
+
+
+/**
+* @brief TaskChain class
+*
+* Runs tasks on a ThreadPool one at a time, in the order they were posted. This is for the
+* stages that carry state from one chunk to the next, like the CBC chaining.
+* Different chains run in parallel.
+*/
+class TaskChain
+{
+public:
+	/**
+	* @brief Constructor
+	*
+	* @param pool the pool that runs the tasks.
+	*/
+	explicit TaskChain(ThreadPool& pool);
+
+	/**
+	* @brief Destructor
+	*
+	* Waits for the posted tasks to finish.
+	*/
+	~TaskChain();
+
+	TaskChain(const TaskChain&) = delete;
+	TaskChain& operator=(const TaskChain&) = delete;
+
+	/**
+	* @brief Queue a task after the ones that were already posted.
+	*
+	* @param task the task
+	*/
+	void post(std::function<void()> task);
+
+	/**
+	* @brief Wait until all the posted tasks ran.
+	*
+	* @throws the first exception thrown by a task.
+	*/
+	void wait();
+
+private:
+	void drain();
+
+	ThreadPool& _pool;
+	std::mutex _mutex;
+	std::condition_variable _idle;
+	std::deque<std::function<void()>> _tasks;
+	bool _running;
+	std::exception_ptr _error;
+};
+
+#endif // THREAD_POOL_H
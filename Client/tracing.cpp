@@ -0,0 +1,154 @@
+#include "tracing.h"
+
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+
+
+Tracer::Tracer()
+	: _start(std::chrono::steady_clock::now())
+	, _eventsPerThread(DEFAULT_EVENTS_PER_THREAD)
+	, _mutex()
+	, _buffers()
+{
+}
+
+
+Tracer& Tracer::instance()
+{
+	static Tracer tracer;
+	return tracer;
+}
+
+
+void Tracer::enable(size_t eventsPerThread)
+{
+	auto& tracer = instance();
+	{
+		std::lock_guard<std::mutex> lock(tracer._mutex);
+		tracer._eventsPerThread = std::max<size_t>(1, eventsPerThread);
+		tracer._start = std::chrono::steady_clock::now();
+	}
+	_enabled.store(true, std::memory_order_relaxed);
+}
+
+
+Tracer::ThreadBuffer& Tracer::threadBuffer()
+{
+	// the buffer of the calling thread, once it recorded a span
+	thread_local ThreadBuffer* current = nullptr;
+	if (current == nullptr)
+	{
+		auto buffer = std::make_unique<ThreadBuffer>();
+		std::lock_guard<std::mutex> lock(_mutex);
+		buffer->id = static_cast<uint32_t>(_buffers.size() + 1);
+		buffer->name = "thread " + std::to_string(buffer->id);
+		buffer->events.resize(_eventsPerThread);
+		current = buffer.get();
+		_buffers.push_back(std::move(buffer));
+	}
+	return *current;
+}
+
+
+void Tracer::nameThread(const std::string& name)
+{
+	if (!enabled())
+	{
+		return;
+	}
+	auto& buffer = threadBuffer();
+	std::lock_guard<std::mutex> lock(_mutex);
+	buffer.name = name;
+}
+
+
+void Tracer::record(const TraceEvent& event)
+{
+	auto& buffer = threadBuffer();
+	buffer.events[buffer.next] = event;
+	if (++buffer.next == buffer.events.size())
+	{
+		buffer.next = 0;
+		buffer.wrapped = true;
+	}
+}
+
+
+uint64_t Tracer::now() const
+{
+	return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now() - _start).count());
+}
+
+
+static void writeMicroseconds(std::ostream& out, uint64_t nanos)
+{
+	out << nanos / 1000 << '.' << std::setw(3) << std::setfill('0') << nanos % 1000 << std::setfill(' ');
+}
+
+
+static void writeString(std::ostream& out, const std::string& text)
+{
+	out << '"';
+	for (char c : text)
+	{
+		if (c == '"' || c == '\\')
+		{
+			out << '\\';
+		}
+		out << c;
+	}
+	out << '"';
+}
+
+
+bool Tracer::write(const std::string& path) const
+{
+	std::ofstream file(path, std::ios::trunc);
+	if (!file)
+	{
+		return false;
+	}
+
+	std::lock_guard<std::mutex> lock(_mutex);
+	file << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+	bool first = true;
+	auto separator = [&]() {
+		file << (first ? "\n" : ",\n");
+		first = false;
+	};
+	for (const auto& buffer : _buffers)
+	{
+		separator();
+		file << "{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":" << buffer->id << ",\"args\":{\"name\":";
+		writeString(file, buffer->name);
+		file << "}}";
+
+		// the oldest span first, it is at the next slot once the ring wrapped
+		size_t count = buffer->wrapped ? buffer->events.size() : buffer->next;
+		size_t oldest = buffer->wrapped ? buffer->next : 0;
+		for (size_t i = 0; i < count; i++)
+		{
+			const auto& event = buffer->events[(oldest + i) % buffer->events.size()];
+			separator();
+			file << "{\"ph\":\"X\",\"name\":\"" << event.name << "\",\"cat\":\"" << event.category
+				<< "\",\"pid\":1,\"tid\":" << buffer->id << ",\"ts\":";
+			writeMicroseconds(file, event.start);
+			file << ",\"dur\":";
+			writeMicroseconds(file, event.duration);
+			if (event.argNames[0] != nullptr)
+			{
+				file << ",\"args\":{";
+				for (size_t arg = 0; arg < TraceEvent::MAX_ARGS && event.argNames[arg] != nullptr; arg++)
+				{
+					file << (arg ? "," : "") << '"' << event.argNames[arg] << "\":" << event.argValues[arg];
+				}
+				file << "}";
+			}
+			file << "}";
+		}
+	}
+	file << "\n]}\n";
+	return static_cast<bool>(file);
+}
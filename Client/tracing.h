@@ -0,0 +1,185 @@
+#ifndef TRACING_H
+#define TRACING_H
+
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+
+/**
+* @brief A span of the timeline, as it is kept in a thread's ring buffer.
+*
+* The names are string literals, so recording a span never allocates.
+*/
+struct TraceEvent
+{
+	static constexpr size_t MAX_ARGS = 2;
+
+	const char* name;
+	const char* category;
+	uint64_t start;     // ns since the tracer started
+	uint64_t duration;  // ns
+	std::array<const char*, MAX_ARGS> argNames;
+	std::array<uint64_t, MAX_ARGS> argValues;
+};
+
+
+/**
+* @brief Tracer class
+*
+* Records spans with the thread that ran them and writes them in the Chrome trace-event format, which
+* chrome://tracing and Perfetto open as a timeline, so the overlap of the reads, the pipeline's stages and
+* the socket can be seen. Every thread writes to a ring buffer of its own, without locks; when a ring is
+* full, its oldest spans are overwritten.
+*
+* The tracer is off by default; when it is off, a span is a single relaxed load and a branch. Building
+* with BACKUP_NO_TRACING removes the spans altogether.
+*/
+class Tracer
+{
+public:
+	static constexpr size_t DEFAULT_EVENTS_PER_THREAD = 1 << 16;
+
+	/**
+	* @brief Get the tracer of the process.
+	*/
+	static Tracer& instance();
+
+	/**
+	* @brief Check if the spans are recorded.
+	*/
+	static bool enabled()
+	{
+		return _enabled.load(std::memory_order_relaxed);
+	}
+
+	/**
+	* @brief Start recording the spans.
+	*
+	* @param eventsPerThread the size of the ring buffer of every thread.
+	*/
+	static void enable(size_t eventsPerThread = DEFAULT_EVENTS_PER_THREAD);
+
+	/**
+	* @brief Name the calling thread in the timeline.
+	*/
+	void nameThread(const std::string& name);
+
+	/**
+	* @brief Record a span of the calling thread.
+	*/
+	void record(const TraceEvent& event);
+
+	/**
+	* @brief Get the time since the tracer started, in ns.
+	*/
+	uint64_t now() const;
+
+	/**
+	* @brief Write the recorded spans as a Chrome trace-event JSON file.
+	*
+	* The threads that record spans should have stopped.
+	*
+	* @return true if the file was written.
+	*/
+	bool write(const std::string& path) const;
+
+private:
+	struct ThreadBuffer
+	{
+		uint32_t id;
+		std::string name;
+		std::vector<TraceEvent> events;
+		size_t next = 0;        // the slot of the next span
+		bool wrapped = false;   // the oldest spans were overwritten
+	};
+
+	Tracer();
+
+	ThreadBuffer& threadBuffer();
+
+	static inline std::atomic<bool> _enabled{ false };
+
+	std::chrono::steady_clock::time_point _start;
+	size_t _eventsPerThread;
+	mutable std::mutex _mutex;  // guards the list of buffers, not their spans
+	std::vector<std::unique_ptr<ThreadBuffer>> _buffers;
+};
+
+
+/**
+* @brief TraceSpan class
+*
+* Records a span from its construction to its destruction. When the tracer is off, it doesn't read the clock.
+*/
+class TraceSpan
+{
+public:
+	TraceSpan(const char* category, const char* name)
+		: _event{ name, category, 0, 0, {}, {} }
+		, _args(0)
+		, _enabled(Tracer::enabled())
+	{
+		if (_enabled)
+		{
+			_event.start = Tracer::instance().now();
+		}
+	}
+
+	~TraceSpan()
+	{
+		if (_enabled)
+		{
+			_event.duration = Tracer::instance().now() - _event.start;
+			Tracer::instance().record(_event);
+		}
+	}
+
+	TraceSpan(const TraceSpan&) = delete;
+	TraceSpan& operator=(const TraceSpan&) = delete;
+
+	/**
+	* @brief Attach a value to the span, like its size or opcode. The name must be a string literal.
+	*/
+	void arg(const char* name, uint64_t value)
+	{
+		if (_enabled && _args < TraceEvent::MAX_ARGS)
+		{
+			_event.argNames[_args] = name;
+			_event.argValues[_args] = value;
+			_args++;
+		}
+	}
+
+private:
+	TraceEvent _event;
+	size_t _args;
+	bool _enabled;
+};
+
+
+/**
+* @brief A span that does nothing, for builds without tracing.
+*/
+class NullTraceSpan
+{
+public:
+	NullTraceSpan(const char*, const char*) {}
+	void arg(const char*, uint64_t) {}
+};
+
+
+#ifdef BACKUP_NO_TRACING
+using ScopedTrace = NullTraceSpan;
+#else
+using ScopedTrace = TraceSpan;
+#endif
+
+#endif // TRACING_H
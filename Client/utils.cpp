@@ -13,11 +13,33 @@ bool isNumber(const std::string_view& s)
 }
 
 
-std::string uuidToHex(const std::vector<char>& uuid) {
-    if (uuid.size() != 16) {
-        throw std::invalid_argument("UUID must be 16 bytes long");
+bool parseByteSize(const std::string_view& s, size_t& bytes)
+{
+    const std::pair<std::string_view, size_t> units[] = {
+        { "GB", 1024 * 1024 * 1024 }, { "MB", 1024 * 1024 }, { "KB", 1024 }, { "B", 1 }
+    };
+
+    std::string_view number = s;
+    size_t multiplier = 1;
+    for (const auto& [suffix, unit] : units)
+    {
+        if (number.size() > suffix.size() && number.substr(number.size() - suffix.size()) == suffix)
+        {
+            number.remove_suffix(suffix.size());
+            multiplier = unit;
+            break;
+        }
+    }
+    if (!isNumber(number) || number.size() > 12)
+    {
+        return false;
     }
+    bytes = std::stoull(std::string(number)) * multiplier;
+    return true;
+}
+
 
+std::string uuidToHex(const ClientID& uuid) {
     // Create a UUID object from the vector
     boost::uuids::uuid boostUuid;
     std::copy(uuid.begin(), uuid.end(), boostUuid.begin());
@@ -26,13 +48,14 @@ std::string uuidToHex(const std::vector<char>& uuid) {
     return boost::uuids::to_string(boostUuid);
 }
 
-std::vector<char> hexToUuidBytes(const std::string& uuidHex) {
+ClientID hexToUuidBytes(const std::string& uuidHex) {
     // Use Boost's string_generator to convert from string to uuid
     boost::uuids::string_generator gen;
     boost::uuids::uuid uuid = gen(uuidHex);
 
-    // Convert the UUID to a vector of bytes
-    std::vector<char> uuidBytes(uuid.begin(), uuid.end());
+    // Convert the UUID to the fixed-size client ID
+    ClientID uuidBytes{};
+    std::copy(uuid.begin(), uuid.end(), uuidBytes.begin());
 
     return uuidBytes;
 }
\ No newline at end of file
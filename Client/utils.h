@@ -1,9 +1,10 @@
 #ifndef UTILS_H
 #define UTILS_H
 
+#include "payload.h"
+
 #include <string_view>
 #include <string>
-#include <vector>
 
 /**
  * @brief Check if a string is a number
@@ -13,13 +14,22 @@
  */
 bool isNumber(const std::string_view& s);
 
+/**
+ * @brief Parse a number of bytes with an optional KB, MB or GB suffix, like 64MB
+ *
+ * @param s the string to be parsed
+ * @param bytes the number of bytes
+ * @return true if the string is a valid size; false otherwise
+ */
+bool parseByteSize(const std::string_view& s, size_t& bytes);
+
 /**
  * @brief convert a uuid in bytes format to a hex string
  *
  * @param the uuid in bytes format
  * @return the uuid in hex string format
  */
-std::string uuidToHex(const std::vector<char>& uuid);
+std::string uuidToHex(const ClientID& uuid);
 
 /**
  * @brief convert a hex string to a uuid in bytes format
@@ -27,7 +37,7 @@ std::string uuidToHex(const std::vector<char>& uuid);
  * @param uuidHex the uuid in hex string format
  * @return the uuid in bytes format
  */
-std::vector<char> hexToUuidBytes(const std::string& uuidHex);
+ClientID hexToUuidBytes(const std::string& uuidHex);
 
 
 #endif
@@ -1,9 +1,18 @@
 """
-This module implements the cksum command found in most UNIXes in pure
-python.
+This module implements the cksum command found in most UNIXes.
+
+The CRC is computed by the client's C++ cksum, built as a shared library from Client/cksum.cpp:
+
+    g++ -O2 -std=c++17 -shared -fPIC Client/cksum.cpp -o Server/libcksum.so
+
+The library is looked up in BACKUP_CKSUM_LIBRARY, then next to this module (libcksum.so,
+libcksum.dylib or cksum.dll). When it can't be loaded the pure python version is used, and
+both give the same CRCs.
 
 The constants and routine are cribbed from the POSIX man page
 """
+import ctypes
+import os
 import sys
 
 crctab = [ 0x00000000, 0x04c11db7, 0x09823b6e, 0x0d4326d9, 0x130476dc,
@@ -62,13 +71,14 @@ crctab = [ 0x00000000, 0x04c11db7, 0x09823b6e, 0x0d4326d9, 0x130476dc,
 UNSIGNED = lambda n: n & 0xffffffff
 
 
-def memcrc(b):
-    n = len(b)
-    i = c = s = 0
+def py_update(s, b):
     for ch in b:
         tabidx = (s>>24)^ch
         s = UNSIGNED((s << 8)) ^ crctab[tabidx]
+    return s
 
+
+def py_finish(s, n):
     while n:
         c = n & 0o377
         n = n >> 8
@@ -76,6 +86,89 @@ def memcrc(b):
     return UNSIGNED(~s)
 
 
-def readfile(fname):
+def py_memcrc(b):
+    return py_finish(py_update(0, b), len(b))
+
+
+def py_readfile(fname):
     buffer = open(fname, 'rb').read()
-    return memcrc(buffer)
+    return py_memcrc(buffer)
+
+
+LIBRARY_ENV = 'BACKUP_CKSUM_LIBRARY'
+LIBRARY_NAMES = {'win32': 'cksum.dll', 'darwin': 'libcksum.dylib'}
+
+
+def load_native():
+    """ Loads the native cksum library, returns None if it can't be loaded."""
+    path = os.environ.get(LIBRARY_ENV) or os.path.join(
+        os.path.dirname(os.path.abspath(__file__)), LIBRARY_NAMES.get(sys.platform, 'libcksum.so'))
+    try:
+        library = ctypes.CDLL(path)
+    except OSError:
+        return None
+    library.cksum_update.argtypes = [ctypes.c_uint32, ctypes.c_char_p, ctypes.c_size_t]
+    library.cksum_update.restype = ctypes.c_uint32
+    library.cksum_finish.argtypes = [ctypes.c_uint32, ctypes.c_uint64]
+    library.cksum_finish.restype = ctypes.c_uint32
+    library.cksum_memcrc.argtypes = [ctypes.c_char_p, ctypes.c_size_t]
+    library.cksum_memcrc.restype = ctypes.c_uint32
+    library.cksum_readfile.argtypes = [ctypes.c_char_p, ctypes.POINTER(ctypes.c_uint32)]
+    library.cksum_readfile.restype = ctypes.c_int
+    return library
+
+
+native = load_native()
+NATIVE = native is not None
+
+
+def as_buffer(b):
+    """ Returns the data as an argument of the library, without a copy when it is bytes or writable."""
+    if isinstance(b, bytes):
+        return b
+    view = memoryview(b)
+    if view.readonly or not view.contiguous:
+        return view.tobytes()
+    return (ctypes.c_char * view.nbytes).from_buffer(view)
+
+
+def memcrc(b):
+    if native is None:
+        return py_memcrc(b)
+    return native.cksum_memcrc(as_buffer(b), len(b))
+
+
+def readfile(fname):
+    if native is None:
+        return py_readfile(fname)
+    crc = ctypes.c_uint32()
+    if native.cksum_readfile(os.fsencode(fname), ctypes.byref(crc)) != 0:
+        raise OSError(f'Cannot read {fname}')
+    return crc.value
+
+
+class Cksum:
+    """
+    A running cksum, the data is added chunk by chunk and the digest is the CRC of all of it.
+
+    Attributes:
+        state (int): The CRC of the data so far, without the length.
+        length (int): The length of the data so far.
+    """
+    def __init__(self):
+        self.state = 0
+        self.length = 0
+
+    def update(self, b):
+        """ Adds a chunk of data."""
+        if native is None:
+            self.state = py_update(self.state, b)
+        else:
+            self.state = native.cksum_update(self.state, as_buffer(b), len(b))
+        self.length += len(b)
+
+    def digest(self) -> int:
+        """ Returns the CRC of all the data so far."""
+        if native is None:
+            return py_finish(self.state, self.length)
+        return native.cksum_finish(self.state, self.length)
@@ -1,12 +1,15 @@
 import socket
 import selectors
+import struct
+from collections import deque
 
-from protocol import Request, Response
+import storage
+from protocol import Request, Response, REQUEST_HEADER_SIZE, FILE_PAYLOAD_HEADER_SIZE, PAYLOAD_SIZE, PACKET_SIZE
 from crypto import AESWrapper
 from file_handler import FileHandler
 
 
-PACKET_SIZE = 32768  # 32KB
+RECEIVE_BUFFER_SIZE = 4 * PACKET_SIZE   # a few messages, the reading stops while it's full
 
 
 class Connection:
@@ -17,13 +20,24 @@ class Connection:
         sock (socket): The socket object for the connection.
         addr (tuple): The address of the connected client (IP, port).
         selector (selectors): The selector for managing I/O events.
-        _send_buffer (bytes): Buffer for outgoing data.
+        _send_queue (deque): The buffers of outgoing data, in order.
+        _send_offset (int): How much of the first buffer of outgoing data was sent.
+        _recv_buffer (bytearray): Buffer that the socket reads into, allocated on the first read and dropped on close.
+        _recv_view (memoryview): A view of the receive buffer, the messages are slices of it.
+        _recv_start (int): Where the data that wasn't taken as a message starts in the receive buffer.
+        _recv_end (int): Where the data that was received ends in the receive buffer.
+        _events (int): The selector events the connection is registered for, 0 if it isn't registered.
         is_closed (bool): Flag indicating if the connection is closed.
         aes_wrapper (AESWrapper): Instance of AESWrapper for encryption/decryption.
         file_handler (FileHandler): Instance of FileHandler for managing file operations.
         request (Request): Placeholder for the request to be sent or received.
         response (Response): Placeholder for the response to be sent or received.
         got_file (bool): Flag indicating if the next packets are part of a file transfer.
+        busy (bool): Flag indicating if a job of the worker pool runs for the connection, its next messages wait.
+        processing (bool): Flag indicating if the connection's messages are being processed.
+        received_files (dict): The paths of the files that wait for the client's CRC request, by file name.
+        stored_files (dict): The files that were stored as they were received and wait for the client's CRC,
+            their encrypted path, path and encrypted size by file name.
         errors_num (int): Counter for the number of errors encountered.
 
     Args:
@@ -35,54 +49,147 @@ class Connection:
         self.sock = sock
         self.addr = addr
         self.selector = selector
-        self._send_buffer = b''
+        self._send_queue = deque()
+        self._send_offset = 0
+        self._recv_buffer = None
+        self._recv_view = None
+        self._recv_start = 0
+        self._recv_end = 0
+        self._events = 0
         self.is_closed = False
         self.aes_wrapper = AESWrapper()
         self.file_handler = FileHandler()
         self.request = None
         self.response = None
         self.got_file = False  # a flag to know if the next packets are supposed to be only a file's payload.
+        self.busy = False
+        self.processing = False
+        self.received_files = {}
+        self.stored_files = {}
         self.errors_num = 0
 
         # Register for read events initially
-        self.selector.register(self.sock, selectors.EVENT_READ, data=self)
+        self.update_events()
 
-    def read(self) -> bytes:
-        """Read data from the socket and return it."""
+    def read(self) -> bool:
+        """Read the available data from the socket into the free end of the receive buffer."""
+        if self._recv_buffer is None:
+            self._recv_buffer = bytearray(RECEIVE_BUFFER_SIZE)
+            self._recv_view = memoryview(self._recv_buffer)
+        if self._recv_start > 0 and len(self._recv_buffer) - self._recv_end < PACKET_SIZE:
+            # move the part of a message that is left to the start, to make room
+            size = self._recv_end - self._recv_start
+            self._recv_view[:size] = self._recv_view[self._recv_start:self._recv_end]
+            self._recv_start, self._recv_end = 0, size
+        if self._recv_end == len(self._recv_buffer):
+            return False    # full of whole messages
         try:
-            data = self.sock.recv(PACKET_SIZE)
-            if data:
-                return data
+            received = self.sock.recv_into(self._recv_view[self._recv_end:])
+            if received:
+                self._recv_end += received
+                if self._recv_end - self._recv_start == len(self._recv_buffer):
+                    self.update_events()    # full, until the messages are taken
+                return True
             else:
                 self.close()  # Connection closed by the client
-                return b''
+                return False
+        except BlockingIOError:
+            return False
         except IOError as e:
             print(f"Error reading from {self.addr}: {e}")
             self.close()
-            return b''
+            return False
+
+    def next_message(self):
+        """
+        Take the next whole message out of the receive buffer, or None if it didn't arrive yet.
+        A client may send several messages back to back, or a message may arrive in pieces,
+        so the messages are split by the sizes in their headers and not by the reads.
+        The message is a view of the receive buffer, it is valid until the next read.
+        """
+        available = self._recv_end - self._recv_start
+        if self.got_file:   # a file packet, the payload header and the content
+            if available < FILE_PAYLOAD_HEADER_SIZE:
+                return None
+            message_size = FILE_PAYLOAD_HEADER_SIZE + struct.unpack_from('<I', self._recv_buffer, self._recv_start)[0]
+        else:   # a request, the header and the payload
+            if available < REQUEST_HEADER_SIZE:
+                return None
+            message_size = REQUEST_HEADER_SIZE + struct.unpack_from(
+                '<I', self._recv_buffer, self._recv_start + REQUEST_HEADER_SIZE - PAYLOAD_SIZE)[0]
+
+        if message_size > PACKET_SIZE:
+            raise ValueError(f'Message is too large: {message_size}')
+        if available < message_size:
+            return None
+        message = self._recv_view[self._recv_start:self._recv_start + message_size]
+        self._recv_start += message_size
+        if self._recv_start == self._recv_end:
+            self._recv_start = self._recv_end = 0
+        if not self._events & selectors.EVENT_READ:
+            self.update_events()    # there is room again
+        return message
 
     def write(self):
-        """Write data from the send buffer to the socket."""
-        if self._send_buffer:
-            try:
-                sent = self.sock.send(self._send_buffer)
-                self._send_buffer = self._send_buffer[sent:]
-                if len(self._send_buffer) == 0:
-                    # Switch back to read mode if all data is sent
-                    self.selector.modify(self.sock, selectors.EVENT_READ, data=self)
-            except IOError as e:
-                print(f"Error writing to {self.addr}: {e}")
-                self.close()
+        """Write data from the send queue to the socket, until it's empty or the socket is full."""
+        try:
+            while self._send_queue:
+                data = self._send_queue[0]
+                sent = self.sock.send(memoryview(data)[self._send_offset:])
+                self._send_offset += sent
+                if self._send_offset < len(data):
+                    return
+                self._send_queue.popleft()
+                self._send_offset = 0
+        except BlockingIOError:
+            return
+        except IOError as e:
+            print(f"Error writing to {self.addr}: {e}")
+            self.close()
+            return
+        # Switch back to read mode if all data is sent
+        self.update_events()
 
     def queue_data(self, data: bytes):
         """Queue data to be sent and register for write events."""
-        self._send_buffer += data
-        self.selector.modify(self.sock, selectors.EVENT_WRITE, data=self)
+        self._send_queue.append(data)
+        self.update_events()
+
+    def update_events(self):
+        """
+        Register for read events while the receive buffer has room, and for write events while there is data to send.
+        A connection that waits for neither is unregistered, the selector can't wait for no events.
+        """
+        if self.is_closed:
+            return
+        events = 0
+        if self._recv_buffer is None or self._recv_end - self._recv_start < len(self._recv_buffer):  # room
+            events |= selectors.EVENT_READ
+        if self._send_queue:
+            events |= selectors.EVENT_WRITE
+        if events == self._events:
+            return
+        if not events:
+            self.selector.unregister(self.sock)
+        elif not self._events:
+            self.selector.register(self.sock, events, data=self)
+        else:
+            self.selector.modify(self.sock, events, data=self)
+        self._events = events
 
     def close(self):
         """Close the connection and unregister from the selector."""
         if not self.is_closed:
             print(f"Closing connection to {self.addr}")
-            self.selector.unregister(self.sock)
+            if self._events:
+                self.selector.unregister(self.sock)
+                self._events = 0
             self.sock.close()
             self.is_closed = True
+            self.file_handler.reset()   # a file that wasn't finished is deleted
+            for encrypted_path, _, _ in self.stored_files.values():    # and a file without its CRC
+                storage.remove(encrypted_path)
+            self.stored_files.clear()
+            # the messages that were taken are views of the buffer, they keep it until they are dropped
+            self._recv_buffer = self._recv_view = None
+            self._recv_start = self._recv_end = 0
@@ -1,3 +1,5 @@
+import functools
+
 from Crypto.Cipher import AES, PKCS1_OAEP
 from Crypto.Random import get_random_bytes
 from Crypto.Util.Padding import pad, unpad
@@ -5,6 +7,7 @@ from Crypto.PublicKey import RSA
 
 
 AES_KEY_SIZE = 32  # (256 bits = 32 bytes)
+RSA_KEY_CACHE_SIZE = 1024   # parsed public keys kept by every process, by their binary format
 
 
 class AESWrapper:
@@ -21,9 +24,11 @@ class AESWrapper:
         self.iv = b'\x00' * AES.block_size
 
     @staticmethod
+    @functools.lru_cache(maxsize=RSA_KEY_CACHE_SIZE)
     def import_rsa_public_key(binary_key: bytes) -> RSA.RsaKey:
         """
-        Import RSA public key from a binary data
+        Import RSA public key from a binary data, a key that was imported before isn't parsed again.
+        A changed key has other bytes, so it is never served from the cache.
         :param binary_key: RSA public key in binary format
         :return: RSA public key object
         """
@@ -33,9 +38,11 @@ class AESWrapper:
         except ValueError:
             raise ValueError('RSA public key must be in binary format')
 
-    def encrypt_aes_with_rsa(self, rsa_key_bytes: bytes) -> bytes:
+    @staticmethod
+    def encrypt_key_with_rsa(aes_key: bytes, rsa_key_bytes: bytes) -> bytes:
         """
         Encrypt an AES key with RSA public key
+        :param aes_key: the AES key
         :param rsa_key_bytes: RSA public key in binary format:
         :return: encrypted AES key
         """
@@ -44,8 +51,15 @@ class AESWrapper:
         rsa_cipher = PKCS1_OAEP.new(rsa_key)
 
         # Encrypt the AES key using the RSA public key
-        encrypted_aes_key = rsa_cipher.encrypt(self.aes_key)
-        return encrypted_aes_key
+        return rsa_cipher.encrypt(aes_key)
+
+    def encrypt_aes_with_rsa(self, rsa_key_bytes: bytes) -> bytes:
+        """
+        Encrypt the AES key with RSA public key
+        :param rsa_key_bytes: RSA public key in binary format:
+        :return: encrypted AES key
+        """
+        return AESWrapper.encrypt_key_with_rsa(self.aes_key, rsa_key_bytes)
 
     def encrypt(self, plaintext: bytes) -> bytes:
         """
@@ -73,6 +87,56 @@ class AESWrapper:
         # Use built-in unpadding function
         return unpad(decrypted, AES.block_size)
 
+    def decryptor(self) -> 'AESStreamDecryptor':
+        """
+        Get a decryptor for ciphertext that arrives in chunks.
+        :return: a new AESStreamDecryptor with the key and the IV
+        """
+        return AESStreamDecryptor(self.aes_key, self.iv)
+
     def get_aes_key(self) -> bytes:
         """ Get AES key """
         return self.aes_key
+
+
+class AESStreamDecryptor:
+    """
+    Decrypts AES-CBC ciphertext chunk by chunk, the chunks may have any size. The last block is held
+    back until finish() because it holds the padding. The state is plain bytes, so a decryptor can be
+    pickled to a worker process and back between the chunks.
+
+    Attributes:
+        aes_key (bytes): AES key
+        iv (bytes): the IV of the next chunk, the last ciphertext block that was decrypted
+        pending (bytearray): ciphertext that wasn't decrypted yet
+    """
+    def __init__(self, aes_key: bytes, iv: bytes):
+        self.aes_key = aes_key
+        self.iv = iv
+        self.pending = bytearray()
+
+    def update(self, ciphertext: bytes) -> bytes:
+        """
+        Decrypt the whole blocks that arrived, except the last one.
+        :param ciphertext: the next chunk of the ciphertext
+        :return: plaintext, may be empty
+        """
+        self.pending += ciphertext
+        size = (len(self.pending) - 1) // AES.block_size * AES.block_size
+        if size <= 0:
+            return b''
+        blocks = memoryview(self.pending)[:size]
+        plaintext = AES.new(self.aes_key, AES.MODE_CBC, self.iv).decrypt(blocks)
+        self.iv = bytes(blocks[-AES.block_size:])
+        blocks.release()
+        del self.pending[:size]
+        return plaintext
+
+    def finish(self) -> bytes:
+        """
+        Decrypt the last block and remove the padding.
+        :return: the rest of the plaintext
+        """
+        if len(self.pending) != AES.block_size:
+            raise ValueError('Ciphertext is not a whole number of blocks')
+        return unpad(AES.new(self.aes_key, AES.MODE_CBC, self.iv).decrypt(bytes(self.pending)), AES.block_size)
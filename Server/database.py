@@ -1,21 +1,50 @@
 import sqlite3
+import time
+from collections import OrderedDict
 from datetime import datetime
 
 
 DATABASE_NAME = 'defensive.db'
+BUSY_TIMEOUT = 30   # seconds a write waits for the shards of the server that hold the database
+LAST_SEEN_DELAY = 1.0   # seconds the LastSeen updates are held back to be written together
+CLIENT_CACHE_SIZE = 4096    # the clients whose name and public key are kept in memory
+PACKED_FILE_COLUMNS = [('Segment', 'TEXT'), ('SegmentOffset', 'INTEGER'), ('Length', 'INTEGER'), ('CRC', 'INTEGER')]
 
 
 class Database:
     """
     SQL Lite3 Database Class that contains the clients and their files that were sent.
+    Every shard of the server has its own connection to the database, a write waits for the others.
+    The database is in WAL mode, so the readers don't wait for the writers, and the LastSeen updates
+    are held back and written in one transaction, since every request updates one. The names and public keys
+    of the recent clients are kept in memory for the logins. When several shards of the server share the
+    database, every shard has its own cache and a client's ID or key may be changed by another shard, so a
+    cached client is checked against the KeyVersion of its row, which every change of its ID or key increments.
+    The files that were stored as they were received wait in VERIFY_TABLE until they are verified.
 
     Attributes:
         connection (sqlite3.Connection): Connection to the database
+        shared (bool): Flag indicating if other shards of the server share the database.
+        last_seen (dict): The LastSeen updates that weren't written, the time by client ID.
+        last_seen_since (float): When the oldest LastSeen update that wasn't written was made.
+        clients (OrderedDict): The names, public keys and key versions of the recent clients by ID, the least
+            recent first.
+
+    Args:
+        shared (bool): Whether other shards of the server share the database, a single server is on its own.
     """
-    def __init__(self):
-        self.connection = sqlite3.connect(DATABASE_NAME)
+    def __init__(self, shared: bool = False):
+        # sqlite3 keeps the last 128 prepared statements by default, every query of the class fits
+        self.connection = sqlite3.connect(DATABASE_NAME, timeout=BUSY_TIMEOUT)
+        self.connection.execute('PRAGMA journal_mode = WAL')
+        self.connection.execute('PRAGMA synchronous = NORMAL')  # WAL is still consistent after a crash
+        self.shared = shared
+        self.last_seen = {}
+        self.last_seen_since = 0.0
+        self.clients = OrderedDict()
         self.create_client_table()
         self.create_file_table()
+        self.create_verify_table()
 
     def create_client_table(self):
         """Create the client table if it doesn't already exist."""
@@ -29,6 +58,13 @@ class Database:
                     AES_Key BLOB
                 )
             ''')
+            self.connection.execute('''
+                CREATE INDEX IF NOT EXISTS CLIENT_NAME_INDEX ON CLIENT_TABLE (Name)
+            ''')
+            # counts the changes of the client's ID and public key, for the caches of the shards
+            columns = {row[1] for row in self.connection.execute('PRAGMA table_info(CLIENT_TABLE)')}
+            if 'KeyVersion' not in columns:
+                self.connection.execute('ALTER TABLE CLIENT_TABLE ADD COLUMN KeyVersion INTEGER NOT NULL DEFAULT 0')
 
     def create_file_table(self):
         """Create the file table if it doesn't already exist."""
@@ -41,21 +77,154 @@ class Database:
                 Verified BOOLEAN NOT NULL
                 )
             ''')
+            # the location of a file in the pack-file store, NULL for a file of its own
+            columns = {row[1] for row in self.connection.execute('PRAGMA table_info(FILE_TABLE)')}
+            for column, column_type in PACKED_FILE_COLUMNS:
+                if column not in columns:
+                    self.connection.execute(f'ALTER TABLE FILE_TABLE ADD COLUMN {column} {column_type}')
+            self.connection.execute('''
+                CREATE INDEX IF NOT EXISTS FILE_SEGMENT_INDEX ON FILE_TABLE (Segment) WHERE Segment IS NOT NULL
+            ''')
+            # covers the lookups of add_file and verify_file
+            self.connection.execute('''
+                CREATE INDEX IF NOT EXISTS FILE_INDEX ON FILE_TABLE (ID, FileName, PathName)
+            ''')
+
+    def create_verify_table(self):
+        """Create the table of the stored files that wait for their verification, if it doesn't already exist."""
+        with self.connection:
+            self.connection.execute('''
+                CREATE TABLE IF NOT EXISTS VERIFY_TABLE (
+                ID BLOB NOT NULL,
+                FileName TEXT NOT NULL,
+                PathName TEXT NOT NULL,
+                EncryptedPath TEXT NOT NULL,
+                AES_Key BLOB NOT NULL,
+                CRC INTEGER NOT NULL
+                )
+            ''')
+            self.connection.execute('''
+                CREATE INDEX IF NOT EXISTS VERIFY_INDEX ON VERIFY_TABLE (ID, FileName, PathName)
+            ''')
 
     def add_file(self, client_id, file_name: str, path_name: str):
-        """Add or update a file in the database."""
+        """Add or update a file in the database, a file of its own that replaces a packed version."""
         with self.connection:
-            # Check if an entry with the same ID, FileName, and PathName already exists
-            cursor = self.connection.execute('''
+            self.insert_file(client_id, file_name, path_name)
+
+    def insert_file(self, client_id, file_name: str, path_name: str):
+        """Add or update a file of its own, in the transaction of the caller."""
+        self.drop_verifications(client_id, file_name, path_name)
+        self.connection.execute('''
+            UPDATE FILE_TABLE
+            SET Segment = NULL, SegmentOffset = NULL, Length = NULL, CRC = NULL
+            WHERE ID = ? AND FileName = ? AND PathName = ? AND Segment IS NOT NULL
+        ''', (client_id, file_name, path_name))
+        # Insert a new row if the combination doesn't exist
+        self.connection.execute('''
+            INSERT INTO FILE_TABLE (ID, FileName, PathName, Verified)
+            SELECT ?, ?, ?, ?
+            WHERE NOT EXISTS (
                 SELECT 1 FROM FILE_TABLE WHERE ID = ? AND FileName = ? AND PathName = ?
-            ''', (client_id, file_name, path_name))
+            )
+        ''', (client_id, file_name, path_name, False, client_id, file_name, path_name))
+
+    def add_stored_file(self, client_id, file_name: str, path_name: str, encrypted_path: str, aes_key: bytes,
+                        crc: int) -> int:
+        """Add a file that was stored as it was received, and its pending verification. Returns the verification's row."""
+        with self.connection:
+            self.insert_file(client_id, file_name, path_name)
+            cursor = self.connection.execute('''
+                INSERT INTO VERIFY_TABLE (ID, FileName, PathName, EncryptedPath, AES_Key, CRC)
+                VALUES (?, ?, ?, ?, ?, ?)
+            ''', (client_id, file_name, path_name, encrypted_path, aes_key, crc))
+            return cursor.lastrowid
+
+    def drop_verifications(self, client_id, file_name: str, path_name: str):
+        """
+        Drop the pending verifications of a file that was uploaded again, in the transaction of the caller,
+        so they don't put the older upload in place when they are done.
+        """
+        self.connection.execute('''
+            DELETE FROM VERIFY_TABLE WHERE ID = ? AND FileName = ? AND PathName = ?
+        ''', (client_id, file_name, path_name))
+
+    def get_verifications(self) -> list:
+        """Get the pending verifications, the oldest first."""
+        cursor = self.connection.execute('''
+            SELECT rowid, ID, FileName, PathName, EncryptedPath, AES_Key, CRC FROM VERIFY_TABLE ORDER BY rowid
+        ''')
+        return cursor.fetchall()
+
+    def finish_verification(self, row_id: int, client_id, file_name: str, path_name: str, verified: bool,
+                            install) -> bool:
+        """
+        Remove a verification that was done. When its CRC matched, install() puts the file in place and the
+        file is verified, unless the file was uploaded again since, in any shard: the check, the install and the
+        update hold the database's write lock, and a newer upload drops the verification before it replaces
+        the file. Returns False for a verification that was dropped.
+        """
+        with self.connection:
+            self.connection.execute('BEGIN IMMEDIATE')
+            cursor = self.connection.execute('DELETE FROM VERIFY_TABLE WHERE rowid = ?', (row_id,))
+            if cursor.rowcount == 0:
+                return False
+            if verified:
+                install()
+                self.connection.execute('''
+                UPDATE FILE_TABLE
+                SET Verified = ?
+                WHERE ID = ? AND FileName = ? AND PathName = ?
+                ''', (True, client_id, file_name, path_name))
+            return True
 
-            if cursor.fetchone() is None:
-                # Insert a new row if the combination doesn't exist
+    def add_packed_file(self, client_id, file_name: str, path_name: str, segment: str, offset: int, length: int,
+                        crc: int):
+        """Add or update a file that is stored in a segment of the pack-file store."""
+        with self.connection:
+            self.drop_verifications(client_id, file_name, path_name)
+            cursor = self.connection.execute('''
+                UPDATE FILE_TABLE
+                SET Segment = ?, SegmentOffset = ?, Length = ?, CRC = ?, Verified = ?
+                WHERE ID = ? AND FileName = ? AND PathName = ?
+            ''', (segment, offset, length, crc, False, client_id, file_name, path_name))
+            if cursor.rowcount == 0:
                 self.connection.execute('''
-                    INSERT INTO FILE_TABLE (ID, FileName, PathName, Verified)
-                    VALUES (?, ?, ?, ?)
-                ''', (client_id, file_name, path_name, False))
+                    INSERT INTO FILE_TABLE (ID, FileName, PathName, Verified, Segment, SegmentOffset, Length, CRC)
+                    VALUES (?, ?, ?, ?, ?, ?, ?, ?)
+                ''', (client_id, file_name, path_name, False, segment, offset, length, crc))
+
+    def get_segment_usage(self) -> dict:
+        """Get the bytes of the files that are stored in every segment."""
+        cursor = self.connection.execute('''
+            SELECT Segment, SUM(Length) FROM FILE_TABLE WHERE Segment IS NOT NULL GROUP BY Segment
+        ''')
+        return dict(cursor.fetchall())
+
+    def get_segment_files(self, segment: str) -> list:
+        """Get the row, the offset and the length of the files that are stored in a segment."""
+        cursor = self.connection.execute('''
+            SELECT rowid, SegmentOffset, Length FROM FILE_TABLE WHERE Segment = ?
+        ''', (segment,))
+        return cursor.fetchall()
+
+    def move_packed_files(self, segment: str, moves: list):
+        """
+        Move files out of a segment in one transaction, unless they were replaced since they were copied.
+        The moves are (row ID, offset, new segment, new offset). The transaction is synced to the disk even in
+        WAL mode, since the segment is deleted after it.
+        """
+        self.connection.execute('PRAGMA synchronous = FULL')
+        try:
+            with self.connection:
+                self.connection.executemany('''
+                    UPDATE FILE_TABLE
+                    SET Segment = ?, SegmentOffset = ?
+                    WHERE rowid = ? AND Segment = ? AND SegmentOffset = ?
+                ''', [(new_segment, new_offset, row_id, segment, offset)
+                      for row_id, offset, new_segment, new_offset in moves])
+        finally:
+            self.connection.execute('PRAGMA synchronous = NORMAL')
 
     def verify_file(self, client_id, file_name: str, path_name: str):
         """Verify a file's CRC in the database."""
@@ -72,67 +241,119 @@ class Database:
         cursor.execute('SELECT 1 FROM CLIENT_TABLE WHERE Name = ?', (name,))
         return cursor.fetchone() is not None
 
+    def get_client_keys(self, client_id: bytes):
+        """
+        Get the name, the public key and the key version of a client, from the cache or the database, or None.
+        A cached client of a shared database is only used while its row has the same key version, another shard
+        may have changed it; otherwise only this server changes the clients, and it forgets the ones it changes.
+        """
+        record = self.clients.get(client_id)
+        if record is not None and not self.shared:
+            self.clients.move_to_end(client_id)
+            return record
+        if record is not None:
+            cursor = self.connection.execute('SELECT KeyVersion FROM CLIENT_TABLE WHERE ID = ?', (client_id,))
+            version = cursor.fetchone()
+            if version is not None and version[0] == record[2]:
+                self.clients.move_to_end(client_id)
+                return record
+            del self.clients[client_id]
+
+        cursor = self.connection.cursor()
+        cursor.execute('SELECT Name, PublicKey, KeyVersion FROM CLIENT_TABLE WHERE ID = ?', (client_id,))
+        record = cursor.fetchone()
+        if record is not None:
+            self.clients[client_id] = record
+            if len(self.clients) > CLIENT_CACHE_SIZE:
+                self.clients.popitem(last=False)
+        return record
+
+    def forget_client(self, client_id: bytes = None, name: str = None):
+        """Remove a client from the cache, by ID or by name."""
+        if client_id is not None:
+            self.clients.pop(client_id, None)
+        if name is not None:
+            for cached_id in [cached_id for cached_id, record in self.clients.items() if record[0] == name]:
+                del self.clients[cached_id]
+
     def check_login(self, client_id: bytes, name: str) -> bool:
         """Check whether a user and his public key exists."""
-        cursor = self.connection.cursor()
-        cursor.execute('''
-            SELECT Name
-            FROM CLIENT_TABLE
-            WHERE ID = ? AND Name = ?
-            AND PublicKey IS NOT NULL AND PublicKey != ?
-            ''', (client_id, name, b''))
-        return cursor.fetchone() is not None
+        return self.get_login_key(client_id, name) is not None
+
+    def get_login_key(self, client_id: bytes, name: str):
+        """Get the public key of a user that logs in with his name, or None if the user or the key don't exist."""
+        record = self.get_client_keys(client_id)
+        if record is None or record[0] != name or not record[1]:
+            return None
+        return record[1]
 
     def get_public_key(self, client_id: bytes) -> bytes:
         """Get the public key of a user."""
-        cursor = self.connection.cursor()
-        cursor.execute('SELECT PublicKey FROM CLIENT_TABLE WHERE ID = ?', (client_id,))
-        result = cursor.fetchone()
-        if result is None:
+        record = self.get_client_keys(client_id)
+        if record is None or record[1] is None:
             raise KeyError(f'No public key found for client {client_id}')
-
-        self.update_last_seen(client_id)
-        return result[0]
+        return record[1]
 
     def add_client(self, name: str) -> bool:
-        """Add a new client to the database."""
-        if self.check_user_exists(name):
-            return False
-
+        """Add a new client to the database, in one statement so two shards can't add the same name."""
         with self.connection:
-            self.connection.execute('''
+            cursor = self.connection.execute('''
                 INSERT INTO CLIENT_TABLE (ID, Name, PublicKey, LastSeen, AES_Key)
-                VALUES (NULL, ?, NULL, ?, NULL)
-            ''', (name, datetime.now().isoformat()))
+                SELECT NULL, ?, NULL, ?, NULL
+                WHERE NOT EXISTS (SELECT 1 FROM CLIENT_TABLE WHERE Name = ?)
+            ''', (name, datetime.now().isoformat(), name))
 
-        return True
+        return cursor.rowcount == 1
 
     def update_last_seen(self, client_id: bytes):
-        """Update the last seen timestamp of a client."""
-        with self.connection:
-            self.connection.execute('''
-                UPDATE CLIENT_TABLE
-                SET LastSeen = ?
-                WHERE ID = ?
-            ''', (datetime.now().isoformat(), client_id))
+        """Update the last seen timestamp of a client, it is written with the others by flush_last_seen."""
+        if not self.last_seen:
+            self.last_seen_since = time.monotonic()
+        self.last_seen[client_id] = datetime.now().isoformat()
+
+    def last_seen_timeout(self):
+        """Return the seconds until the LastSeen updates are due, or None if there are none."""
+        if not self.last_seen:
+            return None
+        return max(0.0, self.last_seen_since + LAST_SEEN_DELAY - time.monotonic())
+
+    def flush_last_seen(self, force: bool = False):
+        """Write the LastSeen updates in one transaction, once they are due or if forced."""
+        if not self.last_seen or (not force and self.last_seen_timeout() > 0):
+            return
+        updates = [(last_seen, client_id) for client_id, last_seen in self.last_seen.items()]
+        try:
+            with self.connection:
+                self.connection.executemany('''
+                    UPDATE CLIENT_TABLE
+                    SET LastSeen = ?
+                    WHERE ID = ?
+                ''', updates)
+        except Exception:
+            # kept for the next try, after another delay rather than on every pass of the loop
+            self.last_seen_since = time.monotonic()
+            raise
+        self.last_seen = {}
 
     def update_client_id(self, client_id: bytes, name: str):
         """update the client ID of a client."""
         with self.connection:
             self.connection.execute('''
             UPDATE CLIENT_TABLE
-            SET ID = ?
+            SET ID = ?, KeyVersion = KeyVersion + 1
             WHERE Name = ?
             ''', (client_id, name))
+        self.forget_client(name=name)
 
     def update_public_key(self, client_id: bytes, name: str, public_key: bytes):
         """Update the public key of a client."""
         with self.connection:
             self.connection.execute('''
             UPDATE CLIENT_TABLE
-            SET PublicKey = ?
+            SET PublicKey = ?, KeyVersion = KeyVersion + 1
             WHERE ID = ? AND Name = ?
             ''', (public_key, client_id, name))
+        self.forget_client(client_id)
 
     def update_aes_key(self, client_id: bytes, name: str, aes_key: bytes):
         """Update the AES key of a client."""
@@ -150,15 +371,18 @@ class Database:
                 self.connection.execute('''
                 DELETE FROM CLIENT_TABLE WHERE ID = ?
                 ''', (param,))
+                self.forget_client(client_id=param)
 
             elif isinstance(param, str):
                 self.connection.execute('''
                 DELETE FROM CLIENT_TABLE WHERE Name = ?
                 ''', (param,))
+                self.forget_client(name=param)
 
 
     def get_client(self, client_id):
         """Retrieve client details by ID."""
+        self.flush_last_seen(force=True)
         cursor = self.connection.cursor()
         cursor.execute('''
             SELECT ID, Name, PublicKey, LastSeen, AES_Key
@@ -168,5 +392,6 @@ class Database:
         return cursor.fetchone()
 
     def close(self):
-        """Close the database connection."""
+        """Write the LastSeen updates, and close the database connection."""
+        self.flush_last_seen(force=True)
         self.connection.close()
@@ -1,43 +1,78 @@
 import os
 import cksum
+import storage
+import workers
+from Crypto.Cipher import AES
+from crypto import AESStreamDecryptor
+from storage import BACKUP_PATH
 
 
-BACKUP_PATH = os.path.join(os.getcwd(), 'backup')
+BATCH_SIZE = 16 * 32768     # the packets that wait for a job, the next messages wait when it's full
 
 
 class FileHandler:
     """
     A class to handle the file being received from the client.
 
+    The content is decrypted as the packets arrive. The plaintext of a file is written straight to a
+    preallocated temporary file of the upload, which is renamed to the file's path when it is complete,
+    and its CRC is computed in the same pass, so a file of any size takes a packet of memory and is never
+    read back. The plaintext of a pack is kept in memory to be unpacked. The decryption is a job of the
+    worker pool that takes the decryptor and the CRC and returns their new state, the handler only keeps
+    the state between the jobs. The packets that arrive while a job runs are batched into the next job,
+    so a file costs a round trip to the pool per batch and not per packet.
+
+    A deferred file is stored as it was received instead: the packets are appended to an encrypted file
+    on the loop, which is flushed to the disk by a job after the last packet, and the file is decrypted
+    and verified later by the verification queue.
+
     Attributes:
         file_name (str): The name of the file being received.
-        file_path (str): The path of the file being received.
-        tmp_file (str): A temporary file that will be deleted after the file has been saved.
+        file_path (str): The path of the file being received, in the client's directory.
+        temp_path (str): The temporary file the file is written to until it is complete, or the encrypted file.
         file_size (int): The size of the file being received.
         expected_packets (int): The total number of packets to be received from the client.
         packets (int): How many packets were received so far.
         encrypted_file_size (int): The size of the encrypted file.
+        decryptor (AESStreamDecryptor): Decrypts the content of the file being received.
+        encrypted (file): The encrypted file of a deferred file while its packets arrive, None otherwise.
+        deferred (bool): Flag indicating if the file is stored as it was received, to be verified later.
+        receiving (bool): Flag indicating if the temporary file was created and isn't finished.
+        pack (bytearray): The plaintext of the pack being received.
+        crc (cksum.Cksum): The CRC of the plaintext so far.
+        written (int): The bytes of plaintext so far.
+        batch (list): The content of the packets that arrived since the last job.
+        batch_size (int): The bytes of content in the batch.
+        writing (bool): Flag indicating if a job of the file runs on the worker pool.
     """
     def __init__(self):
         self.file_name = ''
         self.file_path = ''
-        self.tmp_file = ''
+        self.temp_path = ''
         self.file_size = 0
         self.expected_packets = 0
         self.packets = 0
         self.encrypted_file_size = 0
+        self.decryptor = None
+        self.encrypted = None
+        self.deferred = False
+        self.receiving = False
+        self.pack = None
+        self.crc = cksum.Cksum()
+        self.written = 0
+        self.batch = []
+        self.batch_size = 0
+        self.writing = False
 
         self.create_backup_folder()
 
-    def set_file_name(self, file_name: str):
-        """ Sets the name of the file being received."""
+    def set_file_name(self, file_name: str, client_id: bytes):
+        """ Sets the name of the file being received, and the client whose directory it is saved in."""
         self.file_name = file_name
-        self.file_path = os.path.join(BACKUP_PATH, self.file_name)
         pos = file_name.find('.')
         if pos == -1:
             raise ValueError('Invalid file name')
-        tmp_file_name = file_name[:pos] + '.bin'
-        self.tmp_file = os.path.join(BACKUP_PATH, f'{tmp_file_name}')
+        self.file_path = storage.file_path(client_id, self.file_name)
 
     def set_file_size(self, file_size: int):
         """ Sets the size of the file being received."""
@@ -59,35 +94,126 @@ class FileHandler:
         """ Checks if the file being received exists."""
         return os.path.exists(self.file_path)
 
-    def append_file_content(self, content: bytes, encrypted_content_size: int):
-        """ Appends the content to the temporary file of the file being received."""
+    def start_file(self, decryptor: AESStreamDecryptor, is_pack: bool, deferred: bool = False):
+        """
+        Prepares to receive the content of a file or a pack. A file's temporary file is created and preallocated
+        to the original size of the file, a deferred file's encrypted file to the size of the ciphertext.
+        """
+        self.decryptor = decryptor
+        if is_pack:
+            self.pack = bytearray()
+            return
+        if deferred:
+            self.deferred = True
+            self.temp_path = storage.temp_path(self.file_path, storage.ENCRYPTED_SUFFIX)
+            self.encrypted = open(self.temp_path, 'wb')
+            self.receiving = True
+            encrypted_size = (self.file_size // AES.block_size + 1) * AES.block_size    # with the padding
+            try:
+                os.posix_fallocate(self.encrypted.fileno(), 0, encrypted_size)
+            except (AttributeError, OSError):
+                pass
+            return
+        self.temp_path = storage.temp_path(self.file_path)
+        with open(self.temp_path, 'wb') as output:
+            self.receiving = True
+            if self.file_size > 0:
+                try:
+                    os.posix_fallocate(output.fileno(), 0, self.file_size)
+                except (AttributeError, OSError):   # not on this platform or file system
+                    output.truncate(self.file_size)
+
+    def add_packet(self, content: bytes, encrypted_content_size: int):
+        """
+        Takes the next packet of the file or the pack being received into the batch of the next job.
+        The packets of a deferred file are written right away.
+        """
         self.packets += 1
         self.encrypted_file_size += encrypted_content_size
-        with open(self.tmp_file, 'ab') as f:
-            f.write(content)
-
-    def create_file(self, data: bytes):
-        """ Creates a file from the given data, and removes the temporary file."""
-        os.remove(self.tmp_file)
-        with open(self.file_path, 'wb') as f:
-            f.write(data)
+        if self.deferred:
+            self.encrypted.write(content)
+            return
+        self.batch.append(bytes(content))   # a view of the receive buffer
+        self.batch_size += len(content)
+
+    def batch_full(self) -> bool:
+        """ Checks if the batch reached BATCH_SIZE."""
+        return self.batch_size >= BATCH_SIZE
+
+    def next_batch(self):
+        """
+        Returns the job and the arguments of the packets in the batch, or None if there are none.
+        The only job of a deferred file is the flush after the last packet.
+        """
+        final = self.is_complete()
+        if self.deferred:
+            if not final or self.encrypted is None:
+                return None
+            self.encrypted.truncate(self.encrypted_file_size)   # the preallocation may be longer
+            self.encrypted.close()
+            self.encrypted = None
+            return workers.sync_file, (self.temp_path,)
+        if not self.batch:
+            return None
+        content = self.batch[0] if len(self.batch) == 1 else b''.join(self.batch)
+        self.batch = []
+        self.batch_size = 0
+        if self.pack is not None:
+            return workers.decrypt_chunk, (self.decryptor, content, final)
+        return workers.write_file_chunk, (self.decryptor, self.crc, self.temp_path, self.written, content, final)
+
+    def packet_written(self, result: tuple):
+        """ Takes the result of a batch's job, the new state of the decryptor and the CRC."""
+        if self.deferred:   # the flush of the encrypted file
+            return
+        if self.pack is not None:
+            self.decryptor, plaintext = result
+            self.written += len(plaintext)
+            if self.written > self.file_size:   # the size was checked against the limit of a pack
+                raise ValueError(f'Pack is larger than its size: {self.file_name}')
+            self.pack += plaintext
+            return
+        self.decryptor, self.crc, size = result
+        self.written += size
+
+    def is_complete(self) -> bool:
+        """ Checks if every packet of the file or the pack was received."""
+        return self.packets == self.expected_packets
+
+    def finish_file(self) -> int:
+        """ Finishes the file being received, replacing the file that was backed up before, and returns its CRC."""
+        os.replace(self.temp_path, self.file_path)
+        self.receiving = False
+        return self.crc.digest()
+
+    def finish_stored_file(self) -> str:
+        """ Hands the encrypted file of a deferred file that was received over, and returns its path."""
+        if not self.deferred or self.receiving is False or self.encrypted is not None:
+            raise ValueError(f'No stored file: {self.file_name}')
+        self.receiving = False
+        return self.temp_path
+
+    def finish_pack(self) -> bytearray:
+        """ Finishes the pack being received, and returns its plaintext."""
+        pack, self.pack = self.pack, None
+        return pack
 
     def create_backup_folder(self):
         """ Creates the backup folder."""
         if not os.path.exists(BACKUP_PATH):
             os.makedirs(BACKUP_PATH)
 
-    def get_content_from_file(self) -> bytes:
-        """ Returns the content of the file being received."""
-        with open(self.tmp_file, 'rb') as file:
-            return file.read()
-
     def reset(self):
-        """ Resets the class and deletes the temporary file."""
-        if os.path.exists(self.tmp_file):
-            os.remove(self.tmp_file)
+        """ Resets the class, and deletes the temporary file of a file that wasn't finished."""
+        if self.encrypted is not None:
+            self.encrypted.close()
+        if self.receiving:
+            try:
+                storage.remove(self.temp_path)
+            except OSError:
+                pass
         self.__init__()
 
     def get_crc(self) -> int:
-        """ Returns the crc of the file being received."""
-        return cksum.readfile(self.file_path)
+        """ Returns the crc of the file that was received."""
+        return self.crc.digest()
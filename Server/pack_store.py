@@ -0,0 +1,204 @@
+"""
+The pack-file store of the small files.
+
+The files that arrive in packs are small, and saving each in a file of its own costs an inode, a
+directory entry and an open, write and close. They are appended to large segment files instead, and
+the catalog records the segment, the offset, the length and the CRC of every file:
+
+    backup/segments/<creation time in ns>-<random hex>.seg
+
+Every process that saves files appends to a segment of its own, so the appends need no lock, and it
+starts a new segment when the segment is full or SEGMENT_AGE old. A segment that is older than that
+is sealed, it is never appended to again.
+
+A file that is backed up again leaves its previous version in its segment. The compactor runs in the
+background, copies the files that are still in the catalog out of the sealed segments that are mostly
+superseded, moves them in the catalog, and deletes the segments.
+"""
+import os
+import threading
+import time
+import uuid
+
+from storage import BACKUP_PATH
+
+
+SEGMENTS_PATH = os.path.join(BACKUP_PATH, 'segments')
+SEGMENT_SUFFIX = '.seg'
+SEGMENT_SIZE = 64 * 1024 * 1024     # a full segment, the next file starts a new one
+SEGMENT_AGE = 60                    # seconds a segment is appended to, it's sealed after that
+COMPACT_INTERVAL = 60               # seconds between the runs of the compactor
+COMPACT_RATIO = 0.5                 # the superseded part of a sealed segment that is compacted
+
+
+def segment_path(segment: str) -> str:
+    """ Returns the path of a segment."""
+    return os.path.join(SEGMENTS_PATH, segment + SEGMENT_SUFFIX)
+
+
+def segment_created(segment: str) -> float:
+    """ Returns when a segment was created, in seconds since the epoch, from its name."""
+    return int(segment.split('-', 1)[0]) / 1e9
+
+
+def is_sealed(segment: str) -> bool:
+    """ Checks if a segment is sealed, no writer appends to it anymore."""
+    return time.time() - segment_created(segment) > 2 * SEGMENT_AGE     # with a margin for a slow write
+
+
+def read(segment: str, offset: int, length: int) -> bytes:
+    """ Reads a file out of a segment."""
+    with open(segment_path(segment), 'rb') as f:
+        f.seek(offset)
+        data = f.read(length)
+    if len(data) != length:
+        raise ValueError(f'Segment {segment} is too short')
+    return data
+
+
+class SegmentWriter:
+    """
+    Appends files to the segment of a process.
+
+    Attributes:
+        segment (str): The name of the segment that is appended to, None before the first file.
+        output (file): The segment that is appended to.
+        created (float): When the segment was created.
+        durable (bool): Flag indicating if a segment is synced to the disk when it's sealed, for the compactor,
+            whose copies are the only ones once the old segment is deleted.
+
+    Args:
+        durable (bool): Whether a segment is synced to the disk when it's sealed.
+    """
+    def __init__(self, durable: bool = False):
+        self.segment = None
+        self.output = None
+        self.created = 0.0
+        self.durable = durable
+
+    def append(self, data: bytes) -> tuple:
+        """ Appends a file to the segment, returns the segment and the offset of the file."""
+        if self.output is None or self.output.tell() + len(data) > SEGMENT_SIZE \
+                or time.time() - self.created > SEGMENT_AGE:
+            self.start_segment()
+        offset = self.output.tell()
+        self.output.write(data)
+        return self.segment, offset
+
+    def flush(self):
+        """ Writes the appended files to the segment file."""
+        if self.output is not None:
+            self.output.flush()
+
+    def sync(self):
+        """ Writes the appended files to the disk, and the segment's entry in its directory."""
+        if self.output is None:
+            return
+        self.output.flush()
+        os.fsync(self.output.fileno())
+        if hasattr(os, 'O_DIRECTORY'):  # a new file isn't durable until its directory is
+            directory = os.open(SEGMENTS_PATH, os.O_RDONLY | os.O_DIRECTORY)
+            try:
+                os.fsync(directory)
+            finally:
+                os.close(directory)
+
+    def start_segment(self):
+        """ Seals the segment, and starts a new one."""
+        self.close()
+        os.makedirs(SEGMENTS_PATH, exist_ok=True)
+        self.created = time.time()
+        self.segment = f'{time.time_ns()}-{uuid.uuid4().hex}'
+        self.output = open(segment_path(self.segment), 'ab')
+
+    def close(self):
+        """ Closes the segment."""
+        if self.output is not None:
+            if self.durable:
+                self.sync()
+            self.output.close()
+            self.output = None
+
+
+_writer = SegmentWriter()   # the segment of this process
+
+
+def append(data: bytes) -> tuple:
+    """ Appends a file to the segment of this process, returns the segment and the offset of the file."""
+    return _writer.append(data)
+
+
+def flush():
+    """ Writes the files that were appended by this process to its segment file."""
+    _writer.flush()
+
+
+class Compactor:
+    """
+    Reclaims the space of the superseded files in the sealed segments, on a thread of its own with its
+    own connection to the database. Only one process of the server runs a compactor.
+
+    Attributes:
+        database_factory (callable): Opens a connection to the database, on the compactor's thread.
+        thread (threading.Thread): The compactor's thread.
+        stopped (threading.Event): Set to stop the compactor.
+
+    Args:
+        database_factory (callable): Opens a connection to the database, on the compactor's thread.
+    """
+    def __init__(self, database_factory):
+        self.database_factory = database_factory
+        self.thread = threading.Thread(target=self.run, name='compactor', daemon=True)
+        self.stopped = threading.Event()
+
+    def start(self):
+        """ Starts the compactor's thread."""
+        self.thread.start()
+
+    def stop(self):
+        """ Stops the compactor's thread, after the segment it's compacting."""
+        self.stopped.set()
+        self.thread.join()
+
+    def run(self):
+        """ Compacts the segments every COMPACT_INTERVAL seconds, until stopped."""
+        database = self.database_factory()
+        writer = SegmentWriter(durable=True)
+        try:
+            while not self.stopped.wait(COMPACT_INTERVAL):
+                try:
+                    self.compact(database, writer)
+                except Exception as e:  # the next run tries again
+                    print(f'Compaction failed: {e}')
+        finally:
+            writer.close()
+            database.close()
+
+    def compact(self, database, writer: SegmentWriter):
+        """ Compacts the sealed segments whose superseded part is at least COMPACT_RATIO."""
+        if not os.path.isdir(SEGMENTS_PATH):
+            return
+        live = database.get_segment_usage()
+        for name in os.listdir(SEGMENTS_PATH):
+            if not name.endswith(SEGMENT_SUFFIX) or self.stopped.is_set():
+                continue
+            segment = name[:-len(SEGMENT_SUFFIX)]
+            if segment == writer.segment or not is_sealed(segment):
+                continue
+            size = os.path.getsize(segment_path(segment))
+            if size and live.get(segment, 0) / size > 1 - COMPACT_RATIO:
+                continue
+
+            # the copies are on the disk before the catalog points at them and the segment is deleted
+            moves = []
+            kept = 0
+            for row_id, offset, length in database.get_segment_files(segment):
+                data = read(segment, offset, length)
+                moves.append((row_id, offset) + writer.append(data))
+                kept += length
+            writer.sync()
+            database.move_packed_files(segment, moves)
+            moved = len(moves)
+            if not database.get_segment_files(segment):     # a file may have been moved in meanwhile
+                os.remove(segment_path(segment))
+                print(f'Compacted segment {segment}: moved {moved} files, freed {size - kept} bytes')
@@ -17,6 +17,23 @@ ORIGINAL_FILE_SIZE = 4
 PACKET_NUMBER_SIZE = 2
 TOTAL_PACKET_SIZE = 2
 CRC_SIZE = 4
+FILE_COUNT_SIZE = 4
+
+# A pack holds many small files: the file count, an index entry per file and the content of the files.
+PACK_OFFSET_SIZE = 4
+PACK_ENTRY_SIZE = FILE_NAME_SIZE + PACK_OFFSET_SIZE + CONTENT_SIZE + CRC_SIZE
+
+
+REQUEST_HEADER_SIZE = CLIENT_ID_SIZE + VERSION_SIZE + CODE_SIZE + PAYLOAD_SIZE
+FILE_PAYLOAD_HEADER_SIZE = CONTENT_SIZE + ORIGINAL_FILE_SIZE + PACKET_NUMBER_SIZE + TOTAL_PACKET_SIZE + FILE_NAME_SIZE
+PACKET_SIZE = 32768  # 32KB, the largest message
+AES_BLOCK_SIZE = 16
+
+# A pack is kept in memory until it's whole, so it's limited like the client limits it. The client fills every
+# packet with whole AES blocks, the first one after the request header is the smallest.
+PACK_MAX_SIZE = 4 * 1024 * 1024
+PACK_MIN_PACKET_CONTENT = (PACKET_SIZE - REQUEST_HEADER_SIZE - FILE_PAYLOAD_HEADER_SIZE) // AES_BLOCK_SIZE * AES_BLOCK_SIZE
+PACK_MAX_PACKETS = -(-(PACK_MAX_SIZE + AES_BLOCK_SIZE) // PACK_MIN_PACKET_CONTENT)
 
 
 # Enum for Request and Response Codes
@@ -25,6 +42,9 @@ class RequestCode(IntEnum):
     REQUEST_PUBLIC_KEY = 826
     REQUEST_LOGIN = 827
     REQUEST_SEND_FILE = 828
+    REQUEST_SEND_PACK = 829
+    REQUEST_SEND_FILE_DEFERRED = 830   # a file that is stored as it was received, and verified later
+    REQUEST_FILE_CRC = 831             # the CRC of the plaintext of a deferred file
 
     REQUEST_CRC_VALID = 900
     REQUEST_CRC_INVALID = 901
@@ -40,6 +60,8 @@ class ResponseCode(IntEnum):
     RESPONSE_LOGIN = 1605
     RESPONSE_LOGIN_FAILED = 1606
     RESPONSE_ERROR = 1607
+    RESPONSE_PACK_VALID = 1608
+    RESPONSE_FILE_STORED = 1609
 
 
 # Define payload structures (this should match the C++ payloads)
@@ -79,6 +101,13 @@ class CRCRequest:
         self.file_name = file_name
 
 
+class FileCRCRequest:
+    """ A payload that contains the file name and the CRC of its plaintext """
+    def __init__(self, file_name: str, crc: int):
+        self.file_name = file_name
+        self.crc = crc
+
+
 class ClientIDResponse:
     """ A payload that contains the client ID. """
     def __init__(self, client_id: bytes):
@@ -101,6 +130,23 @@ class FileResponse:
         self.crc = crc
 
 
+class PackResponse:
+    """ The CRCs of the files of a pack, in the order of the pack's index """
+    def __init__(self, client_id: bytes, file_name: str, crcs: list):
+        self.client_id = client_id
+        self.file_name = file_name
+        self.crcs = crcs
+
+
+class PackEntry:
+    """ A file in a pack """
+    def __init__(self, file_name: str, offset: int, size: int, crc: int):
+        self.file_name = file_name
+        self.offset = offset
+        self.size = size
+        self.crc = crc
+
+
 class ErrorResponse:
     pass
 
@@ -111,9 +157,11 @@ Payload = Union[
     , SendPublicKeyRequest
     , SendFileRequest
     , CRCRequest
+    , FileCRCRequest
     , ClientIDResponse
     , SymmetricKeyResponse
     , FileResponse
+    , PackResponse
     , ErrorResponse]
 
 
@@ -137,9 +185,10 @@ class Request:
 
     @staticmethod
     def deserialize(data: bytes):
-        """ Deserialize bytes into a Request object """
+        """ Deserialize bytes into a Request object, the content of a file is a view of data and isn't copied """
+        data = memoryview(data)
         header_size = CLIENT_ID_SIZE + VERSION_SIZE + CODE_SIZE + PAYLOAD_SIZE
-        client_id, version, opcode, payload_size = struct.unpack(f'<{CLIENT_ID_SIZE}sBHI', data[:header_size])
+        client_id, version, opcode, payload_size = struct.unpack_from(f'<{CLIENT_ID_SIZE}sBHI', data)
         try:
             code = RequestCode(opcode)
         except ValueError:
@@ -166,19 +215,21 @@ class Request:
             name = name.decode('utf-8').rstrip('\0')
             return SendPublicKeyRequest(name, public_key)
 
-        elif opcode == RequestCode.REQUEST_SEND_FILE:
+        elif (opcode == RequestCode.REQUEST_SEND_FILE
+              or opcode == RequestCode.REQUEST_SEND_PACK
+              or opcode == RequestCode.REQUEST_SEND_FILE_DEFERRED):
             payload_header_size = (CONTENT_SIZE +
                                    ORIGINAL_FILE_SIZE +
                                    PACKET_NUMBER_SIZE +
                                    TOTAL_PACKET_SIZE +
                                    FILE_NAME_SIZE)
 
-            content_size, original_file_size, current_packet, total_packets, file_name = struct.unpack(
+            content_size, original_file_size, current_packet, total_packets, file_name = struct.unpack_from(
                 f'<IIHH{FILE_NAME_SIZE}s'
-                , payload_data[:payload_header_size]
+                , payload_data
             )
             file_name = file_name.decode('utf-8').rstrip('\0')
-            content = payload_data[payload_header_size:]
+            content = memoryview(payload_data)[payload_header_size:]     # a view, not a copy
             return SendFileRequest(content_size, original_file_size, current_packet, total_packets, file_name, content)
 
         elif (opcode == RequestCode.REQUEST_CRC_VALID
@@ -189,6 +240,11 @@ class Request:
             file_name = file_name.decode('utf-8').rstrip('\0')
             return CRCRequest(file_name)
 
+        elif opcode == RequestCode.REQUEST_FILE_CRC:
+            file_name, crc = struct.unpack(f'<{FILE_NAME_SIZE}sI', payload_data)
+            file_name = file_name.decode('utf-8').rstrip('\0')
+            return FileCRCRequest(file_name, crc)
+
         else:
             raise ValueError("Unknown opcode")
 
@@ -208,10 +264,33 @@ class Request:
                     payload.content_size)
         elif isinstance(payload, CRCRequest):
             return FILE_NAME_SIZE
+        elif isinstance(payload, FileCRCRequest):
+            return FILE_NAME_SIZE + CRC_SIZE
         else:
             raise ValueError("Unknown opcode")
 
 
+def unpack_index(pack: bytes) -> list:
+    """ Parse the index of a pack and check that every file is inside the pack """
+    if len(pack) < FILE_COUNT_SIZE:
+        raise ValueError('Pack is too small')
+    file_count = struct.unpack_from('<I', pack)[0]
+    index_size = FILE_COUNT_SIZE + file_count * PACK_ENTRY_SIZE
+    if index_size > len(pack):
+        raise ValueError(f'Invalid pack index, {file_count} files')
+
+    entries = []
+    for i in range(file_count):
+        file_name, offset, size, crc = struct.unpack_from(
+            f'<{FILE_NAME_SIZE}sIII', pack, FILE_COUNT_SIZE + i * PACK_ENTRY_SIZE
+        )
+        file_name = file_name.decode('utf-8').rstrip('\0')
+        if offset < index_size or offset + size > len(pack):
+            raise ValueError(f'Invalid pack entry: {file_name}')
+        entries.append(PackEntry(file_name, offset, size, crc))
+    return entries
+
+
 # Response structure
 class Response:
     """
@@ -240,6 +319,9 @@ class Response:
         elif isinstance(self.payload, FileResponse):
             return CLIENT_ID_SIZE + CONTENT_SIZE + FILE_NAME_SIZE + CRC_SIZE
 
+        elif isinstance(self.payload, PackResponse):
+            return CLIENT_ID_SIZE + FILE_NAME_SIZE + FILE_COUNT_SIZE + len(self.payload.crcs) * CRC_SIZE
+
         elif isinstance(self.payload, ErrorResponse):
             return 0
 
@@ -276,6 +358,11 @@ class Response:
                 self.payload.crc
             )
 
+        elif isinstance(self.payload, PackResponse):
+            crcs = self.payload.crcs
+            file_name = self.payload.file_name.ljust(FILE_NAME_SIZE, '\0').encode('utf-8')
+            return self.payload.client_id + struct.pack(f'<{FILE_NAME_SIZE}sI{len(crcs)}I', file_name, len(crcs), *crcs)
+
         elif isinstance(self.payload, ErrorResponse):
             return b''
 
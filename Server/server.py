@@ -1,20 +1,31 @@
+import multiprocessing
+import os
 import socket
 import selectors
 import uuid
+import cksum
+import storage
 from connection import Connection
 from database import Database
+from pack_store import Compactor
 from protocol import *
+from verification import VerificationQueue
+from workers import WorkerPool, encrypt_aes_key, save_pack_files
 
 
 SERVER_PORT_FILE = 'port.info'
 DEFAULT_PORT = 1256
 MAX_ERRORS = 3
+PROCESSES_ENV = 'BACKUP_SERVER_PROCESSES'
 
 
 class Server:
     """
     The Server class is responsible for handling multiple clients and applying the protocol on the requests
-    and the responses.
+    and the responses. The selector loop reads and writes the sockets and keeps the state of the connections,
+    the RSA, AES, CRC and file work runs on a worker pool and its results come back to the loop.
+    Several servers can share a port as the shards of a multi-process server, the kernel spreads the
+    connections between them and every shard has its own loop, connections and pool.
 
     Attributes:
         host (str): The host address of the server.
@@ -22,28 +33,54 @@ class Server:
         selector (selectors.DefaultSelector): A selector object that allows selecting clients.
         database (Database): A Database object that allows accessing databases.
         connections (Dictionary): A Dictionary of connections.
+        pool (WorkerPool): The worker processes of the CPU and disk heavy work.
+        compactor (Compactor): Reclaims the superseded files of the pack-file store, only in the first shard.
+        verifications (VerificationQueue): Verifies the files that were stored as they were received.
+        shard (int): The number of the server among the shards that share the port.
+        shards (int): How many shards share the port, 1 for a server on its own.
 
     Args:
         host (str): The host address of the server.
         port (int): The port of the server, the default is DEFAULT_PORT.
+        shard (int): The number of the server among the shards that share the port.
+        shards (int): How many shards share the port, the default is a server on its own.
     """
-    def __init__(self, host, port=DEFAULT_PORT):
+    def __init__(self, host, port=DEFAULT_PORT, shard=0, shards=1):
         self.host = host
         self.port = port
+        self.shard = shard
+        self.shards = shards
         self.selector = selectors.DefaultSelector()
-        self.database = Database()
+        self.database = Database(shared=shards > 1)
         self.connections = {}
+        self.pool = WorkerPool(shards=shards)
+        self.compactor = Compactor(Database) if shard == 0 else None
+        self.verifications = VerificationQueue(self.pool, self.database)
 
     def start(self):
         """Start the server."""
         server_sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        if self.shards > 1:     # every shard binds the port, and the kernel balances the connections
+            server_sock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEPORT, 1)
         server_sock.bind((self.host, self.port))
         server_sock.listen()
-        print(f'Listening on {self.host}:{self.port}')
+        if self.shards > 1:
+            print(f'Shard {self.shard + 1}/{self.shards} listening on {self.host}:{self.port}')
+        else:
+            print(f'Listening on {self.host}:{self.port}')
+        print('Using the native cksum' if cksum.NATIVE else 'Using the pure python cksum, build Server/libcksum.so for speed')
+        print(f'Using {self.pool.workers} worker processes' if self.pool.workers else 'Using no worker processes')
         server_sock.setblocking(False)
 
         # Register the server socket for read events
         self.selector.register(server_sock, selectors.EVENT_READ, data=None)
+        # and the pool's wakeup socket, for the jobs that were done
+        self.selector.register(self.pool.wakeup_receiver, selectors.EVENT_READ, data=self.pool)
+
+        if self.compactor is not None:
+            self.compactor.start()
+        if self.shard == 0:     # the verifications that weren't done before the server stopped
+            self.verifications.resume()
 
         try:
             self.run_event_loop()
@@ -51,15 +88,23 @@ class Server:
             print('Shutting down...')
         finally:
             self.selector.close()
+            self.pool.shutdown()
+            if self.compactor is not None:
+                self.compactor.stop()
+            self.database.close()
 
     def run_event_loop(self):
         """Run the main event loop for handling client connections."""
         while True:
-            events = self.selector.select(timeout=None)
+            # wake up for the LastSeen updates that are due, if nothing else happens
+            events = self.selector.select(timeout=self.database.last_seen_timeout())
             for key, mask in events:
                 if key.data is None:
                     # If the event is on the server socket, accept a new connection
                     self.accept_connection(key.fileobj)
+                elif key.data is self.pool:
+                    # Continue the connections whose jobs were done
+                    self.pool.run_done()
                 else:
                     # If the event is on a client connection, handle the data
                     connection = key.data
@@ -67,6 +112,10 @@ class Server:
                         self.handle_read(connection)
                     if mask & selectors.EVENT_WRITE:
                         self.handle_write(connection)
+            try:
+                self.database.flush_last_seen()
+            except Exception as e:  # the database is locked or failed, the updates are written next time
+                print(e)
 
     def accept_connection(self, server_sock: socket.socket):
         """Accept a new client connection."""
@@ -79,43 +128,92 @@ class Server:
         self.connections[conn] = connection
 
     def handle_read(self, connection: Connection):
-        """Read data from the connection, deserialize, and process."""
-        data = connection.read()
-        if data:
-            if not connection.got_file:     # not supposed to get file packets
-                try:
-                    connection.request = Request.deserialize(data)
-                    if self.handle_request(connection):
-                        response_bytes = connection.response.serialize()
-                        connection.errors_num = 0
-                        connection.queue_data(response_bytes)
-                except Exception as e:
-                    print(e)
-                    connection.errors_num += 1
-                    connection.queue_data(
-                        Response(SERVER_VERSION, ResponseCode.RESPONSE_ERROR, ErrorResponse()).serialize()
-                    )
-                    if connection.errors_num >= MAX_ERRORS:
-                        self.connections.pop(connection.sock)
-                        connection.close()
-
-            # receive the following file packets
-            else:
+        """Read data from the connection, and process every whole message that arrived."""
+        if not connection.read():
+            if connection.is_closed:    # by the client or by an error
+                self.connections.pop(connection.sock, None)
+            return
+        self.process_messages(connection)
+
+    def process_messages(self, connection: Connection):
+        """Process the whole messages that arrived, until one waits for a job of the worker pool."""
+        if connection.processing:   # a job that was done right away, the loop below goes on
+            return
+        connection.processing = True
+        try:
+            while not connection.is_closed and not connection.busy:
                 try:
-                    self.handle_file_payload(connection, data)  #
-                except Exception as e:
+                    data = connection.next_message()
+                except ValueError as e:     # the stream can't be split into messages anymore
                     print(e)
-                    connection.errors_num += 1
-                    connection.queue_data(
-                        Response(SERVER_VERSION, ResponseCode.RESPONSE_ERROR, ErrorResponse()).serialize()
-                    )
-                    if connection.errors_num >= MAX_ERRORS:
-                        self.connections.pop(connection.sock)
-                        connection.close()
+                    self.connections.pop(connection.sock, None)
+                    connection.close()
+                    return
+                if data is None:
+                    return
+                self.handle_message(connection, data)
+        finally:
+            connection.processing = False
+
+    def handle_message(self, connection: Connection, data: bytes):
+        """Deserialize a message and process it."""
+        if not connection.got_file:     # not supposed to get file packets
+            try:
+                connection.request = Request.deserialize(data)
+                if self.handle_request(connection):
+                    self.send_response(connection)
+            except Exception as e:
+                self.handle_error(connection, e)
+
+        # receive the following file packets
+        else:
+            try:
+                self.handle_file_payload(connection, data)
+            except Exception as e:
+                self.handle_error(connection, e)
+
+    def send_response(self, connection: Connection):
+        """Queue the response of the connection."""
+        response_bytes = connection.response.serialize()
+        connection.errors_num = 0
+        connection.queue_data(response_bytes)
+
+    def handle_error(self, connection: Connection, error: Exception):
+        """Answer a request that failed with an error, and close the connection after too many errors."""
+        print(error)
+        connection.errors_num += 1
+        connection.queue_data(
+            Response(SERVER_VERSION, ResponseCode.RESPONSE_ERROR, ErrorResponse()).serialize()
+        )
+        if connection.errors_num >= MAX_ERRORS:
+            self.connections.pop(connection.sock, None)
+            connection.close()
+
+    def submit(self, connection: Connection, function, args: tuple, continuation):
+        """
+        Run a job on the worker pool for a connection, and then continuation(result) on the loop.
+        The connection's next messages wait for the job, they are processed in order.
+        """
+        connection.busy = True
+
+        def complete(result):
+            connection.busy = False
+            if connection.is_closed:
+                return
+            try:
+                continuation(result)
+            except Exception as e:
+                self.handle_error(connection, e)
+            if not connection.busy:
+                self.process_messages(connection)
+
+        self.pool.submit(function, args, complete)
 
     def handle_write(self, connection):
         """Send any queued data in the connection's buffer."""
         connection.write()
+        if connection.is_closed:
+            self.connections.pop(connection.sock, None)
 
     def handle_request(self, connection) -> bool:
         """Handle the incoming request and generate a response."""
@@ -144,28 +242,30 @@ class Server:
         elif opcode == RequestCode.REQUEST_LOGIN:
             client_id = connection.request.client_id
             username = connection.request.payload.name
-            if self.database.check_login(client_id, username):     # check if name and public key exists.
+            public_key = self.database.get_login_key(client_id, username)   # check if name and public key exists.
+            if public_key is not None:
                 try:
                     self.database.update_last_seen(client_id)
                     self.database.update_aes_key(client_id, username, connection.aes_wrapper.get_aes_key())
-
-                    public_key = self.database.get_public_key(client_id)
-                    encrypted_aes_key = connection.aes_wrapper.encrypt_aes_with_rsa(public_key)
-
-                    payload = SymmetricKeyResponse(client_id, encrypted_aes_key)
-                    connection.response = Response(
-                        SERVER_VERSION,
-                        ResponseCode.RESPONSE_LOGIN,
-                        payload
-                    )
                 except Exception as e:     # problem with the database
                     print(e)
                     payload = ClientIDResponse(client_id)
-                    connection.response = Response(
-                        SERVER_VERSION,
-                        ResponseCode.RESPONSE_LOGIN_FAILED,
-                        payload
-                    )
+                    connection.response = Response(SERVER_VERSION, ResponseCode.RESPONSE_LOGIN_FAILED, payload)
+                    return True
+
+                def key_encrypted(result):
+                    try:
+                        payload = SymmetricKeyResponse(client_id, result())
+                        connection.response = Response(SERVER_VERSION, ResponseCode.RESPONSE_LOGIN, payload)
+                    except Exception as e:     # a public key that can't be used
+                        print(e)
+                        payload = ClientIDResponse(client_id)
+                        connection.response = Response(SERVER_VERSION, ResponseCode.RESPONSE_LOGIN_FAILED, payload)
+                    self.send_response(connection)
+
+                self.submit(connection, encrypt_aes_key, (connection.aes_wrapper.get_aes_key(), public_key),
+                            key_encrypted)
+                return False
             else:   # error with login, register again.
                 payload = ClientIDResponse(client_id)
                 connection.response = Response(SERVER_VERSION, ResponseCode.RESPONSE_LOGIN_FAILED, payload)
@@ -178,56 +278,95 @@ class Server:
             try:
                 self.database.update_last_seen(client_id)
                 self.database.update_aes_key(client_id, username, connection.aes_wrapper.get_aes_key())
-                encrypted_aes_key = connection.aes_wrapper.encrypt_aes_with_rsa(public_key)
-                payload = SymmetricKeyResponse(client_id, encrypted_aes_key)
-                connection.response = Response(
-                    SERVER_VERSION,
-                    ResponseCode.RESPONSE_AES_KEY,
-                    payload
-                )
-                self.database.update_public_key(client_id, username, public_key)
             except Exception as e:
                 print(e)
                 connection.response = Response(SERVER_VERSION, ResponseCode.RESPONSE_ERROR, ErrorResponse())
-            return True
+                return True
 
-        elif opcode == RequestCode.REQUEST_SEND_FILE:
+            def key_encrypted(result):
+                try:
+                    payload = SymmetricKeyResponse(client_id, result())
+                    connection.response = Response(SERVER_VERSION, ResponseCode.RESPONSE_AES_KEY, payload)
+                    self.database.update_public_key(client_id, username, public_key)
+                except Exception as e:
+                    print(e)
+                    connection.response = Response(SERVER_VERSION, ResponseCode.RESPONSE_ERROR, ErrorResponse())
+                self.send_response(connection)
+
+            self.submit(connection, encrypt_aes_key, (connection.aes_wrapper.get_aes_key(), public_key),
+                        key_encrypted)
+            return False
+
+        elif (opcode == RequestCode.REQUEST_SEND_FILE or opcode == RequestCode.REQUEST_SEND_PACK
+              or opcode == RequestCode.REQUEST_SEND_FILE_DEFERRED):
             connection.file_handler.reset()     # got a new file
-            print('Receiving file ...')
+            print('Receiving pack ...' if opcode == RequestCode.REQUEST_SEND_PACK else 'Receiving file ...')
             content_size = connection.request.payload.content_size
             file_size = connection.request.payload.original_file_size
             filename = connection.request.payload.file_name
             total_packets = connection.request.payload.total_packets
             content = connection.request.payload.content
+            if opcode == RequestCode.REQUEST_SEND_PACK and (file_size > PACK_MAX_SIZE
+                                                             or total_packets > PACK_MAX_PACKETS):
+                raise ValueError(f'Pack is too large: {filename}')
 
-            connection.file_handler.set_file_name(filename)
-
-            if connection.file_handler.file_exists():      # replace the previous file with the same name
-                connection.file_handler.delete_file()
+            # a file with the same name replaces the previous one when it's complete
+            connection.file_handler.set_file_name(filename, connection.request.client_id)
 
             connection.file_handler.set_file_size(file_size)
             connection.file_handler.set_expected_packets(total_packets)
+            connection.file_handler.start_file(connection.aes_wrapper.decryptor(),
+                                               opcode == RequestCode.REQUEST_SEND_PACK,
+                                               opcode == RequestCode.REQUEST_SEND_FILE_DEFERRED)
 
-            connection.file_handler.append_file_content(content, content_size)
             connection.got_file = True
             self.database.update_last_seen(connection.request.client_id)
-            return False  # for not sending the response
+            self.receive_packet(connection, content, content_size)
+            return False  # the response is queued when the whole file was received
 
+        # the client may have sent more files since, the file is found by its name.
         elif opcode == RequestCode.REQUEST_CRC_VALID:
             client_id = connection.request.client_id
+            file_name = connection.request.payload.file_name
+            file_path = connection.received_files.pop(file_name, None)
+            if file_path is None:
+                raise ValueError(f'No file to verify: {file_name}')
             payload = ClientIDResponse(client_id)
             connection.response = Response(SERVER_VERSION, ResponseCode.RESPONSE_ACK, payload)
-            self.database.verify_file(client_id, connection.file_handler.file_name, connection.file_handler.file_path)
+            self.database.verify_file(client_id, file_name, file_path)
+            self.database.update_last_seen(client_id)
+            return True
+
+        # the CRC of a stored file, the file is verified in the background and the client doesn't wait for it.
+        elif opcode == RequestCode.REQUEST_FILE_CRC:
+            client_id = connection.request.client_id
+            file_name = connection.request.payload.file_name
+            stored = connection.stored_files.pop(file_name, None)
+            if stored is None:
+                raise ValueError(f'No stored file: {file_name}')
+            encrypted_path, file_path, content_size = stored
+            crc = connection.request.payload.crc
+            aes_key = connection.aes_wrapper.get_aes_key()
+            try:
+                row_id = self.database.add_stored_file(client_id, file_name, file_path, encrypted_path, aes_key, crc)
+            except BaseException:
+                storage.remove(encrypted_path)
+                raise
+            self.verifications.add(row_id, client_id, file_name, file_path, encrypted_path, aes_key, crc)
             self.database.update_last_seen(client_id)
+            payload = FileResponse(client_id, content_size, file_name, crc)
+            connection.response = Response(SERVER_VERSION, ResponseCode.RESPONSE_FILE_STORED, payload)
             return True
 
         # do nothing, the client will send the file request again.
         elif opcode == RequestCode.REQUEST_CRC_INVALID:
+            connection.received_files.pop(connection.request.payload.file_name, None)
             self.database.update_last_seen(connection.request.client_id)
-            return True
+            return False
 
         elif opcode == RequestCode.REQUEST_CRC_FATAL:
             client_id = connection.request.client_id
+            connection.received_files.pop(connection.request.payload.file_name, None)
             payload = ClientIDResponse(client_id)
             connection.response = Response(SERVER_VERSION, ResponseCode.RESPONSE_ACK, payload)
             self.database.update_last_seen(client_id)
@@ -236,30 +375,147 @@ class Server:
     def handle_file_payload(self, connection: Connection, data: bytes):
         """Handle a file payload."""
         file_payload = Request.deserialize_payload(data, RequestCode.REQUEST_SEND_FILE)
-        content = file_payload.content
-        content_size = file_payload.content_size
-        connection.file_handler.append_file_content(content, content_size)
-
-        if connection.file_handler.expected_packets == connection.file_handler.packets:
-            print(f'Received file: {connection.file_handler.file_name}')
-            connection.got_file = False
-
-            encrypted_data = connection.file_handler.get_content_from_file()
-            decrypted_data = connection.aes_wrapper.decrypt(encrypted_data)
-            connection.file_handler.create_file(decrypted_data)
-
-            client_id = connection.request.client_id
-            content_size = connection.file_handler.encrypted_file_size
-            file_name = connection.file_handler.file_name
-            crc = connection.file_handler.get_crc()
-
-            file_path = connection.file_handler.file_path
-            self.database.add_file(client_id, file_name, file_path)
-
-            payload = FileResponse(client_id, content_size, file_name, crc)
-            connection.response = Response(SERVER_VERSION, ResponseCode.RESPONSE_FILE_VALID, payload)
-            response_bytes = connection.response.serialize()
-            connection.queue_data(response_bytes)
+        self.receive_packet(connection, file_payload.content, file_payload.content_size)
+
+    def receive_packet(self, connection: Connection, content: bytes, content_size: int):
+        """
+        Take a packet of a file or a pack. The packets that arrive while a batch is decrypted and written on the
+        worker pool make the next batch, so a connection has one job in flight and a round trip to the pool per
+        batch. The connection's next messages wait while the batch is full, and after the last packet until the
+        file is finished. A packet of a deferred file was written by the file handler.
+        """
+        file_handler = connection.file_handler
+        file_handler.add_packet(content, content_size)
+        if not file_handler.writing:
+            self.write_batch(connection)
+        elif file_handler.batch_full() or file_handler.is_complete():
+            connection.busy = True  # until the batch that is being written is done
+
+    def write_batch(self, connection: Connection):
+        """Decrypt and write the batch of packets on the worker pool, and finish after the last packet."""
+        file_handler = connection.file_handler
+        job = file_handler.next_batch()
+        if job is None:
+            return
+        function, args = job
+        last = file_handler.is_complete()
+        file_handler.writing = True
+
+        def batch_written(result):
+            file_handler.writing = False
+            connection.busy = False     # the batch is the connection's only job while the packets arrive
+            if connection.is_closed:
+                return
+            try:
+                if last:    # the next message is a request, even if the last packet failed
+                    connection.got_file = False
+                try:
+                    file_handler.packet_written(result())
+                except ValueError:  # a pack that's larger than it said, the rest of it isn't taken
+                    connection.got_file = False
+                    file_handler.reset()
+                    raise
+                if last:
+                    self.finish_file(connection)
+                else:
+                    self.write_batch(connection)
+            except Exception as e:
+                self.handle_error(connection, e)
+            if not connection.busy:
+                self.process_messages(connection)
+
+        self.pool.submit(function, args, batch_written)
+        if last and file_handler.writing:
+            connection.busy = True  # the next request waits for the file to be finished
+
+    def finish_file(self, connection: Connection):
+        """
+        Finish a file or a pack that was received, decrypted as it arrived, and queue the response.
+        A deferred file that was stored waits for the client's CRC instead.
+        """
+        print(f'Received file: {connection.file_handler.file_name}')
+        connection.got_file = False
+
+        if connection.request.opcode == RequestCode.REQUEST_SEND_PACK:
+            pack = connection.file_handler.finish_pack()
+            self.submit(connection, save_pack_files, (pack, connection.request.client_id),
+                        lambda result: self.finish_pack(connection, result()))
+            return
+
+        if connection.request.opcode == RequestCode.REQUEST_SEND_FILE_DEFERRED:    # answered on its CRC request
+            file_handler = connection.file_handler
+            previous = connection.stored_files.pop(file_handler.file_name, None)
+            if previous is not None:    # sent again before its CRC
+                storage.remove(previous[0])
+            connection.stored_files[file_handler.file_name] = (file_handler.finish_stored_file(),
+                                                               file_handler.file_path,
+                                                               file_handler.encrypted_file_size)
+            return
+
+        client_id = connection.request.client_id
+        content_size = connection.file_handler.encrypted_file_size
+        file_name = connection.file_handler.file_name
+        file_path = connection.file_handler.file_path
+
+        # recorded before the file is replaced, which drops a pending verification of an older upload
+        self.database.add_file(client_id, file_name, file_path)
+        crc = connection.file_handler.finish_file()
+        connection.received_files[file_name] = file_path
+
+        payload = FileResponse(client_id, content_size, file_name, crc)
+        connection.response = Response(SERVER_VERSION, ResponseCode.RESPONSE_FILE_VALID, payload)
+        self.send_response(connection)
+
+    def finish_pack(self, connection: Connection, files: list):
+        """
+        Record the files of a pack that a worker appended to the pack-file store, and queue the response with
+        their CRCs. A file is verified right away when its CRC matches the CRC in the index, the client sends
+        the mismatched files again in the next pack. A previous version that was a file of its own is deleted.
+        """
+        client_id = connection.request.client_id
+        crcs = []
+        for file_name, file_path, crc, index_crc, segment, offset, length in files:
+            self.database.add_packed_file(client_id, file_name, file_path, segment, offset, length, crc)
+            if crc == index_crc:
+                self.database.verify_file(client_id, file_name, file_path)
+            storage.remove(file_path)
+            crcs.append(crc)
+
+        print(f'Unpacked {len(crcs)} files')
+        payload = PackResponse(client_id, connection.file_handler.file_name, crcs)
+        connection.response = Response(SERVER_VERSION, ResponseCode.RESPONSE_PACK_VALID, payload)
+        self.send_response(connection)
+
+
+def run_shard(host, port: int, shard: int, shards: int):
+    """Run one shard of a multi-process server, in its own process."""
+    Server(host, port, shard, shards).start()
+
+
+def run(host, port=DEFAULT_PORT):
+    """
+    Run the server on a port, as BACKUP_SERVER_PROCESSES shards that share the port with SO_REUSEPORT,
+    or as a single process when it's not set or the platform has no SO_REUSEPORT.
+    The shards share the database, SQLite serializes their writes.
+    """
+    processes = int(os.environ.get(PROCESSES_ENV, 1))
+    if processes > 1 and not hasattr(socket, 'SO_REUSEPORT'):
+        print('SO_REUSEPORT is not supported, running a single process')
+        processes = 1
+    if processes <= 1:
+        Server(host, port).start()
+        return
+
+    shards = [multiprocessing.Process(target=run_shard, args=(host, port, shard, processes))
+              for shard in range(processes)]
+    for shard in shards:
+        shard.start()
+    try:
+        for shard in shards:
+            shard.join()
+    except KeyboardInterrupt:   # the shards got the interrupt too
+        for shard in shards:
+            shard.join()
 
 
 def main():
@@ -267,15 +523,13 @@ def main():
         with open(SERVER_PORT_FILE, 'r') as f:  # get the information about the server's port.
             port = int(f.read())
         if 0 < port < 65536:
-            server = Server('', port)
-            server.start()
+            run('', port)
         else:
             raise ValueError(f'Invalid port number: {port}')
 
     except Exception as e:
         print(e)
-        server = Server('')
-        server.start()
+        run('')
 
 
 if __name__ == '__main__':
@@ -0,0 +1,62 @@
+"""
+The layout of the backup folder.
+
+A client's files are kept in a directory of their own, sharded by the client's ID and by a hash of
+the file name, so no directory grows with the number of clients or files:
+
+    backup/<first 2 hex digits of the ID>/<ID in hex>/<2 hex digits of the name's hash>/<file name>
+
+Two clients may back up files with the same name. A file is written to a temporary file in its
+directory, with a name of its own for every upload, and renamed to its name when it is complete, so
+the file that was backed up before is replaced at once and never seen half written.
+"""
+import hashlib
+import os
+import uuid
+
+
+BACKUP_PATH = os.path.join(os.getcwd(), 'backup')
+TEMP_SUFFIX = '.tmp'
+ENCRYPTED_SUFFIX = '.enc'   # a file stored as it was received, until it's verified
+
+
+def client_directory(client_id: bytes) -> str:
+    """ Returns the directory of a client's files."""
+    client_hex = client_id.hex()
+    return os.path.join(BACKUP_PATH, client_hex[:2], client_hex)
+
+
+def file_path(client_id: bytes, file_name: str) -> str:
+    """ Returns the path of a client's file, only the last part of the name is used."""
+    file_name = os.path.basename(file_name)
+    if not file_name or file_name.startswith('.'):  # the temporary files start with a dot
+        raise ValueError('Invalid file name')
+    bucket = hashlib.sha256(file_name.encode('utf-8')).hexdigest()[:2]
+    return os.path.join(client_directory(client_id), bucket, file_name)
+
+
+def temp_path(path: str, suffix: str = TEMP_SUFFIX) -> str:
+    """ Returns a new temporary path for an upload of a file, in the file's directory."""
+    directory, file_name = os.path.split(path)
+    os.makedirs(directory, exist_ok=True)
+    return os.path.join(directory, f'.{file_name}.{uuid.uuid4().hex}{suffix}')
+
+
+def save(path: str, data: bytes):
+    """ Saves a whole file, through a temporary file."""
+    temp = temp_path(path)
+    try:
+        with open(temp, 'wb') as f:
+            f.write(data)
+        os.replace(temp, path)
+    except BaseException:
+        remove(temp)
+        raise
+
+
+def remove(path: str):
+    """ Removes a file, if it exists."""
+    try:
+        os.remove(path)
+    except FileNotFoundError:
+        pass
@@ -0,0 +1,95 @@
+import os
+from collections import deque
+
+import storage
+from database import Database
+from workers import WorkerPool, verify_stored_file
+
+
+class VerificationQueue:
+    """
+    Verifies the files that were stored as they were received, in the background. A file's verification
+    decrypts it, computes its CRC and compares it with the CRC the client sent, on the worker pool, and the
+    plaintext replaces the file that was backed up before when it matches, unless the file was uploaded again
+    in the meantime. The pending verifications are kept in the database, the first shard of the server
+    resumes them when it starts. At most one verification of a file runs at a time in a shard.
+
+    Attributes:
+        pool (WorkerPool): The worker pool the verifications run on.
+        database (Database): The database of the files and of the pending verifications.
+        pending (deque): The verifications that wait for a worker, the oldest first.
+        running (set): The paths of the files whose verification runs.
+        limit (int): How many verifications run at once, the rest of the pool is left to the uploads.
+        scheduling (bool): Flag indicating if run is starting verifications, a verification that was done
+            right away doesn't start more in the middle.
+
+    Args:
+        pool (WorkerPool): The worker pool the verifications run on.
+        database (Database): The database of the files and of the pending verifications.
+    """
+    def __init__(self, pool: WorkerPool, database: Database):
+        self.pool = pool
+        self.database = database
+        self.pending = deque()
+        self.running = set()
+        self.limit = max(1, pool.workers // 2)
+        self.scheduling = False
+
+    def add(self, row_id: int, client_id: bytes, file_name: str, path_name: str, encrypted_path: str,
+            aes_key: bytes, crc: int):
+        """ Queues the verification of a file that was recorded in the database."""
+        self.pending.append((row_id, client_id, file_name, path_name, encrypted_path, aes_key, crc))
+        self.run()
+
+    def resume(self):
+        """ Queues the verifications that weren't done before the server stopped."""
+        verifications = self.database.get_verifications()
+        if verifications:
+            print(f'Resuming {len(verifications)} verifications')
+        self.pending.extend(verifications)
+        self.run()
+
+    def run(self):
+        """ Starts the pending verifications, up to the limit, skipping the files that are being verified."""
+        if self.scheduling:
+            return
+        self.scheduling = True
+        try:
+            while len(self.running) < self.limit:
+                verification = next((v for v in self.pending if v[3] not in self.running), None)
+                if verification is None:
+                    return
+                self.pending.remove(verification)
+                self.start(verification)
+        finally:
+            self.scheduling = False
+
+    def start(self, verification: tuple):
+        """ Runs a verification on the worker pool."""
+        row_id, client_id, file_name, path_name, encrypted_path, aes_key, crc = verification
+        self.running.add(path_name)
+
+        def verified(result):
+            self.running.discard(path_name)
+            temp = None
+            try:
+                try:
+                    file_crc, temp = result()
+                except FileNotFoundError:   # verified by another shard, or before a crash
+                    file_crc = None
+                valid = file_crc == crc
+                current = self.database.finish_verification(row_id, client_id, file_name, path_name, valid,
+                                                            lambda: os.replace(temp, path_name))
+                storage.remove(encrypted_path)
+                if not current:
+                    print(f'Dropped the verification of a file that was uploaded again: {file_name}')
+                else:
+                    print(f'Verified file: {file_name}' if valid else f'Invalid CRC of file: {file_name}')
+            except Exception as e:  # kept in the database, verified again when the server starts
+                print(f'Failed to verify {file_name}: {e}')
+            finally:
+                if temp is not None:    # unless it was put in place
+                    storage.remove(temp)
+            self.run()
+
+        self.pool.submit(verify_stored_file, (encrypted_path, aes_key, path_name, crc), verified)
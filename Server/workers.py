@@ -0,0 +1,187 @@
+import os
+import queue
+import socket
+from concurrent.futures import ProcessPoolExecutor
+
+from Crypto.Cipher import AES
+
+import cksum
+import pack_store
+import storage
+from crypto import AESWrapper, AESStreamDecryptor
+from protocol import unpack_index
+
+
+WORKERS_ENV = 'BACKUP_SERVER_WORKERS'
+VERIFY_CHUNK_SIZE = 1024 * 1024
+
+
+# The jobs, they run in the worker processes and take and return only what can be pickled.
+
+def encrypt_aes_key(aes_key: bytes, public_key: bytes) -> bytes:
+    """ Encrypts an AES key with a client's RSA public key."""
+    return AESWrapper.encrypt_key_with_rsa(aes_key, public_key)
+
+
+def write_file_chunk(decryptor: AESStreamDecryptor, crc: cksum.Cksum, file_path: str, offset: int,
+                     content: bytes, final: bool) -> tuple:
+    """
+    Decrypts the next packets of a file, writes their plaintext at its offset in the file and adds it to the CRC.
+    Returns the decryptor and the CRC with their new state, and the size of the plaintext.
+    """
+    plaintext = decryptor.update(content)
+    if final:
+        plaintext += decryptor.finish()
+    crc.update(plaintext)
+    with open(file_path, 'r+b') as f:
+        f.seek(offset)
+        f.write(plaintext)
+        if final:
+            f.truncate(offset + len(plaintext))     # the preallocation may be longer than the plaintext
+    return decryptor, crc, len(plaintext)
+
+
+def decrypt_chunk(decryptor: AESStreamDecryptor, content: bytes, final: bool) -> tuple:
+    """ Decrypts the next packets of a pack, returns the decryptor with its new state and the plaintext."""
+    plaintext = decryptor.update(content)
+    if final:
+        plaintext += decryptor.finish()
+    return decryptor, plaintext
+
+
+def sync_file(file_path: str):
+    """ Flushes a file that was written to the disk."""
+    with open(file_path, 'rb+') as f:
+        os.fsync(f.fileno())
+
+
+def verify_stored_file(encrypted_path: str, aes_key: bytes, file_path: str, expected_crc: int) -> tuple:
+    """
+    Decrypts a file that was stored as it was received into a temporary file next to its path, and computes
+    its CRC. Returns the CRC and the temporary file when the CRC is the client's, the loop puts it in place if
+    the file wasn't uploaded again since; the CRC and None otherwise, or None and None if the file can't be
+    decrypted. The encrypted file is left to the loop.
+    """
+    decryptor = AESStreamDecryptor(aes_key, b'\0' * AES.block_size)
+    crc = cksum.Cksum()
+    temp = storage.temp_path(file_path)
+    try:
+        with open(encrypted_path, 'rb') as encrypted, open(temp, 'wb') as output:
+            while True:
+                chunk = encrypted.read(VERIFY_CHUNK_SIZE)
+                plaintext = decryptor.update(chunk) if chunk else decryptor.finish()
+                crc.update(plaintext)
+                output.write(plaintext)
+                if not chunk:
+                    break
+    except ValueError:  # not whole blocks or a bad padding, the client's key didn't encrypt it
+        storage.remove(temp)
+        return None, None
+    except BaseException:
+        storage.remove(temp)
+        raise
+
+    if crc.digest() != expected_crc:
+        storage.remove(temp)
+        return crc.digest(), None
+    return crc.digest(), temp
+
+
+def save_pack_files(pack: bytes, client_id: bytes) -> list:
+    """
+    Appends the files of a pack to the pack-file store, returns the name, path, CRC, CRC in the index,
+    segment, offset and length of every file.
+    """
+    view = memoryview(pack)
+    files = []
+    for entry in unpack_index(pack):
+        data = view[entry.offset:entry.offset + entry.size]
+        file_path = storage.file_path(client_id, entry.file_name)
+        segment, offset = pack_store.append(data)
+        files.append((entry.file_name, file_path, cksum.memcrc(data), entry.crc, segment, offset, len(data)))
+    pack_store.flush()
+    return files
+
+
+class WorkerPool:
+    """
+    Runs the CPU and disk heavy work of the server in worker processes, off the selector loop: the RSA
+    encryption of the AES keys, the decryption, CRC and writing of the batches of packets, and the unpacking of packs
+    into the pack-file store, every worker process appends to a segment of its own.
+    The results are posted back to the selector loop, which wakes up on a socket pair and runs the
+    continuation of every job there, so the server's state is only touched by the loop.
+
+    With no workers the jobs run right away on the loop, like a server without a pool.
+
+    Attributes:
+        workers (int): The number of worker processes, 0 to run the jobs on the loop.
+        executor (ProcessPoolExecutor): The worker processes, or None to run the jobs on the loop.
+        wakeup_receiver (socket.socket): Readable when jobs were done, registered with the selector.
+        wakeup_sender (socket.socket): Written by the executor's thread when a job is done.
+        done (queue.SimpleQueue): The continuations of the jobs that were done, with their futures.
+
+    Args:
+        workers (int): The number of worker processes, None for BACKUP_SERVER_WORKERS or a share of the CPUs.
+        shards (int): How many servers share the CPUs, each gets an equal share of them.
+    """
+    def __init__(self, workers=None, shards=1):
+        if workers is None:
+            workers = int(os.environ.get(WORKERS_ENV, max(1, (os.cpu_count() or 1) // shards)))
+        self.workers = workers
+        self.executor = ProcessPoolExecutor(max_workers=workers) if workers > 0 else None
+        self.wakeup_receiver, self.wakeup_sender = socket.socketpair()
+        self.wakeup_receiver.setblocking(False)
+        self.wakeup_sender.setblocking(False)
+        self.done = queue.SimpleQueue()
+
+    def submit(self, function, args: tuple, continuation):
+        """
+        Runs a job, then calls continuation(result) on the selector loop; a job that raised raises again
+        when continuation calls result. A job that runs on the loop gets its memoryview arguments as they are.
+        """
+        if self.executor is None:
+            try:
+                result = function(*args)
+            except Exception as e:
+                continuation(lambda: self.raise_error(e))
+                return
+            continuation(lambda: result)
+            return
+
+        # the arguments are pickled later, on the executor's thread, so views of the receive buffers are copied now
+        args = tuple(bytes(arg) if isinstance(arg, memoryview) else arg for arg in args)
+        future = self.executor.submit(function, *args)
+        future.add_done_callback(lambda f: self.post(continuation, f))
+
+    @staticmethod
+    def raise_error(error: Exception):
+        raise error
+
+    def post(self, continuation, future):
+        """ Hands a job that was done to the selector loop, on the executor's thread."""
+        self.done.put((continuation, future))
+        try:
+            self.wakeup_sender.send(b'\0')
+        except BlockingIOError:     # the loop is already woken up
+            pass
+
+    def run_done(self):
+        """ Runs the continuations of the jobs that were done, on the selector loop."""
+        try:
+            while self.wakeup_receiver.recv(4096):
+                pass
+        except BlockingIOError:
+            pass
+        while True:
+            try:
+                continuation, future = self.done.get_nowait()
+            except queue.Empty:
+                return
+            continuation(future.result)
+
+    def shutdown(self):
+        """ Stops the worker processes and closes the wakeup sockets."""
+        if self.executor is not None:
+            self.executor.shutdown(wait=False, cancel_futures=True)
+        self.wakeup_receiver.close()
+        self.wakeup_sender.close()